@@ -17,7 +17,6 @@
  */
 
 #include "Channel.hpp"
-#include <iostream>
 
 //#include <sys/socket.h>
 //#include <unistd.h>
@@ -117,7 +116,7 @@ void Channel::WaitForInternalThreadToExit()
     std::unique_lock<std::mutex> lock(worker_mutex);
     if (_thread.joinable()) {
         //_thread.join();
-	std::cout << "Channel::WaitForInternalThreadToExit - skipping join" << std::endl;
+	portal_debug("Channel::WaitForInternalThreadToExit - skipping join");
     }
     lock.unlock();
 }
@@ -171,14 +170,14 @@ void Channel::InternalThreadEntry()
         } else if (ret == -ETIMEDOUT) {
 
             // Timed out waiting for data.
-            std::cout << "Timed out" << std::endl;
+            portal_debug("Timed out");
             lock.unlock();
 
 		} else {
             // -ECONNRESET
             // Unlock now as the `close()` function also requires a lock
             lock.unlock();
-			portal_log("There was an error receiving data");
+			portal_warn("There was an error receiving data");
 			close();
 			setState(State::Errored);
 		}
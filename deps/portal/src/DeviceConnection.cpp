@@ -65,10 +65,10 @@ bool DeviceConnection::connect()
 	while (std::chrono::steady_clock::now() < deadline) {
         int socketHandle = socket_connect(host.c_str(), port);
 		if (socketHandle >= 0) {
-			std::cout << "got connection: " << socketHandle
-				  << std::endl;
-			channel = std::make_shared<Channel>(port, socketHandle);
+			portal_info("got connection: %d", socketHandle);
+			auto channel = std::make_shared<Channel>(port, socketHandle);
 			channel->setDelegate(shared_from_this());
+			std::atomic_store(&this->channel, channel);
 			channel->start();
 			return false;
 		} else {
@@ -96,7 +96,8 @@ bool DeviceConnection::disconnect()
 
     auto ret = channel->close();
     if (ret == 0) {
-        channel = nullptr; // Dealloc the channel
+        // Dealloc the channel
+        std::atomic_store(&channel, std::shared_ptr<Channel>());
     }
 
     setState(State::Disconnected);
@@ -106,6 +107,12 @@ bool DeviceConnection::disconnect()
 
 bool DeviceConnection::send(std::vector<char> data)
 {
+    // Called from the decoding threads, the channel may go away underneath
+    auto channel = std::atomic_load(&this->channel);
+    if (channel == nullptr) {
+        return true;
+    }
+
     return channel->send(data);
 }
 
@@ -152,7 +159,7 @@ void DeviceConnection::setState(State state)
         return;
     }
 
-    std::cout << "DeviceConnection::setState: " << state << std::endl;
+    portal_info("DeviceConnection::setState: %d", (int)state);
 
     _state = state;
 
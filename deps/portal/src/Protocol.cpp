@@ -17,25 +17,48 @@
  */
 
 #include <cstdint>
-#include <iostream>
+#include <cstdio>
+#include <cstring>
 
 #ifdef WIN32
 #include <winsock2.h>
+#else
+#include <arpa/inet.h>
 #endif
 
 #include "Protocol.hpp"
 
 namespace portal {
 
+// Anything bigger is a corrupt header rather than a frame
+#define MAX_FRAME_PAYLOAD_SIZE (16 * 1024 * 1024)
+
+static uint64_t read_uint64(const char *data)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value = (value << 8) | (uint8_t)data[i];
+	}
+	return value;
+}
+
+static void write_uint64(char *data, uint64_t value)
+{
+	for (int i = 7; i >= 0; i--) {
+		data[i] = (char)(value & 0xff);
+		value >>= 8;
+	}
+}
+
 SimpleDataPacketProtocol::SimpleDataPacketProtocol()
 {
-	std::cout << "SimpleDataPacketProtocol created\n";
+	portal_debug("SimpleDataPacketProtocol created");
 }
 
 SimpleDataPacketProtocol::~SimpleDataPacketProtocol()
 {
 	buffer.clear();
-	std::cout << "SimpleDataPacketProtocol destroyed\n";
+	portal_debug("SimpleDataPacketProtocol destroyed");
 }
 
 std::vector<SimpleDataPacketProtocol::DataPacket>
@@ -53,6 +76,14 @@ SimpleDataPacketProtocol::processData(std::vector<char> data)
 
 	while (buffer.size() >= naluHeaderLength) {
 
+	    if (buffer[0] == 0 && buffer[1] == 0 && buffer[2] == 0 &&
+		buffer[3] == PortalFrameVersionTimestamped) {
+		    if (!processTimestampedFrame(packets)) {
+			    break;
+		    }
+		    continue;
+	    }
+
 	    // whether startcode is 0x000001 or 0x00000001 (3 or 4 bytes)
 	    uint32_t currentStartCodeSize = buffer[2] == 1 ? 3 : 4;
         uint32_t naluLength = 0;
@@ -98,6 +129,7 @@ SimpleDataPacketProtocol::processData(std::vector<char> data)
 		packet.type = 101;  // video
 		packet.tag = 0;     // whatever
 		packet.data = payload;
+		packet.timestamp = 0;
 
 		packets.push_back(packet);
 
@@ -108,6 +140,76 @@ SimpleDataPacketProtocol::processData(std::vector<char> data)
 	return packets;
 }
 
+// Returns false if the frame isn't complete yet
+bool SimpleDataPacketProtocol::processTimestampedFrame(
+	std::vector<DataPacket> &packets)
+{
+	const size_t headerSize = sizeof(PortalFrame) + sizeof(uint64_t);
+
+	if (buffer.size() < headerSize) {
+		return false;
+	}
+
+	PortalFrame frame;
+	memcpy(&frame, buffer.data(), sizeof(frame));
+
+	uint32_t payloadSize = ntohl(frame.payloadSize);
+
+	if (payloadSize < sizeof(uint64_t) ||
+	    payloadSize > MAX_FRAME_PAYLOAD_SIZE) {
+		portal_warn("Invalid frame payload size %u, dropping buffer",
+			    payloadSize);
+		buffer.clear();
+		return false;
+	}
+
+	if (buffer.size() < sizeof(frame) + payloadSize) {
+		return false;
+	}
+
+	auto packet = DataPacket();
+	packet.version = PortalFrameVersionTimestamped;
+	packet.type = ntohl(frame.type);
+	packet.tag = ntohl(frame.tag);
+	packet.timestamp = read_uint64(buffer.data() + sizeof(frame));
+	packet.data.assign(buffer.begin() + headerSize,
+			   buffer.begin() + sizeof(frame) + payloadSize);
+
+	packets.push_back(packet);
+
+	buffer.erase(buffer.begin(), buffer.begin() + sizeof(frame) + payloadSize);
+	return true;
+}
+
+std::vector<char>
+SimpleDataPacketProtocol::encodePacket(const DataPacket &packet)
+{
+	size_t timestampSize =
+		packet.version == PortalFrameVersionTimestamped ? sizeof(uint64_t)
+								: 0;
+	size_t payloadSize = timestampSize + packet.data.size();
+
+	PortalFrame frame;
+	frame.version = htonl(packet.version);
+	frame.type = htonl(packet.type);
+	frame.tag = htonl(packet.tag);
+	frame.payloadSize = htonl((uint32_t)payloadSize);
+
+	auto data = std::vector<char>(sizeof(frame) + payloadSize);
+	memcpy(data.data(), &frame, sizeof(frame));
+
+	if (timestampSize > 0) {
+		write_uint64(data.data() + sizeof(frame), packet.timestamp);
+	}
+
+	if (packet.data.size() > 0) {
+		memcpy(data.data() + sizeof(frame) + timestampSize,
+		       packet.data.data(), packet.data.size());
+	}
+
+	return data;
+}
+
 void SimpleDataPacketProtocol::reset()
 {
 	buffer.clear();
@@ -34,9 +34,8 @@ namespace portal
         // Type of frame
         uint32_t type;
 
-        // Unless zero, a tag is retained in frames that are responses to previous
-        // frames. Applications can use this to build transactions or request-response
-        // logic.
+        // For video frames and the control frames about them, the stream and
+        // layer the frame belongs to, see PortalMaxStreams and PortalLayerLow.
         uint32_t tag;
 
         // If payloadSize is larger than zero, *payloadSize* number of bytes are
@@ -45,6 +44,56 @@ namespace portal
 
     } PortalFrame;
 
+    // Frames of this version carry the capture time of their payload as a
+    // big endian uint64 of nanoseconds on the device clock, ahead of the
+    // payload itself. payloadSize includes it.
+    //
+    // A version 1 stream is plain Annex-B, which can never start with
+    // 00 00 00 02, so the two can be told apart on the first four bytes.
+    const uint32_t PortalFrameVersionTimestamped = 2;
+
+    // A phone capturing from several cameras at once sends each as its own
+    // video stream over the one connection, numbered in the tag of their
+    // frames. Stream 0 is the main camera, and all a phone that only
+    // captures from one ever sends. Streams from here on are dropped.
+    const uint32_t PortalMaxStreams = 4;
+
+    // Next to the full resolution picture of a camera the phone can send a
+    // second, low resolution simulcast layer of it, which is all a source
+    // that isn't live needs to decode. The layer is in the upper half of
+    // the tag, so the full layer's tag is just the stream.
+    const uint32_t PortalLayerFull = 0;
+    const uint32_t PortalLayerLow = 1;
+    const uint32_t PortalMaxLayers = 2;
+
+    inline uint32_t tagStream(uint32_t tag) { return tag & 0xffff; }
+    inline uint32_t tagLayer(uint32_t tag) { return tag >> 16; }
+    inline uint32_t makeTag(uint32_t stream, uint32_t layer)
+    {
+        return stream | (layer << 16);
+    }
+
+    // Frame types sent from the computer back to the device over the same
+    // connection. All integers are big endian.
+    enum ControlFrameType : uint32_t {
+        // These go to the encoder of the stream and layer in their tag.
+
+        // Ask the encoder for a keyframe as soon as possible. No payload.
+        ControlFrameRequestKeyframe = 200,
+
+        // A picture failed to decode. No payload.
+        ControlFrameDecodeError = 201,
+
+        // A reference picture went missing. The payload is the expected
+        // and the received H.264 frame_num as two uint32s.
+        ControlFrameReferenceLoss = 202,
+
+        // The computer can't keep up with decoding. The payload is a
+        // uint32 percentage of the encoder's own target bitrate to aim
+        // for, 100 lifts the request again.
+        ControlFrameBitrateScale = 203,
+    };
+
 class SimpleDataPacketProtocol
 	    : public std::enable_shared_from_this<SimpleDataPacketProtocol> {
     public:
@@ -53,6 +102,10 @@ class SimpleDataPacketProtocol
 		    uint32_t type;
 		    uint32_t tag;
 		    std::vector<char> data;
+
+		    // Capture time on the device clock in nanoseconds, zero
+		    // when the stream doesn't carry it.
+		    uint64_t timestamp;
 	    };
 
 	    SimpleDataPacketProtocol();
@@ -65,10 +118,15 @@ class SimpleDataPacketProtocol
 
 	    std::vector<DataPacket> processData(std::vector<char> data);
 
+	    // Serialize a packet with a PortalFrame header, ready to be sent.
+	    static std::vector<char> encodePacket(const DataPacket &packet);
+
 	    void reset();
 
     private:
 	    std::vector<char> buffer;
+
+	    bool processTimestampedFrame(std::vector<DataPacket> &packets);
     };
     } // namespace portal
 
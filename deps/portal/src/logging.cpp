@@ -0,0 +1,374 @@
+/*
+portal
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "logging.h"
+
+namespace portal {
+
+#define LOG_QUEUE_SLOTS 256
+#define LOG_MESSAGE_SIZE 480
+
+// Messages each call site may log per window before being summarised
+#define LOG_BURST 5
+#define LOG_WINDOW std::chrono::seconds(1)
+#define LOG_SITE_IDLE std::chrono::seconds(30)
+#define LOG_POLL_INTERVAL std::chrono::milliseconds(50)
+
+typedef std::chrono::steady_clock Clock;
+
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    LogLevel level;
+    const char *site;
+    Clock::time_point time;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+struct LogSite {
+    LogLevel level;
+    Clock::time_point windowStart;
+    Clock::time_point lastSeen;
+    int count = 0;
+
+    // Messages held back in the current window
+    uint64_t suppressed = 0;
+    std::string firstSuppressed;
+    bool allSame = true;
+};
+
+// Bounded multi-producer queue (Vyukov). Producers claim a slot with a CAS
+// on the tail, the single consumer owns the head.
+class Logger {
+    LogSlot mSlots[LOG_QUEUE_SLOTS];
+    std::atomic<size_t> mTail;
+    size_t mHead = 0;
+
+    std::atomic<uint64_t> mDropped;
+    std::atomic<size_t> mDrained;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    // Written under the mutex, read without it on every log call
+    std::atomic<bool> mRunning;
+    bool mFlushRequested = false;
+    std::thread mThread;
+
+    std::mutex mSinkMutex;
+    LogSink mSink;
+
+    // Only touched by the logging thread
+    std::map<const char *, LogSite> mSites;
+
+public:
+    Logger() : mTail(0), mDropped(0), mDrained(0), mRunning(false)
+    {
+        for (size_t i = 0; i < LOG_QUEUE_SLOTS; i++) {
+            mSlots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        mSink = [](LogLevel, const char *message) {
+            fprintf(stdout, "%s\n", message);
+            fflush(stdout);
+        };
+    }
+
+    void start()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mRunning || mThread.joinable()) {
+            return;
+        }
+
+        mRunning = true;
+        mThread = std::thread(&Logger::run, this);
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mRunning = false;
+        }
+        mCondition.notify_all();
+
+        if (mThread.joinable()) {
+            mThread.join();
+        }
+    }
+
+    bool running()
+    {
+        return mRunning.load(std::memory_order_acquire);
+    }
+
+    void setSink(LogSink sink)
+    {
+        std::lock_guard<std::mutex> lock(mSinkMutex);
+        mSink = sink;
+    }
+
+    void write(LogLevel level, const char *message)
+    {
+        std::lock_guard<std::mutex> lock(mSinkMutex);
+        if (mSink) {
+            mSink(level, message);
+        }
+    }
+
+    // Returns the slot to format the message into, or nullptr if the
+    // queue is full. `ticket` has to be handed back to `publish`.
+    LogSlot *claim(size_t *ticket)
+    {
+        size_t position = mTail.load(std::memory_order_relaxed);
+
+        for (;;) {
+            LogSlot *slot = &mSlots[position % LOG_QUEUE_SLOTS];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+            if (difference == 0) {
+                if (mTail.compare_exchange_weak(position, position + 1,
+                                                std::memory_order_relaxed)) {
+                    *ticket = position;
+                    return slot;
+                }
+            } else if (difference < 0) {
+                mDropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            } else {
+                position = mTail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish(LogSlot *slot, size_t ticket)
+    {
+        slot->sequence.store(ticket + 1, std::memory_order_release);
+    }
+
+    void flush()
+    {
+        size_t target = mTail.load(std::memory_order_acquire);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (!mRunning) {
+            return;
+        }
+
+        mFlushRequested = true;
+        mCondition.notify_all();
+
+        mCondition.wait_for(lock, std::chrono::seconds(2), [&] {
+            return !mRunning || mDrained.load(std::memory_order_acquire) >= target;
+        });
+    }
+
+private:
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        while (mRunning) {
+            mCondition.wait_for(lock, LOG_POLL_INTERVAL,
+                                [&] { return !mRunning || mFlushRequested; });
+            mFlushRequested = false;
+
+            lock.unlock();
+            drain();
+            expire(Clock::now(), false);
+            lock.lock();
+
+            mCondition.notify_all();
+        }
+
+        lock.unlock();
+        drain();
+        expire(Clock::now(), true);
+    }
+
+    void drain()
+    {
+        for (;;) {
+            LogSlot *slot = &mSlots[mHead % LOG_QUEUE_SLOTS];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+
+            if (sequence != mHead + 1) {
+                break;
+            }
+
+            handle(slot->level, slot->site, slot->time, slot->text);
+
+            slot->sequence.store(mHead + LOG_QUEUE_SLOTS, std::memory_order_release);
+            mHead++;
+            mDrained.store(mHead, std::memory_order_release);
+        }
+
+        uint64_t dropped = mDropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            char message[128];
+            snprintf(message, sizeof(message),
+                     "Logging queue overflowed, dropped %llu messages",
+                     (unsigned long long)dropped);
+            write(LogLevel::Warning, message);
+        }
+    }
+
+    void handle(LogLevel level, const char *site, Clock::time_point time,
+                const char *text)
+    {
+        auto &state = mSites[site];
+        state.level = level;
+        state.lastSeen = time;
+
+        if (state.count == 0 || time - state.windowStart >= LOG_WINDOW) {
+            summarise(state);
+            state.windowStart = time;
+            state.count = 0;
+        }
+
+        if (++state.count <= LOG_BURST) {
+            write(level, text);
+            return;
+        }
+
+        if (state.suppressed++ == 0) {
+            state.firstSuppressed = text;
+            state.allSame = true;
+        } else if (state.allSame && state.firstSuppressed != text) {
+            state.allSame = false;
+        }
+    }
+
+    void summarise(LogSite &state)
+    {
+        if (state.suppressed == 0) {
+            return;
+        }
+
+        std::string message = state.firstSuppressed;
+        message += state.allSame ? " (repeated " : " (and ";
+        message += std::to_string(state.suppressed);
+        message += state.allSame ? " times)" : " similar messages)";
+
+        write(state.level, message.c_str());
+
+        state.suppressed = 0;
+        state.firstSuppressed.clear();
+    }
+
+    // Report sites whose window has closed and forget the idle ones
+    void expire(Clock::time_point now, bool all)
+    {
+        for (auto it = mSites.begin(); it != mSites.end();) {
+            auto &state = it->second;
+
+            if (all || now - state.windowStart >= LOG_WINDOW) {
+                summarise(state);
+            }
+
+            if (all || now - state.lastSeen >= LOG_SITE_IDLE) {
+                it = mSites.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+};
+
+// Never destroyed, messages can still arrive from other static destructors
+static Logger *shared_logger()
+{
+    static Logger *logger = new Logger();
+    return logger;
+}
+
+static std::once_flag start_once;
+
+static void trim_newlines(char *text)
+{
+    size_t length = strlen(text);
+    while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r')) {
+        text[--length] = '\0';
+    }
+}
+
+void log_set_sink(LogSink sink)
+{
+    shared_logger()->setSink(sink);
+}
+
+void log_message(LogLevel level, const char *site, const char *format, ...)
+{
+    Logger *logger = shared_logger();
+    std::call_once(start_once, [logger] { logger->start(); });
+
+    va_list args;
+    va_start(args, format);
+
+    if (!logger->running()) {
+        // Stopped, nothing is going to drain the queue
+        char text[LOG_MESSAGE_SIZE];
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+
+        trim_newlines(text);
+        logger->write(level, text);
+        return;
+    }
+
+    size_t ticket;
+    LogSlot *slot = logger->claim(&ticket);
+    if (!slot) {
+        va_end(args);
+        return;
+    }
+
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+
+    trim_newlines(slot->text);
+    slot->level = level;
+    slot->site = site;
+    slot->time = Clock::now();
+
+    logger->publish(slot, ticket);
+}
+
+void log_flush()
+{
+    shared_logger()->flush();
+}
+
+void log_stop()
+{
+    shared_logger()->stop();
+}
+
+}
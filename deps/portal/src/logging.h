@@ -18,11 +18,66 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #pragma once
 
+#include <functional>
+
 #ifdef DEBUG
     #define PORTAL_DEBUG_LOG_ENABLED 1
 #else
     #define PORTAL_DEBUG_LOG_ENABLED 0
 #endif
 
-#define portal_log(format, ...) \
-    do { if (PORTAL_DEBUG_LOG_ENABLED) fprintf(stdout, "%s:%d:%s(): " format, __FILE__, __LINE__, __func__, ## __VA_ARGS__); } while (0)
+#if defined(__GNUC__) || defined(__clang__)
+    #define PORTAL_PRINTF_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+    #define PORTAL_PRINTF_FORMAT(fmt, args)
+#endif
+
+namespace portal {
+
+// Same values as libobs' LOG_* levels, so a sink can hand them straight on
+enum class LogLevel : int {
+    Error = 100,
+    Warning = 200,
+    Info = 300,
+    Debug = 400,
+};
+
+typedef std::function<void(LogLevel level, const char *message)> LogSink;
+
+// Where messages end up, stdout until something else is set. The sink is
+// only ever called from the logging thread.
+void log_set_sink(LogSink sink);
+
+// Formats the message on the calling thread and queues it for the logging
+// thread, which does the actual I/O. Never blocks: if the queue is full the
+// message is dropped and counted.
+//
+// `site` identifies the call site for rate limiting. Each site gets a few
+// messages per second, anything over that is folded into a single
+// "repeated N times" line.
+void log_message(LogLevel level, const char *site, const char *format, ...)
+    PORTAL_PRINTF_FORMAT(3, 4);
+
+// Waits until everything queued so far has been handed to the sink
+void log_flush();
+
+// Flushes and stops the logging thread. Messages logged afterwards are
+// written synchronously.
+void log_stop();
+
+}
+
+// The format string literal doubles as the call site, it's unique enough
+// and costs nothing to look up.
+#define portal_error(format, ...) \
+    portal::log_message(portal::LogLevel::Error, format, format, ## __VA_ARGS__)
+#define portal_warn(format, ...) \
+    portal::log_message(portal::LogLevel::Warning, format, format, ## __VA_ARGS__)
+#define portal_info(format, ...) \
+    portal::log_message(portal::LogLevel::Info, format, format, ## __VA_ARGS__)
+
+// Compiled out entirely unless DEBUG is defined
+#define portal_debug(format, ...) \
+    do { if (PORTAL_DEBUG_LOG_ENABLED) portal::log_message(portal::LogLevel::Debug, format, "%s:%d:%s(): " format, __FILE__, __LINE__, __func__, ## __VA_ARGS__); } while (0)
+
+#define portal_log(format, ...) portal_debug(format, ## __VA_ARGS__)
@@ -0,0 +1,172 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef AccessUnitAssembler_hpp
+#define AccessUnitAssembler_hpp
+
+#include <algorithm>
+#include <vector>
+
+#include "nal-unit.h"
+#include "parameter-sets.h"
+
+// Turns the phone's stream of NAL units back into one Annex-B buffer per
+// picture, which is what a muxer wants, and keeps the parameter sets that
+// go in the file header.
+class AccessUnitAssembler
+{
+public:
+    struct AccessUnit {
+        std::vector<uint8_t> data;
+        uint64_t timestamp;
+        bool keyframe;
+    };
+
+    // Returns true when `packet` starts a new picture, the previous one is
+    // moved into `unit`. `configChanged` is set when the codec or a
+    // parameter set changed, whatever came before can't share a file with
+    // what follows.
+    bool add(const std::vector<char> &packet, uint64_t timestamp, AccessUnit *unit,
+             bool *configChanged) {
+        auto data = (const uint8_t *)packet.data();
+
+        nal_codec detected = nal_detect_codec(data, packet.size());
+        if (detected != NAL_CODEC_UNKNOWN && detected != mCodec) {
+            *configChanged = mCodec != NAL_CODEC_UNKNOWN;
+            reset();
+            mCodec = detected;
+        }
+
+        nal_unit nal;
+        if (mCodec == NAL_CODEC_UNKNOWN || !nal_parse_annexb(mCodec, data, packet.size(), &nal)) {
+            return false;
+        }
+
+        if (nal_is_parameter_set(&nal)) {
+            if (updateParameterSet(nal)) {
+                // The picture in progress was encoded with the old ones
+                *configChanged = true;
+                mPending.data.clear();
+            }
+            return false;
+        }
+
+        // Parameter sets go in the file header, SEI and delimiters aren't needed
+        if (!nal_is_vcl(&nal) || !hasParameterSets()) {
+            return false;
+        }
+
+        bool complete = false;
+
+        if (nal_first_slice(mCodec, &nal)) {
+            complete = flush(unit);
+
+            mPending.timestamp = timestamp;
+            mPending.keyframe = nal.kind == NAL_KIND_IRAP;
+        } else if (mPending.data.empty()) {
+            // Joined half way through a picture
+            return false;
+        }
+
+        mPending.data.insert(mPending.data.end(), packet.begin(), packet.end());
+        return complete;
+    }
+
+    // Hand over the picture in progress, e.g. when a recording stops.
+    // Returns false if there is none.
+    bool flush(AccessUnit *unit) {
+        if (mPending.data.empty()) {
+            return false;
+        }
+
+        unit->data.swap(mPending.data);
+        unit->timestamp = mPending.timestamp;
+        unit->keyframe = mPending.keyframe;
+        mPending.data.clear();
+        return true;
+    }
+
+    void reset() {
+        mCodec = NAL_CODEC_UNKNOWN;
+        mVps.clear();
+        mSps.clear();
+        mPps.clear();
+        mPending.data.clear();
+    }
+
+    nal_codec getCodec() {
+        return mCodec;
+    }
+
+    bool hasParameterSets() {
+        return !mSps.empty() && !mPps.empty() &&
+               (mCodec != NAL_CODEC_HEVC || !mVps.empty());
+    }
+
+    bool getParams(video_params *params) {
+        return video_params_parse(mCodec, mSps.data(), mSps.size(), params);
+    }
+
+    // The parameter sets as Annex-B, the muxers convert them to avcC / hvcC
+    std::vector<uint8_t> getExtradata() {
+        std::vector<uint8_t> extradata;
+
+        for (auto *set : {&mVps, &mSps, &mPps}) {
+            if (set->empty()) {
+                continue;
+            }
+            static const uint8_t startCode[] = {0, 0, 0, 1};
+            extradata.insert(extradata.end(), startCode, startCode + sizeof(startCode));
+            extradata.insert(extradata.end(), set->begin(), set->end());
+        }
+
+        return extradata;
+    }
+
+private:
+
+    // Returns true if a parameter set was replaced by a different one
+    bool updateParameterSet(const nal_unit &nal) {
+        std::vector<uint8_t> *slot = &mPps;
+        if (nal.kind == NAL_KIND_VPS) {
+            slot = &mVps;
+        } else if (nal.kind == NAL_KIND_SPS) {
+            slot = &mSps;
+        }
+
+        if (slot->size() == nal.size && std::equal(slot->begin(), slot->end(), nal.data)) {
+            return false;
+        }
+
+        bool changed = !slot->empty();
+        slot->assign(nal.data, nal.data + nal.size);
+        return changed;
+    }
+
+    nal_codec mCodec = NAL_CODEC_UNKNOWN;
+
+    // NAL units without their start code
+    std::vector<uint8_t> mVps;
+    std::vector<uint8_t> mSps;
+    std::vector<uint8_t> mPps;
+
+    // The picture whose slices are still arriving
+    AccessUnit mPending = {{}, 0, false};
+};
+
+#endif /* AccessUnitAssembler_hpp */
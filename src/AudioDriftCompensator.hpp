@@ -0,0 +1,239 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef AudioDriftCompensator_hpp
+#define AudioDriftCompensator_hpp
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include <obs.h>
+
+#include "ClockEstimator.hpp"
+
+// Audio further than this from where it should be is a discontinuity,
+// not drift. OBS itself resyncs at 70 ms.
+#define AUDIO_DRIFT_RESYNC_NS 60000000LL
+
+// Offsets are corrected over roughly this long
+#define AUDIO_DRIFT_CORRECTION_NS 10000000000.0
+
+// Limits on the resampling ratio. 2000 ppm is a pitch change of about
+// 3.5 cents, well below what anyone hears.
+#define AUDIO_DRIFT_MAX_CORRECTION 0.0005
+#define AUDIO_DRIFT_MAX_RATIO 0.002
+
+#define AUDIO_DRIFT_REPORT_INTERVAL_NS 300000000000ULL
+
+// The phone's audio clock never runs at exactly the rate of ours. Left
+// alone the timestamps of consecutive packets slowly stop lining up with
+// their sample counts, until OBS gives up and resyncs with an audible gap.
+//
+// This estimates the drift between the sample clock and the packet
+// timestamps, and stretches the audio by that much with a linear
+// interpolating resampler. Output timestamps are contiguous, and any
+// remaining offset is folded into the ratio so audio converges back onto
+// the capture times, and so onto the video.
+class AudioDriftCompensator
+{
+    ClockEstimator mEstimator;
+
+    std::atomic_bool mStarted = false;
+    uint32_t mSampleRate = 0;
+    uint32_t mChannels = 0;
+    uint64_t mInputSamples = 0;
+
+    // Host time of the next output sample
+    double mNextTimestamp = 0.0;
+
+    // Read position into the next packet. -1 is the last sample of the
+    // previous packet.
+    double mPosition = 0.0;
+    float mHistory[MAX_AUDIO_CHANNELS] = {};
+
+    std::vector<float> mOutput[MAX_AUDIO_CHANNELS];
+
+    std::atomic<int64_t> mAvSkewNs = 0;
+    std::atomic<double> mSkewPpm = 0.0;
+    uint64_t mLastReport = 0;
+
+public:
+
+    // Resample `audio` in place to absorb drift. The data pointers are
+    // replaced with float planar buffers owned by the compensator, valid
+    // until the next call. Returns false if the audio was left untouched.
+    bool process(obs_source_audio *audio) {
+        uint32_t channels = get_audio_channels(audio->speakers);
+
+        if (audio->frames == 0 || audio->samples_per_sec == 0 ||
+            channels == 0 || channels > MAX_AUDIO_CHANNELS ||
+            !canRead(audio->format)) {
+            return false;
+        }
+
+        double error = (double)audio->timestamp - mNextTimestamp;
+
+        if (!mStarted || audio->samples_per_sec != mSampleRate ||
+            channels != mChannels || std::fabs(error) > AUDIO_DRIFT_RESYNC_NS) {
+            if (mStarted) {
+                blog(LOG_INFO, "Audio drift: resyncing, %.1f ms off", error / 1000000.0);
+            }
+            restart(audio, channels);
+            error = 0.0;
+        }
+
+        mEstimator.add((int64_t)(mInputSamples * 1000000000ULL / mSampleRate),
+                       (int64_t)audio->timestamp);
+        mInputSamples += audio->frames;
+
+        double correction = error / AUDIO_DRIFT_CORRECTION_NS;
+        correction = std::fmax(-AUDIO_DRIFT_MAX_CORRECTION,
+                               std::fmin(AUDIO_DRIFT_MAX_CORRECTION, correction));
+
+        double ratio = 1.0 + mEstimator.skew() + correction;
+        ratio = std::fmax(1.0 - AUDIO_DRIFT_MAX_RATIO,
+                          std::fmin(1.0 + AUDIO_DRIFT_MAX_RATIO, ratio));
+
+        uint32_t frames = resample(audio, 1.0 / ratio);
+
+        for (uint32_t c = 0; c < MAX_AV_PLANES; c++) {
+            audio->data[c] = c < channels ? (const uint8_t *)mOutput[c].data() : nullptr;
+        }
+        audio->frames = frames;
+        audio->format = AUDIO_FORMAT_FLOAT_PLANAR;
+        audio->timestamp = (uint64_t)mNextTimestamp;
+
+        mNextTimestamp += (double)frames * 1000000000.0 / mSampleRate;
+
+        report(error);
+        return true;
+    }
+
+    void reset() {
+        mStarted = false;
+    }
+
+    // Where the audio is relative to its capture time, and so relative to
+    // the video. Positive when the audio is early.
+    int64_t avSkewNs() {
+        return mAvSkewNs;
+    }
+
+    // Drift of the phone's sample clock against the host clock
+    double skewPpm() {
+        return mSkewPpm;
+    }
+
+private:
+
+    static bool canRead(audio_format format) {
+        switch (format) {
+        case AUDIO_FORMAT_16BIT:
+        case AUDIO_FORMAT_32BIT:
+        case AUDIO_FORMAT_FLOAT:
+        case AUDIO_FORMAT_16BIT_PLANAR:
+        case AUDIO_FORMAT_32BIT_PLANAR:
+        case AUDIO_FORMAT_FLOAT_PLANAR:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static float sampleAt(const obs_source_audio *audio, uint32_t channels,
+                          uint32_t channel, uint32_t index) {
+        switch (audio->format) {
+        case AUDIO_FORMAT_16BIT:
+            return ((const int16_t *)audio->data[0])[index * channels + channel] / 32768.0f;
+        case AUDIO_FORMAT_32BIT:
+            return ((const int32_t *)audio->data[0])[index * channels + channel] / 2147483648.0f;
+        case AUDIO_FORMAT_FLOAT:
+            return ((const float *)audio->data[0])[index * channels + channel];
+        case AUDIO_FORMAT_16BIT_PLANAR:
+            return ((const int16_t *)audio->data[channel])[index] / 32768.0f;
+        case AUDIO_FORMAT_32BIT_PLANAR:
+            return ((const int32_t *)audio->data[channel])[index] / 2147483648.0f;
+        case AUDIO_FORMAT_FLOAT_PLANAR:
+            return ((const float *)audio->data[channel])[index];
+        default:
+            return 0.0f;
+        }
+    }
+
+    void restart(const obs_source_audio *audio, uint32_t channels) {
+        mStarted = true;
+        mSampleRate = audio->samples_per_sec;
+        mChannels = channels;
+        mInputSamples = 0;
+        mNextTimestamp = (double)audio->timestamp;
+        mPosition = 0.0;
+        mEstimator.reset();
+
+        for (uint32_t c = 0; c < channels; c++) {
+            mHistory[c] = sampleAt(audio, channels, c, 0);
+        }
+    }
+
+    uint32_t resample(const obs_source_audio *audio, double step) {
+        uint32_t frames = audio->frames;
+        double position = mPosition;
+
+        for (uint32_t c = 0; c < mChannels; c++) {
+            auto &output = mOutput[c];
+            output.clear();
+
+            float previous = mHistory[c];
+            position = mPosition;
+
+            while (position < (double)(frames - 1)) {
+                int index = (int)std::floor(position);
+                float fraction = (float)(position - index);
+
+                float a = index < 0 ? previous : sampleAt(audio, mChannels, c, (uint32_t)index);
+                float b = sampleAt(audio, mChannels, c, (uint32_t)(index + 1));
+
+                output.push_back(a + (b - a) * fraction);
+                position += step;
+            }
+
+            mHistory[c] = sampleAt(audio, mChannels, c, frames - 1);
+        }
+
+        mPosition = position - (double)frames;
+        return (uint32_t)mOutput[0].size();
+    }
+
+    void report(double error) {
+        mAvSkewNs = (int64_t)error;
+        mSkewPpm = mEstimator.skew() * 1000000.0;
+
+        uint64_t now = (uint64_t)mNextTimestamp;
+        if (now - mLastReport < AUDIO_DRIFT_REPORT_INTERVAL_NS) {
+            return;
+        }
+        mLastReport = now;
+
+        if (mEstimator.isFitted()) {
+            blog(LOG_INFO, "Audio drift: %+.1f ppm, A/V skew %+.2f ms",
+                 mSkewPpm.load(), error / 1000000.0);
+        }
+    }
+};
+
+#endif /* AudioDriftCompensator_hpp */
@@ -0,0 +1,110 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include "CaptureDaemonClient.hpp"
+
+#include <socket.h>
+#include <util/platform.h>
+
+#include "Trace.hpp"
+#include "logging.h"
+
+// How long to wait for a frame before checking the daemon is still there
+#define CAPTURE_DAEMON_WAIT_MS 100
+#define CAPTURE_DAEMON_SILENCE_NS 2000000000ULL
+#define CAPTURE_DAEMON_RETRY_MS 1000
+
+CaptureDaemonClient::CaptureDaemonClient(const std::string &host, int port,
+                                         FrameSink *output)
+    : mHost(host), mPort(port), mOutput(output)
+{
+    start();
+}
+
+CaptureDaemonClient::~CaptureDaemonClient()
+{
+    join();
+}
+
+bool CaptureDaemonClient::attach()
+{
+    std::string path = shared_frame_socket_path(mHost, mPort);
+
+    int socket = socket_connect_unix(path.c_str());
+    if (socket < 0) {
+        return false;
+    }
+
+    int fd = shared_frame_receive_fd(socket);
+    socket_close(socket);
+
+    if (fd < 0 || !mReader.attach(fd)) {
+        return false;
+    }
+
+    portal_info("Reading %s:%d from the capture daemon", mHost.c_str(), mPort);
+    return true;
+}
+
+void *CaptureDaemonClient::run()
+{
+    Tracer::setThreadName("capture daemon client");
+
+    uint32_t seen = 0;
+    uint64_t lastFrameTime = 0;
+
+    while (!shouldStop()) {
+        if (!mReader.attached()) {
+            if (!attach()) {
+                os_sleep_ms(CAPTURE_DAEMON_RETRY_MS);
+                continue;
+            }
+
+            // Only what is published from now on
+            seen = mReader.published();
+            lastFrameTime = os_gettime_ns();
+        }
+
+        uint32_t published = mReader.wait(seen, CAPTURE_DAEMON_WAIT_MS);
+        if (published == seen) {
+            if (os_gettime_ns() - lastFrameTime > CAPTURE_DAEMON_SILENCE_NS &&
+                !mReader.writerAlive()) {
+                portal_warn("The capture daemon for %s:%d went away", mHost.c_str(), mPort);
+                mReader.detach();
+                mOutput->output(nullptr);
+            }
+            continue;
+        }
+
+        seen = published;
+        lastFrameTime = os_gettime_ns();
+
+        // Behind by more than a frame, only the newest one matters
+        uint32_t index = published - 1;
+
+        obs_source_frame frame;
+        if (!mReader.read(index, &frame)) {
+            continue;
+        }
+
+        mOutput->output(frame.format != VIDEO_FORMAT_NONE ? &frame : nullptr);
+    }
+
+    return NULL;
+}
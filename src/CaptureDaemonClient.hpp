@@ -0,0 +1,50 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef CaptureDaemonClient_hpp
+#define CaptureDaemonClient_hpp
+
+#include <string>
+
+#include "SharedFrameRing.hpp"
+#include "Thread.hpp"
+
+// Shows the frames a capture daemon decodes for a device, in place of a
+// connection to the phone from this process. Keeps trying to reach the
+// daemon, and picks it up again when it restarts.
+class CaptureDaemonClient : private Thread
+{
+public:
+    CaptureDaemonClient(const std::string &host, int port, FrameSink *output);
+    ~CaptureDaemonClient();
+
+    const std::string &getHost() { return mHost; }
+    int getPort() { return mPort; }
+
+private:
+    void *run() override;
+    bool attach();
+
+    std::string mHost;
+    int mPort;
+    FrameSink *mOutput;
+    SharedFrameReader mReader;
+};
+
+#endif /* CaptureDaemonClient_hpp */
@@ -0,0 +1,160 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef ClockEstimator_hpp
+#define ClockEstimator_hpp
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Fits y = x + offset + skew * x for two clocks that run at slightly
+// different rates, from samples where y is late by a random, always
+// positive amount (network and scheduling latency).
+//
+// Samples are grouped into buckets and only the earliest one of each is
+// kept, which traces the lower envelope of the latency. A Theil-Sen style
+// median of slopes over those points gives the skew, so the occasional
+// bucket where every packet was late doesn't pull the fit.
+class ClockEstimator
+{
+    struct Point {
+        int64_t x;
+        int64_t offset; // y - x
+    };
+
+    std::deque<Point> mPoints;
+    size_t mMaxPoints;
+    int64_t mBucketNs;
+
+    Point mCurrent = {0, 0};
+    bool mHaveCurrent = false;
+
+    bool mFitted = false;
+    double mSkew = 0.0;
+    double mIntercept = 0.0;
+    int64_t mReferenceX = 0;
+
+    // Fewer points than this only give the lowest recent offset
+    static const size_t MinPoints = 8;
+
+public:
+
+    // The default covers the last five minutes in one second buckets,
+    // long enough to see a few ppm of drift through the jitter.
+    ClockEstimator(size_t maxPoints = 300, int64_t bucketNs = 1000000000LL)
+        : mMaxPoints(maxPoints), mBucketNs(bucketNs) {
+    }
+
+    void add(int64_t x, int64_t y) {
+        int64_t offset = y - x;
+
+        if (!mHaveCurrent || x - mCurrent.x >= mBucketNs || x < mCurrent.x) {
+            if (mHaveCurrent) {
+                mPoints.push_back(mCurrent);
+                if (mPoints.size() > mMaxPoints) {
+                    mPoints.pop_front();
+                }
+                fit();
+            }
+
+            mCurrent = {x, offset};
+            mHaveCurrent = true;
+        } else if (offset < mCurrent.offset) {
+            mCurrent.offset = offset;
+        }
+    }
+
+    // Best estimate of y - x at `x`
+    int64_t offsetAt(int64_t x) {
+        if (mFitted) {
+            return (int64_t)(mIntercept + mSkew * (double)(x - mReferenceX));
+        }
+
+        int64_t lowest = mCurrent.offset;
+        for (auto &point : mPoints) {
+            lowest = std::min(lowest, point.offset);
+        }
+        return lowest;
+    }
+
+    // Rate of y relative to x, minus one
+    double skew() {
+        return mFitted ? mSkew : 0.0;
+    }
+
+    bool isFitted() {
+        return mFitted;
+    }
+
+    void reset() {
+        mPoints.clear();
+        mHaveCurrent = false;
+        mFitted = false;
+        mSkew = 0.0;
+    }
+
+private:
+
+    static double median(std::vector<double> &values) {
+        auto middle = values.begin() + values.size() / 2;
+        std::nth_element(values.begin(), middle, values.end());
+        return *middle;
+    }
+
+    void fit() {
+        size_t count = mPoints.size();
+        if (count < MinPoints) {
+            mFitted = false;
+            return;
+        }
+
+        // Slopes between points half the window apart, which keeps the
+        // jitter of each point small next to the distance between them.
+        size_t lag = count / 2;
+        std::vector<double> values;
+        values.reserve(count);
+
+        for (size_t i = 0; i + lag < count; i++) {
+            auto &a = mPoints[i];
+            auto &b = mPoints[i + lag];
+            if (b.x != a.x) {
+                values.push_back((double)(b.offset - a.offset) / (double)(b.x - a.x));
+            }
+        }
+
+        if (values.empty()) {
+            return;
+        }
+
+        double skew = median(values);
+
+        mReferenceX = mPoints.back().x;
+        values.clear();
+        for (auto &point : mPoints) {
+            values.push_back((double)point.offset - skew * (double)(point.x - mReferenceX));
+        }
+
+        mIntercept = median(values);
+        mSkew = skew;
+        mFitted = true;
+    }
+};
+
+#endif /* ClockEstimator_hpp */
@@ -0,0 +1,211 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef DecodeGovernor_hpp
+#define DecodeGovernor_hpp
+
+#include <atomic>
+
+#include <obs.h>
+#include <util/platform.h>
+
+// Each level includes everything the levels above it do
+enum class DecodeQuality : uint32_t {
+    Full = 0,
+    // skip_loop_filter on non-reference pictures
+    SkipLoopFilter,
+    // skip_idct on non-reference pictures as well
+    SkipIdct,
+    // Don't decode non-reference pictures at all
+    DiscardNonRef,
+    // Show at most every other picture
+    Decimate,
+    // Ask the phone to send a lower bitrate
+    ReduceBitrate,
+};
+
+static inline const char *decode_quality_name(DecodeQuality quality)
+{
+    switch (quality) {
+    case DecodeQuality::Full:
+        return "full";
+    case DecodeQuality::SkipLoopFilter:
+        return "skip loop filter";
+    case DecodeQuality::SkipIdct:
+        return "skip idct";
+    case DecodeQuality::DiscardNonRef:
+        return "discard non-reference";
+    case DecodeQuality::Decimate:
+        return "decimate";
+    case DecodeQuality::ReduceBitrate:
+        return "reduce bitrate";
+    }
+    return "unknown";
+}
+
+// Decode time as a fraction of the frame interval above which, or OBS CPU
+// usage in percent above which, the decoder is under pressure
+#define DECODE_GOVERNOR_PRESSURE_LOAD 0.85
+#define DECODE_GOVERNOR_PRESSURE_CPU 90.0
+
+// Both have to be below these before quality goes back up
+#define DECODE_GOVERNOR_HEADROOM_LOAD 0.5
+#define DECODE_GOVERNOR_HEADROOM_CPU 70.0
+
+// How long either condition has to last before stepping down or up
+#define DECODE_GOVERNOR_PRESSURE_NS 1000000000ULL
+#define DECODE_GOVERNOR_HEADROOM_NS 5000000000ULL
+
+#define DECODE_GOVERNOR_CPU_INTERVAL_NS 500000000ULL
+
+// Steps decode quality down when software decoding can't keep up with the
+// phone, or OBS as a whole is short of CPU, and back up once there is
+// headroom again. Only used from the decoding thread.
+class DecodeGovernor
+{
+    os_cpu_usage_info_t *mCpuInfo = nullptr;
+    uint64_t mCpuSampledAt = 0;
+    double mCpu = 0.0;
+
+    // Decode time over frame interval, smoothed
+    double mLoad = 0.0;
+
+    uint64_t mPressureSince = 0;
+    uint64_t mHeadroomSince = 0;
+    uint64_t mChangedAt = 0;
+
+    std::atomic<DecodeQuality> mQuality = DecodeQuality::Full;
+    std::atomic<uint32_t> mTransitions = 0;
+
+public:
+
+    ~DecodeGovernor() {
+        if (mCpuInfo != nullptr) {
+            os_cpu_usage_info_destroy(mCpuInfo);
+        }
+    }
+
+    // Call once per picture with how long the previous one took to decode
+    // and the interval between pictures. Returns true if the quality changed.
+    bool update(uint64_t decodeTimeNs, uint64_t frameIntervalNs, uint64_t now) {
+        sampleCpu(now);
+
+        if (frameIntervalNs == 0) {
+            return false;
+        }
+
+        double load = (double)decodeTimeNs / (double)frameIntervalNs;
+        mLoad += (load - mLoad) * 0.1;
+
+        bool pressure = mLoad > DECODE_GOVERNOR_PRESSURE_LOAD ||
+                        mCpu > DECODE_GOVERNOR_PRESSURE_CPU;
+        bool headroom = mLoad < DECODE_GOVERNOR_HEADROOM_LOAD &&
+                        mCpu < DECODE_GOVERNOR_HEADROOM_CPU;
+
+        mPressureSince = pressure ? (mPressureSince ? mPressureSince : now) : 0;
+        mHeadroomSince = headroom ? (mHeadroomSince ? mHeadroomSince : now) : 0;
+
+        if (mPressureSince && now - mPressureSince >= DECODE_GOVERNOR_PRESSURE_NS &&
+            now - mChangedAt >= DECODE_GOVERNOR_PRESSURE_NS) {
+            return step(1, now);
+        }
+
+        if (mHeadroomSince && now - mHeadroomSince >= DECODE_GOVERNOR_HEADROOM_NS &&
+            now - mChangedAt >= DECODE_GOVERNOR_HEADROOM_NS) {
+            return step(-1, now);
+        }
+
+        return false;
+    }
+
+    // The queue overflowed and packets had to be dropped, that is all the
+    // evidence needed.
+    bool overloaded(uint64_t now) {
+        return step(1, now);
+    }
+
+    void reset() {
+        mLoad = 0.0;
+        mPressureSince = 0;
+        mHeadroomSince = 0;
+        mChangedAt = 0;
+
+        if (mQuality != DecodeQuality::Full) {
+            blog(LOG_INFO, "Decode governor: %s -> %s (reset)",
+                 decode_quality_name(mQuality), decode_quality_name(DecodeQuality::Full));
+            mQuality = DecodeQuality::Full;
+            mTransitions++;
+        }
+    }
+
+    DecodeQuality quality() {
+        return mQuality;
+    }
+
+    bool atLeast(DecodeQuality quality) {
+        return (uint32_t)mQuality.load() >= (uint32_t)quality;
+    }
+
+    uint32_t transitions() {
+        return mTransitions;
+    }
+
+private:
+
+    void sampleCpu(uint64_t now) {
+        if (mCpuInfo == nullptr) {
+            mCpuInfo = os_cpu_usage_info_start();
+            mCpuSampledAt = now;
+            return;
+        }
+
+        if (now - mCpuSampledAt >= DECODE_GOVERNOR_CPU_INTERVAL_NS) {
+            mCpu = os_cpu_usage_info_query(mCpuInfo);
+            mCpuSampledAt = now;
+        }
+    }
+
+    bool step(int direction, uint64_t now) {
+        uint32_t current = (uint32_t)mQuality.load();
+        uint32_t next = current;
+
+        if (direction > 0 && current < (uint32_t)DecodeQuality::ReduceBitrate) {
+            next = current + 1;
+        } else if (direction < 0 && current > (uint32_t)DecodeQuality::Full) {
+            next = current - 1;
+        }
+
+        mPressureSince = 0;
+        mHeadroomSince = 0;
+        mChangedAt = now;
+
+        if (next == current) {
+            return false;
+        }
+
+        blog(LOG_INFO, "Decode governor: %s -> %s (decode %.0f%% of frame interval, cpu %.0f%%)",
+             decode_quality_name((DecodeQuality)current),
+             decode_quality_name((DecodeQuality)next), mLoad * 100.0, mCpu);
+
+        mQuality = (DecodeQuality)next;
+        mTransitions++;
+        return true;
+    }
+};
+
+#endif /* DecodeGovernor_hpp */
@@ -0,0 +1,300 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "DecodePool.hpp"
+
+#include <algorithm>
+#include <obs.h>
+#include <util/platform.h>
+
+#include "Trace.hpp"
+
+// Packets a stream processes before giving other streams a turn
+#define DECODE_STREAM_BATCH 4
+
+// Index of the pool worker running on this thread, or -1
+static thread_local int currentWorker = -1;
+
+std::shared_ptr<DecodeStream> DecodeStream::create(std::function<void(PacketItem *)> process)
+{
+    return std::make_shared<DecodeStream>(process);
+}
+
+DecodeStream::DecodeStream(std::function<void(PacketItem *)> process) : mProcess(process) { }
+
+DecodeStream::~DecodeStream()
+{
+    for (auto item : mQueue) {
+        delete item;
+    }
+}
+
+void DecodeStream::add(PacketItem *item)
+{
+    bool schedule = false;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (mStopped) {
+            delete item;
+            return;
+        }
+
+        item->setQueuedAt(os_gettime_ns());
+        mQueue.push_back(item);
+
+        if (!mScheduled) {
+            mScheduled = true;
+            schedule = true;
+        }
+    }
+
+    if (schedule) {
+        DecodePool::shared().schedule(shared_from_this());
+    }
+}
+
+PacketItem *DecodeStream::remove()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mQueue.empty()) {
+        return NULL;
+    }
+
+    PacketItem *item = mQueue.front();
+    mQueue.pop_front();
+    return item;
+}
+
+int DecodeStream::size()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return (int)mQueue.size();
+}
+
+void DecodeStream::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for (auto item : mQueue) {
+        delete item;
+    }
+    mQueue.clear();
+}
+
+void DecodeStream::replace(std::vector<PacketItem *> items)
+{
+    bool schedule = false;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        for (auto item : mQueue) {
+            delete item;
+        }
+        mQueue.clear();
+
+        if (mStopped) {
+            for (auto item : items) {
+                delete item;
+            }
+            return;
+        }
+
+        uint64_t now = os_gettime_ns();
+        for (auto item : items) {
+            item->setQueuedAt(now);
+        }
+        mQueue.insert(mQueue.end(), items.begin(), items.end());
+
+        if (!mScheduled && !mQueue.empty()) {
+            mScheduled = true;
+            schedule = true;
+        }
+    }
+
+    if (schedule) {
+        DecodePool::shared().schedule(shared_from_this());
+    }
+}
+
+void DecodeStream::stop()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    mStopped = true;
+
+    for (auto item : mQueue) {
+        delete item;
+    }
+    mQueue.clear();
+
+    mIdle.wait(lock, [this] { return !mRunning; });
+}
+
+bool DecodeStream::runBatch()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    mRunning = true;
+
+    for (int i = 0; i < DECODE_STREAM_BATCH && !mQueue.empty() && !mStopped; i++) {
+        PacketItem *item = mQueue.front();
+        mQueue.pop_front();
+
+        lock.unlock();
+        mProcess(item);
+        lock.lock();
+    }
+
+    mRunning = false;
+    mIdle.notify_all();
+
+    bool more = !mQueue.empty() && !mStopped;
+    if (!more) {
+        mScheduled = false;
+    }
+
+    return more;
+}
+
+DecodePool &DecodePool::shared()
+{
+    // Leave a core for the OBS video and encoder threads, but never run
+    // fewer than two workers so one slow decoder can't starve the rest.
+    static DecodePool pool((size_t)std::max(2, os_get_logical_cores() - 1));
+    return pool;
+}
+
+DecodePool::DecodePool(size_t workerCount)
+{
+    for (size_t i = 0; i < workerCount; i++) {
+        mWorkers.push_back(std::make_unique<Worker>());
+    }
+
+    for (size_t i = 0; i < workerCount; i++) {
+        mWorkers[i]->thread = std::thread([this, i] { workerLoop(i); });
+    }
+
+    blog(LOG_INFO, "[obs-ios-camera-plugin] Decoding on %zu workers", workerCount);
+}
+
+DecodePool::~DecodePool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mSleepMutex);
+        mStopping = true;
+    }
+    mSleep.notify_all();
+
+    for (auto &worker : mWorkers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+void DecodePool::schedule(std::shared_ptr<DecodeStream> stream)
+{
+    // Rescheduled from a worker, keep the stream where its decoder state is
+    // still in cache. New work is spread round robin.
+    size_t index = currentWorker >= 0
+        ? (size_t)currentWorker
+        : mNextWorker.fetch_add(1) % mWorkers.size();
+
+    auto &worker = mWorkers[index];
+    int priority = (int)stream->getPriority();
+
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->ready[priority].push_back(stream);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mSleepMutex);
+        mPending++;
+    }
+    mSleep.notify_one();
+}
+
+std::shared_ptr<DecodeStream> DecodePool::take(size_t index)
+{
+    size_t count = mWorkers.size();
+
+    // Priority first, then locality: a hidden stream on this worker waits
+    // while another worker has a program stream queued.
+    for (int priority = 0; priority < DECODE_PRIORITY_COUNT; priority++) {
+        for (size_t offset = 0; offset < count; offset++) {
+            auto &worker = mWorkers[(index + offset) % count];
+            std::lock_guard<std::mutex> lock(worker->mutex);
+
+            auto &ready = worker->ready[priority];
+            if (ready.empty()) {
+                continue;
+            }
+
+            std::shared_ptr<DecodeStream> stream;
+
+            // Our own queue runs in order, steal the newest from others
+            if (offset == 0) {
+                stream = ready.front();
+                ready.pop_front();
+            } else {
+                stream = ready.back();
+                ready.pop_back();
+            }
+
+            return stream;
+        }
+    }
+
+    return nullptr;
+}
+
+void DecodePool::workerLoop(size_t index)
+{
+    currentWorker = (int)index;
+    Tracer::setThreadName("decode worker " + std::to_string(index));
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mSleepMutex);
+            mSleep.wait(lock, [this] { return mStopping || mPending > 0; });
+
+            if (mStopping) {
+                break;
+            }
+
+            mPending--;
+        }
+
+        auto stream = take(index);
+        if (stream == nullptr) {
+            // Someone else took it, the count is only a hint
+            continue;
+        }
+
+        if (stream->runBatch()) {
+            schedule(stream);
+        }
+    }
+
+    currentWorker = -1;
+}
@@ -0,0 +1,141 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef DecodePool_hpp
+#define DecodePool_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Queue.hpp"
+
+// Lower values are scheduled first
+enum class DecodePriority : int {
+    // Visible in the program scene
+    Program = 0,
+    // Visible in the preview, or a projector
+    Preview = 1,
+    // Not visible anywhere
+    Hidden = 2,
+};
+
+#define DECODE_PRIORITY_COUNT 3
+
+// An ordered queue of packets for one decoder. Packets are processed one at
+// a time in the order they were added, on whichever pool worker picks the
+// stream up, never on two workers at once.
+class DecodeStream : public std::enable_shared_from_this<DecodeStream>
+{
+public:
+    // `process` takes ownership of the packet
+    static std::shared_ptr<DecodeStream> create(std::function<void(PacketItem *)> process);
+
+    DecodeStream(std::function<void(PacketItem *)> process);
+    ~DecodeStream();
+
+    void add(PacketItem *item);
+
+    // Returns NULL once the queue is empty, never blocks
+    PacketItem *remove();
+
+    int size();
+
+    // Delete everything that is queued
+    void clear();
+
+    // Replace everything that is queued with `items`
+    void replace(std::vector<PacketItem *> items);
+
+    // Stop accepting packets and wait for the packet in progress. Must not
+    // be called from inside `process`.
+    void stop();
+
+    void setPriority(DecodePriority priority) {
+        mPriority = priority;
+    }
+
+    DecodePriority getPriority() {
+        return mPriority;
+    }
+
+private:
+    friend class DecodePool;
+
+    // Process a few packets, returns true if the stream should be scheduled
+    // again because there is more to do.
+    bool runBatch();
+
+    std::function<void(PacketItem *)> mProcess;
+
+    std::mutex mMutex;
+    std::condition_variable mIdle;
+    std::deque<PacketItem *> mQueue;
+
+    bool mScheduled = false;
+    bool mRunning = false;
+    bool mStopped = false;
+
+    std::atomic<DecodePriority> mPriority = DecodePriority::Program;
+};
+
+// Decode workers shared by every camera source. Each worker has its own
+// queue of streams with packets waiting, and takes from the queues of the
+// other workers when its own is empty. Streams visible in the program are
+// always taken before ones in the preview, and those before hidden ones.
+class DecodePool
+{
+public:
+    static DecodePool &shared();
+
+    ~DecodePool();
+
+    void schedule(std::shared_ptr<DecodeStream> stream);
+
+    size_t workerCount() {
+        return mWorkers.size();
+    }
+
+private:
+    DecodePool(size_t workerCount);
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<DecodeStream>> ready[DECODE_PRIORITY_COUNT];
+        std::thread thread;
+    };
+
+    void workerLoop(size_t index);
+    std::shared_ptr<DecodeStream> take(size_t index);
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+
+    std::mutex mSleepMutex;
+    std::condition_variable mSleep;
+    std::atomic<int> mPending = 0;
+    std::atomic_bool mStopping = false;
+
+    std::atomic<size_t> mNextWorker = 0;
+};
+
+#endif /* DecodePool_hpp */
@@ -0,0 +1,92 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef DecoderStandby_hpp
+#define DecoderStandby_hpp
+
+#include <atomic>
+
+#include <obs.h>
+
+#include "nal-unit.h"
+
+// While the source isn't in the program the decoder only decodes random
+// access points. The connection, the parameter sets and the decoder itself
+// stay up, and the last keyframe stays on the source, so there's a picture
+// the moment the scene cuts back instead of black until the next IDR.
+class DecoderStandby
+{
+    std::atomic_bool mRequested = false;
+
+    // Owned by the decoding thread
+    bool mInStandby = false;
+    bool mSkippedSinceKeyframe = false;
+
+    std::atomic<uint32_t> mSkipped = 0;
+
+public:
+
+    // Safe from any thread, takes effect with the next NAL unit
+    void set(bool standby) {
+        mRequested = standby;
+    }
+
+    // Call with every NAL unit before the keyframe gate. Returns false if it
+    // shouldn't be decoded. `resumed` is set when standby ended with the
+    // reference chain broken, the decoder has to wait for a keyframe.
+    bool admit(const nal_unit &nal, bool *resumed) {
+        *resumed = false;
+
+        bool requested = mRequested;
+        if (requested != mInStandby) {
+            mInStandby = requested;
+
+            blog(LOG_INFO, "[obs-ios-camera-plugin] %s standby, %u pictures skipped so far",
+                 requested ? "Entering" : "Leaving", mSkipped.load());
+
+            if (!requested && mSkippedSinceKeyframe) {
+                *resumed = true;
+                mSkippedSinceKeyframe = false;
+            }
+        }
+
+        if (nal.kind == NAL_KIND_IRAP) {
+            mSkippedSinceKeyframe = false;
+            return true;
+        }
+
+        if (mInStandby && nal.kind == NAL_KIND_SLICE) {
+            mSkippedSinceKeyframe = true;
+            mSkipped++;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool isInStandby() {
+        return mRequested;
+    }
+
+    // Pictures that weren't decoded because of standby
+    uint32_t skipped() {
+        return mSkipped;
+    }
+};
+
+#endif /* DecoderStandby_hpp */
@@ -0,0 +1,249 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "DelayLine.hpp"
+
+#include <obs.h>
+#include <util/platform.h>
+
+#include "logging.h"
+
+// Ten seconds of a 50 Mbps stream, the most the delay line will hold
+#define DELAY_LINE_MAX_BYTES (64 * 1024 * 1024)
+
+DelayLine::DelayLine(Forward forward) : forward(forward) { }
+
+DelayLine::~DelayLine()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRunning = false;
+    }
+    mCondition.notify_all();
+    this->join();
+}
+
+void DelayLine::setDelayMs(uint32_t delayMs)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    uint64_t delay = (uint64_t)delayMs * 1000000;
+    if (delay == mDelay) {
+        return;
+    }
+
+    blog(LOG_INFO, "[obs-ios-camera-plugin] Delaying the stream by %u ms", delayMs);
+    mDelay = delay;
+
+    if (!mRunning && delay != 0) {
+        mRunning = true;
+        Thread::start();
+    }
+
+    // Held back packets are released on the new schedule. When the delay
+    // shrinks a burst comes out at once, the decoder's overload handling
+    // skips it forward to the newest keyframe.
+    mCondition.notify_all();
+}
+
+void DelayLine::add(portal::SimpleDataPacketProtocol::DataPacket packet, uint64_t timestamp)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    // Nothing held back, nothing to keep in order with
+    if (mDelay == 0 && mPackets.empty() && !mReleasing) {
+        if (!admit(packet)) {
+            metrics->count(MetricCounter::DropDelayLine);
+            return;
+        }
+
+        lock.unlock();
+        forward(packet, timestamp);
+        return;
+    }
+
+    mBytes += packet.data.size();
+    mPackets.push_back({std::move(packet), timestamp});
+    metrics->set(MetricGauge::DelayLineBytes, mBytes);
+
+    if (mBytes > DELAY_LINE_MAX_BYTES) {
+        trim();
+    }
+
+    mCondition.notify_all();
+}
+
+void DelayLine::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mPackets.clear();
+    mBytes = 0;
+    mTags.clear();
+}
+
+size_t DelayLine::bytes()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBytes;
+}
+
+// Drop the oldest video until there is room again. A stream that lost
+// pictures then carries on from its next random access point, if one is
+// still held back, or run() skips it until one arrives. Parameter sets are
+// kept, everything needs them, and so is audio, which is tiny next to the
+// video and doesn't depend on earlier packets.
+void DelayLine::trim()
+{
+    size_t dropped = 0;
+
+    for (auto it = mPackets.begin(); it != mPackets.end();) {
+        auto &packet = it->packet;
+
+        if (packet.type != 101) {
+            it++;
+            continue;
+        }
+
+        TagState &state = mTags[packet.tag];
+        VideoKind kind = classify(state, packet);
+
+        if (kind == VideoKind::ParameterSet) {
+            it++;
+            continue;
+        }
+
+        if (mBytes > DELAY_LINE_MAX_BYTES / 2) {
+            state.awaitingIrap = true;
+        } else if (!state.awaitingIrap) {
+            it++;
+            continue;
+        } else if (kind == VideoKind::Irap) {
+            state.awaitingIrap = false;
+            it++;
+            continue;
+        }
+
+        mBytes -= packet.data.size();
+        it = mPackets.erase(it);
+        dropped++;
+    }
+
+    size_t waiting = 0;
+    for (auto &tag : mTags) {
+        waiting += tag.second.awaitingIrap ? 1 : 0;
+    }
+
+    metrics->count(MetricCounter::DropDelayLine, dropped);
+    portal_warn("Delay line full, dropped %zu packets, %zu streams wait for a keyframe",
+                dropped, waiting);
+}
+
+DelayLine::VideoKind DelayLine::classify(TagState &state,
+                                         const portal::SimpleDataPacketProtocol::DataPacket &packet)
+{
+    auto data = (const uint8_t *)packet.data.data();
+
+    nal_codec detected = nal_detect_codec(data, packet.data.size());
+    if (detected != NAL_CODEC_UNKNOWN) {
+        state.codec = detected;
+    }
+
+    nal_unit nal;
+    if (!nal_parse_annexb(state.codec, data, packet.data.size(), &nal)) {
+        return VideoKind::Other;
+    }
+
+    if (nal_is_parameter_set(&nal)) {
+        return VideoKind::ParameterSet;
+    }
+
+    if (nal.kind == NAL_KIND_IRAP && nal_first_slice(state.codec, &nal)) {
+        return VideoKind::Irap;
+    }
+
+    return VideoKind::Other;
+}
+
+// Whether a packet on its way out can be decoded, called with mMutex held
+bool DelayLine::admit(const portal::SimpleDataPacketProtocol::DataPacket &packet)
+{
+    if (packet.type != 101) {
+        return true;
+    }
+
+    auto it = mTags.find(packet.tag);
+    if (it == mTags.end() || !it->second.awaitingIrap) {
+        return true;
+    }
+
+    switch (classify(it->second, packet)) {
+    case VideoKind::ParameterSet:
+        return true;
+    case VideoKind::Irap:
+        it->second.awaitingIrap = false;
+        return true;
+    case VideoKind::Other:
+        break;
+    }
+
+    return false;
+}
+
+void *DelayLine::run()
+{
+    Tracer::setThreadName("delay line");
+
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (mRunning) {
+        if (mPackets.empty()) {
+            mCondition.wait(lock);
+            continue;
+        }
+
+        uint64_t delay = mDelay;
+        uint64_t now = os_gettime_ns();
+        uint64_t release = mPackets.front().timestamp + delay;
+
+        if (now < release) {
+            mCondition.wait_for(lock, std::chrono::nanoseconds(release - now));
+            continue;
+        }
+
+        DelayedPacket packet = std::move(mPackets.front());
+        mPackets.pop_front();
+        mBytes -= packet.packet.data.size();
+        metrics->set(MetricGauge::DelayLineBytes, mBytes);
+
+        if (!admit(packet.packet)) {
+            metrics->count(MetricCounter::DropDelayLine);
+            continue;
+        }
+
+        mReleasing = true;
+        lock.unlock();
+
+        forward(packet.packet, packet.timestamp + delay);
+
+        lock.lock();
+        mReleasing = false;
+    }
+
+    return NULL;
+}
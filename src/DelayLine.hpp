@@ -0,0 +1,110 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef DelayLine_hpp
+#define DelayLine_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+
+#include "Metrics.hpp"
+#include "Protocol.hpp"
+#include "Thread.hpp"
+#include "Trace.hpp"
+#include "nal-unit.h"
+
+// Holds the compressed stream back by a fixed delay, so a source can be
+// lined up with audio from elsewhere. A couple of seconds of H.264 is a few
+// MB, where OBS' own sync offset would keep the decoded frames.
+//
+// Packets are released when their timestamp plus the delay comes round on
+// the os_gettime_ns() clock, and their timestamps are moved on by the delay
+// so everything after this sees them as if they were captured then.
+class DelayLine : private Thread
+{
+public:
+    typedef std::function<void(portal::SimpleDataPacketProtocol::DataPacket packet,
+                               uint64_t timestamp)> Forward;
+
+    DelayLine(Forward forward);
+    ~DelayLine();
+
+    void setDelayMs(uint32_t delayMs);
+    uint32_t getDelayMs() { return (uint32_t)(mDelay / 1000000); }
+
+    // Called from the connection thread, `timestamp` is the capture time
+    void add(portal::SimpleDataPacketProtocol::DataPacket packet, uint64_t timestamp);
+
+    // Drop everything that is held back, e.g. on reconnect
+    void clear();
+
+    size_t bytes();
+
+    void setMetrics(Metrics *metrics) {
+        this->metrics = metrics;
+    }
+
+private:
+    struct DelayedPacket {
+        portal::SimpleDataPacketProtocol::DataPacket packet;
+        uint64_t timestamp;
+    };
+
+    // Each camera stream and layer has its own codec and keyframes
+    struct TagState {
+        nal_codec codec = NAL_CODEC_UNKNOWN;
+
+        // Video of this tag was dropped, nothing decodes before its next
+        // random access point
+        bool awaitingIrap = false;
+    };
+
+    enum class VideoKind {
+        ParameterSet,
+        Irap,
+        Other,
+    };
+
+    void *run() override;
+    void trim();
+    VideoKind classify(TagState &state,
+                       const portal::SimpleDataPacketProtocol::DataPacket &packet);
+    bool admit(const portal::SimpleDataPacketProtocol::DataPacket &packet);
+
+    Forward forward;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<DelayedPacket> mPackets;
+    size_t mBytes = 0;
+
+    // Set while a released packet is being forwarded outside the lock
+    bool mReleasing = false;
+    bool mRunning = false;
+
+    std::atomic<uint64_t> mDelay = 0;
+    std::map<uint32_t, TagState> mTags;
+
+    Metrics *metrics = Metrics::unregistered();
+};
+
+#endif /* DelayLine_hpp */
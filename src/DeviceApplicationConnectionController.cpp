@@ -16,7 +16,14 @@
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
-#include <iostream>
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include <util/platform.h>
 
 #include "DeviceApplicationConnectionController.hpp"
 
@@ -25,6 +32,9 @@ DeviceApplicationConnectionController::DeviceApplicationConnectionController(
 {
 	this->protocol = std::make_unique<portal::SimpleDataPacketProtocol>();
 	this->deviceConnection = deviceConnection;
+	this->metrics = MetricsRegistry::shared().scope(
+		"connection " + deviceConnection->getHost() + ":" +
+		std::to_string(deviceConnection->getPort()));
 	should_reconnect = true;
 	worker_stopping = false;
 }
@@ -32,9 +42,7 @@ DeviceApplicationConnectionController::DeviceApplicationConnectionController(
 DeviceApplicationConnectionController::~DeviceApplicationConnectionController()
 {
 	should_reconnect = false;
-	std::cout
-		<< "DeviceApplicationConnectionController::~DeviceApplicationConnectionController()"
-		<< std::endl;
+	portal_debug("DeviceApplicationConnectionController::~DeviceApplicationConnectionController()");
 
 	worker_stopping = true;
 	worker_condition.notify_all();
@@ -75,11 +83,178 @@ void DeviceApplicationConnectionController::disconnect()
 	protocol->reset();
 }
 
+// An IDR usually arrives within a couple of frames, don't ask again before then
+#define RECOVERY_REQUEST_INTERVAL_NS 250000000LL
+
+void DeviceApplicationConnectionController::requestRecovery(
+	const RecoveryRequest &request, uint32_t tag)
+{
+	auto track = trackFor(tag);
+	if (track == nullptr) {
+		return;
+	}
+
+	auto &lastRequestTime = track->lastRecoveryRequestTime;
+	int64_t now = (int64_t)os_gettime_ns();
+	int64_t last = lastRequestTime;
+
+	if (now - last < RECOVERY_REQUEST_INTERVAL_NS ||
+	    !lastRequestTime.compare_exchange_strong(last, now)) {
+		return;
+	}
+
+	switch (request.reason) {
+	case RecoveryReason::ReferenceLoss:
+		sendControlFrame(portal::ControlFrameReferenceLoss,
+				 {request.expectedFrameNum,
+				  request.receivedFrameNum},
+				 tag);
+		break;
+	case RecoveryReason::DecodeError:
+		sendControlFrame(portal::ControlFrameDecodeError, {}, tag);
+		break;
+	default:
+		break;
+	}
+
+	sendControlFrame(portal::ControlFrameRequestKeyframe, {}, tag);
+}
+
+void DeviceApplicationConnectionController::requestBitrate(uint32_t percent,
+							   uint32_t tag)
+{
+	blog(LOG_INFO, "[obs-ios-camera-plugin] Asking the device for %u%% of the bitrate of stream %u layer %u",
+	     percent, portal::tagStream(tag), portal::tagLayer(tag));
+	sendControlFrame(portal::ControlFrameBitrateScale, {percent}, tag);
+}
+
+bool DeviceApplicationConnectionController::sendControlFrame(
+	uint32_t type, std::vector<uint32_t> payload, uint32_t tag)
+{
+	if (deviceConnection->getState() !=
+	    portal::DeviceConnection::State::Connected) {
+		return false;
+	}
+
+	auto packet = portal::SimpleDataPacketProtocol::DataPacket();
+	packet.version = 1;
+	packet.type = type;
+	packet.tag = tag;
+
+	for (auto value : payload) {
+		uint32_t bigEndian = htonl(value);
+		auto bytes = reinterpret_cast<char *>(&bigEndian);
+		packet.data.insert(packet.data.end(), bytes,
+				   bytes + sizeof(bigEndian));
+	}
+
+	// DeviceConnection::send returns true on failure
+	return !deviceConnection->send(
+		portal::SimpleDataPacketProtocol::encodePacket(packet));
+}
+
+bool DeviceApplicationConnectionController::parseVideoPacket(
+	const portal::SimpleDataPacketProtocol::DataPacket &packet, nal_unit *nal)
+{
+	auto data = (const uint8_t *)packet.data.data();
+	auto size = packet.data.size();
+
+	auto &videoCodec = trackFor(packet.tag)->codec;
+
+	nal_codec codec = nal_detect_codec(data, size);
+	if (codec != NAL_CODEC_UNKNOWN) {
+		videoCodec = codec;
+	} else {
+		codec = videoCodec;
+	}
+
+	return codec != NAL_CODEC_UNKNOWN &&
+	       nal_parse_annexb(codec, data, size, nal);
+}
+
+// Plain Annex-B streams can carry the capture time in an SEI ahead of
+// each picture. Returns it for the first slice of that picture.
+uint64_t DeviceApplicationConnectionController::captureTimeFromSei(
+	uint32_t tag, const nal_unit &nal)
+{
+	auto track = trackFor(tag);
+
+	uint64_t timestamp = 0;
+	if (nal_parse_timestamp_sei(track->codec, &nal, &timestamp)) {
+		track->pendingSeiTimestamp = timestamp;
+		return 0;
+	}
+
+	if (nal_is_vcl(&nal)) {
+		timestamp = track->pendingSeiTimestamp;
+		track->pendingSeiTimestamp = 0;
+	}
+
+	return timestamp;
+}
+
 void DeviceApplicationConnectionController::processPacket(
-	portal::SimpleDataPacketProtocol::DataPacket packet)
+	portal::SimpleDataPacketProtocol::DataPacket packet, uint64_t arrivalTime)
 {
+	if (clockNeedsReset.exchange(false)) {
+		clock.reset();
+		for (auto &layers : tracks) {
+			for (auto &track : layers) {
+				track.pendingSeiTimestamp = 0;
+			}
+		}
+	}
+
+	// Only video is split into streams and layers, the phone sends one
+	// audio track
+	uint32_t tag = 0;
+	std::shared_ptr<Metrics> trackMetrics;
+	if (packet.type == 101) {
+		tag = packet.tag;
+
+		auto track = trackFor(tag);
+		if (track == nullptr) {
+			portal_warn("Dropping video for unknown stream %u layer %u",
+				    portal::tagStream(tag), portal::tagLayer(tag));
+			return;
+		}
+		track->seen = true;
+
+		trackMetrics = std::atomic_load(&track->metrics);
+		if (trackMetrics != nullptr) {
+			trackMetrics->count(MetricCounter::BytesReceived, packet.data.size());
+		}
+	}
+
+	uint64_t captureTime = packet.timestamp;
+
+	nal_unit nal;
+	if (packet.type == 101 && parseVideoPacket(packet, &nal)) {
+		if (trackMetrics != nullptr && nal_is_vcl(&nal) &&
+		    nal_first_slice(trackFor(tag)->codec, &nal)) {
+			trackMetrics->count(MetricCounter::Pictures);
+		}
+
+		if (captureTime == 0) {
+			captureTime = captureTimeFromSei(tag, nal);
+		}
+	}
+
+	uint64_t timestamp =
+		captureTime != 0
+			? clock.toHost(packet.type, tag, captureTime, arrivalTime)
+			: clock.arrival(packet.type, tag, arrivalTime);
+
+	if (trackMetrics != nullptr) {
+		trackMetrics->count(MetricCounter::Nals);
+
+		if (captureTime != 0 && timestamp < arrivalTime) {
+			trackMetrics->record(MetricStage::Receive, arrivalTime - timestamp);
+		}
+	}
+
 	if (onProcessPacketCallback) {
-		onProcessPacketCallback(packet);
+		onProcessPacketCallback(packet, timestamp);
 	}
 }
 
@@ -95,7 +270,7 @@ void DeviceApplicationConnectionController::worker_loop()
 		case portal::DeviceConnection::State::Errored:
 
 			if (should_reconnect) {
-				blog(LOG_DEBUG, "[obs-ios-camera-plugin] Device connection errored: reconnecting");
+				portal_debug("Device connection errored: reconnecting");
 				this->deviceConnection->connect();
 			}
 
@@ -103,24 +278,20 @@ void DeviceApplicationConnectionController::worker_loop()
 			
 		case portal::DeviceConnection::State::Disconnected:
 			if (should_reconnect) {
-				blog(LOG_DEBUG,
-				     "[obs-ios-camera-plugin] Device connection disconnected: reconnecting if possible");
+				portal_debug("Device connection disconnected: reconnecting if possible");
 				this->deviceConnection->connect();
 			}
 			
 			break;
 		case portal::DeviceConnection::State::Connected:
-			blog(LOG_DEBUG,
-			     "[obs-ios-camera-plugin] Device connection is already connected. Doing nothing.");
+			portal_debug("Device connection is already connected. Doing nothing.");
 			break;
         case portal::DeviceConnection::State::Connecting:
-            blog(LOG_DEBUG,
-                 "[obs-ios-camera-plugin] Device connection is already connecting. Doing nothing.");
+            portal_debug("Device connection is already connecting. Doing nothing.");
                 break;
 
         case portal::DeviceConnection::State::ImpossibleToConnect:
-            blog(LOG_DEBUG,
-                 "[obs-ios-camera-plugin] Configuration is invalid.");
+            portal_debug("Configuration is invalid.");
             worker_stopping = true;
             break;
         }
@@ -139,7 +310,29 @@ void DeviceApplicationConnectionController::connectionDidChangeState(
 	portal::DeviceConnection::State state)
 {
     UNUSED_PARAMETER(deviceConnection);
-    UNUSED_PARAMETER(state);
+
+    // Don't wait for the phone's next scheduled IDR after a reconnect
+    if (state == portal::DeviceConnection::State::Connected) {
+        if (hasConnected) {
+            metrics->count(MetricCounter::Reconnects);
+        }
+        hasConnected = true;
+
+        // The clock belongs to the receiving thread, reset it from there
+        clockNeedsReset = true;
+
+        // The streams of the last connection need a keyframe just the same
+        for (uint32_t stream = 0; stream < portal::PortalMaxStreams; stream++) {
+            for (uint32_t layer = 0; layer < portal::PortalMaxLayers; layer++) {
+                auto &track = tracks[stream][layer];
+                if ((stream == 0 && layer == portal::PortalLayerFull) || track.seen) {
+                    track.lastRecoveryRequestTime = 0;
+                    requestRecovery({RecoveryReason::Reset, 0, 0},
+                                    portal::makeTag(stream, layer));
+                }
+            }
+        }
+    }
 }
 
 void DeviceApplicationConnectionController::connectionDidRecieveData(
@@ -148,9 +341,17 @@ void DeviceApplicationConnectionController::connectionDidRecieveData(
 {
     UNUSED_PARAMETER(deviceConnection);
 
+	uint64_t arrivalTime = os_gettime_ns();
+	TraceSpan span("receive", data.size());
+
 	auto packets = protocol->processData(data);
+	uint64_t parsed = os_gettime_ns();
+	metrics->record(MetricStage::Parse, parsed - arrivalTime);
+	Tracer::shared().span("processData", arrivalTime, parsed, data.size());
 	std::for_each(packets.begin(), packets.end(),
-		      [this](auto packet) { this->processPacket(packet); });
+		      [this, arrivalTime](auto packet) {
+			      this->processPacket(packet, arrivalTime);
+		      });
 }
 
 void DeviceApplicationConnectionController::connectionDidFail(
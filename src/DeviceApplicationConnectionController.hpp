@@ -19,6 +19,10 @@
 #pragma once
 
 #include "FFMpegVideoDecoder.h"
+#include "KeyframeGate.hpp"
+#include "DeviceClock.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
 
 #include <algorithm>
 #include <functional>
@@ -40,7 +44,22 @@ public:
 	void connect();
 	void disconnect();
 
-	std::function<void(portal::SimpleDataPacketProtocol::DataPacket packet)>
+	// Ask the phone for a keyframe in the stream and layer of `tag`,
+	// reporting why. Safe to call from any thread and as often as needed,
+	// requests are rate limited per layer.
+	void requestRecovery(const RecoveryRequest &request, uint32_t tag = 0);
+
+	// Ask the phone to scale the bitrate of the stream and layer of `tag`,
+	// as a percentage of what it would pick itself. Safe to call from any
+	// thread.
+	void requestBitrate(uint32_t percent, uint32_t tag = 0);
+
+	// `timestamp` is the capture time of the packet on the os_gettime_ns()
+	// clock, or its arrival time if the phone doesn't send capture times.
+	// Video packets carry their stream and layer in `packet.tag`, packets
+	// for any the protocol doesn't know are dropped before they get here.
+	std::function<void(portal::SimpleDataPacketProtocol::DataPacket packet,
+			   uint64_t timestamp)>
 		onProcessPacketCallback;
 
 	auto getState() { return deviceConnection->getState(); }
@@ -48,6 +67,23 @@ public:
     auto getHost() { return deviceConnection->getHost(); }
     auto getPort() { return deviceConnection->getPort(); }
 
+	// Reconnects and parsing, for the whole device
+	std::shared_ptr<Metrics> getMetrics() { return metrics; }
+
+	// Where the pictures and bytes received for the stream and layer of
+	// `tag` are counted, nowhere until it is set. Safe from any thread.
+	void setMetrics(uint32_t tag, std::shared_ptr<Metrics> trackMetrics) {
+		auto track = trackFor(tag);
+		if (track != nullptr) {
+			std::atomic_store(&track->metrics, trackMetrics);
+		}
+	}
+
+	nal_codec getCodec(uint32_t tag = 0) {
+		auto track = trackFor(tag);
+		return track != nullptr ? track->codec.load() : NAL_CODEC_UNKNOWN;
+	}
+
 private:
 
 	bool should_reconnect;
@@ -63,7 +99,48 @@ private:
 	std::unique_ptr<portal::SimpleDataPacketProtocol> protocol;
 	std::shared_ptr<portal::DeviceConnection> deviceConnection;
 
-	void processPacket(portal::SimpleDataPacketProtocol::DataPacket packet);
+	void processPacket(portal::SimpleDataPacketProtocol::DataPacket packet,
+			   uint64_t arrivalTime);
+	bool parseVideoPacket(
+		const portal::SimpleDataPacketProtocol::DataPacket &packet,
+		nal_unit *nal);
+	uint64_t captureTimeFromSei(uint32_t tag, const nal_unit &nal);
+
+	DeviceClock clock;
+	std::atomic_bool clockNeedsReset = false;
+
+	// One layer of one video stream
+	struct VideoTrack {
+		// Whether the phone has sent anything for this layer
+		std::atomic_bool seen = false;
+
+		// Codec of the layer, from its last parameter set
+		std::atomic<nal_codec> codec = NAL_CODEC_UNKNOWN;
+
+		// Capture time from the last timestamp SEI, for the picture after it
+		uint64_t pendingSeiTimestamp = 0;
+
+		std::atomic<int64_t> lastRecoveryRequestTime = 0;
+
+		// Swapped atomically, see setMetrics
+		std::shared_ptr<Metrics> metrics;
+	};
+	VideoTrack tracks[portal::PortalMaxStreams][portal::PortalMaxLayers];
+
+	VideoTrack *trackFor(uint32_t tag) {
+		uint32_t stream = portal::tagStream(tag);
+		uint32_t layer = portal::tagLayer(tag);
+		if (stream >= portal::PortalMaxStreams || layer >= portal::PortalMaxLayers) {
+			return nullptr;
+		}
+		return &tracks[stream][layer];
+	}
+
+	bool sendControlFrame(uint32_t type, std::vector<uint32_t> payload,
+			      uint32_t tag);
+
+	std::shared_ptr<Metrics> metrics;
+	bool hasConnected = false;
 
 	// Device Connection Delegate
 	void connectionDidChangeState(
@@ -0,0 +1,147 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef DeviceClock_hpp
+#define DeviceClock_hpp
+
+#include <atomic>
+#include <cstdlib>
+#include <map>
+
+#include <obs.h>
+
+#include "ClockEstimator.hpp"
+#include "logging.h"
+
+// Largest change to the offset per sample, so timestamps never jump
+#define DEVICE_CLOCK_MAX_SLEW_NS 500000LL
+
+// An offset this far from the estimate means the device clock restarted
+#define DEVICE_CLOCK_RESYNC_NS 1000000000LL
+
+#define DEVICE_CLOCK_REPORT_INTERVAL_NS 300000000000LL
+
+// Maps capture times on the phone's clock onto os_gettime_ns().
+//
+// Every packet gives a sample of host arrival time minus device capture
+// time: the clock offset plus however long the packet took to get here.
+// A ClockEstimator fits offset and skew to the lowest of those samples, so
+// the mapping follows the phone's clock drifting away from ours. The
+// applied offset follows the fit at a limited rate, so timestamps stay
+// monotonic and jitter free.
+//
+// Audio and every video stream and layer share one mapping so they stay
+// comparable, but each keeps its own timeline.
+// Not thread safe, packets arrive on a single connection thread, apart
+// from skewPpm().
+class DeviceClock
+{
+    ClockEstimator mEstimator;
+
+    bool mSynced = false;
+    int64_t mOffset = 0;
+
+    std::atomic<double> mSkewPpm = 0.0;
+    int64_t mLastReport = 0;
+
+    // Last timestamp handed out per packet type and tag
+    std::map<uint64_t, uint64_t> mLastTimestamps;
+
+public:
+
+    // Host time for a packet of `type` and `tag` captured at `deviceTime`.
+    uint64_t toHost(uint32_t type, uint32_t tag, uint64_t deviceTime,
+                    uint64_t arrivalTime) {
+        int64_t arrival = (int64_t)arrivalTime;
+        int64_t sample = arrival - (int64_t)deviceTime;
+
+        if (mSynced && llabs(sample - mOffset) > DEVICE_CLOCK_RESYNC_NS) {
+            portal_info("Device clock jumped by %lld ms, resynchronizing",
+                        (long long)((sample - mOffset) / 1000000));
+            mSynced = false;
+        }
+
+        if (!mSynced) {
+            mEstimator.reset();
+            mOffset = sample;
+            mSynced = true;
+        }
+
+        mEstimator.add((int64_t)deviceTime, arrival);
+        mSkewPpm = mEstimator.skew() * 1000000.0;
+
+        if (mEstimator.isFitted() && arrival - mLastReport > DEVICE_CLOCK_REPORT_INTERVAL_NS) {
+            blog(LOG_INFO, "Device clock: %+.1f ppm", mSkewPpm.load());
+            mLastReport = arrival;
+        }
+
+        int64_t target = mEstimator.offsetAt((int64_t)deviceTime);
+        int64_t step = target - mOffset;
+        if (step > DEVICE_CLOCK_MAX_SLEW_NS) {
+            step = DEVICE_CLOCK_MAX_SLEW_NS;
+        } else if (step < -DEVICE_CLOCK_MAX_SLEW_NS) {
+            step = -DEVICE_CLOCK_MAX_SLEW_NS;
+        }
+        mOffset += step;
+
+        return monotonic(timeline(type, tag), (uint64_t)((int64_t)deviceTime + mOffset));
+    }
+
+    // Host time for a packet without a capture time.
+    //
+    // In a stream that carries capture times these are parameter sets, SEIs
+    // or the later slices of a picture, which take the time of the picture
+    // before them. Otherwise the packet is stamped on arrival, which at
+    // least keeps queueing and decoding out of the timestamps.
+    uint64_t arrival(uint32_t type, uint32_t tag, uint64_t arrivalTime) {
+        auto last = mLastTimestamps.find(timeline(type, tag));
+        if (mSynced && last != mLastTimestamps.end()) {
+            return last->second;
+        }
+
+        return monotonic(timeline(type, tag), arrivalTime);
+    }
+
+    // How much faster the host clock runs than the phone's, in ppm
+    double skewPpm() {
+        return mSkewPpm;
+    }
+
+    void reset() {
+        mEstimator.reset();
+        mSynced = false;
+        mLastTimestamps.clear();
+    }
+
+private:
+
+    static uint64_t timeline(uint32_t type, uint32_t tag) {
+        return ((uint64_t)tag << 32) | type;
+    }
+
+    uint64_t monotonic(uint64_t timeline, uint64_t timestamp) {
+        uint64_t &last = mLastTimestamps[timeline];
+        if (timestamp <= last) {
+            timestamp = last + 1;
+        }
+        last = timestamp;
+        return timestamp;
+    }
+};
+
+#endif /* DeviceClock_hpp */
@@ -0,0 +1,651 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include "DeviceSession.hpp"
+
+#include <algorithm>
+#include <map>
+
+#include <util/platform.h>
+
+#include "logging.h"
+
+std::shared_ptr<DeviceSession> DeviceSession::forDevice(const std::string &host, int port)
+{
+	static std::mutex sessionsMutex;
+	static std::map<std::string, std::weak_ptr<DeviceSession>> sessions;
+
+	std::lock_guard<std::mutex> lock(sessionsMutex);
+
+	auto &entry = sessions[host + ":" + std::to_string(port)];
+	auto session = entry.lock();
+	if (session == nullptr) {
+		session = std::make_shared<DeviceSession>(host, port);
+		entry = session;
+	}
+
+	// Forget the devices nobody shows any more
+	for (auto it = sessions.begin(); it != sessions.end();) {
+		it = it->second.expired() ? sessions.erase(it) : std::next(it);
+	}
+
+	return session;
+}
+
+DeviceSession::DeviceSession(const std::string &host, int port)
+	: mHost(host), mPort(port),
+	  mDelayLine([this](auto packet, uint64_t timestamp) {
+		  this->dispatchPacket(packet, timestamp);
+	  })
+{
+	portal_info("Did Add device %s:%d", host.c_str(), port);
+
+	// Create the connection, but don't start anything just yet
+	auto deviceConnection = std::make_shared<portal::DeviceConnection>(host, port);
+	mController = std::make_shared<DeviceApplicationConnectionController>(deviceConnection);
+	mMetrics = mController->getMetrics();
+
+	mController->onProcessPacketCallback = [this](auto packet, uint64_t timestamp) {
+		this->mDelayLine.add(packet, timestamp);
+	};
+
+	mDelayLine.setMetrics(mMetrics.get());
+
+	mAudioDecoder.output = [this](const obs_source_audio *audio) {
+		this->outputAudio(audio);
+	};
+	mAudioDecoder.Init();
+}
+
+DeviceSession::~DeviceSession()
+{
+	mController->disconnect();
+	mDelayLine.clear();
+
+	mMetrics->snapshot().log();
+	for (auto &stream : mStreams) {
+		if (stream == nullptr) {
+			continue;
+		}
+		for (auto &layer : stream->layers) {
+			layer.metrics->snapshot().log();
+		}
+	}
+}
+
+std::shared_ptr<Metrics> DeviceSession::getStreamMetrics(uint32_t id)
+{
+	std::lock_guard<std::mutex> lock(mSubscribersMutex);
+
+	if (id >= portal::PortalMaxStreams || mStreams[id] == nullptr) {
+		return nullptr;
+	}
+
+	auto stream = mStreams[id].get();
+	std::lock_guard<std::mutex> outputLock(stream->outputMutex);
+	return stream->layers[stream->outputLayer].metrics;
+}
+
+// Called with mSubscribersMutex held
+DeviceSession::VideoStream *DeviceSession::streamFor(uint32_t id)
+{
+	auto &stream = mStreams[id];
+	if (stream != nullptr) {
+		return stream.get();
+	}
+
+	portal_info("Decoding stream %u of %s:%d", id, mHost.c_str(), mPort);
+
+	stream = std::make_unique<VideoStream>();
+	stream->id = id;
+
+	for (uint32_t index = 0; index < portal::PortalMaxLayers; index++) {
+		auto layer = &stream->layers[index];
+		layer->stream = stream.get();
+		layer->layer = index;
+		layer->tag = portal::makeTag(id, index);
+
+		// Each layer counts on its own, or a low layer would double the
+		// rates every source of the device sees
+		std::string scope = "connection " + mHost + ":" + std::to_string(mPort) +
+				    " stream " + std::to_string(id);
+		if (index == portal::PortalLayerLow) {
+			scope += " low layer";
+		}
+		layer->metrics = MetricsRegistry::shared().scope(scope);
+		mController->setMetrics(layer->tag, layer->metrics);
+
+#ifdef __APPLE__
+		layer->videoToolboxDecoder.output = layer;
+		layer->videoToolboxDecoder.metrics = layer->metrics.get();
+		layer->videoToolboxDecoder.Init();
+#endif
+
+		layer->ffmpegVideoDecoder.output = layer;
+		layer->ffmpegVideoDecoder.metrics = layer->metrics.get();
+		layer->ffmpegVideoDecoder.Init();
+
+		layer->videoDecoder = &layer->ffmpegVideoDecoder;
+
+		auto controller = mController;
+		uint32_t tag = layer->tag;
+		auto onRecoveryNeeded = [controller, tag](const RecoveryRequest &request) {
+			controller->requestRecovery(request, tag);
+		};
+		layer->ffmpegVideoDecoder.onRecoveryNeeded = onRecoveryNeeded;
+		layer->ffmpegVideoDecoder.onBitrateRequest = [controller, tag](uint32_t percent) {
+			controller->requestBitrate(percent, tag);
+		};
+#ifdef __APPLE__
+		layer->videoToolboxDecoder.onRecoveryNeeded = onRecoveryNeeded;
+#endif
+
+		// Parameter sets from an earlier connection to this phone let the
+		// decoder get ready before the first keyframe arrives
+		layer->parameterSets = ParameterSetCache::forDevice(mHost, mPort, tag);
+		layer->ffmpegVideoDecoder.setParameterSetCache(layer->parameterSets);
+#ifdef __APPLE__
+		layer->videoToolboxDecoder.setParameterSetCache(layer->parameterSets);
+#endif
+
+		for (auto &packet : layer->parameterSets->getPackets()) {
+			layer->videoDecoder->Input(packet, 101, tag, os_gettime_ns());
+		}
+	}
+
+	stream->layers[portal::PortalLayerFull].feeding = true;
+
+	return stream.get();
+}
+
+bool DeviceSession::subscribe(Subscriber *subscriber)
+{
+	uint32_t id = subscriber->getStreamId();
+	if (id >= portal::PortalMaxStreams) {
+		portal_warn("Can't show stream %u, the last one is %u", id,
+			    portal::PortalMaxStreams - 1);
+		return false;
+	}
+
+	bool first;
+	bool created;
+	VideoStream *stream;
+	{
+		std::lock_guard<std::mutex> lock(mSubscribersMutex);
+		first = std::none_of(mSubscribers.begin(), mSubscribers.end(),
+				     [id](Subscriber *other) {
+					     return other->getStreamId() == id;
+				     });
+		created = mStreams[id] == nullptr;
+		stream = streamFor(id);
+		mSubscribers.push_back(subscriber);
+	}
+
+	subscriber->getFrameSink()->setStandby(stream->standby);
+	stream->outputs.add(subscriber->getFrameSink());
+
+	// The phone sent the last keyframe of the stream before anybody
+	// decoded it
+	if (created) {
+		mController->requestRecovery({RecoveryReason::Reset, 0, 0},
+					     portal::makeTag(id, portal::PortalLayerFull));
+	}
+
+	// A live source needs the full layer right away
+	updatePriority();
+	updateScale();
+
+	return first;
+}
+
+void DeviceSession::unsubscribe(Subscriber *subscriber)
+{
+	VideoStream *stream = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(mSubscribersMutex);
+		mSubscribers.erase(std::remove(mSubscribers.begin(),
+					       mSubscribers.end(), subscriber),
+				   mSubscribers.end());
+
+		// A packet may still be on its way to it
+		mDispatchedCondition.wait(lock, [this] { return mDispatching == 0; });
+
+		uint32_t id = subscriber->getStreamId();
+		if (id < portal::PortalMaxStreams) {
+			stream = mStreams[id].get();
+		}
+	}
+
+	if (stream != nullptr) {
+		stream->outputs.remove(subscriber->getFrameSink());
+		subscriber->getFrameSink()->setStandby(false);
+
+		// The one that left may have been the only one watching
+		setStandby(stream, wantsStandby(stream));
+	}
+	updatePriority();
+	updateScale();
+}
+
+void DeviceSession::configure(uint32_t id, const DeviceSessionSettings &settings)
+{
+	mDelayLine.setDelayMs(settings.delayMs);
+
+	VideoStream *stream = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mSubscribersMutex);
+		if (id < portal::PortalMaxStreams) {
+			stream = mStreams[id].get();
+		}
+	}
+
+	if (stream == nullptr) {
+		return;
+	}
+
+	for (auto &layer : stream->layers) {
+		bool decoderChanged = layer.ffmpegVideoDecoder.getHW() != settings.ffmpegHardwareDecoder;
+		VideoDecoder *previousDecoder = layer.videoDecoder;
+
+		layer.ffmpegVideoDecoder.setHW(settings.ffmpegHardwareDecoder);
+		layer.ffmpegVideoDecoder.decimator.setEnabled(settings.decimateToCanvas);
+
+		decoderChanged |= layer.ffmpegVideoDecoder.getCodecPreference() != settings.codec;
+		layer.ffmpegVideoDecoder.setCodec(settings.codec);
+#ifdef __APPLE__
+		layer.videoToolboxDecoder.setCodec(settings.codec);
+
+		if (settings.videoToolboxDecoder && !settings.ffmpegHardwareDecoder) {
+			layer.videoDecoder = &layer.videoToolboxDecoder;
+		} else {
+			layer.videoDecoder = &layer.ffmpegVideoDecoder;
+		}
+#endif
+
+		// The decoder was flushed or swapped, catch it up from the GOP cache
+		if (layer.feeding && (decoderChanged || layer.videoDecoder != previousDecoder)) {
+			primeLayer(stream, &layer);
+		}
+	}
+}
+
+void DeviceSession::update()
+{
+	bool connect = false;
+	std::vector<VideoStream *> streams;
+	{
+		std::lock_guard<std::mutex> lock(mSubscribersMutex);
+		for (auto subscriber : mSubscribers) {
+			connect |= subscriber->wantsConnection();
+		}
+		for (auto &stream : mStreams) {
+			if (stream != nullptr) {
+				streams.push_back(stream.get());
+			}
+		}
+	}
+
+	// Bring the decoder from the last keyframe to the live picture rather
+	// than wait for the phone to send a new one
+	for (auto stream : streams) {
+		bool standby = wantsStandby(stream);
+		if (!(stream->standby && !standby && primeDecoder(stream))) {
+			setStandby(stream, standby);
+		}
+	}
+
+	if (connect) {
+		mController->start();
+	}
+}
+
+void DeviceSession::updatePriority()
+{
+	std::vector<VideoStream *> streams;
+	DecodePriority audioPriority = DecodePriority::Hidden;
+	{
+		std::lock_guard<std::mutex> lock(mSubscribersMutex);
+
+		for (auto &stream : mStreams) {
+			if (stream == nullptr) {
+				continue;
+			}
+
+			DecodePriority priority = DecodePriority::Hidden;
+			bool lowLayerAllowed = true;
+			for (auto subscriber : mSubscribers) {
+				if (subscriber->getStreamId() == stream->id) {
+					priority = std::min(priority, subscriber->getDecodePriority());
+					lowLayerAllowed &= subscriber->allowsLowLayer();
+				}
+			}
+			audioPriority = std::min(audioPriority, priority);
+
+			stream->lowLayerAllowed = lowLayerAllowed;
+			if (stream->decodePriority.exchange(priority) != priority) {
+				for (auto &layer : stream->layers) {
+					layer.ffmpegVideoDecoder.SetPriority(priority);
+#ifdef __APPLE__
+					layer.videoToolboxDecoder.SetPriority(priority);
+#endif
+				}
+			}
+
+			streams.push_back(stream.get());
+		}
+
+		if (audioPriority != mAudioPriority) {
+			mAudioPriority = audioPriority;
+			mAudioDecoder.SetPriority(audioPriority);
+		}
+	}
+
+	// Priming takes the subscribers lock again
+	for (auto stream : streams) {
+		selectLayer(stream);
+	}
+}
+
+void DeviceSession::updateScale()
+{
+	std::lock_guard<std::mutex> lock(mSubscribersMutex);
+
+	for (auto &stream : mStreams) {
+		if (stream == nullptr) {
+			continue;
+		}
+
+		// Any subscriber that needs the full picture gets it
+		bool scale = true;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		for (auto subscriber : mSubscribers) {
+			if (subscriber->getStreamId() != stream->id) {
+				continue;
+			}
+
+			uint32_t subscriberWidth = 0;
+			uint32_t subscriberHeight = 0;
+			subscriber->getScaleTarget(&subscriberWidth, &subscriberHeight);
+
+			scale &= subscriberWidth > 0 && subscriberHeight > 0;
+			width = std::max(width, subscriberWidth);
+			height = std::max(height, subscriberHeight);
+		}
+
+		if (!scale) {
+			width = 0;
+			height = 0;
+		}
+
+		// The low layer is only halved if it is still larger than needed
+		for (auto &layer : stream->layers) {
+			layer.ffmpegVideoDecoder.scaler.setTarget(width, height);
+		}
+	}
+}
+
+void DeviceSession::finishDispatch()
+{
+	std::lock_guard<std::mutex> lock(mSubscribersMutex);
+	if (--mDispatching == 0) {
+		mDispatchedCondition.notify_all();
+	}
+}
+
+void DeviceSession::dispatchPacket(portal::SimpleDataPacketProtocol::DataPacket packet,
+				   uint64_t timestamp)
+{
+	try {
+		bool video = packet.type == 101;
+		VideoStream *stream = nullptr;
+		std::vector<Subscriber *> receivers;
+		{
+			std::lock_guard<std::mutex> lock(mSubscribersMutex);
+			if (video && portal::tagStream(packet.tag) < portal::PortalMaxStreams) {
+				stream = mStreams[portal::tagStream(packet.tag)].get();
+			}
+
+			// The replay buffer and ISO recordings keep the full layer
+			for (auto subscriber : mSubscribers) {
+				if (!video || subscriber->getStreamId() == packet.tag) {
+					receivers.push_back(subscriber);
+				}
+			}
+
+			if (!receivers.empty()) {
+				mDispatching++;
+			}
+		}
+
+		// Outside the lock, a slow recorder mustn't hold up subscribing
+		// and configuring other sources
+		if (!receivers.empty()) {
+			try {
+				for (auto subscriber : receivers) {
+					subscriber->sessionDidReceivePacket(packet, timestamp);
+				}
+			} catch (...) {
+				finishDispatch();
+				throw;
+			}
+			finishDispatch();
+		}
+
+		switch (packet.type) {
+		case 101: { // Video Packet
+			// Nobody shows this camera
+			uint32_t index = portal::tagLayer(packet.tag);
+			if (stream == nullptr || index >= portal::PortalMaxLayers) {
+				break;
+			}
+
+			bool newLayer = index == portal::PortalLayerLow &&
+					!stream->hasLowLayer.exchange(true);
+			if (newLayer) {
+				portal_info("Stream %u has a low resolution layer", stream->id);
+			}
+
+			auto layer = &stream->layers[index];
+			layer->gopCache.add(packet.data, timestamp,
+				[layer, &packet](auto &data, uint64_t timestamp) {
+					if (layer->feeding) {
+						layer->videoDecoder->Input(data, packet.type, packet.tag, timestamp);
+					}
+				});
+
+			if (newLayer) {
+				selectLayer(stream);
+			}
+			break;
+		}
+		case 102: // Audio Packet
+			mAudioDecoder.Input(packet.data, packet.type, packet.tag, timestamp);
+			break;
+		default:
+			break;
+		}
+	} catch (...) {
+		// This isn't great, but I haven't been able to figure out what is causing
+		// the exception that happens when
+		//   the phone is plugged in with the app open
+		//   OBS Studio is launched with the iOS Camera plugin ready
+		// This also doesn't happen _all_ the time. Which makes this 'fun'..
+		portal_info("Exception caught...");
+	}
+}
+
+void DeviceSession::outputAudio(const obs_source_audio *audio)
+{
+	std::lock_guard<std::mutex> lock(mSubscribersMutex);
+
+	uint32_t lowest = UINT32_MAX;
+	for (auto subscriber : mSubscribers) {
+		lowest = std::min(lowest, subscriber->getStreamId());
+	}
+
+	for (auto subscriber : mSubscribers) {
+		if (subscriber->getStreamId() == lowest) {
+			subscriber->sessionDidDecodeAudio(audio);
+		}
+	}
+}
+
+// The layer on screen
+bool DeviceSession::primeDecoder(VideoStream *stream)
+{
+	uint32_t shown;
+	{
+		std::lock_guard<std::mutex> lock(stream->outputMutex);
+		shown = stream->outputLayer;
+	}
+
+	return primeLayer(stream, &stream->layers[shown]);
+}
+
+bool DeviceSession::primeLayer(VideoStream *stream, VideoLayer *layer)
+{
+	auto sets = layer->parameterSets;
+
+	return layer->gopCache.replay(layer->tag, [this, stream, layer, sets](std::vector<PacketItem *> packets) {
+		// The decoder may have been recreated, the parameter sets go first
+		std::vector<PacketItem *> priming;
+
+		if (sets != nullptr) {
+			for (auto &packet : sets->getPackets()) {
+				priming.push_back(new PacketItem(packet, 101, layer->tag, os_gettime_ns(), true));
+			}
+		}
+		priming.insert(priming.end(), packets.begin(), packets.end());
+
+		portal_info("Priming the decoder of stream %u layer %u with %zu cached packets",
+			    stream->id, layer->layer, packets.size());
+
+		// Under the cache lock, so no live packet is decoded between
+		// leaving standby and the replayed keyframe
+		setStandby(stream, wantsStandby(stream));
+		layer->videoDecoder->Prime(priming);
+	});
+}
+
+// Sources in the program always get the full picture, the others make do
+// with the low layer if the phone sends one and they all allow it
+void DeviceSession::selectLayer(VideoStream *stream)
+{
+	bool low = stream->hasLowLayer && stream->lowLayerAllowed &&
+		   stream->decodePriority != DecodePriority::Program;
+
+	switchLayer(stream, low ? portal::PortalLayerLow : portal::PortalLayerFull);
+}
+
+// The layer on screen keeps decoding until the new one, primed from its
+// last keyframe, has caught up with it, see VideoStream::output
+void DeviceSession::switchLayer(VideoStream *stream, uint32_t index)
+{
+	std::lock_guard<std::mutex> switchLock(stream->switchMutex);
+
+	if (index == stream->targetLayer) {
+		return;
+	}
+	stream->targetLayer = index;
+
+	uint32_t shown;
+	{
+		std::lock_guard<std::mutex> lock(stream->outputMutex);
+		shown = stream->outputLayer;
+		stream->pendingLayer = index == shown ? portal::PortalMaxLayers : index;
+	}
+
+	for (auto &layer : stream->layers) {
+		layer.feeding = layer.layer == shown || layer.layer == index;
+	}
+
+	// Switched back before the other layer caught up
+	if (index == shown) {
+		return;
+	}
+
+	portal_info("Switching stream %u to its %s layer", stream->id,
+		    index == portal::PortalLayerLow ? "low" : "full");
+
+	auto layer = &stream->layers[index];
+	if (!primeLayer(stream, layer)) {
+		// Nothing cached yet, decode from the layer's next keyframe
+		mController->requestRecovery({RecoveryReason::Reset, 0, 0}, layer->tag);
+	}
+}
+
+void DeviceSession::VideoLayer::output(const obs_source_frame *frame)
+{
+	stream->output(layer, frame);
+}
+
+void DeviceSession::VideoStream::output(uint32_t layer, const obs_source_frame *frame)
+{
+	std::lock_guard<std::mutex> lock(outputMutex);
+
+	if (layer != outputLayer) {
+		// The layer being switched to takes over with its first frame that
+		// isn't older than the picture on screen, so the switch never
+		// steps back in time or leaves a gap
+		if (layer != pendingLayer || frame == nullptr ||
+		    frame->timestamp < lastTimestamp) {
+			return;
+		}
+
+		portal_info("Stream %u shows its %s layer", id,
+			    layer == portal::PortalLayerLow ? "low" : "full");
+
+		layers[outputLayer].feeding = false;
+		outputLayer = layer;
+		pendingLayer = portal::PortalMaxLayers;
+	}
+
+	if (frame != nullptr) {
+		lastTimestamp = frame->timestamp;
+	}
+	outputs.output(frame);
+}
+
+// Only when nobody shows the picture, one source in the program keeps
+// every frame of its stream decoded for all of them. A stream nobody
+// shows any more isn't decoded at all.
+bool DeviceSession::wantsStandby(VideoStream *stream)
+{
+	std::lock_guard<std::mutex> lock(mSubscribersMutex);
+
+	return std::all_of(mSubscribers.begin(), mSubscribers.end(),
+			   [stream](Subscriber *subscriber) {
+				   return subscriber->getStreamId() != stream->id ||
+					  subscriber->wantsStandby();
+			   });
+}
+
+void DeviceSession::setStandby(VideoStream *stream, bool standby)
+{
+	stream->standby = standby;
+	stream->outputs.setStandby(standby);
+
+	for (auto &layer : stream->layers) {
+		layer.ffmpegVideoDecoder.setStandby(standby);
+#ifdef __APPLE__
+		layer.videoToolboxDecoder.setStandby(standby);
+#endif
+	}
+}
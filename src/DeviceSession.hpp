@@ -0,0 +1,245 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef DeviceSession_hpp
+#define DeviceSession_hpp
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <obs.h>
+
+#include "DeviceApplicationConnectionController.hpp"
+#include "FFMpegVideoDecoder.h"
+#include "FFMpegAudioDecoder.h"
+#include "ParameterSetCache.hpp"
+#include "GopCache.hpp"
+#include "DelayLine.hpp"
+#include "VideoOutput.hpp"
+#include "Metrics.hpp"
+#ifdef __APPLE__
+#include "VideoToolboxVideoDecoder.h"
+#endif
+
+// How a device is decoded. There is one decoder per video stream of a
+// device, so when several sources show the same camera the one whose
+// settings changed last decides. The delay applies to the whole device.
+struct DeviceSessionSettings {
+    bool ffmpegHardwareDecoder = false;
+    bool videoToolboxDecoder = false;
+    bool decimateToCanvas = true;
+    nal_codec codec = NAL_CODEC_UNKNOWN;
+    uint32_t delayMs = 0;
+};
+
+// The connection to one phone and everything that decodes its streams. The
+// phone only serves one connection per port, so every source showing it,
+// whether in another scene, a duplicate or another of its cameras, shares
+// the session. Each video stream gets its own decoder, and its packets and
+// decoded frames fan out to the sources showing that stream.
+//
+// When the phone sends a low resolution simulcast layer of a stream as
+// well, the stream is decoded from that while none of its sources is in the
+// program, and from the full layer, primed from its last keyframe, once one
+// goes live.
+class DeviceSession
+{
+public:
+    class Subscriber {
+    public:
+        virtual ~Subscriber() {}
+
+        // The video stream this subscriber shows, must not change while
+        // it is subscribed
+        virtual uint32_t getStreamId() = 0;
+
+        // Whether the stream may be decoded from its low resolution
+        // simulcast layer while this subscriber isn't in the program.
+        // The frames then come at that resolution.
+        virtual bool allowsLowLayer() = 0;
+
+        // Packets of the full layer of its stream and audio as they leave
+        // the delay line, before decoding
+        virtual void sessionDidReceivePacket(
+            const portal::SimpleDataPacketProtocol::DataPacket &packet,
+            uint64_t timestamp) = 0;
+
+        // Called from the audio decoding thread. The phone sends one audio
+        // track, it only goes to the subscribers of the lowest stream
+        // anybody shows so it isn't mixed in more than once.
+        virtual void sessionDidDecodeAudio(const obs_source_audio *audio) = 0;
+
+        // Where this subscriber's copy of the decoded frames goes
+        virtual FrameSink *getFrameSink() = 0;
+
+        // The smallest picture this subscriber can show without losing
+        // detail, 0 x 0 if it needs the picture as decoded
+        virtual void getScaleTarget(uint32_t *width, uint32_t *height) = 0;
+
+        virtual bool wantsConnection() = 0;
+        virtual bool wantsStandby() = 0;
+        virtual DecodePriority getDecodePriority() = 0;
+    };
+
+    // The session for `host:port`, created if no source holds it. It lives
+    // for as long as a source does.
+    static std::shared_ptr<DeviceSession> forDevice(const std::string &host, int port);
+
+    DeviceSession(const std::string &host, int port);
+    ~DeviceSession();
+
+    // Returns true if `subscriber` is the first one of its stream, which
+    // gets to configure it.
+    bool subscribe(Subscriber *subscriber);
+
+    // Once this returns nothing reaches `subscriber` any more
+    void unsubscribe(Subscriber *subscriber);
+
+    void configure(uint32_t stream, const DeviceSessionSettings &settings);
+
+    // Connect, leave or enter standby, depending on what the subscribers want
+    void update();
+
+    // Decode each stream at the priority of its most visible subscriber,
+    // and from the layer it needs
+    void updatePriority();
+
+    // Shrink each stream's pictures to the largest size any of its
+    // subscribers shows them at
+    void updateScale();
+
+    const std::string &getHost() { return mHost; }
+    int getPort() { return mPort; }
+
+    std::shared_ptr<DeviceApplicationConnectionController> getController() { return mController; }
+
+    // The connection's metrics, reconnects and the delay line count here
+    std::shared_ptr<Metrics> getMetrics() { return mMetrics; }
+
+    // What was received and decoded for the layer of `stream` the sources
+    // see, null if nobody shows it
+    std::shared_ptr<Metrics> getStreamMetrics(uint32_t stream);
+
+    uint32_t getDelayMs() { return mDelayLine.getDelayMs(); }
+
+private:
+    struct VideoStream;
+
+    // One simulcast layer of a stream and its decoder. Its frames go
+    // through the stream, which decides which layer the sources see.
+    struct VideoLayer : public FrameSink {
+        VideoStream *stream;
+        uint32_t layer;
+        uint32_t tag;
+
+        // Only the layer on screen and the one being switched to decode,
+        // the other one just keeps its GOP cache up to date
+        std::atomic_bool feeding = false;
+
+        // The layer's pictures, bytes and decoding
+        std::shared_ptr<Metrics> metrics;
+
+        // Parameter sets and the current GOP of the layer
+        std::shared_ptr<ParameterSetCache> parameterSets;
+        GopCache gopCache;
+
+        VideoDecoder *videoDecoder;
+#ifdef __APPLE__
+        VideoToolboxDecoder videoToolboxDecoder;
+#endif
+        FFMpegVideoDecoder ffmpegVideoDecoder;
+
+        void output(const obs_source_frame *frame) override;
+    };
+
+    // One camera of the phone
+    struct VideoStream {
+        uint32_t id;
+
+        std::atomic_bool standby = false;
+        std::atomic<DecodePriority> decodePriority = DecodePriority::Program;
+
+        // Whether every source showing the stream is fine with the low
+        // layer while it isn't live
+        std::atomic_bool lowLayerAllowed = false;
+
+        // Whether the phone sends a low layer of the stream at all
+        std::atomic_bool hasLowLayer = false;
+
+        // Declared before the layers so it outlives their threads
+        VideoFanout outputs;
+
+        // The layer asked for last, switches are serialized by the mutex
+        std::mutex switchMutex;
+        uint32_t targetLayer = portal::PortalLayerFull;
+
+        // The layer the sources see, and the one taking over once its
+        // frames catch up. Decoder threads hand frames over under the mutex.
+        std::mutex outputMutex;
+        uint32_t outputLayer = portal::PortalLayerFull;
+        uint32_t pendingLayer = portal::PortalMaxLayers;
+        uint64_t lastTimestamp = 0;
+
+        VideoLayer layers[portal::PortalMaxLayers];
+
+        void output(uint32_t layer, const obs_source_frame *frame);
+    };
+
+    VideoStream *streamFor(uint32_t id);
+    void dispatchPacket(portal::SimpleDataPacketProtocol::DataPacket packet,
+                        uint64_t timestamp);
+    void finishDispatch();
+    void outputAudio(const obs_source_audio *audio);
+    bool primeDecoder(VideoStream *stream);
+    bool primeLayer(VideoStream *stream, VideoLayer *layer);
+    void selectLayer(VideoStream *stream);
+    void switchLayer(VideoStream *stream, uint32_t layer);
+    bool wantsStandby(VideoStream *stream);
+    void setStandby(VideoStream *stream, bool standby);
+
+    std::string mHost;
+    int mPort;
+
+    std::shared_ptr<DeviceApplicationConnectionController> mController;
+    std::shared_ptr<Metrics> mMetrics;
+
+    // Also guards mStreams
+    std::mutex mSubscribersMutex;
+    std::vector<Subscriber *> mSubscribers;
+
+    // Packets handed to subscribers outside mSubscribersMutex. A subscriber
+    // that has left is only let go once none is in flight.
+    int mDispatching = 0;
+    std::condition_variable mDispatchedCondition;
+
+    // Created when the first source shows a stream and kept until the
+    // session goes, so a stream stays valid once it is looked up
+    std::unique_ptr<VideoStream> mStreams[portal::PortalMaxStreams];
+
+    FFMpegAudioDecoder mAudioDecoder;
+    DecodePriority mAudioPriority = DecodePriority::Program;
+
+    // Declared after the decoders, its thread feeds them
+    DelayLine mDelayLine;
+};
+
+#endif /* DeviceSession_hpp */
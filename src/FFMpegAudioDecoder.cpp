@@ -20,9 +20,15 @@
 #include <util/platform.h>
 #include <fstream>
 
+#include "logging.h"
+
 FFMpegAudioDecoder::FFMpegAudioDecoder()
 {
     memset(&audio_frame, 0, sizeof(audio_frame));
+
+    mStream = DecodeStream::create([this](PacketItem *item) {
+        this->processQueuedItem(item);
+    });
 }
 
 FFMpegAudioDecoder::~FFMpegAudioDecoder()
@@ -34,13 +40,13 @@ FFMpegAudioDecoder::~FFMpegAudioDecoder()
 
 void FFMpegAudioDecoder::Init()
 {
-    // Start the thread.
-    this->start();
+    // Packets are decoded on the shared pool, there is nothing to start
 }
 
 void FFMpegAudioDecoder::Flush()
 {
     // Clear the queue
+    driftCompensator.reset();
 }
 
 void FFMpegAudioDecoder::Drain()
@@ -50,21 +56,31 @@ void FFMpegAudioDecoder::Drain()
 
 void FFMpegAudioDecoder::Shutdown()
 {
-    mQueue.stop();
-    this->join();
+    mStream->stop();
+}
+
+void FFMpegAudioDecoder::Prime(std::vector<PacketItem *> packets)
+{
+    // Audio is never cached
+    for (auto item : packets) {
+        delete item;
+    }
 }
 
-void FFMpegAudioDecoder::Input(std::vector<char> packet, int type, int tag)
+void FFMpegAudioDecoder::SetPriority(DecodePriority priority)
+{
+    mStream->setPriority(priority);
+}
+
+void FFMpegAudioDecoder::Input(std::vector<char> packet, int type, int tag, uint64_t timestamp)
 {
     // Create a new packet item and enqueue it.
-    PacketItem *item = new PacketItem(packet, type, tag);
-    this->mQueue.add(item);
+    PacketItem *item = new PacketItem(packet, type, tag, timestamp);
+    mStream->add(item);
 }
 
 void FFMpegAudioDecoder::processPacketItem(PacketItem *packetItem)
 {
-    uint64_t cur_time = os_gettime_ns();
-
     if (!ffmpeg_decode_valid(audio_decoder))
     {
         if (ffmpeg_decode_init(audio_decoder, AV_CODEC_ID_AAC, false) < 0)
@@ -85,44 +101,32 @@ void FFMpegAudioDecoder::processPacketItem(PacketItem *packetItem)
 
         if (!success)
         {
-            blog(LOG_WARNING, "Error decoding audio");
+            portal_warn("Error decoding audio");
             return;
         }
 
-        if (got_output && source != NULL)
+        if (got_output && output)
         {
-            audio_frame.timestamp = cur_time;
-            obs_source_output_audio(source, &audio_frame);
+            audio_frame.timestamp = packetItem->getTimestamp();
+            driftCompensator.process(&audio_frame);
+            output(&audio_frame);
         }
     }
 }
 
-void *FFMpegAudioDecoder::run() {
-
-    while (shouldStop() == false) {
-
-        PacketItem *item = (PacketItem *)mQueue.remove();
-
-        if (item != NULL) {
-            this->processPacketItem(item);
-            delete item;
-        }
+void FFMpegAudioDecoder::processQueuedItem(PacketItem *item)
+{
+    this->processPacketItem(item);
+    delete item;
 
-        // Check queue lengths
+    // Check queue lengths
 
-        const int queueSize = mQueue.size();
-        if (queueSize > 25) {
-            blog(LOG_WARNING, "Audio Decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
+    const int queueSize = mStream->size();
+    if (queueSize > 25) {
+        portal_warn("Audio Decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
 
-            if (queueSize > 25) {
-                while (mQueue.size() > 5) {
-                    PacketItem *item = (PacketItem *)mQueue.remove();
-                    if (item != NULL) {
-                        delete item;
-                    }
-                }
-            }
+        while (mStream->size() > 5) {
+            delete mStream->remove();
         }
     }
-    return NULL;
 }
@@ -19,10 +19,11 @@
 #pragma once
 
 #include <chrono>
+#include <functional>
 #include "VideoDecoder.h"
 #include "ffmpeg-decode.h"
 #include "Queue.hpp"
-#include "Thread.hpp"
+#include "AudioDriftCompensator.hpp"
 
 class AudioDecoder
 {
@@ -41,7 +42,7 @@ public:
     virtual ~FFMpegAudioDecoderCallback() {}
 };
 
-class FFMpegAudioDecoder: public VideoDecoder, private Thread
+class FFMpegAudioDecoder: public VideoDecoder
 {
 public:
     FFMpegAudioDecoder();
@@ -49,21 +50,25 @@ public:
     
     void Init() override;
     
-    void Input(std::vector<char> packet, int type, int tag) override;
+    void Input(std::vector<char> packet, int type, int tag, uint64_t timestamp) override;
     
     void Flush() override;
     void Drain() override;
     void Shutdown() override;
+    void SetPriority(DecodePriority priority) override;
+    void Prime(std::vector<PacketItem *> packets) override;
     
-    obs_source_t *source;
+    // Called from the decoding thread for every decoded frame
+    std::function<void(const obs_source_audio *audio)> output;
+
+    AudioDriftCompensator driftCompensator;
     
 private:
     
-    void *run() override;
-    
+    void processQueuedItem(PacketItem *packetItem);
     void processPacketItem(PacketItem *packetItem);
     
-    WorkQueue<PacketItem *> mQueue;
+    std::shared_ptr<DecodeStream> mStream;
     
     obs_source_audio audio_frame;
     
@@ -19,9 +19,18 @@
 #include "FFMpegVideoDecoder.h"
 #include <util/platform.h>
 
+#include <utility>
+
+#include "logging.h"
+
 FFMpegVideoDecoder::FFMpegVideoDecoder()
 {
 	memset(&video_frame, 0, sizeof(video_frame));
+	parameterSets = std::make_shared<ParameterSetCache>();
+
+	mStream = DecodeStream::create([this](PacketItem *item) {
+		this->processQueuedItem(item);
+	});
 }
 
 FFMpegVideoDecoder::~FFMpegVideoDecoder()
@@ -33,21 +42,22 @@ FFMpegVideoDecoder::~FFMpegVideoDecoder()
 
 void FFMpegVideoDecoder::Init()
 {
-    // Start the thread.
-    this->start();
+    // Packets are decoded on the shared pool, there is nothing to start
 }
 
 void FFMpegVideoDecoder::Flush()
 {
     // Clear the queue
-    while(this->mQueue.size() > 0) {
-        this->mQueue.remove();
-    }
+    mStream->clear();
 
     mMutex.lock();
     // Re-initialize the decoder
     ffmpeg_decode_free(video_decoder);
+    decimator.reset();
+    resetGovernor();
     mMutex.unlock();
+
+    sendBitrateRequest();
 }
 
 void FFMpegVideoDecoder::Drain()
@@ -57,8 +67,17 @@ void FFMpegVideoDecoder::Drain()
 
 void FFMpegVideoDecoder::Shutdown()
 {
-    mQueue.stop();
-    this->join();
+    mStream->stop();
+}
+
+void FFMpegVideoDecoder::Prime(std::vector<PacketItem *> packets)
+{
+    mStream->replace(packets);
+}
+
+void FFMpegVideoDecoder::SetPriority(DecodePriority priority)
+{
+    mStream->setPriority(priority);
 }
 
 void FFMpegVideoDecoder::setHW(bool hw)
@@ -69,79 +88,339 @@ void FFMpegVideoDecoder::setHW(bool hw)
     }
 }
 
-void FFMpegVideoDecoder::Input(std::vector<char> packet, int type, int tag)
+void FFMpegVideoDecoder::setCodec(nal_codec codec)
+{
+    if (this->codecPreference != codec) {
+        this->codecPreference = codec;
+        this->Flush();
+    }
+}
+
+void FFMpegVideoDecoder::setParameterSetCache(std::shared_ptr<ParameterSetCache> cache)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    parameterSets = cache;
+}
+
+void FFMpegVideoDecoder::Input(std::vector<char> packet, int type, int tag, uint64_t timestamp)
 {
     // Create a new packet item and enqueue it.
-    PacketItem *item = new PacketItem(packet, type, tag);
-    this->mQueue.add(item);
+    PacketItem *item = new PacketItem(packet, type, tag, timestamp);
+    mStream->add(item);
+}
+
+bool FFMpegVideoDecoder::selectCodec(PacketItem *packetItem)
+{
+    nal_codec wanted = codecPreference;
+
+    if (wanted == NAL_CODEC_UNKNOWN) {
+        // Parameter sets identify the codec, everything else keeps
+        // whatever was detected last.
+        auto &packet = packetItem->getPacket();
+        wanted = nal_detect_codec((const uint8_t *)packet.data(), packet.size());
+
+        if (wanted == NAL_CODEC_UNKNOWN) {
+            wanted = codec;
+        }
+    }
+
+    if (wanted == NAL_CODEC_UNKNOWN) {
+        return false;
+    }
+
+    if (wanted != codec) {
+        blog(LOG_INFO, "FFMpeg: decoding %s video", nal_codec_name(wanted));
+        ffmpeg_decode_free(video_decoder);
+        codec = wanted;
+    }
+
+    return true;
+}
+
+bool FFMpegVideoDecoder::initDecoder()
+{
+    video_params params;
+    bool configured = parameterSets->isComplete(codec) && parameterSets->getParams(&params);
+    std::vector<uint8_t> extradata;
+
+    if (configured) {
+        extradata = parameterSets->getExtradata();
+        maxSubLayersMinus1 = params.max_sub_layers_minus1;
+    }
+
+    int ret = ffmpeg_decode_init_video(video_decoder, ffmpeg_codec_id(codec), this->hw,
+                                       configured ? &params : NULL,
+                                       extradata.data(), extradata.size());
+    if (ret < 0) {
+        blog(LOG_WARNING, "Could not initialize %s video decoder", nal_codec_name(codec));
+        return false;
+    }
+
+    if (configured) {
+        blog(LOG_INFO, "FFMpeg: configured %s decoder for %ux%u before the first picture",
+             nal_codec_name(codec), params.width, params.height);
+    }
+
+    // Pick up the colour parameters of the new decoder on the next frame
+    video_frame.format = VIDEO_FORMAT_NONE;
+
+    // A fresh decoder has no reference pictures
+    keyframeGate.close(RecoveryReason::Reset);
+
+    // How hard the last one found the stream says nothing about this one
+    resetGovernor();
+    return true;
+}
+
+// Called with mMutex held
+void FFMpegVideoDecoder::resetGovernor()
+{
+    bool reduced = governor.quality() == DecodeQuality::ReduceBitrate;
+
+    governor.reset();
+    pictureDecodeTime = 0;
+
+    if (reduced) {
+        pendingBitrate = 100;
+    }
+}
+
+// Sending waits for the connection, so the request is only recorded while
+// mMutex is held and sent once it has been released
+void FFMpegVideoDecoder::sendBitrateRequest()
+{
+    uint32_t percent;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        percent = std::exchange(pendingBitrate, 0);
+    }
+
+    if (percent != 0 && onBitrateRequest) {
+        onBitrateRequest(percent);
+    }
+}
+
+void FFMpegVideoDecoder::startPicture(uint64_t timestamp)
+{
+    DecodeQuality previous = governor.quality();
+
+    if (governor.update(pictureDecodeTime, (uint64_t)decimator.sourceIntervalNs(), os_gettime_ns())) {
+        DecodeQuality quality = governor.quality();
+
+        bool reduce = quality == DecodeQuality::ReduceBitrate;
+        if (reduce != (previous == DecodeQuality::ReduceBitrate)) {
+            pendingBitrate = reduce ? 70 : 100;
+        }
+    }
+    pictureDecodeTime = 0;
+
+    ffmpeg_decode_set_skip_filters(
+        video_decoder,
+        governor.atLeast(DecodeQuality::SkipLoopFilter) ? AVDISCARD_NONREF : AVDISCARD_DEFAULT,
+        governor.atLeast(DecodeQuality::SkipIdct) ? AVDISCARD_NONREF : AVDISCARD_DEFAULT);
+
+    decimator.setLimit(governor.atLeast(DecodeQuality::Decimate) ? 0.5 : 1.0);
+
+    // Let the decoder drop whatever non-reference slices of this picture
+    // we couldn't classify ourselves
+    bool show = decimator.startPicture(timestamp);
+    bool discard = !show || governor.atLeast(DecodeQuality::DiscardNonRef);
+    ffmpeg_decode_set_skip_frame(video_decoder, discard ? AVDISCARD_NONREF : AVDISCARD_DEFAULT);
 }
 
 static const char *ffmpeg_decode_video_name = "obs_camera_ffmpeg_decode_video";
 void FFMpegVideoDecoder::processPacketItem(PacketItem *packetItem)
 {
-	mMutex.lock();
-	uint64_t cur_time = os_gettime_ns();
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	// Nothing can be decoded until the parameter sets tell us the codec
+	if (!selectCodec(packetItem)) {
+		return;
+	}
+
+	auto &packet = packetItem->getPacket();
+	unsigned char *data = (unsigned char *)packet.data();
+	long long ts = (long long)packetItem->getTimestamp();
+
+	nal_unit nal = {};
+	bool parsed = nal_parse_annexb(codec, data, packet.size(), &nal);
+
+	if (parsed && nal_is_parameter_set(&nal)) {
+		auto change = parameterSets->update(codec, nal);
+
+		if (change == ParameterSetChange::Reinit && ffmpeg_decode_valid(video_decoder)) {
+			blog(LOG_INFO, "FFMpeg: stream format changed, recreating the decoder");
+			ffmpeg_decode_free(video_decoder);
+		}
+
+		video_params params;
+		if (nal.kind == NAL_KIND_SPS && parameterSets->getParams(&params)) {
+			maxSubLayersMinus1 = params.max_sub_layers_minus1;
+		}
+	}
+
+	if (parsed) {
+		nal_apply_sub_layers(&nal, maxSubLayersMinus1);
+	}
+
 	if (!ffmpeg_decode_valid(video_decoder)) {
-		if (ffmpeg_decode_init(video_decoder, AV_CODEC_ID_H264, this->hw) < 0) {
-			blog(LOG_WARNING, "Could not initialize video decoder");
-			mMutex.unlock();
+		// Hold off until the rest of the parameter sets are here, so the
+		// decoder can be opened with all of them.
+		if (parsed && nal_is_parameter_set(&nal) && !parameterSets->isComplete(codec)) {
+			RecoveryRequest request;
+			keyframeGate.admit(codec, nal, &request);
 			return;
 		}
-	}
 
-	auto packet = packetItem->getPacket();
-	unsigned char *data = (unsigned char *)packet.data();
-	long long ts = cur_time;
+		if (!initDecoder()) {
+			return;
+		}
+	}
 
     if (packetItem->getType() == 101) {
+        bool resumed = false;
+        if (parsed && !standby.admit(nal, &resumed)) {
+            metrics->count(MetricCounter::DropStandby);
+            return;
+        }
+
+        if (resumed) {
+            // Pictures were skipped, the next keyframe is the first one
+            // that decodes cleanly
+            keyframeGate.close(RecoveryReason::Reset);
+        }
+
+        RecoveryRequest request;
+        if (parsed && !keyframeGate.admit(codec, nal, &request)) {
+            // Skip pictures that can't be decoded instead of spending time
+            // on garbage, and ask for a keyframe.
+            metrics->count(MetricCounter::DropUndecodable);
+            if (onRecoveryNeeded) {
+                onRecoveryNeeded(request);
+            }
+            return;
+        }
+
+        if (parsed && nal_first_slice(codec, &nal)) {
+            startPicture((uint64_t)ts);
+        }
+
+        // Nothing depends on a non-reference picture, so one the canvas
+        // can't show never needs decoding. Reference pictures still have to
+        // be decoded, they just aren't output.
+        if (parsed && nal_is_vcl(&nal) && !nal.reference &&
+            (!decimator.show() || governor.atLeast(DecodeQuality::DiscardNonRef))) {
+            metrics->count(MetricCounter::DropDecimated);
+            return;
+        }
+
         profile_start(ffmpeg_decode_video_name);
+        uint64_t decodeStart = os_gettime_ns();
 
         bool got_output;
         bool success = ffmpeg_decode_video(video_decoder, data, packet.size(), &ts,
                                            &video_frame, &got_output);
 
+        uint64_t decodeTime = os_gettime_ns() - decodeStart;
+        pictureDecodeTime += decodeTime;
         profile_end(ffmpeg_decode_video_name);
+        Tracer::shared().span("ffmpeg_decode_video", decodeStart, decodeStart + decodeTime, (uint64_t)ts);
+
+        // The download happens inside ffmpeg_decode_video, keep it apart
+        uint64_t downloadTime = got_output ? video_decoder->download_ns : 0;
+        metrics->record(MetricStage::Decode, decodeTime - std::min(downloadTime, decodeTime));
+        if (downloadTime > 0) {
+            metrics->record(MetricStage::Download, downloadTime);
+        }
         if (!success)
         {
-            blog(LOG_WARNING, "Error decoding video");
-            mMutex.unlock();
+            portal_warn("Error decoding video");
+
+            if (nal_is_vcl(&nal)) {
+                keyframeGate.close(RecoveryReason::DecodeError);
+                if (onRecoveryNeeded) {
+                    onRecoveryNeeded({RecoveryReason::DecodeError, 0, 0});
+                }
+            }
             return;
         }
 
-		if (got_output && source != nullptr) {
-			video_frame.timestamp = cur_time;
-			obs_source_output_video(source, &video_frame);
+		// The decoder hands back the pts of the packet the picture came in
+		if (got_output && output != nullptr && decimator.show() && !packetItem->isPriming()) {
+			video_frame.timestamp = (uint64_t)ts;
+
+			uint64_t scaleStart = os_gettime_ns();
+			const obs_source_frame *frame = scaler.scale(&video_frame);
+			if (frame != &video_frame) {
+				Tracer::shared().span("downscale", scaleStart, os_gettime_ns(), (uint64_t)ts);
+			}
+
+			output->output(frame);
+			metrics->count(MetricCounter::Frames);
+		} else if (got_output && !decimator.show()) {
+			metrics->count(MetricCounter::DropDecimated);
 		}
 	}
-	mMutex.unlock();
 }
 
-void *FFMpegVideoDecoder::run() {
+void FFMpegVideoDecoder::dropQueuedPackets()
+{
+    std::vector<PacketItem *> packets;
 
-    while (shouldStop() == false) {
+    while (PacketItem *item = mStream->remove()) {
+        packets.push_back(item);
+    }
 
-        PacketItem *item = (PacketItem *)mQueue.remove();
+    // Everything from the most recent random access point onwards still
+    // decodes, older pictures are dropped apart from the parameter sets.
+    size_t resume = KeyframeGate::resumeIndex(codec, packets);
 
-        if (item != NULL) {
-            this->processPacketItem(item);
-            delete item;
-        }
+    {
+        // Flush resets the governor from another thread
+        std::lock_guard<std::mutex> lock(mMutex);
 
-        // Check queue lengths
+        DecodeQuality previous = governor.quality();
+        if (governor.overloaded(os_gettime_ns()) &&
+            governor.quality() == DecodeQuality::ReduceBitrate &&
+            previous != DecodeQuality::ReduceBitrate) {
+            pendingBitrate = 70;
+        }
+    }
 
-        const int queueSize = mQueue.size();
-        if (queueSize > 5) {
-            blog(LOG_WARNING, "FFMpeg: Decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
+    for (size_t i = 0; i < packets.size(); i++) {
+        PacketItem *item = packets[i];
 
-            while (mQueue.size() > 0) {
-                PacketItem *item = (PacketItem *)mQueue.remove();
-                if (item != NULL) {
-                    blog(LOG_INFO, "FFMpeg: dropping packet type=%d tag=%d size=%d", item->getType(), item->getTag(), item->size());
-                    delete item;
-                }
-            }
+        if (i >= resume || KeyframeGate::isParameterSet(codec, item)) {
+            this->processPacketItem(item);
+        } else {
+            portal_info("FFMpeg: dropping packet type=%d tag=%d size=%d", item->getType(), item->getTag(), item->size());
+            keyframeGate.dropped(codec, item);
+            metrics->count(MetricCounter::DropQueueOverload);
         }
+
+        delete item;
     }
-    return NULL;
+
+    sendBitrateRequest();
 }
 
+void FFMpegVideoDecoder::processQueuedItem(PacketItem *item)
+{
+    uint64_t now = os_gettime_ns();
+    metrics->record(MetricStage::QueueWait, now - item->getQueuedAt());
+    Tracer::shared().asyncSpan("queue wait", item->getQueuedAt(), now, item->getTimestamp());
+
+    this->processPacketItem(item);
+    this->sendBitrateRequest();
+    delete item;
+
+    // Check queue lengths
+
+    const int queueSize = mStream->size();
+    metrics->set(MetricGauge::DecodeQueueDepth, (uint64_t)queueSize);
+    if (queueSize > 5) {
+        portal_warn("FFMpeg: Decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
+
+        this->dropQueuedPackets();
+    }
+}
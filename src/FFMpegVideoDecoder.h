@@ -19,11 +19,20 @@
 #pragma once
 
 #include <chrono>
+#include <functional>
 
 #include "VideoDecoder.h"
 #include "ffmpeg-decode.h"
 #include "Queue.hpp"
-#include "Thread.hpp"
+#include "KeyframeGate.hpp"
+#include "ParameterSetCache.hpp"
+#include "VideoOutput.hpp"
+#include "FrameDecimator.hpp"
+#include "FrameScaler.hpp"
+#include "DecodeGovernor.hpp"
+#include "DecoderStandby.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
 
 class Decoder {
 	struct ffmpeg_decode decode;
@@ -39,7 +48,6 @@ public:
 
 class FFMpegVideoDecoder
 	: public VideoDecoder,
-	  private Thread,
 	  public std::enable_shared_from_this<FFMpegVideoDecoder> {
 public:
 	class Delegate {
@@ -55,15 +63,27 @@ public:
 
 	void Init() override;
 
-	void Input(std::vector<char> packet, int type, int tag) override;
+	void Input(std::vector<char> packet, int type, int tag, uint64_t timestamp) override;
 
 	void Flush() override;
 	void Drain() override;
 	void Shutdown() override;
+	void SetPriority(DecodePriority priority) override;
+	void Prime(std::vector<PacketItem *> packets) override;
 
 	bool getHW() { return hw; }
 	void setHW(bool hw);
 
+	// NAL_CODEC_UNKNOWN detects the codec from the parameter sets
+	void setCodec(nal_codec codec);
+	nal_codec getCodecPreference() { return codecPreference; }
+
+	// Where the parameter sets of the current device are kept
+	void setParameterSetCache(std::shared_ptr<ParameterSetCache> cache);
+
+	// Only decode keyframes while the source isn't in the program
+	void setStandby(bool standby) { this->standby.set(standby); }
+
 	void setDelegate(std::shared_ptr<Delegate> newDelegate)
 	{
 		delegate = newDelegate;
@@ -71,22 +91,60 @@ public:
 
 	std::weak_ptr<Delegate> getDelegate() { return delegate; };
 
-	    obs_source_t *source;
+	// Where decoded frames go
+	FrameSink *output = nullptr;
+
+	// The source's metrics, set before the first packet
+	Metrics *metrics = Metrics::unregistered();
+
+	// Skips pictures the OBS canvas runs too slowly to show
+	FrameDecimator decimator;
 	obs_source_frame video_frame;
 
+	// Shrinks pictures the sources only show at a fraction of their size
+	FrameScaler scaler;
 
-private:
-	void *run() override;
+	// Called from the decoding thread whenever a picture can't be decoded
+	// until the phone sends a keyframe.
+	std::function<void(const RecoveryRequest &request)> onRecoveryNeeded;
 
+	// Called when the governor wants the phone to scale its bitrate, 100
+	// means back to normal. Never called with the decoder's lock held.
+	std::function<void(uint32_t percent)> onBitrateRequest;
+
+
+private:
+	void processQueuedItem(PacketItem *packetItem);
 	void processPacketItem(PacketItem *packetItem);
+	bool selectCodec(PacketItem *packetItem);
+	bool initDecoder();
+	void startPicture(uint64_t timestamp);
+	void resetGovernor();
+	void sendBitrateRequest();
+	void dropQueuedPackets();
 
-	WorkQueue<PacketItem *> mQueue;
+	std::shared_ptr<DecodeStream> mStream;
 
 	Decoder video_decoder;
 	std::weak_ptr<Delegate> delegate;
 	std::mutex mMutex;
 
 	bool hw = false;
+
+	std::atomic<nal_codec> codecPreference = NAL_CODEC_UNKNOWN;
+	nal_codec codec = NAL_CODEC_UNKNOWN;
+	KeyframeGate keyframeGate;
+	DecodeGovernor governor;
+	DecoderStandby standby;
+	uint64_t pictureDecodeTime = 0;
+
+	// sps_max_sub_layers_minus1 of the current SPS, which HEVC _N
+	// pictures are non-reference pictures on
+	uint32_t maxSubLayersMinus1 = 0;
+
+	// Percent to ask the phone for once mMutex is released, 0 if none
+	uint32_t pendingBitrate = 0;
+	std::shared_ptr<ParameterSetCache> parameterSets;
 };
 
 //
@@ -103,7 +161,7 @@ private:
 //    
 //    void Init() override;
 //    
-//    void Input(std::vector<char> packet, int type, int tag) override;
+//    void Input(std::vector<char> packet, int type, int tag, uint64_t timestamp) override;
 //    
 //    void Flush() override;
 //    void Drain() override;
@@ -0,0 +1,155 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef FrameDecimator_hpp
+#define FrameDecimator_hpp
+
+#include <algorithm>
+#include <atomic>
+
+#include <obs.h>
+
+// How often the canvas frame rate is looked up again
+#define FRAME_DECIMATOR_CANVAS_REFRESH_NS 1000000000ULL
+
+// Decides which pictures are worth showing when the phone sends more
+// frames than the OBS canvas can display, e.g. 60 fps into a 30 fps canvas.
+//
+// The canvas-to-source rate ratio is accumulated for every picture and one
+// is shown each time the total reaches a whole frame. That keeps an even
+// cadence for any ratio, 60 to 30 shows every other picture and 60 to 24
+// shows two out of every five.
+class FrameDecimator
+{
+    std::atomic_bool mEnabled = true;
+
+    // Fraction of pictures to show at most, whatever the canvas runs at
+    std::atomic<double> mLimit = 1.0;
+
+    uint64_t mCanvasIntervalNs = 0;
+    uint64_t mCanvasCheckedAt = 0;
+
+    uint64_t mLastTimestamp = 0;
+    double mSourceIntervalNs = 0.0;
+
+    bool mDecimating = false;
+    bool mShow = true;
+    double mCredit = 0.0;
+
+    std::atomic<uint32_t> mDropped = 0;
+
+public:
+
+    void setEnabled(bool enabled) {
+        mEnabled = enabled;
+    }
+
+    void setLimit(double limit) {
+        mLimit = limit;
+    }
+
+    // Call with the first slice of every picture. Returns whether the
+    // picture should be shown.
+    bool startPicture(uint64_t timestamp) {
+        refreshCanvas(timestamp);
+
+        if (mLastTimestamp != 0 && timestamp > mLastTimestamp) {
+            double interval = (double)(timestamp - mLastTimestamp);
+
+            if (interval > 1000000.0 && interval < 200000000.0) {
+                mSourceIntervalNs = mSourceIntervalNs == 0.0
+                    ? interval
+                    : mSourceIntervalNs + (interval - mSourceIntervalNs) * 0.05;
+            }
+        }
+        mLastTimestamp = timestamp;
+
+        double ratio = 1.0;
+        if (mEnabled && mCanvasIntervalNs != 0 && mSourceIntervalNs != 0.0) {
+            ratio = std::min(mSourceIntervalNs / (double)mCanvasIntervalNs, 1.0);
+        }
+        ratio *= mLimit;
+
+        // A little slack so 59.94 into 60 doesn't decimate
+        if (ratio >= 0.95) {
+            mDecimating = false;
+            mShow = true;
+            return true;
+        }
+
+        if (!mDecimating) {
+            // Show the first picture, then carry on at the canvas cadence
+            mDecimating = true;
+            mCredit = 1.0 - ratio;
+        }
+
+        mCredit += ratio;
+        mShow = mCredit >= 0.999;
+
+        if (mShow) {
+            mCredit -= 1.0;
+        } else {
+            mDropped++;
+        }
+
+        return mShow;
+    }
+
+    // Whether the picture started last should be shown
+    bool show() {
+        return mShow;
+    }
+
+    double sourceIntervalNs() {
+        return mSourceIntervalNs;
+    }
+
+    bool isDecimating() {
+        return mDecimating;
+    }
+
+    // Pictures the canvas couldn't have shown
+    uint32_t dropped() {
+        return mDropped;
+    }
+
+    void reset() {
+        mLastTimestamp = 0;
+        mSourceIntervalNs = 0.0;
+        mDecimating = false;
+        mShow = true;
+    }
+
+private:
+
+    void refreshCanvas(uint64_t now) {
+        if (mCanvasCheckedAt != 0 && now - mCanvasCheckedAt < FRAME_DECIMATOR_CANVAS_REFRESH_NS) {
+            return;
+        }
+        mCanvasCheckedAt = now;
+
+        obs_video_info ovi;
+        if (obs_get_video_info(&ovi) && ovi.fps_num != 0) {
+            mCanvasIntervalNs = (uint64_t)ovi.fps_den * 1000000000ULL / ovi.fps_num;
+        } else {
+            mCanvasIntervalNs = 0;
+        }
+    }
+};
+
+#endif /* FrameDecimator_hpp */
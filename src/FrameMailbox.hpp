@@ -0,0 +1,150 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef FrameMailbox_hpp
+#define FrameMailbox_hpp
+
+#include <atomic>
+
+#include <obs.h>
+
+#define FRAME_MAILBOX_REPORT_INTERVAL_NS 300000000000ULL
+
+// Latest-wins triple buffer between a decoder thread and the OBS video
+// tick. The decoder always writes into a slot of its own and swaps it into
+// the middle, the tick swaps the middle out if something new arrived. A
+// frame that gets replaced before a tick picks it up is never handed to
+// OBS, the slot is just written over.
+class FrameMailbox
+{
+    static const uint32_t FRESH = 4;
+    static const uint32_t INDEX_MASK = 3;
+
+    obs_source_frame *mSlots[3] = {nullptr, nullptr, nullptr};
+
+    // Owned by the decoder thread
+    uint32_t mBack = 0;
+    uint64_t mLastTimestamp = 0;
+
+    // Middle slot index, plus FRESH if it hasn't been picked up yet
+    std::atomic<uint32_t> mMiddle = 1;
+
+    // Owned by the video tick
+    uint32_t mFront = 2;
+    uint64_t mLastReport = 0;
+
+    std::atomic<uint64_t> mFrameIntervalNs = 0;
+
+    std::atomic<uint32_t> mPublished = 0;
+    std::atomic<uint32_t> mSkipped = 0;
+    std::atomic<uint32_t> mLate = 0;
+
+public:
+
+    ~FrameMailbox() {
+        for (auto slot : mSlots) {
+            if (slot != nullptr) {
+                obs_source_frame_destroy(slot);
+            }
+        }
+    }
+
+    // Decoder thread. `frame` is copied. Returns true if it replaced a frame
+    // that was never shown.
+    bool publish(const obs_source_frame *frame) {
+        obs_source_frame *&slot = mSlots[mBack];
+
+        if (slot != nullptr && (slot->format != frame->format ||
+                                slot->width != frame->width ||
+                                slot->height != frame->height)) {
+            obs_source_frame_destroy(slot);
+            slot = nullptr;
+        }
+
+        if (slot == nullptr) {
+            slot = obs_source_frame_create(frame->format, frame->width, frame->height);
+        }
+
+        obs_source_frame_copy(slot, frame);
+
+        if (mLastTimestamp != 0 && frame->timestamp > mLastTimestamp) {
+            mFrameIntervalNs = frame->timestamp - mLastTimestamp;
+        }
+        mLastTimestamp = frame->timestamp;
+
+        uint32_t previous = mMiddle.exchange(mBack | FRESH, std::memory_order_acq_rel);
+        if (previous & FRESH) {
+            mSkipped++;
+        }
+
+        mBack = previous & INDEX_MASK;
+        mPublished++;
+
+        return (previous & FRESH) != 0;
+    }
+
+    // Video tick. Returns the newest frame if there is one that hasn't been
+    // returned before. It stays valid until the next call.
+    obs_source_frame *consume(uint64_t tickIntervalNs) {
+        if (!(mMiddle.load(std::memory_order_acquire) & FRESH)) {
+            // Only late if the phone sends at least one frame per tick,
+            // otherwise repeating the last frame is expected.
+            uint64_t interval = mFrameIntervalNs;
+            if (interval != 0 && interval <= tickIntervalNs + tickIntervalNs / 10) {
+                mLate++;
+            }
+            return nullptr;
+        }
+
+        uint32_t previous = mMiddle.exchange(mFront, std::memory_order_acq_rel);
+        mFront = previous & INDEX_MASK;
+
+        return mSlots[mFront];
+    }
+
+    // Drop a frame that hasn't been picked up yet, safe from any thread
+    void clear() {
+        mMiddle.fetch_and(~FRESH, std::memory_order_acq_rel);
+        mFrameIntervalNs = 0;
+    }
+
+    void report(uint64_t now) {
+        if (mLastReport == 0) {
+            mLastReport = now;
+            return;
+        }
+
+        if (now - mLastReport < FRAME_MAILBOX_REPORT_INTERVAL_NS) {
+            return;
+        }
+        mLastReport = now;
+
+        blog(LOG_INFO, "Frame mailbox: %u published, %u skipped, %u late",
+             mPublished.load(), mSkipped.load(), mLate.load());
+    }
+
+    uint32_t published() { return mPublished; }
+
+    // Replaced before a video tick could pick them up
+    uint32_t skipped() { return mSkipped; }
+
+    // Video ticks that had to repeat a frame although one was due
+    uint32_t late() { return mLate; }
+};
+
+#endif /* FrameMailbox_hpp */
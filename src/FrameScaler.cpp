@@ -0,0 +1,204 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include "FrameScaler.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FRAME_SCALER_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FRAME_SCALER_NEON
+#endif
+
+// Rows of the scaled planes start this aligned
+#define FRAME_SCALER_ALIGN 32
+
+static inline uint32_t align_linesize(uint32_t size)
+{
+    return (size + FRAME_SCALER_ALIGN - 1) & ~(uint32_t)(FRAME_SCALER_ALIGN - 1);
+}
+
+// Average every 2x2 block of a plane with one byte per sample, rounding to
+// nearest. `width` and `height` are those of `dst`.
+static void halve_plane(const uint8_t *src, uint32_t srcLinesize, uint8_t *dst,
+                        uint32_t dstLinesize, uint32_t width, uint32_t height)
+{
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row0 = src + (size_t)(2 * y) * srcLinesize;
+        const uint8_t *row1 = row0 + srcLinesize;
+        uint8_t *out = dst + (size_t)y * dstLinesize;
+        uint32_t x = 0;
+
+#if defined(FRAME_SCALER_SSE2)
+        const __m128i mask = _mm_set1_epi16(0x00ff);
+        const __m128i two = _mm_set1_epi16(2);
+
+        // 32 samples of both rows make 16
+        for (; x + 16 <= width; x += 16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + 2 * x));
+            __m128i a1 = _mm_loadu_si128((const __m128i *)(row0 + 2 * x + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i *)(row1 + 2 * x));
+            __m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + 2 * x + 16));
+
+            __m128i lo = _mm_add_epi16(
+                _mm_add_epi16(_mm_and_si128(a0, mask), _mm_srli_epi16(a0, 8)),
+                _mm_add_epi16(_mm_and_si128(b0, mask), _mm_srli_epi16(b0, 8)));
+            __m128i hi = _mm_add_epi16(
+                _mm_add_epi16(_mm_and_si128(a1, mask), _mm_srli_epi16(a1, 8)),
+                _mm_add_epi16(_mm_and_si128(b1, mask), _mm_srli_epi16(b1, 8)));
+
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+
+            _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(lo, hi));
+        }
+#elif defined(FRAME_SCALER_NEON)
+        for (; x + 16 <= width; x += 16) {
+            uint16x8_t lo = vpaddlq_u8(vld1q_u8(row0 + 2 * x));
+            uint16x8_t hi = vpaddlq_u8(vld1q_u8(row0 + 2 * x + 16));
+            lo = vpadalq_u8(lo, vld1q_u8(row1 + 2 * x));
+            hi = vpadalq_u8(hi, vld1q_u8(row1 + 2 * x + 16));
+
+            vst1q_u8(out + x, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+        }
+#endif
+
+        for (; x < width; x++) {
+            out[x] = (uint8_t)((row0[2 * x] + row0[2 * x + 1] +
+                                row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+        }
+    }
+}
+
+// The same for the interleaved UV plane of NV12, `width` counts UV pairs
+static void halve_plane_interleaved(const uint8_t *src, uint32_t srcLinesize,
+                                    uint8_t *dst, uint32_t dstLinesize,
+                                    uint32_t width, uint32_t height)
+{
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row0 = src + (size_t)(2 * y) * srcLinesize;
+        const uint8_t *row1 = row0 + srcLinesize;
+        uint8_t *out = dst + (size_t)y * dstLinesize;
+        uint32_t x = 0;
+
+#if defined(FRAME_SCALER_NEON)
+        // 16 pairs of both rows make 8
+        for (; x + 8 <= width; x += 8) {
+            uint8x16x2_t a = vld2q_u8(row0 + 4 * x);
+            uint8x16x2_t b = vld2q_u8(row1 + 4 * x);
+
+            uint8x8x2_t result;
+            result.val[0] = vrshrn_n_u16(vpadalq_u8(vpaddlq_u8(a.val[0]), b.val[0]), 2);
+            result.val[1] = vrshrn_n_u16(vpadalq_u8(vpaddlq_u8(a.val[1]), b.val[1]), 2);
+            vst2_u8(out + 2 * x, result);
+        }
+#endif
+
+        for (; x < width; x++) {
+            for (uint32_t c = 0; c < 2; c++) {
+                out[2 * x + c] = (uint8_t)((row0[4 * x + c] + row0[4 * x + 2 + c] +
+                                            row1[4 * x + c] + row1[4 * x + 2 + c] + 2) >> 2);
+            }
+        }
+    }
+}
+
+const obs_source_frame *FrameScaler::scale(const obs_source_frame *frame)
+{
+    uint32_t targetWidth = mTargetWidth;
+    uint32_t targetHeight = mTargetHeight;
+
+    if ((targetWidth == 0 && targetHeight == 0) ||
+        (frame->format != VIDEO_FORMAT_I420 && frame->format != VIDEO_FORMAT_NV12)) {
+        mFactor = 1;
+        return frame;
+    }
+
+    const obs_source_frame *scaled = frame;
+    uint32_t factor = 1;
+
+    for (size_t i = 0; i < 2; i++) {
+        uint32_t width = (scaled->width / 2) & ~1u;
+        uint32_t height = (scaled->height / 2) & ~1u;
+
+        if (width == 0 || height == 0 || width < targetWidth || height < targetHeight) {
+            break;
+        }
+
+        halve(scaled, &mFrames[i], mBuffers[i]);
+        scaled = &mFrames[i];
+        factor *= 2;
+    }
+
+    mFactor = factor;
+    return scaled;
+}
+
+void FrameScaler::halve(const obs_source_frame *src, obs_source_frame *dst,
+                        std::vector<uint8_t> &buffer)
+{
+    // Timestamp, format, colour matrix and range carry over
+    *dst = *src;
+    dst->width = (src->width / 2) & ~1u;
+    dst->height = (src->height / 2) & ~1u;
+
+    bool planar = src->format == VIDEO_FORMAT_I420;
+    uint32_t chromaWidth = dst->width / 2;
+    uint32_t chromaHeight = dst->height / 2;
+
+    uint32_t lumaLinesize = align_linesize(dst->width);
+    uint32_t chromaLinesize = align_linesize(planar ? chromaWidth : chromaWidth * 2);
+    size_t lumaSize = (size_t)lumaLinesize * dst->height;
+    size_t chromaSize = (size_t)chromaLinesize * chromaHeight;
+
+    // Only grows, after the first picture of a size nothing is allocated
+    size_t size = lumaSize + chromaSize * (planar ? 2 : 1) + FRAME_SCALER_ALIGN;
+    if (buffer.size() < size) {
+        buffer.resize(size);
+    }
+
+    uintptr_t address = (uintptr_t)buffer.data();
+    uint8_t *base = buffer.data() +
+                    ((FRAME_SCALER_ALIGN - address % FRAME_SCALER_ALIGN) % FRAME_SCALER_ALIGN);
+
+    for (size_t i = 0; i < MAX_AV_PLANES; i++) {
+        dst->data[i] = nullptr;
+        dst->linesize[i] = 0;
+    }
+
+    dst->data[0] = base;
+    dst->linesize[0] = lumaLinesize;
+    halve_plane(src->data[0], src->linesize[0], dst->data[0], lumaLinesize,
+                dst->width, dst->height);
+
+    if (planar) {
+        for (size_t i = 1; i < 3; i++) {
+            dst->data[i] = base + lumaSize + chromaSize * (i - 1);
+            dst->linesize[i] = chromaLinesize;
+            halve_plane(src->data[i], src->linesize[i], dst->data[i],
+                        chromaLinesize, chromaWidth, chromaHeight);
+        }
+    } else {
+        dst->data[1] = base + lumaSize;
+        dst->linesize[1] = chromaLinesize;
+        halve_plane_interleaved(src->data[1], src->linesize[1], dst->data[1],
+                                chromaLinesize, chromaWidth, chromaHeight);
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef FrameScaler_hpp
+#define FrameScaler_hpp
+
+#include <atomic>
+#include <vector>
+
+#include <obs.h>
+
+// Shrinks decoded pictures on the decoding thread when every source showing
+// them is displayed much smaller than the phone sends, e.g. a 4K feed in a
+// quarter of a 1080p canvas. OBS copies, uploads and scales whatever it is
+// handed, a picture half the size each way is a quarter of that work.
+//
+// Pictures are halved with a 2x2 box filter, once or twice, as long as they
+// stay at least as large as the target. Planar and NV12 4:2:0 are handled,
+// anything else is passed through.
+class FrameScaler
+{
+    std::atomic<uint32_t> mTargetWidth = 0;
+    std::atomic<uint32_t> mTargetHeight = 0;
+
+    std::atomic<uint32_t> mFactor = 1;
+
+    // One per halving, reused from picture to picture
+    obs_source_frame mFrames[2];
+    std::vector<uint8_t> mBuffers[2];
+
+public:
+
+    // The smallest picture the sources still need, 0 x 0 leaves pictures
+    // at the size they were decoded. Safe from any thread.
+    void setTarget(uint32_t width, uint32_t height) {
+        mTargetWidth = width;
+        mTargetHeight = height;
+    }
+
+    // Returns `frame`, or a smaller copy that stays valid until the next
+    // call. Called from the decoding thread.
+    const obs_source_frame *scale(const obs_source_frame *frame);
+
+    // How much the last picture was shrunk in each direction
+    uint32_t factor() {
+        return mFactor;
+    }
+
+private:
+    void halve(const obs_source_frame *src, obs_source_frame *dst,
+               std::vector<uint8_t> &buffer);
+};
+
+#endif /* FrameScaler_hpp */
@@ -0,0 +1,167 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef GopCache_hpp
+#define GopCache_hpp
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <obs.h>
+
+#include "nal-unit.h"
+#include "parameter-sets.h"
+#include "Queue.hpp"
+#include "logging.h"
+
+// A GOP of 1080p H.264 is usually a few hundred KB, this only stops a
+// stream without keyframes from growing the cache forever.
+#define GOP_CACHE_MAX_BYTES (8 * 1024 * 1024)
+#define GOP_CACHE_MAX_PICTURES 1200
+
+// The most recent random access point and every reference picture after
+// it, still compressed. Replaying them brings a fresh decoder to the live
+// picture without waiting for the phone's next keyframe.
+class GopCache
+{
+public:
+    typedef std::function<void(const std::vector<char> &packet, uint64_t timestamp)> Forward;
+
+    // Cache a video packet and hand it on with `forward`. Both happen under
+    // the cache lock, so a replay can never interleave with live packets.
+    void add(const std::vector<char> &packet, uint64_t timestamp, const Forward &forward) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        store(packet, timestamp);
+        forward(packet, timestamp);
+    }
+
+    // Build priming packets for a decoder: everything from the cached
+    // random access point to the live edge. Only the last picture is marked
+    // for output. The packets carry `tag`, the frame tag of the stream and
+    // layer the cache belongs to. `prime` runs under the cache lock, live
+    // packets that arrive meanwhile wait and are forwarded after it.
+    //
+    // Returns false, without calling `prime`, if nothing is cached.
+    bool replay(uint32_t tag, const std::function<void(std::vector<PacketItem *> packets)> &prime) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (mPackets.empty()) {
+            return false;
+        }
+
+        std::vector<PacketItem *> packets;
+        packets.reserve(mPackets.size());
+
+        for (size_t i = 0; i < mPackets.size(); i++) {
+            bool last = i + 1 == mPackets.size();
+            packets.push_back(new PacketItem(mPackets[i].data, 101, tag,
+                                             mPackets[i].timestamp, !last));
+        }
+
+        prime(packets);
+        return true;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        mPackets.clear();
+        mBytes = 0;
+        mCodec = NAL_CODEC_UNKNOWN;
+    }
+
+    size_t bytes() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mBytes;
+    }
+
+private:
+
+    struct CachedPacket {
+        std::vector<char> data;
+        uint64_t timestamp;
+    };
+
+    void store(const std::vector<char> &packet, uint64_t timestamp) {
+        auto data = (const uint8_t *)packet.data();
+
+        nal_codec detected = nal_detect_codec(data, packet.size());
+        if (detected != NAL_CODEC_UNKNOWN && detected != mCodec) {
+            mCodec = detected;
+            mPackets.clear();
+            mBytes = 0;
+        }
+
+        nal_unit nal;
+        if (mCodec == NAL_CODEC_UNKNOWN ||
+            !nal_parse_annexb(mCodec, data, packet.size(), &nal)) {
+            return;
+        }
+
+        if (nal.kind == NAL_KIND_SPS) {
+            video_params params;
+            if (video_params_parse(mCodec, nal.data, nal.size, &params)) {
+                mMaxSubLayersMinus1 = params.max_sub_layers_minus1;
+            }
+        }
+
+        if (!nal_is_vcl(&nal)) {
+            return;
+        }
+
+        nal_apply_sub_layers(&nal, mMaxSubLayersMinus1);
+
+        if (nal.kind == NAL_KIND_IRAP && nal_first_slice(mCodec, &nal)) {
+            mPackets.clear();
+            mBytes = 0;
+            mValid = true;
+        } else if (!mValid) {
+            return;
+        }
+
+        // Nothing references a non-reference picture, priming doesn't need it
+        if (!nal.reference) {
+            return;
+        }
+
+        if (mBytes + packet.size() > GOP_CACHE_MAX_BYTES ||
+            mPackets.size() >= GOP_CACHE_MAX_PICTURES) {
+            // Wait for the next keyframe rather than keep a GOP with a hole
+            portal_info("GOP cache full at %zu bytes, waiting for a keyframe",
+                        mBytes);
+            mPackets.clear();
+            mBytes = 0;
+            mValid = false;
+            return;
+        }
+
+        mPackets.push_back({packet, timestamp});
+        mBytes += packet.size();
+    }
+
+    std::mutex mMutex;
+    std::vector<CachedPacket> mPackets;
+    size_t mBytes = 0;
+    bool mValid = false;
+    nal_codec mCodec = NAL_CODEC_UNKNOWN;
+    uint32_t mMaxSubLayersMinus1 = 0;
+};
+
+#endif /* GopCache_hpp */
@@ -0,0 +1,716 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "IsoRecorder.hpp"
+
+#include <algorithm>
+
+#include <obs.h>
+#include <util/platform.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#endif
+
+// Writes go to disk in batches of this size, starting at multiples of
+// ISO_RECORDER_ALIGNMENT in the file
+#define ISO_RECORDER_BATCH_SIZE (4 * 1024 * 1024)
+#define ISO_RECORDER_ALIGNMENT 4096
+
+// Space is reserved this far ahead of the data, so the file system isn't
+// extending the file on every write
+#define ISO_RECORDER_PREALLOCATE (256 * 1024 * 1024)
+
+#define ISO_RECORDER_AVIO_BUFFER_SIZE (64 * 1024)
+
+// Whatever is batched is written at least this often, so a crash loses as
+// little as possible
+#define ISO_RECORDER_FLUSH_INTERVAL_NS 1000000000ULL
+
+// How long to wait for audio before starting a recording without it
+#define ISO_RECORDER_AUDIO_WAIT_NS 1000000000ULL
+
+struct adts_header {
+    size_t header_size;
+    size_t frame_size;
+    int sample_rate;
+    int channels;
+    uint8_t asc[2];
+};
+
+// The phone sends AAC with ADTS headers, MP4 wants the raw frames and an
+// AudioSpecificConfig instead.
+static bool adts_parse_header(const uint8_t *data, size_t size, adts_header *header)
+{
+    static const int sampleRates[] = {96000, 88200, 64000, 48000, 44100, 32000,
+                                      24000, 22050, 16000, 12000, 11025, 8000, 7350};
+
+    if (size < 7 || data[0] != 0xff || (data[1] & 0xf6) != 0xf0) {
+        return false;
+    }
+
+    int objectType = ((data[2] >> 6) & 0x3) + 1;
+    int rateIndex = (data[2] >> 2) & 0xf;
+    int channels = ((data[2] & 0x1) << 2) | ((data[3] >> 6) & 0x3);
+
+    if (rateIndex >= (int)(sizeof(sampleRates) / sizeof(sampleRates[0]))) {
+        return false;
+    }
+
+    header->header_size = (data[1] & 0x1) ? 7 : 9;
+    header->frame_size = ((size_t)(data[3] & 0x3) << 11) | ((size_t)data[4] << 3) |
+                         ((data[5] >> 5) & 0x7);
+    header->sample_rate = sampleRates[rateIndex];
+    header->channels = channels;
+    header->asc[0] = (uint8_t)((objectType << 3) | (rateIndex >> 1));
+    header->asc[1] = (uint8_t)(((rateIndex & 0x1) << 7) | (channels << 3));
+
+    return header->frame_size > header->header_size && header->frame_size <= size;
+}
+
+static std::string part_path(const std::string &path, uint32_t part)
+{
+    if (part == 0) {
+        return path;
+    }
+
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = path.size();
+    }
+
+    return path.substr(0, dot) + " part " + std::to_string(part + 1) + path.substr(dot);
+}
+
+IsoRecorder::~IsoRecorder()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (mRecording) {
+            mRecording = false;
+            push({Item::Close, "", {}, 0, false, nullptr});
+        }
+        mRunning = false;
+    }
+    mCondition.notify_all();
+
+    // The writer finishes what is queued before it exits
+    this->join();
+}
+
+void IsoRecorder::start(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!mRunning) {
+        mRunning = true;
+        Thread::start();
+    }
+
+    if (mRecording) {
+        push({Item::Close, "", {}, 0, false, nullptr});
+    }
+
+    mRecording = true;
+    mWaitForKeyframe = true;
+    mDropped = 0;
+    mMaxQueuedBytes = 0;
+    mAssembler.reset();
+    mConfig.reset();
+
+    push({Item::Open, path, {}, 0, false, nullptr});
+}
+
+void IsoRecorder::stop()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!mRecording) {
+        return;
+    }
+
+    AccessUnitAssembler::AccessUnit unit;
+    if (mAssembler.flush(&unit)) {
+        queueVideo(unit);
+    }
+
+    mRecording = false;
+    push({Item::Close, "", {}, 0, false, nullptr});
+}
+
+bool IsoRecorder::isRecording()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mRecording;
+}
+
+void IsoRecorder::addVideo(const std::vector<char> &packet, uint64_t timestamp)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!mRecording) {
+        return;
+    }
+
+    AccessUnitAssembler::AccessUnit unit;
+    bool configChanged = false;
+
+    bool complete = mAssembler.add(packet, timestamp, &unit, &configChanged);
+    if (configChanged) {
+        // The writer starts a new file at the next keyframe
+        mConfig.reset();
+        mWaitForKeyframe = true;
+    }
+
+    if (complete) {
+        queueVideo(unit);
+    }
+}
+
+void IsoRecorder::addAudio(const std::vector<char> &packet, uint64_t timestamp)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!mRecording) {
+        return;
+    }
+
+    if (mQueuedBytes + packet.size() > ISO_RECORDER_MAX_QUEUED_BYTES) {
+        mDropped++;
+        return;
+    }
+
+    push({Item::Audio, "", std::vector<uint8_t>(packet.begin(), packet.end()),
+          timestamp, false, nullptr});
+}
+
+void IsoRecorder::queueVideo(AccessUnitAssembler::AccessUnit &unit)
+{
+    if (mWaitForKeyframe && !unit.keyframe) {
+        return;
+    }
+
+    if (mQueuedBytes + unit.data.size() > ISO_RECORDER_MAX_QUEUED_BYTES) {
+        if (!mWaitForKeyframe) {
+            blog(LOG_WARNING, "[obs-ios-camera-plugin] The disk can't keep up with the recording, "
+                              "skipping to the next keyframe");
+        }
+        mWaitForKeyframe = true;
+        mDropped++;
+        return;
+    }
+
+    mWaitForKeyframe = false;
+
+    if (mConfig == nullptr) {
+        auto config = std::make_shared<VideoConfig>();
+        config->codec = mAssembler.getCodec();
+        mAssembler.getParams(&config->params);
+        config->extradata = mAssembler.getExtradata();
+        mConfig = config;
+    }
+
+    push({Item::Video, "", std::move(unit.data), unit.timestamp, unit.keyframe, mConfig});
+}
+
+void IsoRecorder::push(Item item)
+{
+    mQueuedBytes += item.data.size();
+    mMaxQueuedBytes = std::max(mMaxQueuedBytes, mQueuedBytes);
+    mQueue.push_back(std::move(item));
+    mCondition.notify_all();
+}
+
+void *IsoRecorder::run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (mRunning || !mQueue.empty()) {
+        if (mQueue.empty()) {
+            mCondition.wait_for(lock, std::chrono::nanoseconds(ISO_RECORDER_FLUSH_INTERVAL_NS));
+        }
+
+        // A live recording hardly ever leaves the queue empty, so this is
+        // checked on every pass rather than only when the wait times out
+        if (os_gettime_ns() - mLastWrite >= ISO_RECORDER_FLUSH_INTERVAL_NS) {
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+
+        if (mQueue.empty()) {
+            continue;
+        }
+
+        Item item = std::move(mQueue.front());
+        mQueue.pop_front();
+        mQueuedBytes -= item.data.size();
+
+        lock.unlock();
+        process(item);
+        lock.lock();
+    }
+
+    return NULL;
+}
+
+#pragma mark - Writer thread
+
+void IsoRecorder::process(Item &item)
+{
+    switch (item.kind) {
+    case Item::Open:
+        closeFile();
+
+        mPath = item.path;
+        mPart = 0;
+        mHaveAudio = false;
+        mHeld.clear();
+        mBytesWritten = 0;
+        mWriteNs = 0;
+        mStartedAt = os_gettime_ns();
+
+        openFile();
+        break;
+
+    case Item::Close:
+        closeFile();
+        break;
+
+    case Item::Video:
+    case Item::Audio:
+        if (mFile == nullptr) {
+            break;
+        }
+
+        if (mMuxer != nullptr && item.kind == Item::Video && item.config != mMuxerConfig) {
+            // The parameter sets changed, they can't change within a file
+            blog(LOG_INFO, "[obs-ios-camera-plugin] The video format changed, continuing the recording in a new file");
+            closeFile();
+            mPart++;
+            openFile();
+        }
+
+        if (mMuxer == nullptr) {
+            hold(item);
+        } else if (item.kind == Item::Video) {
+            writeVideo(item);
+        } else {
+            writeAudio(item);
+        }
+        break;
+    }
+}
+
+// Keep samples until the first keyframe, and until the first audio shows
+// what the audio track looks like
+void IsoRecorder::hold(Item &item)
+{
+    bool haveKeyframe = !mHeld.empty();
+
+    if (item.kind == Item::Audio) {
+        adts_header header;
+        if (adts_parse_header(item.data.data(), item.data.size(), &header)) {
+            mAudio.sampleRate = header.sample_rate;
+            mAudio.channels = header.channels;
+            memcpy(mAudio.asc, header.asc, sizeof(mAudio.asc));
+            mHaveAudio = true;
+        }
+    }
+
+    // The recording starts at the first keyframe
+    if (!haveKeyframe && (item.kind == Item::Audio || !item.keyframe)) {
+        return;
+    }
+
+    mHeld.push_back(std::move(item));
+
+    uint64_t waited = mHeld.back().timestamp > mHeld.front().timestamp
+                          ? mHeld.back().timestamp - mHeld.front().timestamp : 0;
+    if (mHaveAudio || waited >= ISO_RECORDER_AUDIO_WAIT_NS) {
+        writeHeld();
+    }
+}
+
+void IsoRecorder::writeHeld()
+{
+    if (mHeld.empty()) {
+        return;
+    }
+
+    if (!openMuxer(mHeld.front())) {
+        mHeld.clear();
+        closeFile();
+        return;
+    }
+
+    for (auto &held : mHeld) {
+        if (held.kind == Item::Video) {
+            writeVideo(held);
+        } else {
+            writeAudio(held);
+        }
+    }
+    mHeld.clear();
+}
+
+bool IsoRecorder::openFile()
+{
+    std::string path = part_path(mPath, mPart);
+
+    mFile = os_fopen(path.c_str(), "wb");
+    if (mFile == nullptr) {
+        blog(LOG_ERROR, "[obs-ios-camera-plugin] Can't record to %s", path.c_str());
+        return false;
+    }
+
+    // Everything is batched here already
+    setvbuf(mFile, nullptr, _IONBF, 0);
+
+    mFileOffset = 0;
+    mAllocated = 0;
+    preallocate(ISO_RECORDER_BATCH_SIZE);
+
+    mBatchStorage.resize(ISO_RECORDER_BATCH_SIZE + ISO_RECORDER_ALIGNMENT);
+    uintptr_t address = (uintptr_t)mBatchStorage.data();
+    mBatch = mBatchStorage.data() + (ISO_RECORDER_ALIGNMENT - address % ISO_RECORDER_ALIGNMENT) %
+                                        ISO_RECORDER_ALIGNMENT;
+    mBatchSize = 0;
+    mLastWrite = os_gettime_ns();
+
+    blog(LOG_INFO, "[obs-ios-camera-plugin] Recording to %s", path.c_str());
+    return true;
+}
+
+bool IsoRecorder::openMuxer(const Item &keyframe)
+{
+    auto &config = *keyframe.config;
+    char error[AV_ERROR_MAX_STRING_SIZE] = {};
+    AVDictionary *options = nullptr;
+    uint8_t *buffer = nullptr;
+    int ret;
+
+    ret = avformat_alloc_output_context2(&mMuxer, nullptr, "mp4", nullptr);
+    if (mMuxer == nullptr) {
+        ret = ret < 0 ? ret : AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    // Sequential writes through our own batching, nothing seeks back
+    buffer = (uint8_t *)av_malloc(ISO_RECORDER_AVIO_BUFFER_SIZE);
+    mMuxer->pb = avio_alloc_context(buffer, ISO_RECORDER_AVIO_BUFFER_SIZE, 1, this,
+                                    nullptr, writePacket, nullptr);
+    if (mMuxer->pb == nullptr) {
+        av_free(buffer);
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    mMuxer->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    mVideoStream = avformat_new_stream(mMuxer, nullptr);
+    if (mVideoStream == nullptr) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    mVideoStream->time_base = av_make_q(1, 1000000);
+    mVideoStream->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    mVideoStream->codecpar->codec_id = config.codec == NAL_CODEC_HEVC ? AV_CODEC_ID_HEVC
+                                                                      : AV_CODEC_ID_H264;
+    mVideoStream->codecpar->width = (int)config.params.width;
+    mVideoStream->codecpar->height = (int)config.params.height;
+    mVideoStream->codecpar->extradata = (uint8_t *)av_mallocz(
+        config.extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (mVideoStream->codecpar->extradata == nullptr) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    memcpy(mVideoStream->codecpar->extradata, config.extradata.data(), config.extradata.size());
+    mVideoStream->codecpar->extradata_size = (int)config.extradata.size();
+
+    mAudioStream = nullptr;
+    if (mHaveAudio) {
+        mAudioStream = avformat_new_stream(mMuxer, nullptr);
+        if (mAudioStream == nullptr) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+
+        mAudioStream->time_base = av_make_q(1, mAudio.sampleRate);
+        mAudioStream->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+        mAudioStream->codecpar->codec_id = AV_CODEC_ID_AAC;
+        mAudioStream->codecpar->sample_rate = mAudio.sampleRate;
+        mAudioStream->codecpar->channels = mAudio.channels;
+        mAudioStream->codecpar->extradata = (uint8_t *)av_mallocz(
+            sizeof(mAudio.asc) + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (mAudioStream->codecpar->extradata == nullptr) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        memcpy(mAudioStream->codecpar->extradata, mAudio.asc, sizeof(mAudio.asc));
+        mAudioStream->codecpar->extradata_size = sizeof(mAudio.asc);
+    }
+
+    // A fragment per keyframe, each one complete on its own
+    av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    ret = avformat_write_header(mMuxer, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    mMuxerConfig = keyframe.config;
+    mStart = keyframe.timestamp;
+    mLastVideoDts = -1;
+    mLastAudioDts = -1;
+    return true;
+
+fail:
+    av_strerror(ret, error, sizeof(error));
+    blog(LOG_ERROR, "[obs-ios-camera-plugin] Can't start recording to %s: %s",
+         part_path(mPath, mPart).c_str(), error);
+
+    if (mMuxer != nullptr) {
+        if (mMuxer->pb != nullptr) {
+            av_freep(&mMuxer->pb->buffer);
+            avio_context_free(&mMuxer->pb);
+        }
+        avformat_free_context(mMuxer);
+        mMuxer = nullptr;
+    }
+    mVideoStream = nullptr;
+    mAudioStream = nullptr;
+    return false;
+}
+
+void IsoRecorder::writeVideo(const Item &item)
+{
+    if (item.timestamp < mStart) {
+        return;
+    }
+
+    // The phone's encoder doesn't reorder pictures, pts == dts
+    int64_t dts = av_rescale_q((int64_t)(item.timestamp - mStart), av_make_q(1, 1000000000),
+                               mVideoStream->time_base);
+    dts = std::max(dts, mLastVideoDts + 1);
+    mLastVideoDts = dts;
+
+    AVPacket *packet = av_packet_alloc();
+    packet->data = (uint8_t *)item.data.data();
+    packet->size = (int)item.data.size();
+    packet->stream_index = mVideoStream->index;
+    packet->pts = dts;
+    packet->dts = dts;
+    packet->flags = item.keyframe ? AV_PKT_FLAG_KEY : 0;
+
+    // Not reference counted, libavformat makes its own copy
+    int ret = av_interleaved_write_frame(mMuxer, packet);
+    av_packet_free(&packet);
+
+    if (ret < 0) {
+        char error[AV_ERROR_MAX_STRING_SIZE] = {};
+        av_strerror(ret, error, sizeof(error));
+        blog(LOG_WARNING, "[obs-ios-camera-plugin] Failed to record a picture: %s", error);
+    }
+}
+
+void IsoRecorder::writeAudio(const Item &item)
+{
+    if (mAudioStream == nullptr || item.timestamp < mStart) {
+        return;
+    }
+
+    const uint8_t *data = item.data.data();
+    size_t size = item.data.size();
+    int64_t frame = 0;
+
+    adts_header header;
+    while (adts_parse_header(data, size, &header)) {
+        // 1024 samples per AAC frame
+        int64_t dts = av_rescale_q((int64_t)(item.timestamp - mStart), av_make_q(1, 1000000000),
+                                   mAudioStream->time_base) + frame * 1024;
+        dts = std::max(dts, mLastAudioDts + 1);
+        mLastAudioDts = dts;
+
+        AVPacket *packet = av_packet_alloc();
+        packet->data = (uint8_t *)data + header.header_size;
+        packet->size = (int)(header.frame_size - header.header_size);
+        packet->stream_index = mAudioStream->index;
+        packet->pts = dts;
+        packet->dts = dts;
+        packet->flags = AV_PKT_FLAG_KEY;
+
+        int ret = av_interleaved_write_frame(mMuxer, packet);
+        av_packet_free(&packet);
+        if (ret < 0) {
+            return;
+        }
+
+        data += header.frame_size;
+        size -= header.frame_size;
+        frame++;
+    }
+}
+
+void IsoRecorder::closeMuxer()
+{
+    if (mMuxer == nullptr) {
+        return;
+    }
+
+    av_write_trailer(mMuxer);
+
+    av_freep(&mMuxer->pb->buffer);
+    avio_context_free(&mMuxer->pb);
+    avformat_free_context(mMuxer);
+
+    mMuxer = nullptr;
+    mVideoStream = nullptr;
+    mAudioStream = nullptr;
+    mMuxerConfig.reset();
+}
+
+void IsoRecorder::closeFile()
+{
+    // A recording that ended while waiting for audio
+    if (mMuxer == nullptr && mFile != nullptr) {
+        writeHeld();
+    }
+    mHeld.clear();
+
+    closeMuxer();
+
+    if (mFile == nullptr) {
+        return;
+    }
+
+    writeBatch();
+    fclose(mFile);
+    mFile = nullptr;
+
+    uint64_t dropped;
+    size_t maxQueued;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        dropped = mDropped;
+        maxQueued = mMaxQueuedBytes;
+    }
+
+    double seconds = (os_gettime_ns() - mStartedAt) / 1e9;
+    double megabytes = mBytesWritten / (1024.0 * 1024.0);
+    blog(LOG_INFO, "[obs-ios-camera-plugin] Recorded %.1f MB in %.1f s, the disk wrote %.0f MB/s, "
+                   "the queue peaked at %.1f MB, %llu samples dropped",
+         megabytes, seconds, mWriteNs > 0 ? megabytes / (mWriteNs / 1e9) : 0.0,
+         maxQueued / (1024.0 * 1024.0), (unsigned long long)dropped);
+}
+
+int IsoRecorder::writePacket(void *opaque, uint8_t *buf, int size)
+{
+    auto self = reinterpret_cast<IsoRecorder *>(opaque);
+    int written = 0;
+
+    while (written < size) {
+        // Batches end on an aligned file offset, even after a partial flush
+        size_t capacity = ISO_RECORDER_BATCH_SIZE - self->mFileOffset % ISO_RECORDER_ALIGNMENT;
+        size_t count = std::min((size_t)(size - written), capacity - self->mBatchSize);
+
+        memcpy(self->mBatch + self->mBatchSize, buf + written, count);
+        self->mBatchSize += count;
+        written += (int)count;
+
+        if (self->mBatchSize == capacity && !self->writeBatch()) {
+            return AVERROR(EIO);
+        }
+    }
+
+    return size;
+}
+
+// Push what the muxer and the batch hold to the file
+void IsoRecorder::flush()
+{
+    if (mMuxer != nullptr && mMuxer->pb != nullptr) {
+        avio_flush(mMuxer->pb);
+    }
+    writeBatch();
+
+    // Nothing may have been waiting, don't check again right away
+    mLastWrite = os_gettime_ns();
+}
+
+bool IsoRecorder::writeBatch()
+{
+    if (mFile == nullptr || mBatchSize == 0) {
+        return true;
+    }
+
+    preallocate(mFileOffset + mBatchSize);
+
+    uint64_t start = os_gettime_ns();
+    size_t written = fwrite(mBatch, 1, mBatchSize, mFile);
+    uint64_t end = os_gettime_ns();
+
+    mWriteNs += end - start;
+    mBytesWritten += written;
+    mFileOffset += written;
+    mLastWrite = end;
+
+    bool success = written == mBatchSize;
+    mBatchSize = 0;
+
+    if (!success) {
+        blog(LOG_ERROR, "[obs-ios-camera-plugin] Failed to write to %s",
+             part_path(mPath, mPart).c_str());
+    }
+    return success;
+}
+
+// Reserve disk space ahead of the data without changing the file size, so
+// a file cut short by a crash still ends after its last fragment
+void IsoRecorder::preallocate(uint64_t end)
+{
+    if (end <= mAllocated) {
+        return;
+    }
+
+    uint64_t allocate = end + ISO_RECORDER_PREALLOCATE;
+
+#if defined(_WIN32)
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = (LONGLONG)allocate;
+    SetFileInformationByHandle((HANDLE)_get_osfhandle(_fileno(mFile)), FileAllocationInfo,
+                               &info, sizeof(info));
+#elif defined(__APPLE__)
+    fstore_t store = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)(allocate - mAllocated), 0};
+    fcntl(fileno(mFile), F_PREALLOCATE, &store);
+#elif defined(__linux__)
+    fallocate(fileno(mFile), FALLOC_FL_KEEP_SIZE, (off_t)mAllocated,
+              (off_t)(allocate - mAllocated));
+#endif
+
+    mAllocated = allocate;
+}
@@ -0,0 +1,151 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef IsoRecorder_hpp
+#define IsoRecorder_hpp
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "AccessUnitAssembler.hpp"
+#include "Thread.hpp"
+
+// Half a minute of a 15 Mbps stream. If the disk falls that far behind,
+// pictures are dropped up to the next keyframe rather than slowing down
+// the connection.
+#define ISO_RECORDER_MAX_QUEUED_BYTES (64 * 1024 * 1024)
+
+struct AVFormatContext;
+struct AVIOContext;
+struct AVStream;
+
+// Records the phone's stream to a fragmented MP4 exactly as it arrives, so
+// each camera can be kept at full quality without OBS encoding it again.
+//
+// The connection thread only puts packets back together into pictures and
+// queues them. A writer thread muxes them and writes the file in large,
+// aligned batches to space that was allocated ahead of time. Fragments
+// start at every keyframe and what the muxer has written is flushed at
+// least once a second, a crash loses at most the fragment in progress.
+class IsoRecorder : private Thread
+{
+public:
+    IsoRecorder() = default;
+    ~IsoRecorder();
+
+    // Start recording to `path`, finishing the current recording first
+    void start(const std::string &path);
+    void stop();
+    bool isRecording();
+
+    // Called from the connection thread, never waits for the disk
+    void addVideo(const std::vector<char> &packet, uint64_t timestamp);
+    void addAudio(const std::vector<char> &packet, uint64_t timestamp);
+
+private:
+    struct VideoConfig {
+        nal_codec codec;
+        video_params params;
+        std::vector<uint8_t> extradata;
+    };
+
+    struct Item {
+        enum Kind { Open, Close, Video, Audio } kind;
+        std::string path;
+        std::vector<uint8_t> data;
+        uint64_t timestamp;
+        bool keyframe;
+        std::shared_ptr<const VideoConfig> config;
+    };
+
+    struct AudioConfig {
+        int sampleRate;
+        int channels;
+        uint8_t asc[2]; // AudioSpecificConfig
+    };
+
+    void push(Item item);
+    void queueVideo(AccessUnitAssembler::AccessUnit &unit);
+    void *run() override;
+
+    // Writer thread
+    void process(Item &item);
+    void hold(Item &item);
+    void writeHeld();
+    bool openFile();
+    bool openMuxer(const Item &keyframe);
+    void writeVideo(const Item &item);
+    void writeAudio(const Item &item);
+    void closeMuxer();
+    void closeFile();
+    void preallocate(uint64_t end);
+    void flush();
+    bool writeBatch();
+
+    static int writePacket(void *opaque, uint8_t *buf, int size);
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<Item> mQueue;
+    size_t mQueuedBytes = 0;
+    bool mRunning = false;
+
+    // Connection thread, under mMutex
+    bool mRecording = false;
+    bool mWaitForKeyframe = false;
+    uint64_t mDropped = 0;
+    AccessUnitAssembler mAssembler;
+    std::shared_ptr<const VideoConfig> mConfig;
+
+    // Writer thread
+    std::string mPath;
+    uint32_t mPart = 0;
+    FILE *mFile = nullptr;
+    uint64_t mFileOffset = 0;
+    uint64_t mAllocated = 0;
+
+    uint8_t *mBatch = nullptr;
+    std::vector<uint8_t> mBatchStorage;
+    size_t mBatchSize = 0;
+    uint64_t mLastWrite = 0;
+
+    AVFormatContext *mMuxer = nullptr;
+    AVStream *mVideoStream = nullptr;
+    AVStream *mAudioStream = nullptr;
+    std::shared_ptr<const VideoConfig> mMuxerConfig;
+    bool mHaveAudio = false;
+    AudioConfig mAudio = {};
+    uint64_t mStart = 0;
+    int64_t mLastVideoDts = 0;
+    int64_t mLastAudioDts = 0;
+
+    // Samples waiting for the first keyframe and the audio configuration
+    std::deque<Item> mHeld;
+
+    // Throughput of the current recording, logged when it ends
+    uint64_t mBytesWritten = 0;
+    uint64_t mWriteNs = 0;
+    uint64_t mStartedAt = 0;
+    size_t mMaxQueuedBytes = 0;
+};
+
+#endif /* IsoRecorder_hpp */
@@ -0,0 +1,252 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "JitterBuffer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <util/platform.h>
+
+// About four seconds of frames to measure lateness over
+#define LATENESS_WINDOW 120
+
+// Only this many of the most recent samples decide whether to grow
+#define LATENESS_ATTACK_WINDOW 60
+
+// The jitter estimate halves every this long once frames are on time again
+#define JITTER_HALF_LIFE_NS 1000000000.0
+
+// Copies kept around to avoid allocating a frame for every picture
+#define FRAME_POOL_SIZE 4
+
+JitterBuffer::JitterBuffer(obs_source_t *source) : source(source) { }
+
+JitterBuffer::~JitterBuffer()
+{
+    stop();
+
+    for (auto frame : mFrames) {
+        obs_source_frame_destroy(frame);
+    }
+    for (auto frame : mPool) {
+        obs_source_frame_destroy(frame);
+    }
+}
+
+void JitterBuffer::start()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mRunning) {
+            return;
+        }
+        mRunning = true;
+    }
+
+    Thread::start();
+}
+
+void JitterBuffer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mRunning) {
+            return;
+        }
+        mRunning = false;
+    }
+
+    mCondition.notify_all();
+    this->join();
+    clear();
+}
+
+void JitterBuffer::configure(JitterBufferSettings settings)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (settings.maxDepth < settings.minDepth) {
+        settings.maxDepth = settings.minDepth;
+    }
+    mSettings = settings;
+}
+
+void JitterBuffer::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    while (!mFrames.empty()) {
+        recycle(mFrames.front());
+        mFrames.pop_front();
+    }
+
+    mLateness.clear();
+    mJitterNs = 0;
+    mLastTimestamp = 0;
+}
+
+obs_source_frame *JitterBuffer::copyFrame(const obs_source_frame *frame)
+{
+    obs_source_frame *copy = nullptr;
+
+    auto match = std::find_if(mPool.begin(), mPool.end(), [frame](obs_source_frame *f) {
+        return f->format == frame->format && f->width == frame->width &&
+               f->height == frame->height;
+    });
+
+    if (match != mPool.end()) {
+        copy = *match;
+        mPool.erase(match);
+    } else {
+        copy = obs_source_frame_create(frame->format, frame->width, frame->height);
+    }
+
+    obs_source_frame_copy(copy, frame);
+    return copy;
+}
+
+void JitterBuffer::recycle(obs_source_frame *frame)
+{
+    if (mPool.size() < FRAME_POOL_SIZE) {
+        mPool.push_back(frame);
+    } else {
+        obs_source_frame_destroy(frame);
+    }
+}
+
+void JitterBuffer::updateDelay(const obs_source_frame *frame, uint64_t now)
+{
+    if (mLastTimestamp != 0 && frame->timestamp > mLastTimestamp) {
+        double interval = (double)(frame->timestamp - mLastTimestamp);
+        if (interval > 1000000.0 && interval < 200000000.0) {
+            mFrameIntervalNs += (interval - mFrameIntervalNs) * 0.05;
+        }
+    }
+    mLastTimestamp = frame->timestamp;
+
+    mLateness.push_back((int64_t)(now - frame->timestamp));
+    if (mLateness.size() > LATENESS_WINDOW) {
+        mLateness.pop_front();
+    }
+
+    int64_t base = *std::min_element(mLateness.begin(), mLateness.end());
+
+    // 95th percentile of the jitter over the most recent frames
+    size_t count = std::min(mLateness.size(), (size_t)LATENESS_ATTACK_WINDOW);
+    std::vector<int64_t> jitter(mLateness.end() - count, mLateness.end());
+    for (auto &value : jitter) {
+        value -= base;
+    }
+
+    auto percentile = jitter.begin() + (jitter.size() * 95) / 100;
+    if (percentile == jitter.end()) {
+        percentile--;
+    }
+    std::nth_element(jitter.begin(), percentile, jitter.end());
+
+    // Grow immediately, shrink with a short half life
+    double elapsed = mLastUpdate != 0 ? (double)(now - mLastUpdate) : 0.0;
+    double decayed = mJitterNs * std::pow(0.5, elapsed / JITTER_HALF_LIFE_NS);
+    mJitterNs = std::max(*percentile, (int64_t)decayed);
+    mLastUpdate = now;
+
+    int64_t delay = std::max(mJitterNs, (int64_t)mSettings.targetLatencyMs * 1000000);
+    uint32_t frames = (uint32_t)std::ceil((double)delay / mFrameIntervalNs);
+    frames = std::max(mSettings.minDepth, std::min(mSettings.maxDepth, frames));
+
+    delay = (int64_t)(frames * mFrameIntervalNs);
+
+    mPlayoutOffset = base + delay;
+    mDelayMs = (uint32_t)(delay / 1000000);
+}
+
+void JitterBuffer::push(const obs_source_frame *frame)
+{
+    uint64_t now = os_gettime_ns();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!mRunning) {
+        return;
+    }
+
+    updateDelay(frame, now);
+
+    // Nothing should ever back up this far, but don't grow without bound
+    if (mFrames.size() > mSettings.maxDepth + 1) {
+        recycle(mFrames.front());
+        mFrames.pop_front();
+    }
+
+    mFrames.push_back(copyFrame(frame));
+    mCondition.notify_all();
+}
+
+void *JitterBuffer::run()
+{
+    Tracer::setThreadName("jitter buffer");
+
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (mRunning) {
+        if (mFrames.empty()) {
+            mCondition.wait(lock);
+            continue;
+        }
+
+        uint64_t now = os_gettime_ns();
+        int64_t due = (int64_t)mFrames.front()->timestamp + mPlayoutOffset;
+
+        if ((int64_t)now < due) {
+            mCondition.wait_for(lock, std::chrono::nanoseconds(due - (int64_t)now));
+            continue;
+        }
+
+        // Skip straight to the newest frame that is due, which is how the
+        // buffer sheds latency after a burst.
+        while (mFrames.size() > 1 &&
+               (int64_t)mFrames[1]->timestamp + mPlayoutOffset <= (int64_t)now) {
+            metrics->count(MetricCounter::DropJitterBuffer);
+            recycle(mFrames.front());
+            mFrames.pop_front();
+        }
+
+        obs_source_frame *frame = mFrames.front();
+        mFrames.pop_front();
+
+        lock.unlock();
+        uint64_t start = os_gettime_ns();
+        obs_source_output_video(source, frame);
+        uint64_t end = os_gettime_ns();
+
+        metrics->record(MetricStage::Output, end - start);
+        if (frame->timestamp <= end) {
+            metrics->record(MetricStage::EndToEnd, end - frame->timestamp);
+        }
+
+        Tracer::shared().span("obs_source_output_video", start, end, frame->timestamp);
+        if (hitches != nullptr) {
+            hitches->output(end);
+        }
+        lock.lock();
+
+        recycle(frame);
+    }
+
+    return NULL;
+}
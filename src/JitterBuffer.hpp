@@ -0,0 +1,109 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef JitterBuffer_hpp
+#define JitterBuffer_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <obs.h>
+
+#include "Metrics.hpp"
+#include "Trace.hpp"
+#include "Thread.hpp"
+
+struct JitterBufferSettings {
+    // Latency to aim for even when the link is clean, in milliseconds
+    uint32_t targetLatencyMs;
+
+    // Bounds on how many frames the buffer may hold back
+    uint32_t minDepth;
+    uint32_t maxDepth;
+};
+
+// Holds decoded frames back just long enough to play them out evenly.
+//
+// Every frame's lateness (when it came out of the decoder, minus its
+// capture time) is measured. The lowest recent lateness is the base
+// latency of the link, and the 95th percentile above that is the jitter
+// to absorb. A frame is shown at its capture time plus the base latency
+// plus that much delay, rounded to whole frames and clamped to the depth
+// limits.
+//
+// The delay grows as soon as enough frames are late, and decays quickly
+// once a burst is over. Frames that are overdue when the delay shrinks are
+// skipped, so latency drops straight back instead of draining slowly.
+class JitterBuffer : private Thread
+{
+public:
+    JitterBuffer(obs_source_t *source);
+    ~JitterBuffer();
+
+    void start();
+    void stop();
+
+    void configure(JitterBufferSettings settings);
+
+    // Copies the frame, the caller keeps ownership of `frame`
+    void push(const obs_source_frame *frame);
+
+    // Drop everything that hasn't been shown yet
+    void clear();
+
+    // Current playout delay on top of the base latency
+    uint32_t getDelayMs() { return mDelayMs; }
+
+    Metrics *metrics = Metrics::unregistered();
+    HitchDetector *hitches = nullptr;
+
+private:
+    void *run() override;
+
+    obs_source_frame *copyFrame(const obs_source_frame *frame);
+    void recycle(obs_source_frame *frame);
+    void updateDelay(const obs_source_frame *frame, uint64_t now);
+
+    obs_source_t *source;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mRunning = false;
+
+    JitterBufferSettings mSettings = {0, 0, 10};
+
+    std::deque<obs_source_frame *> mFrames;
+    std::vector<obs_source_frame *> mPool;
+
+    // Recent lateness samples, in nanoseconds
+    std::deque<int64_t> mLateness;
+
+    int64_t mJitterNs = 0;
+    uint64_t mLastUpdate = 0;
+    uint64_t mLastTimestamp = 0;
+    double mFrameIntervalNs = 1000000000.0 / 30.0;
+
+    // Added to a frame's timestamp to get the time it is shown at
+    int64_t mPlayoutOffset = 0;
+    std::atomic<uint32_t> mDelayMs = 0;
+};
+
+#endif /* JitterBuffer_hpp */
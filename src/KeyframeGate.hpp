@@ -0,0 +1,282 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef KeyframeGate_hpp
+#define KeyframeGate_hpp
+
+#include <vector>
+#include <chrono>
+#include <atomic>
+
+#include <obs.h>
+
+#include "nal-unit.h"
+#include "parameter-sets.h"
+#include "Queue.hpp"
+#include "logging.h"
+
+// Why the decoder is waiting for a keyframe
+enum class RecoveryReason {
+    // The decoder was (re)created, after a flush or a reconnect
+    Reset,
+    // Reference pictures were dropped because the queue overloaded
+    Dropped,
+    // frame_num jumped, a reference picture never arrived
+    ReferenceLoss,
+    // The decoder failed to decode a picture
+    DecodeError,
+};
+
+struct RecoveryRequest {
+    RecoveryReason reason;
+
+    // Only set for RecoveryReason::ReferenceLoss
+    uint32_t expectedFrameNum;
+    uint32_t receivedFrameNum;
+};
+
+static inline const char *recovery_reason_name(RecoveryReason reason)
+{
+    switch (reason) {
+    case RecoveryReason::Reset:
+        return "reset";
+    case RecoveryReason::Dropped:
+        return "dropped frames";
+    case RecoveryReason::ReferenceLoss:
+        return "reference loss";
+    case RecoveryReason::DecodeError:
+        return "decode error";
+    }
+    return "unknown";
+}
+
+// Watches H.264 frame_num for gaps, which means a reference picture went
+// missing somewhere between the phone's encoder and us.
+class ReferenceLossDetector
+{
+    h264_sps mSps;
+    bool mHaveSps = false;
+
+    bool mHavePrevious = false;
+    uint32_t mPrevRefFrameNum = 0;
+
+public:
+
+    // Returns true if `nal` is the first slice of a picture that follows a
+    // gap in the reference chain.
+    bool check(nal_codec codec, const nal_unit &nal, RecoveryRequest *request) {
+        if (codec != NAL_CODEC_H264) {
+            return false;
+        }
+
+        if (nal.kind == NAL_KIND_SPS) {
+            mHaveSps = h264_parse_sps(nal.data, nal.size, &mSps);
+            mHavePrevious = false;
+            return false;
+        }
+
+        if (!nal_is_vcl(&nal) || !mHaveSps || mSps.gaps_in_frame_num_allowed) {
+            return false;
+        }
+
+        h264_slice_header header;
+        if (!h264_parse_slice_header(nal.data, nal.size, &mSps, &header) ||
+            header.first_mb_in_slice != 0) {
+            return false;
+        }
+
+        bool gap = false;
+
+        if (nal.kind == NAL_KIND_SLICE && mHavePrevious) {
+            uint32_t maxFrameNum = 1u << mSps.log2_max_frame_num;
+            uint32_t expected = (mPrevRefFrameNum + 1) % maxFrameNum;
+
+            if (header.frame_num != mPrevRefFrameNum && header.frame_num != expected) {
+                request->reason = RecoveryReason::ReferenceLoss;
+                request->expectedFrameNum = expected;
+                request->receivedFrameNum = header.frame_num;
+                gap = true;
+            }
+        }
+
+        if (nal.reference) {
+            mPrevRefFrameNum = header.frame_num;
+            mHavePrevious = true;
+        }
+
+        return gap;
+    }
+
+    void reset() {
+        mHavePrevious = false;
+    }
+};
+
+// Once a reference picture has been dropped (or the decoder has been reset)
+// every picture up to the next random access point decodes to garbage.
+// The gate skips those instead of handing them to the decoder, and measures
+// how long it takes to get a clean picture back.
+class KeyframeGate
+{
+    bool mWaiting = true;
+    bool mSkipLeading = false;
+
+    RecoveryRequest mRequest = {RecoveryReason::Reset, 0, 0};
+    std::chrono::steady_clock::time_point mClosedAt;
+    bool mTiming = false;
+
+    ReferenceLossDetector mDetector;
+
+    std::atomic<uint32_t> mRecoveries = 0;
+    std::atomic<uint32_t> mLastRecoveryMs = 0;
+
+public:
+
+    // Returns false if the NAL unit can't be decoded and should be skipped.
+    // `request` is filled in with the reason whenever that happens.
+    bool admit(nal_codec codec, const nal_unit &nal, RecoveryRequest *request) {
+        RecoveryRequest loss;
+        if (mDetector.check(codec, nal, &loss)) {
+            close(loss);
+        }
+
+        if (nal.kind == NAL_KIND_IRAP) {
+            if (mWaiting) {
+                recovered();
+            }
+
+            mSkipLeading = mWaiting;
+            mWaiting = false;
+            return true;
+        }
+
+        if (nal.kind != NAL_KIND_SLICE) {
+            return true;
+        }
+
+        if (mWaiting) {
+            if (!mTiming) {
+                mClosedAt = std::chrono::steady_clock::now();
+                mTiming = true;
+            }
+
+            *request = mRequest;
+            return false;
+        }
+
+        if (mSkipLeading) {
+            // HEVC RASL pictures reference pictures from before the CRA
+            if (nal.skippable_leading) {
+                return false;
+            }
+            mSkipLeading = false;
+        }
+
+        return true;
+    }
+
+    // The reference chain is broken, wait for the next random access point.
+    void close(RecoveryRequest request) {
+        if (mWaiting) {
+            return;
+        }
+
+        mWaiting = true;
+        mRequest = request;
+        mClosedAt = std::chrono::steady_clock::now();
+        mTiming = true;
+        mDetector.reset();
+    }
+
+    void close(RecoveryReason reason) {
+        close({reason, 0, 0});
+    }
+
+    bool isWaiting() {
+        return mWaiting;
+    }
+
+    uint32_t recoveries() {
+        return mRecoveries;
+    }
+
+    // Time from the reference chain breaking to the next random access
+    // point, for the most recent recovery.
+    uint32_t lastRecoveryMs() {
+        return mLastRecoveryMs;
+    }
+
+    // A packet was dropped without being decoded. Only dropping a
+    // reference picture breaks the chain.
+    void dropped(nal_codec codec, PacketItem *packetItem) {
+        auto &packet = packetItem->getPacket();
+
+        nal_unit nal;
+        if (!nal_parse_annexb(codec, (const uint8_t *)packet.data(), packet.size(), &nal) ||
+            (nal_is_vcl(&nal) && nal.reference)) {
+            close(RecoveryReason::Dropped);
+        }
+    }
+
+    // Index of the first packet that is still decodable after a queue
+    // overload: the most recent random access point, or `packets.size()`
+    // if there is none and everything but the parameter sets has to go.
+    static size_t resumeIndex(nal_codec codec, const std::vector<PacketItem *> &packets) {
+        for (size_t i = packets.size(); i-- > 0;) {
+            auto &packet = packets[i]->getPacket();
+
+            nal_unit nal;
+            if (nal_parse_annexb(codec, (const uint8_t *)packet.data(), packet.size(), &nal) &&
+                nal.kind == NAL_KIND_IRAP) {
+                return i;
+            }
+        }
+
+        return packets.size();
+    }
+
+    // Parameter sets should never be dropped when the queue overloads,
+    // they are tiny and nothing decodes without them.
+    static bool isParameterSet(nal_codec codec, PacketItem *packetItem) {
+        auto &packet = packetItem->getPacket();
+
+        nal_unit nal;
+        return nal_parse_annexb(codec, (const uint8_t *)packet.data(), packet.size(), &nal) &&
+               nal_is_parameter_set(&nal);
+    }
+
+private:
+
+    void recovered() {
+        if (!mTiming) {
+            return;
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - mClosedAt);
+
+        mTiming = false;
+        mRecoveries++;
+        mLastRecoveryMs = (uint32_t)elapsed.count();
+
+        portal_info("Clean picture %u ms after %s",
+                    (uint32_t)elapsed.count(), recovery_reason_name(mRequest.reason));
+    }
+};
+
+#endif /* KeyframeGate_hpp */
@@ -0,0 +1,252 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "Metrics.hpp"
+
+#include <algorithm>
+
+#include <obs.h>
+
+const char *metric_stage_name(MetricStage stage)
+{
+    switch (stage) {
+    case MetricStage::Receive:
+        return "receive";
+    case MetricStage::Parse:
+        return "parse";
+    case MetricStage::QueueWait:
+        return "queue_wait";
+    case MetricStage::Decode:
+        return "decode";
+    case MetricStage::Download:
+        return "download";
+    case MetricStage::Output:
+        return "output";
+    case MetricStage::EndToEnd:
+        return "end_to_end";
+    }
+    return "unknown";
+}
+
+const char *metric_counter_name(MetricCounter counter)
+{
+    switch (counter) {
+    case MetricCounter::BytesReceived:
+        return "bytes_received";
+    case MetricCounter::Nals:
+        return "nals";
+    case MetricCounter::Pictures:
+        return "pictures";
+    case MetricCounter::Frames:
+        return "frames";
+    case MetricCounter::Reconnects:
+        return "reconnects";
+    case MetricCounter::DropQueueOverload:
+        return "drop_queue_overload";
+    case MetricCounter::DropUndecodable:
+        return "drop_undecodable";
+    case MetricCounter::DropStandby:
+        return "drop_standby";
+    case MetricCounter::DropDecimated:
+        return "drop_decimated";
+    case MetricCounter::DropMailbox:
+        return "drop_mailbox";
+    case MetricCounter::DropDelayLine:
+        return "drop_delay_line";
+    case MetricCounter::DropJitterBuffer:
+        return "drop_jitter_buffer";
+    }
+    return "unknown";
+}
+
+const char *metric_gauge_name(MetricGauge gauge)
+{
+    switch (gauge) {
+    case MetricGauge::DecodeQueueDepth:
+        return "decode_queue_depth";
+    case MetricGauge::DelayLineBytes:
+        return "delay_line_bytes";
+    }
+    return "unknown";
+}
+
+uint64_t HistogramSnapshot::bucketUpperBound(size_t bucket)
+{
+    if (bucket < METRIC_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int shift = (int)(bucket / METRIC_SUB_BUCKETS) - 1;
+    uint64_t lower = (uint64_t)(METRIC_SUB_BUCKETS + bucket % METRIC_SUB_BUCKETS) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+HistogramSnapshot HistogramSnapshot::since(const HistogramSnapshot &earlier) const
+{
+    HistogramSnapshot delta;
+    delta.count = count - earlier.count;
+    delta.sum = sum - earlier.sum;
+    delta.buckets.assign(buckets.size(), 0);
+
+    for (size_t i = 0; i < buckets.size(); i++) {
+        delta.buckets[i] = buckets[i] - (i < earlier.buckets.size() ? earlier.buckets[i] : 0);
+        if (delta.buckets[i] != 0) {
+            delta.max = std::min(bucketUpperBound(i), max);
+        }
+    }
+
+    return delta;
+}
+
+uint64_t HistogramSnapshot::percentile(double quantile) const
+{
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(quantile * (double)(count - 1)) + 1;
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::min(bucketUpperBound(i), max);
+        }
+    }
+
+    return max;
+}
+
+void MetricsSnapshot::log() const
+{
+    blog(LOG_INFO, "[obs-ios-camera-plugin] Metrics for %s", scope.c_str());
+
+    for (int i = 0; i < METRIC_STAGE_COUNT; i++) {
+        auto &histogram = stages[i];
+        if (histogram.count == 0) {
+            continue;
+        }
+
+        blog(LOG_INFO, "[obs-ios-camera-plugin]   %-10s n=%llu mean=%.2fms p50=%.2fms p99=%.2fms max=%.2fms",
+             metric_stage_name((MetricStage)i), (unsigned long long)histogram.count,
+             histogram.mean() / 1e6, histogram.percentile(0.5) / 1e6,
+             histogram.percentile(0.99) / 1e6, histogram.max / 1e6);
+    }
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        if (counters[i] != 0) {
+            blog(LOG_INFO, "[obs-ios-camera-plugin]   %s=%llu",
+                 metric_counter_name((MetricCounter)i), (unsigned long long)counters[i]);
+        }
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        if (highs[i] != 0) {
+            blog(LOG_INFO, "[obs-ios-camera-plugin]   %s_max=%llu",
+                 metric_gauge_name((MetricGauge)i), (unsigned long long)highs[i]);
+        }
+    }
+}
+
+size_t Metrics::shard()
+{
+    static std::atomic<size_t> nextShard = 0;
+    thread_local size_t shard = nextShard++ % METRIC_SHARDS;
+    return shard;
+}
+
+MetricsSnapshot Metrics::snapshot()
+{
+    MetricsSnapshot snapshot;
+    snapshot.scope = mScope;
+
+    for (auto &histogram : snapshot.stages) {
+        histogram.buckets.assign(METRIC_BUCKETS, 0);
+    }
+
+    for (auto &shard : mShards) {
+        for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+            snapshot.counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+        }
+
+        for (int i = 0; i < METRIC_STAGE_COUNT; i++) {
+            auto &from = shard.stages[i];
+            auto &to = snapshot.stages[i];
+
+            for (size_t b = 0; b < METRIC_BUCKETS; b++) {
+                uint64_t count = from.buckets[b].load(std::memory_order_relaxed);
+                to.buckets[b] += count;
+                to.count += count;
+            }
+            to.sum += from.sum.load(std::memory_order_relaxed);
+            to.max = std::max(to.max, from.max.load(std::memory_order_relaxed));
+        }
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        snapshot.gauges[i] = mGauges[i].load(std::memory_order_relaxed);
+        snapshot.highs[i] = mHighs[i].load(std::memory_order_relaxed);
+    }
+
+    return snapshot;
+}
+
+Metrics *Metrics::unregistered()
+{
+    static Metrics metrics("unregistered");
+    return &metrics;
+}
+
+MetricsRegistry &MetricsRegistry::shared()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<Metrics> MetricsRegistry::scope(const std::string &scope)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto &entry = mScopes[scope];
+    auto metrics = entry.lock();
+    if (metrics == nullptr) {
+        metrics = std::make_shared<Metrics>(scope);
+        entry = metrics;
+    }
+
+    // Forget the scopes nobody holds any more
+    for (auto it = mScopes.begin(); it != mScopes.end();) {
+        it = it->second.expired() ? mScopes.erase(it) : std::next(it);
+    }
+
+    return metrics;
+}
+
+std::vector<std::shared_ptr<Metrics>> MetricsRegistry::all()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::vector<std::shared_ptr<Metrics>> all;
+
+    for (auto &entry : mScopes) {
+        if (auto metrics = entry.second.lock()) {
+            all.push_back(metrics);
+        }
+    }
+
+    return all;
+}
@@ -0,0 +1,255 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef Metrics_hpp
+#define Metrics_hpp
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Where the time goes between the phone and OBS
+enum class MetricStage : int {
+    // Capture on the phone to arrival here, when the phone sends capture times
+    Receive = 0,
+    // Splitting received data into packets
+    Parse,
+    // Waiting in the decode queue
+    QueueWait,
+    Decode,
+    // Copying a hardware decoded picture out of GPU memory
+    Download,
+    // obs_source_output_video
+    Output,
+    // Capture on the phone, or arrival when the phone doesn't send capture
+    // times, to obs_source_output_video. A configured delay isn't included.
+    EndToEnd,
+};
+
+#define METRIC_STAGE_COUNT 7
+
+enum class MetricCounter : int {
+    BytesReceived = 0,
+    Nals,
+    // Pictures received, counted at their first slice
+    Pictures,
+    // Pictures handed to the video output
+    Frames,
+    Reconnects,
+
+    // Pictures, or packets, that never made it to the screen, by reason
+    DropQueueOverload,
+    DropUndecodable,
+    DropStandby,
+    DropDecimated,
+    DropMailbox,
+    DropDelayLine,
+    DropJitterBuffer,
+};
+
+#define METRIC_COUNTER_COUNT 12
+
+// Current values, with their high-water marks
+enum class MetricGauge : int {
+    DecodeQueueDepth = 0,
+    DelayLineBytes,
+};
+
+#define METRIC_GAUGE_COUNT 2
+
+// Threads are spread over this many copies of every counter, so recording
+// rarely touches a cache line another thread is writing
+#define METRIC_SHARDS 8
+
+// Histogram buckets are exact below 16ns, above that each power of two is
+// split into 16 buckets, so values are within 1/16 of the truth. Anything
+// above 2^40 ns (18 minutes) goes in the last bucket.
+#define METRIC_SUB_BUCKET_BITS 4
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BUCKET_BITS)
+#define METRIC_MAX_BITS 40
+#define METRIC_BUCKETS ((METRIC_MAX_BITS - METRIC_SUB_BUCKET_BITS + 1) * METRIC_SUB_BUCKETS)
+
+extern const char *metric_stage_name(MetricStage stage);
+extern const char *metric_counter_name(MetricCounter counter);
+extern const char *metric_gauge_name(MetricGauge gauge);
+
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> buckets;
+
+    // `quantile` between 0 and 1, returns the upper edge of the bucket
+    uint64_t percentile(double quantile) const;
+
+    uint64_t mean() const {
+        return count > 0 ? sum / count : 0;
+    }
+
+    // What was recorded after `earlier`, a snapshot of the same histogram.
+    // `max` becomes an upper bound.
+    HistogramSnapshot since(const HistogramSnapshot &earlier) const;
+
+    static uint64_t bucketUpperBound(size_t bucket);
+};
+
+struct MetricsSnapshot {
+    std::string scope;
+    std::array<uint64_t, METRIC_COUNTER_COUNT> counters = {};
+    std::array<uint64_t, METRIC_GAUGE_COUNT> gauges = {};
+    std::array<uint64_t, METRIC_GAUGE_COUNT> highs = {};
+    std::array<HistogramSnapshot, METRIC_STAGE_COUNT> stages;
+
+    uint64_t counter(MetricCounter counter) const {
+        return counters[(int)counter];
+    }
+
+    uint64_t gauge(MetricGauge gauge) const {
+        return gauges[(int)gauge];
+    }
+
+    uint64_t high(MetricGauge gauge) const {
+        return highs[(int)gauge];
+    }
+
+    const HistogramSnapshot &stage(MetricStage stage) const {
+        return stages[(int)stage];
+    }
+
+    // One line per stage and the counters that aren't zero
+    void log() const;
+};
+
+// The metrics of one source or one connection. Recording is a relaxed
+// atomic add on the calling thread's shard, it never takes a lock.
+class Metrics
+{
+public:
+    Metrics(const std::string &scope) : mScope(scope) { }
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    void count(MetricCounter counter, uint64_t value = 1) {
+        mShards[shard()].counters[(int)counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void record(MetricStage stage, uint64_t ns) {
+        auto &histogram = mShards[shard()].stages[(int)stage];
+
+        histogram.buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        histogram.sum.fetch_add(ns, std::memory_order_relaxed);
+
+        uint64_t max = histogram.max.load(std::memory_order_relaxed);
+        while (ns > max && !histogram.max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    void set(MetricGauge gauge, uint64_t value) {
+        mGauges[(int)gauge].store(value, std::memory_order_relaxed);
+
+        auto &high = mHighs[(int)gauge];
+
+        uint64_t current = high.load(std::memory_order_relaxed);
+        while (value > current && !high.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    const std::string &scope() {
+        return mScope;
+    }
+
+    MetricsSnapshot snapshot();
+
+    // For components that aren't attached to a source, recorded but never
+    // reported
+    static Metrics *unregistered();
+
+    static size_t bucket(uint64_t ns) {
+        if (ns < METRIC_SUB_BUCKETS) {
+            return (size_t)ns;
+        }
+
+        int msb = 63 - count_leading_zeros(ns);
+        if (msb >= METRIC_MAX_BITS) {
+            return METRIC_BUCKETS - 1;
+        }
+
+        int shift = msb - METRIC_SUB_BUCKET_BITS;
+        return (size_t)(shift + 1) * METRIC_SUB_BUCKETS +
+               (size_t)((ns >> shift) - METRIC_SUB_BUCKETS);
+    }
+
+private:
+    struct Histogram {
+        std::atomic<uint64_t> buckets[METRIC_BUCKETS] = {};
+        std::atomic<uint64_t> sum = 0;
+        std::atomic<uint64_t> max = 0;
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[METRIC_COUNTER_COUNT] = {};
+        Histogram stages[METRIC_STAGE_COUNT];
+    };
+
+    // `value` must not be zero
+    static int count_leading_zeros(uint64_t value) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return 63 - (int)index;
+#else
+        return __builtin_clzll(value);
+#endif
+    }
+
+    static size_t shard();
+
+    std::string mScope;
+    Shard mShards[METRIC_SHARDS];
+    std::atomic<uint64_t> mGauges[METRIC_GAUGE_COUNT] = {};
+    std::atomic<uint64_t> mHighs[METRIC_GAUGE_COUNT] = {};
+};
+
+// Every source's and every connection's metrics by name, for reporting.
+// Scopes live as long as someone holds on to them.
+class MetricsRegistry
+{
+public:
+    static MetricsRegistry &shared();
+
+    // The metrics for `scope`, created on first use. A scope that is still
+    // alive is shared, so a reconnect keeps counting where it left off.
+    std::shared_ptr<Metrics> scope(const std::string &scope);
+
+    std::vector<std::shared_ptr<Metrics>> all();
+
+private:
+    std::mutex mMutex;
+    std::map<std::string, std::weak_ptr<Metrics>> mScopes;
+};
+
+#endif /* Metrics_hpp */
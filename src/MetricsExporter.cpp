@@ -0,0 +1,447 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include "MetricsExporter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+// Before anything that pulls in windows.h, it includes winsock2.h
+#include "socket.h"
+
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#include <sys/qos.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Requests are a request line and a few headers, nothing more is read
+#define METRICS_EXPORTER_MAX_REQUEST 8192
+
+// Bucket bounds for the stage histograms, in seconds. The recorded
+// histograms are much finer, a bucket counts everything recorded in a
+// finer bucket that ends at or below its bound.
+static const double stage_bounds[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05,   0.1,     0.25,   0.5,   1.0,    2.5,   5.0,  10.0,
+};
+
+MetricsExporterConfig MetricsExporterConfig::load()
+{
+    MetricsExporterConfig config;
+
+    char *path = obs_module_config_path("metrics-exporter.json");
+    obs_data_t *data = path != nullptr ? obs_data_create_from_json_file_safe(path, "bak") : nullptr;
+    bfree(path);
+
+    if (data == nullptr) {
+        return config;
+    }
+
+    obs_data_set_default_int(data, "port", config.port);
+    obs_data_set_default_int(data, "interval", config.intervalSeconds);
+
+    std::string mode = obs_data_get_string(data, "mode");
+    if (mode == "http") {
+        config.mode = MetricsExportMode::Http;
+#ifndef _WIN32
+    } else if (mode == "unix") {
+        config.mode = MetricsExportMode::Unix;
+#endif
+    } else if (mode == "file") {
+        config.mode = MetricsExportMode::File;
+    } else if (!mode.empty()) {
+        blog(LOG_WARNING, "[obs-ios-camera-plugin] Unknown metrics exporter mode '%s'", mode.c_str());
+    }
+
+    config.port = (int)obs_data_get_int(data, "port");
+    config.path = obs_data_get_string(data, "path");
+    config.intervalSeconds = std::max((int)obs_data_get_int(data, "interval"), 1);
+
+    if ((config.mode == MetricsExportMode::Unix || config.mode == MetricsExportMode::File) &&
+        config.path.empty()) {
+        blog(LOG_WARNING, "[obs-ios-camera-plugin] The metrics exporter needs a path");
+        config.mode = MetricsExportMode::Off;
+    }
+
+    obs_data_release(data);
+    return config;
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    stop();
+}
+
+void MetricsExporter::start()
+{
+    Thread::start();
+}
+
+void MetricsExporter::stop()
+{
+    Thread::join();
+}
+
+static void lower_thread_priority()
+{
+#if defined(_WIN32)
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__APPLE__)
+    pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#elif defined(__linux__)
+    // Nice values are per thread on Linux
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+#endif
+}
+
+void *MetricsExporter::run()
+{
+    os_set_thread_name("ios-camera-metrics");
+    lower_thread_priority();
+
+    switch (mConfig.mode) {
+    case MetricsExportMode::Http:
+    case MetricsExportMode::Unix:
+        serve();
+        break;
+    case MetricsExportMode::File:
+        writeFiles();
+        break;
+    case MetricsExportMode::Off:
+        break;
+    }
+
+    return NULL;
+}
+
+void MetricsExporter::serve()
+{
+#ifndef _WIN32
+    if (mConfig.mode == MetricsExportMode::Unix) {
+        mListener = socket_create_unix(mConfig.path.c_str());
+    } else
+#endif
+    {
+        mListener = socket_create((uint16_t)mConfig.port);
+    }
+
+    if (mListener < 0) {
+        blog(LOG_WARNING, "[obs-ios-camera-plugin] Metrics exporter could not listen on %s",
+             mConfig.mode == MetricsExportMode::Unix ? mConfig.path.c_str()
+                                                     : std::to_string(mConfig.port).c_str());
+        return;
+    }
+
+    blog(LOG_INFO, "[obs-ios-camera-plugin] Serving metrics on %s",
+         mConfig.mode == MetricsExportMode::Unix ? mConfig.path.c_str()
+                                                 : ("127.0.0.1:" + std::to_string(mConfig.port)).c_str());
+
+    while (!shouldStop()) {
+        // Wake up now and then to notice when the plugin unloads
+        if (socket_check_fd(mListener, FDM_READ, 500) <= 0) {
+            continue;
+        }
+
+        int fd = socket_accept(mListener, (uint16_t)mConfig.port);
+        if (fd < 0) {
+            continue;
+        }
+
+        respond(fd);
+        socket_close(fd);
+    }
+
+    socket_close(mListener);
+    mListener = -1;
+
+    if (mConfig.mode == MetricsExportMode::Unix) {
+        os_unlink(mConfig.path.c_str());
+    }
+}
+
+static bool send_all(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        int sent = socket_send(fd, (void *)data, size);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+void MetricsExporter::respond(int fd)
+{
+    char request[METRICS_EXPORTER_MAX_REQUEST];
+    size_t size = 0;
+
+    // A client gets two seconds to send its headers
+    uint64_t deadline = os_gettime_ns() + 2000000000ULL;
+
+    while (size < sizeof(request) - 1 && os_gettime_ns() < deadline) {
+        int received = socket_receive_timeout(fd, request + size, sizeof(request) - 1 - size, 0, 500);
+        if (received == -ETIMEDOUT) {
+            continue;
+        }
+        if (received <= 0) {
+            return;
+        }
+
+        size += (size_t)received;
+        request[size] = '\0';
+        if (strstr(request, "\r\n\r\n") != nullptr) {
+            break;
+        }
+    }
+    request[size] = '\0';
+
+    const char *status = "200 OK";
+    if (strncmp(request, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+    } else if (strncmp(request + 4, "/metrics ", 9) != 0 && strncmp(request + 4, "/ ", 2) != 0) {
+        status = "404 Not Found";
+    }
+
+    mBuffer.clear();
+    if (strcmp(status, "200 OK") == 0) {
+        collect();
+        render(mSnapshots, true, mBuffer);
+    }
+
+    std::string header = std::string("HTTP/1.1 ") + status + "\r\n" +
+                         "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n" +
+                         "Content-Length: " + std::to_string(mBuffer.size()) + "\r\n" +
+                         "Connection: close\r\n\r\n";
+
+    if (send_all(fd, header.data(), header.size())) {
+        send_all(fd, mBuffer.data(), mBuffer.size());
+    }
+}
+
+void MetricsExporter::writeFiles()
+{
+    blog(LOG_INFO, "[obs-ios-camera-plugin] Writing metrics to %s every %d s",
+         mConfig.path.c_str(), mConfig.intervalSeconds);
+
+    uint64_t next = os_gettime_ns();
+
+    while (!shouldStop()) {
+        if (os_gettime_ns() < next) {
+            os_sleep_ms(250);
+            continue;
+        }
+        next += (uint64_t)mConfig.intervalSeconds * 1000000000ULL;
+
+        collect();
+        mBuffer.clear();
+        render(mSnapshots, false, mBuffer);
+
+        // Written next to the file and renamed over it, so the collector
+        // never reads half a file
+        if (!os_quick_write_utf8_file_safe(mConfig.path.c_str(), mBuffer.data(), mBuffer.size(),
+                                           false, "tmp", nullptr)) {
+            blog(LOG_WARNING, "[obs-ios-camera-plugin] Could not write metrics to %s",
+                 mConfig.path.c_str());
+        }
+    }
+}
+
+void MetricsExporter::collect()
+{
+    mSnapshots.clear();
+
+    for (auto &metrics : MetricsRegistry::shared().all()) {
+        mSnapshots.push_back(metrics->snapshot());
+    }
+}
+
+#pragma mark - Rendering
+
+static void append_escaped(std::string &out, const std::string &value)
+{
+    for (char c : value) {
+        switch (c) {
+        case '\\':
+            out += "\\\\";
+            break;
+        case '"':
+            out += "\\\"";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        default:
+            out += c;
+        }
+    }
+}
+
+// "source Camera 1" becomes scope="source",name="Camera 1"
+static void append_labels(std::string &out, const MetricsSnapshot &snapshot)
+{
+    size_t space = snapshot.scope.find(' ');
+
+    out += "scope=\"";
+    append_escaped(out, snapshot.scope.substr(0, space));
+    out += "\",name=\"";
+    if (space != std::string::npos) {
+        append_escaped(out, snapshot.scope.substr(space + 1));
+    }
+    out += "\"";
+}
+
+static void append_sample(std::string &out, const std::string &name, const MetricsSnapshot &snapshot,
+                          const char *extraLabels, const char *value)
+{
+    out += name;
+    out += "{";
+    append_labels(out, snapshot);
+    if (extraLabels != nullptr) {
+        out += ",";
+        out += extraLabels;
+    }
+    out += "} ";
+    out += value;
+    out += "\n";
+}
+
+static void append_type(std::string &out, const std::string &name, const char *type)
+{
+    out += "# TYPE ";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+}
+
+void MetricsExporter::render(const std::vector<MetricsSnapshot> &snapshots, bool openMetrics,
+                             std::string &out)
+{
+    char value[64];
+    char labels[128];
+
+    // The Prometheus text format names counters with their suffix,
+    // OpenMetrics without
+    auto counterFamily = [&](const std::string &name) {
+        append_type(out, openMetrics ? name : name + "_total", "counter");
+    };
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        std::string counter = metric_counter_name((MetricCounter)i);
+        if (counter.compare(0, 5, "drop_") == 0) {
+            continue;
+        }
+
+        std::string name = "ios_camera_" + counter;
+        counterFamily(name);
+        for (auto &snapshot : snapshots) {
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)snapshot.counters[i]);
+            append_sample(out, name + "_total", snapshot, nullptr, value);
+        }
+    }
+
+    counterFamily("ios_camera_dropped");
+    for (auto &snapshot : snapshots) {
+        for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+            const char *counter = metric_counter_name((MetricCounter)i);
+            if (strncmp(counter, "drop_", 5) != 0) {
+                continue;
+            }
+
+            snprintf(labels, sizeof(labels), "reason=\"%s\"", counter + 5);
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)snapshot.counters[i]);
+            append_sample(out, "ios_camera_dropped_total", snapshot, labels, value);
+        }
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        std::string name = std::string("ios_camera_") + metric_gauge_name((MetricGauge)i);
+
+        append_type(out, name, "gauge");
+        for (auto &snapshot : snapshots) {
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)snapshot.gauges[i]);
+            append_sample(out, name, snapshot, nullptr, value);
+        }
+
+        append_type(out, name + "_max", "gauge");
+        for (auto &snapshot : snapshots) {
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)snapshot.highs[i]);
+            append_sample(out, name + "_max", snapshot, nullptr, value);
+        }
+    }
+
+    append_type(out, "ios_camera_stage_seconds", "histogram");
+    if (openMetrics) {
+        out += "# UNIT ios_camera_stage_seconds seconds\n";
+    }
+
+    for (auto &snapshot : snapshots) {
+        for (int i = 0; i < METRIC_STAGE_COUNT; i++) {
+            auto &histogram = snapshot.stages[i];
+            const char *stage = metric_stage_name((MetricStage)i);
+
+            // Only the stages this scope records
+            if (histogram.count == 0) {
+                continue;
+            }
+
+            uint64_t cumulative = 0;
+            size_t bucket = 0;
+
+            for (double bound : stage_bounds) {
+                uint64_t boundNs = (uint64_t)(bound * 1e9);
+                while (bucket < histogram.buckets.size() &&
+                       HistogramSnapshot::bucketUpperBound(bucket) <= boundNs) {
+                    cumulative += histogram.buckets[bucket++];
+                }
+
+                snprintf(labels, sizeof(labels), "stage=\"%s\",le=\"%g\"", stage, bound);
+                snprintf(value, sizeof(value), "%llu", (unsigned long long)cumulative);
+                append_sample(out, "ios_camera_stage_seconds_bucket", snapshot, labels, value);
+            }
+
+            snprintf(labels, sizeof(labels), "stage=\"%s\",le=\"+Inf\"", stage);
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)histogram.count);
+            append_sample(out, "ios_camera_stage_seconds_bucket", snapshot, labels, value);
+
+            snprintf(labels, sizeof(labels), "stage=\"%s\"", stage);
+            append_sample(out, "ios_camera_stage_seconds_count", snapshot, labels, value);
+
+            snprintf(value, sizeof(value), "%.9f", histogram.sum / 1e9);
+            append_sample(out, "ios_camera_stage_seconds_sum", snapshot, labels, value);
+        }
+    }
+
+    if (openMetrics) {
+        out += "# EOF\n";
+    }
+}
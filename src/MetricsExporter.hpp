@@ -0,0 +1,88 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef MetricsExporter_hpp
+#define MetricsExporter_hpp
+
+#include <string>
+#include <vector>
+
+#include "Metrics.hpp"
+#include "Thread.hpp"
+
+enum class MetricsExportMode {
+    Off,
+    // HTTP on a port of 127.0.0.1, for Prometheus or a local agent
+    Http,
+    // HTTP on a unix socket
+    Unix,
+    // A file rewritten every few seconds, for node_exporter's textfile
+    // collector
+    File,
+};
+
+struct MetricsExporterConfig {
+    MetricsExportMode mode = MetricsExportMode::Off;
+    int port = 9464;
+    std::string path;
+    int intervalSeconds = 15;
+
+    // Read from metrics-exporter.json in the plugin's config folder, e.g.
+    //   {"mode": "http", "port": 9464}
+    //   {"mode": "unix", "path": "/run/obs/ios-camera.sock"}
+    //   {"mode": "file", "path": "/var/lib/node_exporter/ios-camera.prom", "interval": 15}
+    // The exporter stays off without it.
+    static MetricsExporterConfig load();
+};
+
+// Serves every metrics scope in the registry in the OpenMetrics text
+// format. It runs on its own low priority thread and handles one request
+// at a time with a reused buffer, so memory is bounded by the number of
+// scopes. A scrape only reads the metrics' atomics, it never waits for a
+// decoder.
+class MetricsExporter : private Thread
+{
+public:
+    MetricsExporter(const MetricsExporterConfig &config) : mConfig(config) { }
+    ~MetricsExporter();
+
+    void start();
+    void stop();
+
+    // Every scope as OpenMetrics, or the Prometheus text format that
+    // node_exporter reads when `openMetrics` is false
+    static void render(const std::vector<MetricsSnapshot> &snapshots,
+                       bool openMetrics, std::string &out);
+
+private:
+    void *run() override;
+
+    void serve();
+    void writeFiles();
+    void respond(int fd);
+    void collect();
+
+    MetricsExporterConfig mConfig;
+    int mListener = -1;
+
+    std::vector<MetricsSnapshot> mSnapshots;
+    std::string mBuffer;
+};
+
+#endif /* MetricsExporter_hpp */
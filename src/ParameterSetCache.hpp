@@ -0,0 +1,240 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef ParameterSetCache_hpp
+#define ParameterSetCache_hpp
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <obs.h>
+
+#include "nal-unit.h"
+#include "parameter-sets.h"
+
+enum class ParameterSetChange {
+    // Repeat of what we already had, phones send these before every IDR
+    None,
+    // The cache just got its first full set, the decoder can be configured
+    Complete,
+    // Different bytes, but the decoder can keep going
+    Updated,
+    // Resolution, profile or bit depth changed, recreate the decoder
+    Reinit,
+};
+
+// The most recent VPS / SPS / PPS of a stream, along with what they tell us
+// about it. One cache lives per device, stream and layer, so reconnecting
+// to the same phone can configure the decoder before the first picture
+// arrives.
+class ParameterSetCache
+{
+    std::mutex mMutex;
+
+    nal_codec mCodec = NAL_CODEC_UNKNOWN;
+
+    // NAL units without their start code
+    std::vector<uint8_t> mVps;
+    std::vector<uint8_t> mSps;
+    std::vector<uint8_t> mPps;
+
+    video_params mParams = {};
+    bool mHaveParams = false;
+
+public:
+
+    ParameterSetChange update(nal_codec codec, const nal_unit &nal) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (codec != mCodec) {
+            clearLocked();
+            mCodec = codec;
+        }
+
+        std::vector<uint8_t> *slot = slotFor(nal.kind);
+        if (slot == nullptr) {
+            return ParameterSetChange::None;
+        }
+
+        if (slot->size() == nal.size && memcmp(slot->data(), nal.data, nal.size) == 0) {
+            return ParameterSetChange::None;
+        }
+
+        bool wasComplete = isCompleteLocked();
+        slot->assign(nal.data, nal.data + nal.size);
+
+        bool reinit = false;
+
+        if (nal.kind == NAL_KIND_SPS) {
+            video_params params;
+            if (!video_params_parse(codec, nal.data, nal.size, &params)) {
+                blog(LOG_WARNING, "Could not parse %s SPS", nal_codec_name(codec));
+                mHaveParams = false;
+                return ParameterSetChange::Updated;
+            }
+
+            reinit = mHaveParams && video_params_need_reinit(&mParams, &params);
+            mParams = params;
+            mHaveParams = true;
+        }
+
+        if (!isCompleteLocked()) {
+            return ParameterSetChange::None;
+        }
+
+        if (!wasComplete || reinit) {
+            logParams();
+            return wasComplete ? ParameterSetChange::Reinit : ParameterSetChange::Complete;
+        }
+
+        return ParameterSetChange::Updated;
+    }
+
+    bool isComplete(nal_codec codec) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return codec == mCodec && isCompleteLocked();
+    }
+
+    nal_codec getCodec() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mCodec;
+    }
+
+    bool getParams(video_params *params) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        *params = mParams;
+        return mHaveParams;
+    }
+
+    std::vector<uint8_t> getParameterSet(nal_kind kind) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::vector<uint8_t> *slot = slotFor(kind);
+        return slot != nullptr ? *slot : std::vector<uint8_t>();
+    }
+
+    // The parameter sets as Annex-B, which is what FFmpeg expects in
+    // AVCodecContext.extradata for raw H.264 / HEVC.
+    std::vector<uint8_t> getExtradata() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::vector<uint8_t> extradata;
+
+        for (auto *set : {&mVps, &mSps, &mPps}) {
+            if (set->empty()) {
+                continue;
+            }
+            static const uint8_t startCode[] = {0, 0, 0, 1};
+            extradata.insert(extradata.end(), startCode, startCode + sizeof(startCode));
+            extradata.insert(extradata.end(), set->begin(), set->end());
+        }
+
+        return extradata;
+    }
+
+    // The parameter sets as the video packets the phone would send them in,
+    // for replaying into a freshly flushed decoder.
+    std::vector<std::vector<char>> getPackets() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::vector<std::vector<char>> packets;
+
+        if (!isCompleteLocked()) {
+            return packets;
+        }
+
+        for (auto *set : {&mVps, &mSps, &mPps}) {
+            if (set->empty()) {
+                continue;
+            }
+            std::vector<char> packet = {0, 0, 0, 1};
+            packet.insert(packet.end(), set->begin(), set->end());
+            packets.push_back(std::move(packet));
+        }
+
+        return packets;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        clearLocked();
+    }
+
+    // The cache for one video stream or layer of a device, by its tag, kept
+    // for the lifetime of the plugin so it survives reconnects.
+    static std::shared_ptr<ParameterSetCache> forDevice(const std::string &host, int port,
+                                                        uint32_t tag = 0) {
+        static std::mutex devicesMutex;
+        static std::map<std::string, std::shared_ptr<ParameterSetCache>> devices;
+
+        std::lock_guard<std::mutex> lock(devicesMutex);
+
+        auto &cache = devices[host + ":" + std::to_string(port) + "/" + std::to_string(tag)];
+        if (cache == nullptr) {
+            cache = std::make_shared<ParameterSetCache>();
+        }
+        return cache;
+    }
+
+private:
+
+    std::vector<uint8_t> *slotFor(nal_kind kind) {
+        switch (kind) {
+        case NAL_KIND_VPS:
+            return mCodec == NAL_CODEC_HEVC ? &mVps : nullptr;
+        case NAL_KIND_SPS:
+            return &mSps;
+        case NAL_KIND_PPS:
+            return &mPps;
+        default:
+            return nullptr;
+        }
+    }
+
+    bool isCompleteLocked() {
+        if (mCodec == NAL_CODEC_HEVC && mVps.empty()) {
+            return false;
+        }
+        return !mSps.empty() && !mPps.empty();
+    }
+
+    void clearLocked() {
+        mCodec = NAL_CODEC_UNKNOWN;
+        mVps.clear();
+        mSps.clear();
+        mPps.clear();
+        mHaveParams = false;
+    }
+
+    void logParams() {
+        if (!mHaveParams) {
+            return;
+        }
+
+        blog(LOG_INFO, "%s stream: %ux%u, profile %u, level %u, %u bit, %.2f fps, "
+             "colour %u/%u/%u %s range",
+             nal_codec_name(mCodec), mParams.width, mParams.height,
+             mParams.profile, mParams.level, mParams.bit_depth,
+             mParams.fps_den != 0 ? (double)mParams.fps_num / mParams.fps_den : 0.0,
+             mParams.colour_primaries, mParams.transfer_characteristics,
+             mParams.matrix_coefficients, mParams.full_range ? "full" : "limited");
+    }
+};
+
+#endif /* ParameterSetCache_hpp */
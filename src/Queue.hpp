@@ -28,11 +28,14 @@ class PacketItem
     std::vector<char> mPacket;
     int mType;
     int mTag;
+    uint64_t mTimestamp;
+    bool mPriming;
+    uint64_t mQueuedAt = 0;
     
 public:
-    PacketItem(std::vector<char> packet, int type, int tag): mPacket(packet), mType(type), mTag(tag) { }
+    PacketItem(std::vector<char> packet, int type, int tag, uint64_t timestamp, bool priming = false): mPacket(packet), mType(type), mTag(tag), mTimestamp(timestamp), mPriming(priming) { }
     
-    std::vector<char> getPacket() {
+    const std::vector<char> &getPacket() {
         return mPacket;
     }
     
@@ -44,9 +47,28 @@ public:
         return mTag;
     }
 
+    uint64_t getTimestamp() {
+        return mTimestamp;
+    }
+
+    // Replayed from the GOP cache to bring a decoder up to date, decoded
+    // but never shown
+    bool isPriming() {
+        return mPriming;
+    }
+
     int size() {
         return mPacket.size();
     }
+
+    // When the packet went into a decode queue, on the os_gettime_ns() clock
+    void setQueuedAt(uint64_t queuedAt) {
+        mQueuedAt = queuedAt;
+    }
+
+    uint64_t getQueuedAt() {
+        return mQueuedAt;
+    }
 };
 
 template <typename T> class WorkQueue
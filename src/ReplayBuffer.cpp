@@ -0,0 +1,311 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "ReplayBuffer.hpp"
+
+#include <algorithm>
+
+#include <obs.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+ReplayBuffer::~ReplayBuffer()
+{
+    if (mSaveThread.joinable()) {
+        mSaveThread.join();
+    }
+}
+
+void ReplayBuffer::setDurationSeconds(uint32_t seconds)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    uint64_t duration = (uint64_t)seconds * 1000000000;
+    if (duration == mDuration) {
+        return;
+    }
+
+    blog(LOG_INFO, "[obs-ios-camera-plugin] Keeping %u seconds of video for replays", seconds);
+    mDuration = duration;
+
+    if (duration == 0) {
+        clearLocked();
+    } else {
+        evict();
+    }
+}
+
+void ReplayBuffer::add(const std::vector<char> &packet, uint64_t timestamp)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mDuration == 0) {
+        return;
+    }
+
+    AccessUnitAssembler::AccessUnit unit;
+    bool configChanged = false;
+
+    bool complete = mAssembler.add(packet, timestamp, &unit, &configChanged);
+    if (configChanged) {
+        // A file only has one set of parameter sets
+        clearLocked();
+    }
+
+    if (complete) {
+        store(unit);
+    }
+}
+
+void ReplayBuffer::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    clearLocked();
+}
+
+size_t ReplayBuffer::bytes()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBytes;
+}
+
+void ReplayBuffer::clearLocked()
+{
+    mUnits.clear();
+    mKeyframes.clear();
+    mFirst = 0;
+    mBytes = 0;
+}
+
+void ReplayBuffer::store(AccessUnitAssembler::AccessUnit &unit)
+{
+    // The phone restarted its clock, the new pictures can't follow the old
+    // ones in a file
+    if (!mUnits.empty() && unit.timestamp < mUnits.back().timestamp) {
+        clearLocked();
+    }
+
+    // The buffer always starts at a random access point
+    if (mUnits.empty() && !unit.keyframe) {
+        return;
+    }
+
+    if (unit.keyframe) {
+        mKeyframes.push_back(mFirst + mUnits.size());
+    }
+
+    mBytes += unit.data.size();
+    mUnits.push_back({std::make_shared<const std::vector<uint8_t>>(std::move(unit.data)),
+                      unit.timestamp, unit.keyframe});
+
+    evict();
+}
+
+void ReplayBuffer::evict()
+{
+    if (mUnits.empty()) {
+        return;
+    }
+
+    uint64_t newest = mUnits.back().timestamp;
+    uint64_t cutoff = newest > mDuration ? newest - mDuration : 0;
+
+    // Drop the oldest GOP once the next one alone covers the duration
+    while (mKeyframes.size() > 1) {
+        uint64_t next = mKeyframes[1];
+        bool expired = mUnits[next - mFirst].timestamp <= cutoff;
+
+        if (!expired && mBytes <= REPLAY_BUFFER_MAX_BYTES) {
+            break;
+        }
+
+        for (; mFirst < next; mFirst++) {
+            mBytes -= mUnits.front().data->size();
+            mUnits.pop_front();
+        }
+        mKeyframes.pop_front();
+    }
+
+    if (mBytes > REPLAY_BUFFER_MAX_BYTES) {
+        // A single GOP that big, wait for the next keyframe
+        blog(LOG_INFO, "[obs-ios-camera-plugin] Replay buffer full at %zu bytes, waiting for a keyframe",
+             mBytes);
+        clearLocked();
+    }
+}
+
+bool ReplayBuffer::save(const std::string &path, uint32_t seconds)
+{
+    // The hotkey and the save_replay procedure come from different threads,
+    // only one of them gets to start a save
+    if (mSaving.exchange(true)) {
+        blog(LOG_WARNING, "[obs-ios-camera-plugin] Still saving the last replay, not saving %s",
+             path.c_str());
+        return false;
+    }
+
+    Snapshot snapshot;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (mUnits.empty()) {
+            mSaving = false;
+            return false;
+        }
+
+        // The last random access point at or before the start of the window
+        size_t start = 0;
+        if (seconds != 0) {
+            uint64_t window = (uint64_t)seconds * 1000000000;
+            uint64_t newest = mUnits.back().timestamp;
+            uint64_t from = newest > window ? newest - window : 0;
+
+            for (auto it = mKeyframes.rbegin(); it != mKeyframes.rend(); it++) {
+                if (mUnits[*it - mFirst].timestamp <= from) {
+                    start = *it - mFirst;
+                    break;
+                }
+            }
+        }
+
+        snapshot.codec = mAssembler.getCodec();
+        mAssembler.getParams(&snapshot.params);
+        snapshot.extradata = mAssembler.getExtradata();
+
+        // Only the pointers are copied, the pictures are shared
+        snapshot.units.assign(mUnits.begin() + start, mUnits.end());
+    }
+
+    if (mSaveThread.joinable()) {
+        mSaveThread.join();
+    }
+
+    mSaveThread = std::thread([this, path, snapshot = std::move(snapshot)]() {
+        write(path, snapshot);
+        mSaving = false;
+    });
+
+    return true;
+}
+
+bool ReplayBuffer::write(const std::string &path, const Snapshot &snapshot)
+{
+    char error[AV_ERROR_MAX_STRING_SIZE] = {};
+    AVFormatContext *format = nullptr;
+    AVPacket *packet = nullptr;
+    AVStream *stream = nullptr;
+    int64_t lastDts = INT64_MIN;
+    int ret;
+
+    ret = avformat_alloc_output_context2(&format, nullptr, nullptr, path.c_str());
+    if (ret < 0 || format == nullptr) {
+        av_strerror(ret, error, sizeof(error));
+        blog(LOG_ERROR, "[obs-ios-camera-plugin] Can't save a replay to %s: %s",
+             path.c_str(), error);
+        return false;
+    }
+
+    stream = avformat_new_stream(format, nullptr);
+    if (stream == nullptr) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    stream->time_base = av_make_q(1, 1000000);
+    stream->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    stream->codecpar->codec_id = snapshot.codec == NAL_CODEC_HEVC ? AV_CODEC_ID_HEVC
+                                                                  : AV_CODEC_ID_H264;
+    stream->codecpar->width = (int)snapshot.params.width;
+    stream->codecpar->height = (int)snapshot.params.height;
+
+    // Annex-B parameter sets, the muxers convert them to avcC / hvcC
+    stream->codecpar->extradata = (uint8_t *)av_mallocz(
+        snapshot.extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (stream->codecpar->extradata == nullptr) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    memcpy(stream->codecpar->extradata, snapshot.extradata.data(), snapshot.extradata.size());
+    stream->codecpar->extradata_size = (int)snapshot.extradata.size();
+
+    if (!(format->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&format->pb, path.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = avformat_write_header(format, nullptr);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    packet = av_packet_alloc();
+    if (packet == nullptr) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    for (auto &unit : snapshot.units) {
+        // The phone's encoder doesn't reorder pictures, pts == dts
+        int64_t dts = av_rescale_q((int64_t)(unit.timestamp - snapshot.units.front().timestamp),
+                                   av_make_q(1, 1000000000), stream->time_base);
+        dts = std::max(dts, lastDts + 1);
+        lastDts = dts;
+
+        // Not reference counted, libavformat makes its own copy
+        packet->data = (uint8_t *)unit.data->data();
+        packet->size = (int)unit.data->size();
+        packet->stream_index = stream->index;
+        packet->pts = dts;
+        packet->dts = dts;
+        packet->flags = unit.keyframe ? AV_PKT_FLAG_KEY : 0;
+
+        ret = av_interleaved_write_frame(format, packet);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = av_write_trailer(format);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    blog(LOG_INFO, "[obs-ios-camera-plugin] Saved a %.1f second replay to %s",
+         (snapshot.units.back().timestamp - snapshot.units.front().timestamp) / 1e9,
+         path.c_str());
+
+fail:
+    if (ret < 0) {
+        av_strerror(ret, error, sizeof(error));
+        blog(LOG_ERROR, "[obs-ios-camera-plugin] Failed to save a replay to %s: %s",
+             path.c_str(), error);
+    }
+
+    av_packet_free(&packet);
+    if (!(format->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&format->pb);
+    }
+    avformat_free_context(format);
+
+    return ret >= 0;
+}
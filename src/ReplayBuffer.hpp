@@ -0,0 +1,100 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef ReplayBuffer_hpp
+#define ReplayBuffer_hpp
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AccessUnitAssembler.hpp"
+
+// Five minutes of a 7 Mbps stream, the most the replay buffer will hold
+#define REPLAY_BUFFER_MAX_BYTES (256 * 1024 * 1024)
+
+// The last few seconds of video exactly as the phone encoded it, so an
+// instant replay can be saved without decoding or encoding anything.
+//
+// Packets are put back together into access units, one per picture, and
+// kept in timestamp order together with the index of every random access
+// point. Old GOPs are dropped whole so the buffer always starts at one.
+class ReplayBuffer
+{
+public:
+    ReplayBuffer() = default;
+    ~ReplayBuffer();
+
+    // How much video to keep, 0 turns the buffer off and empties it
+    void setDurationSeconds(uint32_t seconds);
+
+    // Called with every video packet the decoder is fed
+    void add(const std::vector<char> &packet, uint64_t timestamp);
+
+    void clear();
+
+    // Remux the last `seconds` (everything when 0) to `path`, starting at
+    // the nearest random access point before that. The container follows
+    // the file extension. The file is written on a background thread;
+    // returns false if there is nothing to save or a save is in progress.
+    bool save(const std::string &path, uint32_t seconds = 0);
+
+    size_t bytes();
+
+private:
+    struct AccessUnit {
+        // Annex-B, shared with the snapshots that are being saved
+        std::shared_ptr<const std::vector<uint8_t>> data;
+        uint64_t timestamp;
+        bool keyframe;
+    };
+
+    struct Snapshot {
+        nal_codec codec;
+        video_params params;
+        std::vector<uint8_t> extradata;
+        std::vector<AccessUnit> units;
+    };
+
+    void store(AccessUnitAssembler::AccessUnit &unit);
+    void evict();
+    void clearLocked();
+
+    static bool write(const std::string &path, const Snapshot &snapshot);
+
+    std::mutex mMutex;
+
+    std::deque<AccessUnit> mUnits;
+    // Sequence numbers of the random access points in mUnits, mFirst is
+    // the sequence number of mUnits.front()
+    std::deque<uint64_t> mKeyframes;
+    uint64_t mFirst = 0;
+    size_t mBytes = 0;
+    uint64_t mDuration = 0;
+
+    AccessUnitAssembler mAssembler;
+
+    std::thread mSaveThread;
+    std::atomic_bool mSaving = false;
+};
+
+#endif /* ReplayBuffer_hpp */
@@ -0,0 +1,395 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include "SharedFrameRing.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "The ring is shared between processes, its atomics can't use locks");
+
+#define SHARED_FRAME_PAGE_SIZE 4096
+#define SHARED_FRAME_PLANE_ALIGN 64
+
+static size_t align_up(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Not FUTEX_PRIVATE_FLAG, the waiters are in other processes
+static long futex(std::atomic<uint32_t> *address, int op, uint32_t value,
+                  const struct timespec *timeout)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(address), op, value,
+                   timeout, nullptr, 0);
+}
+
+// The formats ffmpeg-decode.c hands out
+static int plane_count(video_format format)
+{
+    switch (format) {
+    case VIDEO_FORMAT_NONE:
+        return 0;
+    case VIDEO_FORMAT_I420:
+        return 3;
+    case VIDEO_FORMAT_NV12:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+static uint32_t plane_rows(video_format format, uint32_t height, int plane)
+{
+    bool subsampled = format == VIDEO_FORMAT_I420 || format == VIDEO_FORMAT_NV12;
+    return plane > 0 && subsampled ? (height + 1) / 2 : height;
+}
+
+#pragma mark - Writer
+
+SharedFrameWriter::~SharedFrameWriter()
+{
+    if (mMapping != nullptr) {
+        munmap(mMapping, mSize);
+    }
+    if (mFd >= 0) {
+        close(mFd);
+    }
+}
+
+bool SharedFrameWriter::create(const std::string &name)
+{
+    mFd = memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mFd < 0) {
+        portal_error("Could not create the frame ring: %s", strerror(errno));
+        return false;
+    }
+
+    size_t dataOffset = align_up(sizeof(SharedFrameRingHeader), SHARED_FRAME_PAGE_SIZE);
+    mSize = dataOffset + (size_t)SHARED_FRAME_RING_SLOTS * SHARED_FRAME_SLOT_BYTES;
+
+    // The pages are only allocated once a frame is written to them
+    if (ftruncate(mFd, (off_t)mSize) < 0) {
+        portal_error("Could not size the frame ring: %s", strerror(errno));
+        return false;
+    }
+
+    void *mapping = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (mapping == MAP_FAILED) {
+        portal_error("Could not map the frame ring: %s", strerror(errno));
+        return false;
+    }
+    mMapping = (uint8_t *)mapping;
+
+    // Readers get the same fd, they must not be able to resize the ring
+    // or map it writable
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+#ifdef F_SEAL_FUTURE_WRITE
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    fcntl(mFd, F_ADD_SEALS, seals | F_SEAL_SEAL);
+
+    mHeader = new (mMapping) SharedFrameRingHeader();
+    mHeader->magic = SHARED_FRAME_RING_MAGIC;
+    mHeader->version = SHARED_FRAME_RING_VERSION;
+    mHeader->slotCount = SHARED_FRAME_RING_SLOTS;
+    mHeader->slotBytes = SHARED_FRAME_SLOT_BYTES;
+    mHeader->dataOffset = dataOffset;
+    mHeader->writerPid = (int32_t)getpid();
+
+    return true;
+}
+
+void SharedFrameWriter::output(const obs_source_frame *frame)
+{
+    if (mHeader == nullptr) {
+        return;
+    }
+
+    uint32_t index = mHeader->published.load(std::memory_order_relaxed);
+    size_t slotIndex = index % SHARED_FRAME_RING_SLOTS;
+    SharedFrameSlot *slot = &mHeader->slots[slotIndex];
+
+    uint32_t sequence = slot->sequence.load(std::memory_order_relaxed) + 1;
+    slot->sequence.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // A NULL frame tells the readers to clear their source
+    slot->format = VIDEO_FORMAT_NONE;
+    if (frame == nullptr) {
+        publish(slot, sequence);
+        return;
+    }
+
+    size_t base = mHeader->dataOffset + slotIndex * SHARED_FRAME_SLOT_BYTES;
+    size_t used = 0;
+
+    for (int plane = 0; plane < plane_count(frame->format); plane++) {
+        size_t bytes = (size_t)frame->linesize[plane] *
+                       plane_rows(frame->format, frame->height, plane);
+
+        if (used + bytes > SHARED_FRAME_SLOT_BYTES) {
+            portal_warn("A %ux%u frame doesn't fit the frame ring", frame->width,
+                        frame->height);
+            publish(slot, sequence);
+            return;
+        }
+
+        memcpy(mMapping + base + used, frame->data[plane], bytes);
+        slot->offset[plane] = base + used;
+        slot->linesize[plane] = frame->linesize[plane];
+        used += align_up(bytes, SHARED_FRAME_PLANE_ALIGN);
+    }
+
+    slot->width = frame->width;
+    slot->height = frame->height;
+    slot->timestamp = frame->timestamp;
+    memcpy(slot->colorMatrix, frame->color_matrix, sizeof(slot->colorMatrix));
+    memcpy(slot->colorRangeMin, frame->color_range_min, sizeof(slot->colorRangeMin));
+    memcpy(slot->colorRangeMax, frame->color_range_max, sizeof(slot->colorRangeMax));
+    slot->fullRange = frame->full_range;
+    slot->format = frame->format;
+
+    publish(slot, sequence);
+}
+
+void SharedFrameWriter::publish(SharedFrameSlot *slot, uint32_t sequence)
+{
+    slot->sequence.store(sequence + 1, std::memory_order_release);
+    mHeader->published.fetch_add(1, std::memory_order_release);
+
+    futex(&mHeader->published, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+#pragma mark - Reader
+
+SharedFrameReader::~SharedFrameReader()
+{
+    detach();
+}
+
+bool SharedFrameReader::attach(int fd)
+{
+    detach();
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(SharedFrameRingHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        portal_warn("Could not map the frame ring: %s", strerror(errno));
+        return false;
+    }
+
+    auto header = (SharedFrameRingHeader *)mapping;
+    if (header->magic != SHARED_FRAME_RING_MAGIC ||
+        header->version != SHARED_FRAME_RING_VERSION ||
+        header->slotCount != SHARED_FRAME_RING_SLOTS ||
+        header->dataOffset + (size_t)header->slotCount * header->slotBytes > size) {
+        portal_warn("The capture daemon's frame ring has an unknown layout");
+        munmap(mapping, size);
+        return false;
+    }
+
+    mMapping = (const uint8_t *)mapping;
+    mSize = size;
+    mHeader = header;
+    return true;
+}
+
+void SharedFrameReader::detach()
+{
+    if (mMapping != nullptr) {
+        munmap((void *)mMapping, mSize);
+    }
+
+    mMapping = nullptr;
+    mSize = 0;
+    mHeader = nullptr;
+}
+
+uint32_t SharedFrameReader::published()
+{
+    return mHeader->published.load(std::memory_order_acquire);
+}
+
+uint32_t SharedFrameReader::wait(uint32_t seen, uint32_t timeoutMs)
+{
+    uint32_t current = published();
+    if (current != seen) {
+        return current;
+    }
+
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+
+    futex(&mHeader->published, FUTEX_WAIT, seen, &timeout);
+    return published();
+}
+
+bool SharedFrameReader::read(uint32_t index, obs_source_frame *frame)
+{
+    SharedFrameSlot *slot = &mHeader->slots[index % SHARED_FRAME_RING_SLOTS];
+
+    uint32_t before = slot->sequence.load(std::memory_order_acquire);
+    if (before & 1) {
+        return false;
+    }
+
+    // Anything read from the slot may be torn until the sequence is found
+    // unchanged after the copy, so only the local copies are bounds checked
+    // and used.
+    memset(frame, 0, sizeof(*frame));
+    frame->format = (video_format)slot->format;
+    frame->width = slot->width;
+    frame->height = slot->height;
+    frame->timestamp = slot->timestamp;
+    memcpy(frame->color_matrix, slot->colorMatrix, sizeof(slot->colorMatrix));
+    memcpy(frame->color_range_min, slot->colorRangeMin, sizeof(slot->colorRangeMin));
+    memcpy(frame->color_range_max, slot->colorRangeMax, sizeof(slot->colorRangeMax));
+    frame->full_range = slot->fullRange != 0;
+
+    int planes = plane_count(frame->format);
+    size_t offsets[MAX_AV_PLANES];
+    size_t sizes[MAX_AV_PLANES];
+    size_t total = 0;
+
+    for (int plane = 0; plane < planes; plane++) {
+        offsets[plane] = slot->offset[plane];
+        frame->linesize[plane] = slot->linesize[plane];
+        sizes[plane] = (size_t)frame->linesize[plane] *
+                       plane_rows(frame->format, frame->height, plane);
+
+        if (offsets[plane] > mSize || sizes[plane] > mSize - offsets[plane]) {
+            return false;
+        }
+        total += sizes[plane];
+    }
+
+    if (mBuffer.size() < total) {
+        mBuffer.resize(total);
+    }
+
+    size_t position = 0;
+    for (int plane = 0; plane < planes; plane++) {
+        memcpy(mBuffer.data() + position, mMapping + offsets[plane], sizes[plane]);
+        frame->data[plane] = mBuffer.data() + position;
+        position += sizes[plane];
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence.load(std::memory_order_relaxed) != before) {
+        portal_warn("The capture daemon overwrote a frame while it was copied, "
+                    "OBS is falling behind");
+        return false;
+    }
+
+    return true;
+}
+
+bool SharedFrameReader::writerAlive()
+{
+    return kill(mHeader->writerPid, 0) == 0 || errno == EPERM;
+}
+
+#pragma mark - Handing out the ring
+
+std::string shared_frame_socket_path(const std::string &host, int port)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    std::string directory = runtime != nullptr && *runtime ? runtime : "/tmp";
+
+    std::string name = host;
+    std::replace(name.begin(), name.end(), '/', '_');
+
+    return directory + "/obs-ios-camera-" + name + "-" + std::to_string(port) + ".sock";
+}
+
+bool shared_frame_send_fd(int socket, int fd)
+{
+    char byte = 0;
+    struct iovec io = {&byte, 1};
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr message = {};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+    return sendmsg(socket, &message, MSG_NOSIGNAL) == 1;
+}
+
+int shared_frame_receive_fd(int socket)
+{
+    char byte;
+    struct iovec io = {&byte, 1};
+
+    char control[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr message = {};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    if (recvmsg(socket, &message, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header == nullptr || header->cmsg_level != SOL_SOCKET ||
+        header->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(header), sizeof(int));
+    return fd;
+}
@@ -0,0 +1,140 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef SharedFrameRing_hpp
+#define SharedFrameRing_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <obs.h>
+
+#include "VideoOutput.hpp"
+
+// Decoded frames shared between processes. The capture daemon writes them
+// into a memfd, and every OBS process showing the device maps it read-only
+// and copies the frames out of the mapping.
+//
+// There is one writer. Each slot is guarded by a sequence number that is odd
+// while the slot is being written. A reader checks it again after copying a
+// frame, and drops the copy if the writer came round to the slot meanwhile.
+// Readers sleep on a futex on the published count rather than poll.
+
+#define SHARED_FRAME_RING_MAGIC 0x5246534f4953424fULL // "OBSIOSFR"
+#define SHARED_FRAME_RING_VERSION 1
+#define SHARED_FRAME_RING_SLOTS 4
+
+// Room for a 4K frame in any format the decoder produces
+#define SHARED_FRAME_SLOT_BYTES (3840 * 2160 * 4)
+
+struct SharedFrameSlot {
+    std::atomic<uint32_t> sequence;
+
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t linesize[MAX_AV_PLANES];
+    // From the start of the mapping
+    uint64_t offset[MAX_AV_PLANES];
+    uint64_t timestamp;
+
+    float colorMatrix[16];
+    float colorRangeMin[3];
+    float colorRangeMax[3];
+    uint32_t fullRange;
+};
+
+struct SharedFrameRingHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint64_t slotBytes;
+    uint64_t dataOffset;
+    int32_t writerPid;
+
+    // Frames published so far, readers wait on it
+    std::atomic<uint32_t> published;
+
+    SharedFrameSlot slots[SHARED_FRAME_RING_SLOTS];
+};
+
+// Lives in the daemon, behind the decoders
+class SharedFrameWriter : public FrameSink
+{
+public:
+    ~SharedFrameWriter();
+
+    bool create(const std::string &name);
+
+    // Handed to readers over the daemon's socket
+    int getFd() { return mFd; }
+
+    // Called from the decoding thread
+    void output(const obs_source_frame *frame) override;
+
+private:
+    void publish(SharedFrameSlot *slot, uint32_t sequence);
+
+    int mFd = -1;
+    uint8_t *mMapping = nullptr;
+    size_t mSize = 0;
+    SharedFrameRingHeader *mHeader = nullptr;
+};
+
+class SharedFrameReader
+{
+public:
+    ~SharedFrameReader();
+
+    // Maps the ring the daemon sent, taking ownership of `fd`
+    bool attach(int fd);
+    void detach();
+    bool attached() { return mHeader != nullptr; }
+
+    uint32_t published();
+
+    // Sleeps until something past `seen` is published, or `timeoutMs` runs
+    // out. Returns the published count.
+    uint32_t wait(uint32_t seen, uint32_t timeoutMs);
+
+    // Copies frame `index` out of the mapping, `frame` points at the copy
+    // until the next call. Returns false if the writer overwrote it while it
+    // was copied, the writer does not wait for readers.
+    bool read(uint32_t index, obs_source_frame *frame);
+
+    bool writerAlive();
+
+private:
+    const uint8_t *mMapping = nullptr;
+    size_t mSize = 0;
+    SharedFrameRingHeader *mHeader = nullptr;
+
+    // The last frame read, only ever grows
+    std::vector<uint8_t> mBuffer;
+};
+
+// The unix socket the daemon for `host:port` hands out its ring on
+std::string shared_frame_socket_path(const std::string &host, int port);
+
+bool shared_frame_send_fd(int socket, int fd);
+int shared_frame_receive_fd(int socket);
+
+#endif /* SharedFrameRing_hpp */
@@ -0,0 +1,155 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef StreamStats_hpp
+#define StreamStats_hpp
+
+#include <memory>
+#include <mutex>
+
+#include <util/platform.h>
+
+#include "Metrics.hpp"
+
+// What the properties view shows about a running stream
+struct StreamStatsSummary {
+    // Over the last one to two seconds
+    double bitsPerSecond = 0;
+    double inputFps = 0;
+    double outputFps = 0;
+    uint64_t decodeP50 = 0;
+    uint64_t decodeP99 = 0;
+    uint64_t latencyP50 = 0;
+
+    uint64_t queueDepth = 0;
+    uint64_t queueDepthMax = 0;
+    uint64_t reconnects = 0;
+
+    // Totals since the source was created
+    MetricsSnapshot source;
+
+    // Totals for the layer of the camera the source shows, which every
+    // source showing it shares
+    MetricsSnapshot stream;
+
+    // Totals for the device
+    MetricsSnapshot connection;
+};
+
+// Turns metrics snapshots into rates and recent percentiles. A snapshot is
+// taken once a second from the video tick and the summary compares against
+// the one before that, so reading never touches the decode path beyond
+// the relaxed loads a snapshot does.
+class StreamStats
+{
+public:
+    // Called from the source's video_tick
+    void tick(float seconds, Metrics *source, const std::shared_ptr<Metrics> &stream,
+              const std::shared_ptr<Metrics> &connection) {
+        mElapsed += seconds;
+        if (mElapsed < 1.0f) {
+            return;
+        }
+        mElapsed = 0.0f;
+
+        Sample sample = take(source, stream, connection);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mOlder = std::move(mNewer);
+        mNewer = std::move(sample);
+    }
+
+    StreamStatsSummary summary(Metrics *source, const std::shared_ptr<Metrics> &stream,
+                               const std::shared_ptr<Metrics> &connection) {
+        Sample now = take(source, stream, connection);
+
+        Sample then;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            then = mOlder.time != 0 ? mOlder : mNewer;
+        }
+
+        StreamStatsSummary summary;
+        summary.queueDepth = now.stream.gauge(MetricGauge::DecodeQueueDepth);
+        summary.queueDepthMax = now.stream.high(MetricGauge::DecodeQueueDepth);
+        summary.reconnects = now.connection.counter(MetricCounter::Reconnects);
+
+        double seconds = (now.time - then.time) / 1e9;
+        if (then.time != 0 && seconds > 0) {
+            // A new connection or a layer switch starts from other counters
+            if (now.streamScope == then.streamScope) {
+                summary.bitsPerSecond = delta(now.stream, then.stream, MetricCounter::BytesReceived) * 8 / seconds;
+                summary.inputFps = delta(now.stream, then.stream, MetricCounter::Pictures) / seconds;
+
+                auto decode = now.stream.stage(MetricStage::Decode).since(then.stream.stage(MetricStage::Decode));
+                summary.decodeP50 = decode.percentile(0.5);
+                summary.decodeP99 = decode.percentile(0.99);
+            }
+
+            auto output = now.source.stage(MetricStage::Output).since(then.source.stage(MetricStage::Output));
+            auto latency = now.source.stage(MetricStage::EndToEnd).since(then.source.stage(MetricStage::EndToEnd));
+
+            summary.outputFps = output.count / seconds;
+            summary.latencyP50 = latency.percentile(0.5);
+        }
+
+        summary.source = std::move(now.source);
+        summary.stream = std::move(now.stream);
+        summary.connection = std::move(now.connection);
+        return summary;
+    }
+
+private:
+    struct Sample {
+        uint64_t time = 0;
+        MetricsSnapshot source;
+        MetricsSnapshot stream;
+        MetricsSnapshot connection;
+        const Metrics *streamScope = nullptr;
+    };
+
+    static Sample take(Metrics *source, const std::shared_ptr<Metrics> &stream,
+                       const std::shared_ptr<Metrics> &connection) {
+        Sample sample;
+        sample.time = os_gettime_ns();
+        sample.source = source->snapshot();
+        if (stream != nullptr) {
+            sample.stream = stream->snapshot();
+            sample.streamScope = stream.get();
+        }
+        if (connection != nullptr) {
+            sample.connection = connection->snapshot();
+        }
+        return sample;
+    }
+
+    static double delta(const MetricsSnapshot &now, const MetricsSnapshot &then, MetricCounter counter) {
+        uint64_t a = now.counter(counter);
+        uint64_t b = then.counter(counter);
+        return a >= b ? (double)(a - b) : 0.0;
+    }
+
+    float mElapsed = 0.0f;
+
+    std::mutex mMutex;
+    Sample mOlder;
+    Sample mNewer;
+};
+
+#endif /* StreamStats_hpp */
@@ -0,0 +1,304 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+
+#include <obs.h>
+
+struct TraceEvent {
+    // 2 * index + 2 once the event at `index` is written, odd while it is
+    // being written
+    std::atomic<uint64_t> seq = 0;
+    std::atomic<const char *> name = nullptr;
+    std::atomic<uint64_t> start = 0;
+    std::atomic<uint64_t> end = 0;
+    std::atomic<uint64_t> id = 0;
+    // Only set for async spans
+    std::atomic<uint64_t> asyncId = 0;
+    std::atomic<uint32_t> tid = 0;
+};
+
+// Names of threads that may still have events in a ring
+#define TRACE_MAX_THREAD_NAMES 256
+
+// Written by one thread, read by whoever dumps. Each event is guarded by
+// its sequence number, a reader skips events that were overwritten while
+// it copied them.
+class TraceRing
+{
+public:
+    void push(const char *name, uint64_t start, uint64_t end, uint64_t id, uint64_t asyncId) {
+        uint64_t index = mHead.load(std::memory_order_relaxed);
+        auto &event = mEvents[index % TRACE_RING_EVENTS];
+
+        event.seq.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        event.name.store(name, std::memory_order_relaxed);
+        event.start.store(start, std::memory_order_relaxed);
+        event.end.store(end, std::memory_order_relaxed);
+        event.id.store(id, std::memory_order_relaxed);
+        event.asyncId.store(asyncId, std::memory_order_relaxed);
+        event.tid.store(tid, std::memory_order_relaxed);
+
+        event.seq.store(2 * index + 2, std::memory_order_release);
+        mHead.store(index + 1, std::memory_order_release);
+    }
+
+    struct Copy {
+        const char *name;
+        uint64_t start;
+        uint64_t end;
+        uint64_t id;
+        uint64_t asyncId;
+        uint32_t tid;
+    };
+
+    void copy(std::vector<Copy> &out) {
+        uint64_t head = mHead.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        for (uint64_t index = first; index < head; index++) {
+            auto &event = mEvents[index % TRACE_RING_EVENTS];
+
+            uint64_t seq = event.seq.load(std::memory_order_acquire);
+            if (seq != 2 * index + 2) {
+                continue;
+            }
+
+            Copy copy = {
+                event.name.load(std::memory_order_relaxed),
+                event.start.load(std::memory_order_relaxed),
+                event.end.load(std::memory_order_relaxed),
+                event.id.load(std::memory_order_relaxed),
+                event.asyncId.load(std::memory_order_relaxed),
+                event.tid.load(std::memory_order_relaxed),
+            };
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (event.seq.load(std::memory_order_relaxed) == seq) {
+                out.push_back(copy);
+            }
+        }
+    }
+
+    // Set under the tracer's mutex before the owning thread records. The
+    // events of a thread that exited stay until they are overwritten.
+    uint32_t tid = 0;
+    bool retired = false;
+
+private:
+    std::atomic<uint64_t> mHead = 0;
+    TraceEvent mEvents[TRACE_RING_EVENTS];
+};
+
+std::atomic<int> Tracer::sEnabled = 0;
+
+static thread_local std::string thread_name;
+
+// Gives the ring back when its thread exits
+struct TraceRingHolder {
+    TraceRing *ring = nullptr;
+
+    ~TraceRingHolder() {
+        if (ring != nullptr) {
+            Tracer::shared().retire(ring);
+        }
+    }
+};
+
+static thread_local TraceRingHolder ring_holder;
+
+Tracer &Tracer::shared()
+{
+    static Tracer tracer;
+    return tracer;
+}
+
+Tracer::~Tracer()
+{
+    if (mDumpThread.joinable()) {
+        mDumpThread.join();
+    }
+}
+
+void Tracer::enable()
+{
+    if (sEnabled++ == 0) {
+        blog(LOG_INFO, "[obs-ios-camera-plugin] Pipeline tracing on");
+    }
+}
+
+void Tracer::disable()
+{
+    if (--sEnabled == 0) {
+        blog(LOG_INFO, "[obs-ios-camera-plugin] Pipeline tracing off");
+    }
+}
+
+TraceRing *Tracer::ringForThread()
+{
+    if (ring_holder.ring != nullptr) {
+        return ring_holder.ring;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    TraceRing *ring = nullptr;
+
+    for (auto &candidate : mRings) {
+        if (candidate->retired) {
+            ring = candidate.get();
+            break;
+        }
+    }
+
+    if (ring == nullptr) {
+        mRings.push_back(std::make_unique<TraceRing>());
+        ring = mRings.back().get();
+    }
+
+    ring->tid = mNextTid++;
+    ring->retired = false;
+
+    // Forget the oldest threads that are gone
+    for (auto it = mThreadNames.begin(); mThreadNames.size() >= TRACE_MAX_THREAD_NAMES && it != mThreadNames.end();) {
+        bool running = std::any_of(mRings.begin(), mRings.end(), [&](auto &r) {
+            return !r->retired && r->tid == it->first;
+        });
+        it = running ? std::next(it) : mThreadNames.erase(it);
+    }
+    mThreadNames[ring->tid] = thread_name.empty() ? "thread " + std::to_string(ring->tid) : thread_name;
+
+    ring_holder.ring = ring;
+    return ring;
+}
+
+void Tracer::retire(TraceRing *ring)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    ring->retired = true;
+}
+
+void Tracer::setThreadName(const std::string &name)
+{
+    thread_name = name;
+
+    if (ring_holder.ring != nullptr) {
+        auto &tracer = shared();
+        std::lock_guard<std::mutex> lock(tracer.mMutex);
+        tracer.mThreadNames[ring_holder.ring->tid] = name;
+    }
+}
+
+void Tracer::record(const char *name, uint64_t start, uint64_t end, uint64_t id, uint64_t asyncId)
+{
+    ringForThread()->push(name, start, end, id, asyncId);
+}
+
+static void append_json_string(std::string &out, const std::string &value)
+{
+    out += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        if ((unsigned char)c >= 0x20) {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+bool Tracer::dump(const std::string &path)
+{
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    std::vector<TraceRing::Copy> events;
+    char line[512];
+
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    for (auto &ring : mRings) {
+        ring->copy(events);
+    }
+
+    for (auto &name : mThreadNames) {
+        json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" +
+                std::to_string(name.first) + ",\"args\":{\"name\":";
+        append_json_string(json, name.second);
+        json += "}},\n";
+    }
+
+    lock.unlock();
+
+    for (auto &event : events) {
+        if (event.asyncId == 0) {
+            snprintf(line, sizeof(line),
+                     "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"args\":{\"id\":%" PRIu64 "}},\n",
+                     event.name, event.tid, event.start / 1000.0,
+                     (event.end - event.start) / 1000.0, event.id);
+        } else {
+            // Async spans are drawn on their own track per name
+            snprintf(line, sizeof(line),
+                     "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"b\",\"pid\":1,\"id\":%" PRIu64 ",\"ts\":%.3f,"
+                     "\"args\":{\"id\":%" PRIu64 "}},\n"
+                     "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"e\",\"pid\":1,\"id\":%" PRIu64 ",\"ts\":%.3f},\n",
+                     event.name, event.name, event.asyncId, event.start / 1000.0, event.id,
+                     event.name, event.name, event.asyncId, event.end / 1000.0);
+        }
+        json += line;
+    }
+
+    // Close the list without a trailing comma
+    json += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"obs-ios-camera-source\"}}\n]}\n";
+
+    FILE *file = os_fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        blog(LOG_WARNING, "[obs-ios-camera-plugin] Could not write trace to %s", path.c_str());
+        return false;
+    }
+
+    bool written = fwrite(json.data(), 1, json.size(), file) == json.size();
+    fclose(file);
+
+    blog(written ? LOG_INFO : LOG_WARNING, "[obs-ios-camera-plugin] %s trace of %zu spans to %s",
+         written ? "Wrote" : "Could not write", events.size(), path.c_str());
+    return written;
+}
+
+void Tracer::dumpLater(const std::string &path, uint32_t delayMs)
+{
+    if (mDumping.exchange(true)) {
+        return;
+    }
+
+    if (mDumpThread.joinable()) {
+        mDumpThread.join();
+    }
+
+    mDumpThread = std::thread([this, path, delayMs] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+        dump(path);
+        mDumping = false;
+    });
+}
@@ -0,0 +1,184 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef Trace_hpp
+#define Trace_hpp
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <util/platform.h>
+
+// Events kept per thread. A decode worker records a few hundred a second,
+// so this is the last half minute or so.
+#define TRACE_RING_EVENTS 8192
+
+// A gap this long between two frames of a source is a hitch worth keeping
+// a trace of
+#define TRACE_HITCH_NS (150 * 1000000ULL)
+#define TRACE_HITCH_COOLDOWN_NS (60 * 1000000000ULL)
+
+class TraceRing;
+struct TraceRingHolder;
+
+// Records spans of the pipeline, one per packet or frame and stage, into
+// per-thread rings, and writes them out as a Chrome trace (JSON), which
+// chrome://tracing and the Perfetto UI both open.
+//
+// Recording is off until a source turns it on. While it is off a span is
+// a relaxed load and a branch. While it is on a span is two clock reads
+// and a handful of relaxed stores into the calling thread's ring, no locks.
+class Tracer
+{
+public:
+    static Tracer &shared();
+
+    static bool enabled() {
+        return sEnabled.load(std::memory_order_relaxed) > 0;
+    }
+
+    // Counted, recording stays on while any source wants it
+    void enable();
+    void disable();
+
+    // A span on the calling thread. `name` has to be a string literal.
+    // `id` ties the spans of one packet or frame together, it is the
+    // packet's timestamp.
+    void span(const char *name, uint64_t start, uint64_t end, uint64_t id) {
+        if (enabled()) {
+            record(name, start, end, id, 0);
+        }
+    }
+
+    // A span that didn't happen on any one thread, like a queue wait
+    void asyncSpan(const char *name, uint64_t start, uint64_t end, uint64_t id) {
+        if (enabled()) {
+            record(name, start, end, id, mNextAsyncId.fetch_add(1, std::memory_order_relaxed));
+        }
+    }
+
+    // Name the calling thread in traces
+    static void setThreadName(const std::string &name);
+
+    // Write every ring to `path`, returns false if the file couldn't be
+    // written
+    bool dump(const std::string &path);
+
+    // Dump from a background thread after `delayMs`, so what happens just
+    // after a hitch is in the trace too. Ignored while a dump is pending.
+    void dumpLater(const std::string &path, uint32_t delayMs);
+
+    ~Tracer();
+
+private:
+    friend struct TraceRingHolder;
+
+    void record(const char *name, uint64_t start, uint64_t end, uint64_t id, uint64_t asyncId);
+    TraceRing *ringForThread();
+    void retire(TraceRing *ring);
+
+    static std::atomic<int> sEnabled;
+
+    std::mutex mMutex;
+    std::vector<std::unique_ptr<TraceRing>> mRings;
+    std::map<uint32_t, std::string> mThreadNames;
+    uint32_t mNextTid = 1;
+    std::atomic<uint64_t> mNextAsyncId = 1;
+
+    std::thread mDumpThread;
+    std::atomic<bool> mDumping = false;
+};
+
+// Times the enclosing scope. Does nothing unless tracing is on.
+class TraceSpan
+{
+public:
+    TraceSpan(const char *name, uint64_t id)
+        : mName(name), mId(id), mStart(Tracer::enabled() ? os_gettime_ns() : 0) { }
+
+    ~TraceSpan() {
+        if (mStart != 0) {
+            Tracer::shared().span(mName, mStart, os_gettime_ns(), mId);
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *mName;
+    uint64_t mId;
+    uint64_t mStart;
+};
+
+// Watches a source's output for gaps
+class HitchDetector
+{
+public:
+    // Called with the length of the gap, at most once a minute
+    std::function<void(uint64_t gapNs)> onHitch;
+
+    void output(uint64_t now) {
+        if (!Tracer::enabled() || mSuspended) {
+            mLast = 0;
+            return;
+        }
+
+        uint64_t last = mLast.exchange(now);
+        if (last == 0 || now - last < TRACE_HITCH_NS) {
+            return;
+        }
+
+        uint64_t reported = mLastReport;
+        if (reported != 0 && now - reported < TRACE_HITCH_COOLDOWN_NS) {
+            return;
+        }
+        mLastReport = now;
+
+        if (onHitch) {
+            onHitch(now - last);
+        }
+    }
+
+    // The source stopped on purpose, the next frame isn't a hitch
+    void reset() {
+        mLast = 0;
+    }
+
+    // Gaps aren't counted while suspended, nor the one until the first
+    // frame after it
+    void suspend(bool suspended) {
+        if (mSuspended.exchange(suspended) != suspended) {
+            reset();
+        }
+    }
+
+private:
+    std::atomic<bool> mSuspended = false;
+    std::atomic<uint64_t> mLast = 0;
+    std::atomic<uint64_t> mLastReport = 0;
+};
+
+#endif /* Trace_hpp */
@@ -22,6 +22,8 @@
 #include <obs.h>
 #include <vector>
 
+#include "DecodePool.hpp"
+
 class VideoDecoderCallback {
 public:
     virtual ~VideoDecoderCallback() {}
@@ -32,10 +34,15 @@ protected:
     virtual ~VideoDecoder() {};
 public:
     virtual void Init() = 0;
-    virtual void Input(std::vector<char> packet, int type, int tag) = 0;
+    // `timestamp` is the capture time on the os_gettime_ns() clock
+    virtual void Input(std::vector<char> packet, int type, int tag, uint64_t timestamp) = 0;
     virtual void Flush() = 0;
     virtual void Drain() = 0;
     virtual void Shutdown() = 0;
+    // How urgently the shared decode pool should get to this decoder
+    virtual void SetPriority(DecodePriority priority) = 0;
+    // Drop whatever is queued and decode `packets` first. Takes ownership.
+    virtual void Prime(std::vector<PacketItem *> packets) = 0;
 };
 
 #endif /* VideoDecoderCallback_h */
@@ -0,0 +1,236 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef VideoOutput_hpp
+#define VideoOutput_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <obs.h>
+#include <util/platform.h>
+
+#include "FrameMailbox.hpp"
+#include "JitterBuffer.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+enum class VideoOutputMode {
+    // Every frame goes to OBS, which buffers them itself
+    Direct,
+    // Only the newest frame is shown on each video tick
+    Latest,
+    // Frames are held back by the jitter buffer
+    Buffered,
+};
+
+// Anything decoded frames can be handed to
+class FrameSink
+{
+public:
+    virtual ~FrameSink() {}
+
+    // `frame` is only valid during the call, a NULL frame clears the output
+    virtual void output(const obs_source_frame *frame) = 0;
+
+    // Only keyframes come while the stream is in standby
+    virtual void setStandby(bool standby) {
+        UNUSED_PARAMETER(standby);
+    }
+};
+
+// Where the video decoders send their frames. Either straight to OBS,
+// through the latest-frame mailbox, or through the jitter buffer,
+// depending on the latency mode.
+class VideoOutput : public FrameSink
+{
+public:
+    VideoOutput(obs_source_t *source) : source(source), jitterBuffer(source) {
+        jitterBuffer.hitches = &hitches;
+    }
+
+    ~VideoOutput() {
+        jitterBuffer.stop();
+    }
+
+    // `frame` is copied, a NULL frame clears the source
+    void output(const obs_source_frame *frame) override {
+        if (frame == nullptr) {
+            clear();
+            return;
+        }
+
+        mWidth = frame->width;
+        mHeight = frame->height;
+
+        switch (mMode) {
+        case VideoOutputMode::Direct:
+            outputVideo(frame);
+            break;
+        case VideoOutputMode::Latest:
+            if (mailbox.publish(frame)) {
+                metrics->count(MetricCounter::DropMailbox);
+            }
+            break;
+        case VideoOutputMode::Buffered:
+            jitterBuffer.push(frame);
+            break;
+        }
+    }
+
+    // Called from the source's video_tick
+    void tick(float seconds) {
+        if (mMode != VideoOutputMode::Latest) {
+            return;
+        }
+
+        obs_source_frame *frame = mailbox.consume((uint64_t)(seconds * 1000000000.0));
+        if (frame != nullptr) {
+            outputVideo(frame);
+        }
+
+        mailbox.report(obs_get_video_frame_time());
+    }
+
+    // Only keyframes come in standby, the gaps between them aren't hitches
+    void setStandby(bool standby) override {
+        hitches.suspend(standby);
+    }
+
+    void clear() {
+        hitches.reset();
+        mailbox.clear();
+        jitterBuffer.clear();
+        obs_source_output_video(source, nullptr);
+    }
+
+    void setMode(VideoOutputMode mode, JitterBufferSettings settings) {
+        jitterBuffer.configure(settings);
+
+        if (mode == mMode) {
+            return;
+        }
+
+        if (mode == VideoOutputMode::Buffered) {
+            jitterBuffer.start();
+        }
+
+        VideoOutputMode previous = mMode.exchange(mode);
+
+        if (previous == VideoOutputMode::Buffered) {
+            jitterBuffer.stop();
+        } else if (previous == VideoOutputMode::Latest) {
+            mailbox.clear();
+        }
+    }
+
+    uint32_t getDelayMs() {
+        return mMode == VideoOutputMode::Buffered ? jitterBuffer.getDelayMs() : 0;
+    }
+
+    FrameMailbox &getMailbox() {
+        return mailbox;
+    }
+
+    void setMetrics(Metrics *metrics) {
+        this->metrics = metrics;
+        jitterBuffer.metrics = metrics;
+    }
+
+    // Gaps in the output, whichever path the frames take
+    HitchDetector hitches;
+
+    // Size of the last decoded frame
+    uint32_t getWidth() {
+        return mWidth;
+    }
+
+    uint32_t getHeight() {
+        return mHeight;
+    }
+
+private:
+    void outputVideo(const obs_source_frame *frame) {
+        uint64_t start = os_gettime_ns();
+        obs_source_output_video(source, frame);
+        uint64_t end = os_gettime_ns();
+
+        metrics->record(MetricStage::Output, end - start);
+        if (frame->timestamp <= end) {
+            metrics->record(MetricStage::EndToEnd, end - frame->timestamp);
+        }
+
+        Tracer::shared().span("obs_source_output_video", start, end, frame->timestamp);
+        hitches.output(end);
+    }
+
+    obs_source_t *source;
+    FrameMailbox mailbox;
+    JitterBuffer jitterBuffer;
+    std::atomic<VideoOutputMode> mMode = VideoOutputMode::Direct;
+    std::atomic<uint32_t> mWidth = 0;
+    std::atomic<uint32_t> mHeight = 0;
+    Metrics *metrics = Metrics::unregistered();
+};
+
+// Where the decoders of a device send their frames when more than one source
+// shows it. Every source gets its own copy through its own sink, the picture
+// is only decoded once.
+class VideoFanout : public FrameSink
+{
+public:
+    void add(FrameSink *output) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mOutputs.push_back(output);
+    }
+
+    // Once this returns no frame reaches `output` any more
+    void remove(FrameSink *output) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mOutputs.erase(std::remove(mOutputs.begin(), mOutputs.end(), output),
+                       mOutputs.end());
+    }
+
+    // `frame` is copied, a NULL frame clears every source
+    void output(const obs_source_frame *frame) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto output : mOutputs) {
+            output->output(frame);
+        }
+    }
+
+    // Only keyframes come while the session is in standby
+    void setStandby(bool standby) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto output : mOutputs) {
+            output->setStandby(standby);
+        }
+    }
+
+    void clear() {
+        output(nullptr);
+    }
+
+private:
+    std::mutex mMutex;
+    std::vector<FrameSink *> mOutputs;
+};
+
+#endif /* VideoOutput_hpp */
@@ -22,12 +22,17 @@
 
 VideoToolboxDecoder::VideoToolboxDecoder()
 {
-    waitingForSps = true;
-    waitingForPps = true;
+    codecPreference = NAL_CODEC_UNKNOWN;
+    codec = NAL_CODEC_UNKNOWN;
+    parameterSets = std::make_shared<ParameterSetCache>();
     mSession = NULL;
     mFormat = NULL;
 
     memset(&frame, 0, sizeof(frame));
+
+    mStream = DecodeStream::create([this](PacketItem *item) {
+        this->processQueuedItem(item);
+    });
 }
 
 VideoToolboxDecoder::~VideoToolboxDecoder()
@@ -37,8 +42,7 @@ VideoToolboxDecoder::~VideoToolboxDecoder()
 
 void VideoToolboxDecoder::Init()
 {
-    // Start the thread.
-    this->start();
+    // Packets are decoded on the shared pool, there is nothing to start
 }
 
 void VideoToolboxDecoder::Flush()
@@ -46,12 +50,35 @@ void VideoToolboxDecoder::Flush()
     std::lock_guard<std::mutex> lock (mMutex);
 
     // Clear the queue
-    while(this->mQueue.size() > 0) {
-        this->mQueue.remove();
-    }
+    mStream->clear();
 
     VTDecompressionSessionInvalidate(mSession);
     mSession = NULL;
+
+    // The next picture has to be a random access point again
+    keyframeGate.close(RecoveryReason::Reset);
+}
+
+void VideoToolboxDecoder::setCodec(nal_codec codec)
+{
+    if (this->codecPreference != codec) {
+        this->codecPreference = codec;
+        this->Flush();
+    }
+}
+
+void VideoToolboxDecoder::setParameterSetCache(std::shared_ptr<ParameterSetCache> cache)
+{
+    std::lock_guard<std::mutex> lock (mMutex);
+    parameterSets = cache;
+}
+
+void VideoToolboxDecoder::releaseFormatDescription()
+{
+    if (mFormat != NULL) {
+        CFRelease(mFormat);
+        mFormat = NULL;
+    }
 }
 
 void VideoToolboxDecoder::Drain()
@@ -61,45 +88,74 @@ void VideoToolboxDecoder::Drain()
 
 void VideoToolboxDecoder::Shutdown()
 {
-    std::lock_guard<std::mutex> lock (mMutex);
+    // Wait for the packet in progress before the session goes away, the
+    // decoding takes the lock as well.
+    mStream->stop();
 
-    mQueue.stop();
+    std::lock_guard<std::mutex> lock (mMutex);
 
     if (mSession != NULL) {
         VTDecompressionSessionInvalidate(mSession);
     }
 
     mSession = NULL;
+}
 
-    this->join();
+void VideoToolboxDecoder::Prime(std::vector<PacketItem *> packets)
+{
+    mStream->replace(packets);
 }
 
-void *VideoToolboxDecoder::run() {
+void VideoToolboxDecoder::SetPriority(DecodePriority priority)
+{
+    mStream->setPriority(priority);
+}
 
-    while (shouldStop() == false) {
-        PacketItem *item = (PacketItem *)mQueue.remove();
-        if (item != NULL) {
-            this->processPacketItem(item);
-            delete item;
-        }
+void VideoToolboxDecoder::processQueuedItem(PacketItem *item)
+{
+    uint64_t now = os_gettime_ns();
+    metrics->record(MetricStage::QueueWait, now - item->getQueuedAt());
+    Tracer::shared().asyncSpan("queue wait", item->getQueuedAt(), now, item->getTimestamp());
 
-        // Check queue lengths
+    this->processPacketItem(item);
+    delete item;
 
-        const int queueSize = mQueue.size();
-        if (queueSize > 5) {
-            blog(LOG_WARNING, "Video Toolbox: decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
+    // Check queue lengths
 
-            while (mQueue.size() > 0) {
-                PacketItem *item = (PacketItem *)mQueue.remove();
-                if (item != NULL) {
-                    blog(LOG_INFO, "Video Toolbox: dropping packet type=%d tag=%d size=%d", item->getType(), item->getTag(), item->size());
-                    delete item;
-                }
-            }
-        }
+    const int queueSize = mStream->size();
+    metrics->set(MetricGauge::DecodeQueueDepth, (uint64_t)queueSize);
+    if (queueSize > 5) {
+        portal_warn("Video Toolbox: decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
+
+        this->dropQueuedPackets();
+    }
+}
+
+void VideoToolboxDecoder::dropQueuedPackets()
+{
+    std::vector<PacketItem *> packets;
+
+    while (PacketItem *item = mStream->remove()) {
+        packets.push_back(item);
     }
 
-    return NULL;
+    // Everything from the most recent random access point onwards still
+    // decodes, older pictures are dropped apart from the parameter sets.
+    size_t resume = KeyframeGate::resumeIndex(codec, packets);
+
+    for (size_t i = 0; i < packets.size(); i++) {
+        PacketItem *item = packets[i];
+
+        if (i >= resume || KeyframeGate::isParameterSet(codec, item)) {
+            this->processPacketItem(item);
+        } else {
+            portal_info("Video Toolbox: dropping packet type=%d tag=%d size=%d", item->getType(), item->getTag(), item->size());
+            keyframeGate.dropped(codec, item);
+            metrics->count(MetricCounter::DropQueueOverload);
+        }
+
+        delete item;
+    }
 }
 
 static const char *video_toolbox_decode_video_name = "obs_camera_video_toolbox_decode_video";
@@ -112,76 +168,76 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
     OSStatus status = 0;
     uint32_t frameSize = packet.size();
 
-    if (frameSize < 3) {
+    if (frameSize <= NAL_LENGTH_PREFIX_SIZE) {
         return;
     }
 
     std::lock_guard<std::mutex> lock (mMutex);
 
-    int naluType = (packet[4] & 0x1F);
-
-    if (naluType == 7 || naluType == 8) {
-
-        // NALU is the SPS Parameter
-        if (naluType == 7) {
-
-            spsData = std::vector<char>(packet.begin() + 4, packet.end() + (frameSize - 4));
-
-            waitingForSps = false;
-            waitingForPps = true;
-
+    nal_codec wanted = codecPreference;
+    if (wanted == NAL_CODEC_UNKNOWN) {
+        wanted = nal_detect_codec((uint8_t *)packet.data(), frameSize);
+        if (wanted == NAL_CODEC_UNKNOWN) {
+            wanted = codec;
         }
+    }
 
-        // NALU is the PPS Parameter
-        if (naluType == 8) {
-
-            ppsData = std::vector<char>(packet.begin() + 4, packet.end() + (frameSize - 4));
-
-            waitingForPps = false;
-        }
+    if (wanted == NAL_CODEC_UNKNOWN) {
+        return;
+    }
 
-        if (!waitingForPps && !waitingForSps) {
+    if (wanted != codec) {
+        blog(LOG_INFO, "Video Toolbox: decoding %s video", nal_codec_name(wanted));
+        codec = wanted;
+        releaseFormatDescription();
+        keyframeGate.close(RecoveryReason::Reset);
+    }
 
-            const uint8_t * const parameterSetPointers[] = { (uint8_t *)spsData.data(), (uint8_t *)ppsData.data() };
-            const size_t parameterSetSizes[] = { spsData.size(), ppsData.size() };
+    // The protocol always hands us NALUs with a four byte start code
+    nal_unit nal;
+    if (!nal_parse(codec, (uint8_t *)packet.data() + NAL_LENGTH_PREFIX_SIZE,
+                   frameSize - NAL_LENGTH_PREFIX_SIZE, &nal)) {
+        return;
+    }
 
-            status = CMVideoFormatDescriptionCreateFromH264ParameterSets(kCFAllocatorDefault,
-                                                                         2, /* count of parameter sets */
-                                                                         parameterSetPointers,
-                                                                         parameterSetSizes,
-                                                                         NAL_LENGTH_PREFIX_SIZE,
-                                                                         &mFormat);
+    bool resumed = false;
+    if (!standby.admit(nal, &resumed)) {
+        metrics->count(MetricCounter::DropStandby);
+        return;
+    }
 
-            if (status != noErr) {
-                blog(LOG_INFO, "Failed to create format description");
-                mFormat = NULL;
-            } else {
+    if (resumed) {
+        // Pictures were skipped, the next keyframe is the first one that
+        // decodes cleanly
+        keyframeGate.close(RecoveryReason::Reset);
+    }
 
-                if (mSession == NULL) {
-                    this->createDecompressionSession();
-                } else {
+    RecoveryRequest request;
+    if (!keyframeGate.admit(codec, nal, &request)) {
+        // Skip pictures that can't be decoded and ask for a keyframe
+        metrics->count(MetricCounter::DropUndecodable);
+        if (onRecoveryNeeded) {
+            onRecoveryNeeded(request);
+        }
+        return;
+    }
 
-                    bool needNewDecompSession = (VTDecompressionSessionCanAcceptFormatDescription(mSession, mFormat) == false);
-                    if(needNewDecompSession) {
-                        blog(LOG_INFO, "Created Decompression session");
-                        this->createDecompressionSession();
-                    }
-                }
+    if (nal_is_parameter_set(&nal)) {
+        // Phones repeat the parameter sets before every IDR, only build a
+        // new format description when they actually changed.
+        auto change = parameterSets->update(codec, nal);
+        if (change == ParameterSetChange::Reinit && mSession != NULL) {
+            // The pixel buffer pool was sized for the old stream
+            VTDecompressionSessionInvalidate(mSession);
+            mSession = NULL;
+        }
 
+        if (change != ParameterSetChange::None || mFormat == NULL) {
+            if (parameterSets->isComplete(codec)) {
+                this->createFormatDescription();
             }
-
-        } else {
-            return;
         }
 
-    }
-
-    // Ensure that
-    if (ppsData.size() < 1 || spsData.size() < 1) {
-        return;
-    }
-
-    if (waitingForSps || waitingForPps) {
         return;
     }
 
@@ -189,12 +245,11 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
         return;
     }
 
-    // This decoder only supports these two frames
-    if (naluType != 1 && naluType != 5) {
+    // This decoder only supports picture NALUs
+    if (!nal_is_vcl(&nal)) {
         return;
     }
 
-
     if (mSession == NULL) {
         this->createDecompressionSession();
     }
@@ -202,47 +257,21 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
     // Create the sample data for the decoder
 
     CMBlockBufferRef blockBuffer = NULL;
-    long blockLength = 0;
-
-    // type 5 is an IDR frame NALU. The SPS and PPS NALUs should always be followed by an IDR (or IFrame) NALU, as far as I know
-    if (naluType == 5) {
-
-        blockLength = frameSize;
-
-        // replace the start code header on this NALU with its size.
-        // AVCC format requires that you do this.
-        // htonl converts the unsigned int from host to network byte order
-        uint32_t dataLength32 = htonl (blockLength - 4);
-        memcpy(packet.data(), &dataLength32, sizeof (uint32_t));
-
-        // create a block buffer from the IDR NALU
-        status = CMBlockBufferCreateWithMemoryBlock(NULL, packet.data(),  // memoryBlock to hold buffered data
-                                                    blockLength,  // block length of the mem block in bytes.
-                                                    kCFAllocatorNull, NULL,
-                                                    0, // offsetToData
-                                                    blockLength,   // dataLength of relevant bytes, starting at offsetToData
-                                                    0, &blockBuffer);
-
-    }
-
-    // NALU type 1 is non-IDR (or PFrame) picture
-    if (naluType == 1) {
-        // non-IDR frames do not have an offset due to SPS and PSS, so the approach
-        // is similar to the IDR frames just without the offset
-        blockLength = frameSize;
-
-        // again, replace the start header with the size of the NALU
-        uint32_t dataLength32 = htonl (blockLength - 4);
-        memcpy (packet.data(), &dataLength32, sizeof (uint32_t));
-
-        status = CMBlockBufferCreateWithMemoryBlock(NULL, packet.data(),  // memoryBlock to hold data. If NULL, block will be alloc when needed
-                                                    blockLength,  // overall length of the mem block in bytes
-                                                    kCFAllocatorNull, NULL,
-                                                    0,     // offsetToData
-                                                    blockLength,  // dataLength of relevant data bytes, starting at offsetToData
-                                                    0, &blockBuffer);
-
-    }
+    long blockLength = frameSize;
+
+    // replace the start code header on this NALU with its size.
+    // AVCC / HVCC format requires that you do this.
+    // htonl converts the unsigned int from host to network byte order
+    uint32_t dataLength32 = htonl (blockLength - NAL_LENGTH_PREFIX_SIZE);
+    memcpy(packet.data(), &dataLength32, sizeof (uint32_t));
+
+    // create a block buffer from the NALU
+    status = CMBlockBufferCreateWithMemoryBlock(NULL, packet.data(),  // memoryBlock to hold buffered data
+                                                blockLength,  // block length of the mem block in bytes.
+                                                kCFAllocatorNull, NULL,
+                                                0, // offsetToData
+                                                blockLength,   // dataLength of relevant bytes, starting at offsetToData
+                                                0, &blockBuffer);
 
     // now create our sample buffer from the block buffer,
     if (status != noErr) {
@@ -254,10 +283,6 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
         return;
     }
 
-    if (!mFormat) {
-        return;
-    }
-
     // here I'm not bothering with any timing specifics since in this case we displayed all frames immediately
     CMSampleBufferRef sampleBuffer = NULL;
     const size_t sampleSize = blockLength;
@@ -274,33 +299,109 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
                                   &sampleSize,
                                   &sampleBuffer);
 
+    CFRelease(blockBuffer);
+
     if (sampleBuffer != NULL) {
-        VTDecodeFrameFlags flags = 0;
+        // Primed pictures only have to end up in the reference buffers
+        VTDecodeFrameFlags flags = packetItem->isPriming() ? kVTDecodeFrame_DoNotOutputFrame : 0;
         VTDecodeInfoFlags flagOut;
 
         profile_start(video_toolbox_decode_video_name);
 
-        auto now = os_gettime_ns();
+        // The capture time comes back to the output callback
+        auto timestamp = packetItem->getTimestamp();
 
-        VTDecompressionSessionDecodeFrame(mSession, sampleBuffer, flags,
-                                          (void*)now, &flagOut);
+        // Synchronous, this includes copying the picture out in the callback
+        uint64_t decodeStart = os_gettime_ns();
+        status = VTDecompressionSessionDecodeFrame(mSession, sampleBuffer, flags,
+                                                   (void*)timestamp, &flagOut);
+        uint64_t decodeEnd = os_gettime_ns();
+        metrics->record(MetricStage::Decode, decodeEnd - decodeStart);
+        Tracer::shared().span("VTDecompressionSessionDecodeFrame", decodeStart, decodeEnd, timestamp);
 
         CFRelease(sampleBuffer);
 
+        if (status != noErr) {
+            portal_warn("Video Toolbox: error decoding video (%d)", (int)status);
+
+            keyframeGate.close(RecoveryReason::DecodeError);
+            if (onRecoveryNeeded) {
+                onRecoveryNeeded({RecoveryReason::DecodeError, 0, 0});
+            }
+        }
+
         profile_end(video_toolbox_decode_video_name);
     }
 }
 
+void VideoToolboxDecoder::createFormatDescription()
+{
+    OSStatus status = 0;
+    CMVideoFormatDescriptionRef format = NULL;
+
+    auto vpsData = parameterSets->getParameterSet(NAL_KIND_VPS);
+    auto spsData = parameterSets->getParameterSet(NAL_KIND_SPS);
+    auto ppsData = parameterSets->getParameterSet(NAL_KIND_PPS);
+
+    if (codec == NAL_CODEC_HEVC) {
+        if (__builtin_available(macOS 10.13, *)) {
+            const uint8_t * const parameterSetPointers[] = { (uint8_t *)vpsData.data(), (uint8_t *)spsData.data(), (uint8_t *)ppsData.data() };
+            const size_t parameterSetSizes[] = { vpsData.size(), spsData.size(), ppsData.size() };
+
+            status = CMVideoFormatDescriptionCreateFromHEVCParameterSets(kCFAllocatorDefault,
+                                                                         3, /* count of parameter sets */
+                                                                         parameterSetPointers,
+                                                                         parameterSetSizes,
+                                                                         NAL_LENGTH_PREFIX_SIZE,
+                                                                         NULL,
+                                                                         &format);
+        } else {
+            blog(LOG_WARNING, "Video Toolbox: HEVC requires macOS 10.13 or newer");
+            return;
+        }
+    } else {
+        const uint8_t * const parameterSetPointers[] = { (uint8_t *)spsData.data(), (uint8_t *)ppsData.data() };
+        const size_t parameterSetSizes[] = { spsData.size(), ppsData.size() };
+
+        status = CMVideoFormatDescriptionCreateFromH264ParameterSets(kCFAllocatorDefault,
+                                                                     2, /* count of parameter sets */
+                                                                     parameterSetPointers,
+                                                                     parameterSetSizes,
+                                                                     NAL_LENGTH_PREFIX_SIZE,
+                                                                     &format);
+    }
+
+    if (status != noErr) {
+        blog(LOG_INFO, "Failed to create format description");
+        return;
+    }
+
+    releaseFormatDescription();
+    mFormat = format;
+
+    if (mSession == NULL) {
+        this->createDecompressionSession();
+    } else {
+
+        bool needNewDecompSession = (VTDecompressionSessionCanAcceptFormatDescription(mSession, mFormat) == false);
+        if(needNewDecompSession) {
+            blog(LOG_INFO, "Created Decompression session");
+            VTDecompressionSessionInvalidate(mSession);
+            this->createDecompressionSession();
+        }
+    }
+}
+
 
 
-void VideoToolboxDecoder::Input(std::vector<char> packet, int type, int tag)
+void VideoToolboxDecoder::Input(std::vector<char> packet, int type, int tag, uint64_t timestamp)
 {
     // Create a new packet item and enqueue it.
-    PacketItem *item = new PacketItem(packet, type, tag);
-    this->mQueue.add(item);
+    PacketItem *item = new PacketItem(packet, type, tag, timestamp);
+    mStream->add(item);
 }
 
-void VideoToolboxDecoder::OutputFrame(CVPixelBufferRef pixelBufferRef)
+void VideoToolboxDecoder::OutputFrame(CVPixelBufferRef pixelBufferRef, uint64_t timestamp)
 {
     CVImageBufferRef     image = pixelBufferRef;
     //        obs_source_frame *frame = frame;
@@ -311,13 +412,19 @@ void VideoToolboxDecoder::OutputFrame(CVPixelBufferRef pixelBufferRef)
     // kCMTimeRoundingMethod_Default);
     // frame->timestamp = target_pts_nano.value;
 
-    if (!update_frame(source, &frame, image, mFormat)) {
+    if (output == nullptr) {
+        return;
+    }
+
+    if (!update_frame(nullptr, &frame, image, mFormat)) {
         // Send blank video
-        obs_source_output_video(source, nullptr);
+        output->output(nullptr);
         return;
     }
 
-    obs_source_output_video(source, &frame);
+    frame.timestamp = timestamp;
+    output->output(&frame);
+    metrics->count(MetricCounter::Frames);
 
     CVPixelBufferUnlockBaseAddress(image, kCVPixelBufferLock_ReadOnly);
 }
@@ -331,19 +438,22 @@ DecompressionSessionDecodeFrameCallback(void *decompressionOutputRefCon,
                                         CMTime presentationTimeStamp,
                                         CMTime presentationDuration)
 {
-    UNUSED_PARAMETER(sourceFrameRefCon);
     UNUSED_PARAMETER(presentationTimeStamp);
     UNUSED_PARAMETER(presentationDuration);
 
     VideoToolboxDecoder* decoder = static_cast<VideoToolboxDecoder*>(decompressionOutputRefCon);
 
     if (status != noErr || !imageBuffer) {
-        blog(LOG_INFO, "VideoToolbox decoder returned no image");
+        // Asked for with kVTDecodeFrame_DoNotOutputFrame when priming
+        if (!(infoFlags & kVTDecodeInfo_FrameDropped)) {
+            portal_info("VideoToolbox decoder returned no image");
+        }
+        return;
     } else if (infoFlags & kVTDecodeInfo_FrameDropped) {
-        blog(LOG_INFO, "VideoToolbox dropped frame");
+        portal_info("VideoToolbox dropped frame");
     }
 
-    decoder->OutputFrame(imageBuffer);
+    decoder->OutputFrame(imageBuffer, (uint64_t)sourceFrameRefCon);
 }
 
 void VideoToolboxDecoder::createDecompressionSession()
@@ -368,6 +478,21 @@ void VideoToolboxDecoder::createDecompressionSession()
     CFDictionarySetValue(destinationPixelBufferAttributes, kCVPixelBufferPixelFormatTypeKey, number);
     CFRelease(number);
 
+    // Size the pixel buffer pool from the SPS up front
+    video_params params;
+    if (parameterSets->getParams(&params)) {
+        int width = (int)params.width;
+        int height = (int)params.height;
+
+        number = CFNumberCreate(NULL, kCFNumberSInt32Type, &width);
+        CFDictionarySetValue(destinationPixelBufferAttributes, kCVPixelBufferWidthKey, number);
+        CFRelease(number);
+
+        number = CFNumberCreate(NULL, kCFNumberSInt32Type, &height);
+        CFDictionarySetValue(destinationPixelBufferAttributes, kCVPixelBufferHeightKey, number);
+        CFRelease(number);
+    }
+
     // Format Pixel Buffer Attributes
     CFMutableDictionaryRef videoDecoderSpecification;
     videoDecoderSpecification = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
@@ -396,7 +521,6 @@ bool VideoToolboxDecoder::update_frame(obs_source_t *capture, obs_source_frame *
     // video_format    format = format_from_subtype(fourcc);
     CMVideoDimensions dims = CMVideoFormatDescriptionGetDimensions(formatDesc);
 
-    frame->timestamp = os_gettime_ns();
     frame->width    = dims.width;
     frame->height   = dims.height;
     frame->format   = VIDEO_FORMAT_BGRA;
@@ -21,15 +21,22 @@
 #include <obs.h>
 #include <chrono>
 #include <vector>
+#include <functional>
 #include <util/platform.h>
 
 #include <VideoToolbox/VideoToolbox.h>
 
 #include "Queue.hpp"
-#include "Thread.hpp"
 #include "VideoDecoder.h"
+#include "KeyframeGate.hpp"
+#include "ParameterSetCache.hpp"
+#include "DecoderStandby.hpp"
+#include "VideoOutput.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+#include "logging.h"
 
-class VideoToolboxDecoder: public VideoDecoder, private Thread
+class VideoToolboxDecoder: public VideoDecoder
 {
 public:
     VideoToolboxDecoder();
@@ -37,36 +44,58 @@ public:
 
     void Init() override;
     
-    void Input(std::vector<char> packet, int type, int tag) override;
+    void Input(std::vector<char> packet, int type, int tag, uint64_t timestamp) override;
     
     void Flush() override;
     void Drain() override;
     void Shutdown() override;
+    void SetPriority(DecodePriority priority) override;
+    void Prime(std::vector<PacketItem *> packets) override;
+
+    // NAL_CODEC_UNKNOWN detects the codec from the parameter sets
+    void setCodec(nal_codec codec);
+
+    // Where the parameter sets of the current device are kept
+    void setParameterSetCache(std::shared_ptr<ParameterSetCache> cache);
+
+    // Only decode keyframes while the source isn't in the program
+    void setStandby(bool standby) { this->standby.set(standby); }
     
-    void OutputFrame(CVPixelBufferRef pixelBufferRef);
+    void OutputFrame(CVPixelBufferRef pixelBufferRef, uint64_t timestamp);
         
     bool update_frame(obs_source_t *capture, obs_source_frame *frame, CVImageBufferRef imageBufferRef, CMVideoFormatDescriptionRef formatDesc);
     
-    // The OBS Source to update.
-    obs_source_t *source;
+    // Where decoded frames go
+    FrameSink *output = nullptr;
+
+    // The source's metrics, set before the first packet
+    Metrics *metrics = Metrics::unregistered();
+
+    // Called from the decoding thread whenever a picture can't be decoded
+    // until the phone sends a keyframe.
+    std::function<void(const RecoveryRequest &request)> onRecoveryNeeded;
     
 private:
     
-    void *run() override; // Thread
+    void processQueuedItem(PacketItem *packetItem);
     void processPacketItem(PacketItem *packetItem);
+    void dropQueuedPackets();
     
     void createDecompressionSession();
+    void createFormatDescription();
+    void releaseFormatDescription();
     
     CMVideoFormatDescriptionRef mFormat;
     VTDecompressionSessionRef mSession;
     
-    bool waitingForSps;
-    bool waitingForPps;
-    
-    std::vector<char> spsData;
-    std::vector<char> ppsData;
+    std::shared_ptr<ParameterSetCache> parameterSets;
+
+    std::atomic<nal_codec> codecPreference;
+    nal_codec codec;
+    KeyframeGate keyframeGate;
+    DecoderStandby standby;
     
-    WorkQueue<PacketItem *> mQueue;
+    std::shared_ptr<DecodeStream> mStream;
     std::mutex mMutex;
     
     obs_source_frame frame;
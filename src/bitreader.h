@@ -0,0 +1,128 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// MSB first bit reader over an RBSP (emulation prevention bytes removed).
+// Reading past the end yields zeros and sets `overrun`.
+struct bitreader {
+    const uint8_t *data;
+    size_t size;
+    size_t bit;
+    bool overrun;
+};
+
+// Copy a NAL unit payload into `dst` with the emulation prevention bytes
+// (the 0x03 in 0x00 0x00 0x03) removed. At most `dst_size` bytes are written,
+// which is plenty for headers that only need the first few bytes.
+static inline size_t nal_unescape(const uint8_t *src, size_t size, uint8_t *dst,
+                                  size_t dst_size)
+{
+    size_t zeros = 0;
+    size_t out = 0;
+
+    for (size_t i = 0; i < size && out < dst_size; i++) {
+        if (zeros >= 2 && src[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+
+        zeros = src[i] == 0 ? zeros + 1 : 0;
+        dst[out++] = src[i];
+    }
+
+    return out;
+}
+
+static inline void br_init(struct bitreader *br, const uint8_t *data,
+                           size_t size)
+{
+    br->data = data;
+    br->size = size;
+    br->bit = 0;
+    br->overrun = false;
+}
+
+static inline uint32_t br_read_bit(struct bitreader *br)
+{
+    if (br->bit >= br->size * 8) {
+        br->overrun = true;
+        return 0;
+    }
+
+    uint32_t value = (br->data[br->bit >> 3] >> (7 - (br->bit & 7))) & 1;
+    br->bit++;
+    return value;
+}
+
+static inline uint32_t br_read_bits(struct bitreader *br, int count)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < count; i++)
+        value = (value << 1) | br_read_bit(br);
+    return value;
+}
+
+static inline void br_skip_bits(struct bitreader *br, size_t count)
+{
+    br->bit += count;
+    if (br->bit > br->size * 8) {
+        br->bit = br->size * 8;
+        br->overrun = true;
+    }
+}
+
+// Unsigned Exp-Golomb, ue(v)
+static inline uint32_t br_read_ue(struct bitreader *br)
+{
+    int leading_zeros = 0;
+
+    while (br_read_bit(br) == 0) {
+        if (br->overrun || ++leading_zeros > 31) {
+            br->overrun = true;
+            return 0;
+        }
+    }
+
+    if (leading_zeros == 0)
+        return 0;
+
+    return ((1u << leading_zeros) - 1) + br_read_bits(br, leading_zeros);
+}
+
+// Signed Exp-Golomb, se(v)
+static inline int32_t br_read_se(struct bitreader *br)
+{
+    uint32_t value = br_read_ue(br);
+
+    if (value & 1)
+        return (int32_t)((value + 1) / 2);
+    return -(int32_t)(value / 2);
+}
+
+#ifdef __cplusplus
+}
+#endif
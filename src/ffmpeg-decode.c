@@ -17,8 +17,8 @@
 
 #include "ffmpeg-decode.h"
 #include "obs-ffmpeg-compat.h"
-#include <obs-avc.h>
 #include <libavutil/pixdesc.h>
+#include <util/platform.h>
 
 enum AVHWDeviceType hw_priority[] = {
         AV_HWDEVICE_TYPE_D3D11VA, AV_HWDEVICE_TYPE_DXVA2,
@@ -73,11 +73,66 @@ static void init_hw_decoder(struct ffmpeg_decode *d)
     }
 }
 
-int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id, bool hw)
+static enum video_colorspace convert_colorspace(uint8_t matrix_coefficients)
+{
+    switch (matrix_coefficients)
+    {
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:
+            return VIDEO_CS_601;
+        default:
+            return VIDEO_CS_709;
+    }
+}
+
+// Slice threads don't add a frame of latency the way frame threads do
+static int decode_thread_count(const struct video_params *params)
+{
+    int threads = 1;
+
+    if (params->height > 1080)
+        threads = 4;
+    else if (params->height > 720)
+        threads = 2;
+
+    int cores = os_get_logical_cores();
+    return threads < cores ? threads : cores;
+}
+
+static void configure_video(struct ffmpeg_decode *decode,
+                            const struct video_params *params)
+{
+    AVCodecContext *c = decode->decoder;
+
+    c->width = c->coded_width = (int)params->width;
+    c->height = c->coded_height = (int)params->height;
+    c->profile = (int)params->profile;
+    c->level = (int)params->level;
+
+    c->color_range = params->full_range ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+    c->color_primaries = (enum AVColorPrimaries)params->colour_primaries;
+    c->color_trc = (enum AVColorTransferCharacteristic)params->transfer_characteristics;
+    c->colorspace = (enum AVColorSpace)params->matrix_coefficients;
+
+    if (params->fps_num && params->fps_den)
+        c->framerate = av_make_q((int)params->fps_num, (int)params->fps_den);
+
+    if (!decode->hw) {
+        c->thread_type = FF_THREAD_SLICE;
+        c->thread_count = decode_thread_count(params);
+    }
+
+    decode->colorspace = convert_colorspace(params->matrix_coefficients);
+}
+
+static int decode_init(struct ffmpeg_decode *decode, enum AVCodecID id, bool hw,
+                       const struct video_params *params,
+                       const uint8_t *extradata, size_t extradata_size)
 {
     int ret;
 
     memset(decode, 0, sizeof(*decode));
+    decode->colorspace = VIDEO_CS_709;
 
     decode->codec = avcodec_find_decoder(id);
     if (!decode->codec)
@@ -90,6 +145,17 @@ int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id, bool hw)
         init_hw_decoder(decode);
     }
 
+    if (extradata && extradata_size) {
+        decode->decoder->extradata = av_mallocz(extradata_size + INPUT_BUFFER_PADDING_SIZE);
+        if (decode->decoder->extradata) {
+            memcpy(decode->decoder->extradata, extradata, extradata_size);
+            decode->decoder->extradata_size = (int)extradata_size;
+        }
+    }
+
+    if (params)
+        configure_video(decode, params);
+
     ret = avcodec_open2(decode->decoder, decode->codec, NULL);
     if (ret < 0)
     {
@@ -97,8 +163,9 @@ int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id, bool hw)
         return ret;
     }
 
-    // skip random stuff (mostly SEIs generated by VT)
-    decode->decoder->skip_frame = AVDISCARD_NONREF;
+    // Non-reference pictures are only skipped while the canvas can't
+    // show them, see ffmpeg_decode_set_skip_frame
+    decode->decoder->skip_frame = AVDISCARD_DEFAULT;
 
     decode->decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
     decode->decoder->flags2 |= AV_CODEC_FLAG2_FAST;
@@ -114,11 +181,42 @@ int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id, bool hw)
     return 0;
 }
 
+int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id, bool hw)
+{
+    return decode_init(decode, id, hw, NULL, NULL, 0);
+}
+
+int ffmpeg_decode_init_video(struct ffmpeg_decode *decode, enum AVCodecID id, bool hw,
+                             const struct video_params *params,
+                             const uint8_t *extradata, size_t extradata_size)
+{
+    return decode_init(decode, id, hw, params, extradata, extradata_size);
+}
+
+void ffmpeg_decode_set_skip_frame(struct ffmpeg_decode *decode,
+                                  enum AVDiscard skip)
+{
+    if (decode->decoder && decode->decoder->skip_frame != skip)
+        decode->decoder->skip_frame = skip;
+}
+
+void ffmpeg_decode_set_skip_filters(struct ffmpeg_decode *decode,
+                                    enum AVDiscard loop_filter,
+                                    enum AVDiscard idct)
+{
+    if (!decode->decoder)
+        return;
+
+    decode->decoder->skip_loop_filter = loop_filter;
+    decode->decoder->skip_idct = idct;
+}
+
 void ffmpeg_decode_free(struct ffmpeg_decode *decode)
 {
     if (decode->decoder)
     {
         avcodec_close(decode->decoder);
+        av_freep(&decode->decoder->extradata);
         av_free(decode->decoder);
     }
 
@@ -310,7 +408,8 @@ bool ffmpeg_decode_video(struct ffmpeg_decode *decode,
     packet.size = (int)size;
     packet.pts = *ts;
 
-    if (decode->codec->id == AV_CODEC_ID_H264 && obs_avc_keyframe(data, size))
+    enum nal_codec codec = ffmpeg_decode_nal_codec(decode);
+    if (codec != NAL_CODEC_UNKNOWN && nal_keyframe(codec, data, size))
     {
         packet.flags |= AV_PKT_FLAG_KEY;
     }
@@ -351,9 +450,12 @@ bool ffmpeg_decode_video(struct ffmpeg_decode *decode,
         return true;
 
     AVFrame *targetFrame = receiveFrame;
+    decode->download_ns = 0;
     if (decode->hw) {
         if (decode->hw_frame->format == decode->hw_format) {
+            uint64_t download_start = os_gettime_ns();
             ret = av_hwframe_transfer_data(decode->frame, decode->hw_frame, 0);
+            decode->download_ns = os_gettime_ns() - download_start;
 
             if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
                 return true;
@@ -385,14 +487,14 @@ bool ffmpeg_decode_video(struct ffmpeg_decode *decode,
 
         range = frame->full_range ? VIDEO_RANGE_FULL : VIDEO_RANGE_PARTIAL;
 
-        success = video_format_get_parameters(VIDEO_CS_709,
+        success = video_format_get_parameters(decode->colorspace,
                                               range, frame->color_matrix,
                                               frame->color_range_min, frame->color_range_max);
         if (!success)
         {
             blog(LOG_ERROR, "Failed to get video format "
                  "parameters for video format %u",
-                 VIDEO_CS_709);
+                 decode->colorspace);
             return false;
         }
     }
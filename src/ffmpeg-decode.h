@@ -36,6 +36,9 @@ extern "C" {
 #pragma warning(pop)
 #endif
 
+#include "nal-unit.h"
+#include "parameter-sets.h"
+
 struct ffmpeg_decode
 {
 	AVCodecContext *decoder;
@@ -51,11 +54,32 @@ struct ffmpeg_decode
 	AVFrame *hw_frame;
 	AVBufferRef *hw_ctx;
 	enum AVPixelFormat hw_format;
+
+	// Time the last picture spent being copied out of GPU memory
+	uint64_t download_ns;
+
+	// from the SPS when the decoder was configured up front
+	enum video_colorspace colorspace;
 };
 
 extern int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id, bool hw);
+
+// Open a video decoder that already knows the stream. The parameter sets go
+// in as Annex-B extradata, so it is ready before the first IDR arrives.
+extern int ffmpeg_decode_init_video(struct ffmpeg_decode *decode, enum AVCodecID id, bool hw,
+									const struct video_params *params,
+									const uint8_t *extradata, size_t extradata_size);
 extern void ffmpeg_decode_free(struct ffmpeg_decode *decode);
 
+// Which pictures the decoder may throw away, can change between packets
+extern void ffmpeg_decode_set_skip_frame(struct ffmpeg_decode *decode,
+									 enum AVDiscard skip);
+
+// Which pictures may be decoded without the loop filter, or without IDCT
+extern void ffmpeg_decode_set_skip_filters(struct ffmpeg_decode *decode,
+										   enum AVDiscard loop_filter,
+										   enum AVDiscard idct);
+
 extern bool ffmpeg_decode_audio(struct ffmpeg_decode *decode,
 								uint8_t *data, size_t size,
 								struct obs_source_audio *audio,
@@ -71,6 +95,30 @@ static inline bool ffmpeg_decode_valid(struct ffmpeg_decode *decode)
 	return decode->decoder != NULL;
 }
 
+static inline enum AVCodecID ffmpeg_codec_id(enum nal_codec codec)
+{
+	switch (codec) {
+	case NAL_CODEC_H264:
+		return AV_CODEC_ID_H264;
+	case NAL_CODEC_HEVC:
+		return AV_CODEC_ID_HEVC;
+	default:
+		return AV_CODEC_ID_NONE;
+	}
+}
+
+static inline enum nal_codec ffmpeg_decode_nal_codec(struct ffmpeg_decode *decode)
+{
+	switch (decode->codec->id) {
+	case AV_CODEC_ID_H264:
+		return NAL_CODEC_H264;
+	case AV_CODEC_ID_HEVC:
+		return NAL_CODEC_HEVC;
+	default:
+		return NAL_CODEC_UNKNOWN;
+	}
+}
+
 #ifdef __cplusplus
 }
 #endif
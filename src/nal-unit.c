@@ -0,0 +1,344 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "nal-unit.h"
+#include "bitreader.h"
+
+#include <string.h>
+
+enum {
+    H264_NAL_SLICE = 1,
+    H264_NAL_IDR_SLICE = 5,
+    H264_NAL_SEI = 6,
+    H264_NAL_SPS = 7,
+    H264_NAL_PPS = 8,
+    H264_NAL_AUD = 9,
+};
+
+enum {
+    HEVC_NAL_RASL_N = 8,
+    HEVC_NAL_RASL_R = 9,
+    HEVC_NAL_RSV_VCL_N14 = 14,
+    HEVC_NAL_BLA_W_LP = 16,
+    HEVC_NAL_RSV_IRAP_23 = 23,
+    HEVC_NAL_RSV_VCL_31 = 31,
+    HEVC_NAL_VPS = 32,
+    HEVC_NAL_SPS = 33,
+    HEVC_NAL_PPS = 34,
+    HEVC_NAL_AUD = 35,
+    HEVC_NAL_SEI_PREFIX = 39,
+    HEVC_NAL_SEI_SUFFIX = 40,
+};
+
+#define SEI_USER_DATA_UNREGISTERED 5
+
+// A timestamp SEI is tiny, nothing past this is of interest
+#define MAX_SEI_SIZE 64
+
+const uint8_t NAL_TIMESTAMP_SEI_UUID[16] = {
+    0x6f, 0x62, 0x73, 0x2d, 0x69, 0x6f, 0x73, 0x2d,
+    0x63, 0x61, 0x6d, 0x2d, 0x70, 0x74, 0x73, 0x31,
+};
+
+static const uint8_t *find_start_code(const uint8_t *p, const uint8_t *end)
+{
+    for (; p + 3 <= end; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+
+    return end;
+}
+
+static bool parse_h264(const uint8_t *data, struct nal_unit *nal)
+{
+    int type = data[0] & 0x1f;
+    int ref_idc = (data[0] >> 5) & 0x3;
+
+    nal->type = type;
+    nal->reference = ref_idc != 0;
+
+    switch (type) {
+    case H264_NAL_SLICE:
+        nal->kind = NAL_KIND_SLICE;
+        break;
+    case H264_NAL_IDR_SLICE:
+        nal->kind = NAL_KIND_IRAP;
+        break;
+    case H264_NAL_SEI:
+        nal->kind = NAL_KIND_SEI;
+        break;
+    case H264_NAL_SPS:
+        nal->kind = NAL_KIND_SPS;
+        break;
+    case H264_NAL_PPS:
+        nal->kind = NAL_KIND_PPS;
+        break;
+    case H264_NAL_AUD:
+        nal->kind = NAL_KIND_AUD;
+        break;
+    default:
+        nal->kind = NAL_KIND_OTHER;
+        break;
+    }
+
+    return true;
+}
+
+static bool parse_hevc(const uint8_t *data, size_t size,
+                       struct nal_unit *nal)
+{
+    // HEVC has a two byte header:
+    // forbidden_zero_bit(1) nal_unit_type(6) nuh_layer_id(6)
+    // nuh_temporal_id_plus1(3)
+    if (size < 2)
+        return false;
+
+    int type = (data[0] >> 1) & 0x3f;
+    int temporal_id_plus1 = data[1] & 0x7;
+
+    if (temporal_id_plus1 == 0)
+        return false;
+
+    nal->type = type;
+    nal->reference = true;
+    nal->temporal_id = temporal_id_plus1 - 1;
+
+    if (type <= HEVC_NAL_RSV_VCL_31) {
+        if (type >= HEVC_NAL_BLA_W_LP && type <= HEVC_NAL_RSV_IRAP_23) {
+            nal->kind = NAL_KIND_IRAP;
+        } else {
+            nal->kind = NAL_KIND_SLICE;
+
+            // Even types below RSV_VCL_N14 are sub-layer non-reference
+            // pictures (TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N, ...).
+            // Pictures on higher sub-layers can still reference them, which
+            // only the SPS can rule out, see nal_apply_sub_layers().
+            nal->sub_layer_non_reference =
+                type <= HEVC_NAL_RSV_VCL_N14 && (type & 1) == 0;
+
+            nal->skippable_leading = type == HEVC_NAL_RASL_N ||
+                                     type == HEVC_NAL_RASL_R;
+        }
+        return true;
+    }
+
+    switch (type) {
+    case HEVC_NAL_VPS:
+        nal->kind = NAL_KIND_VPS;
+        break;
+    case HEVC_NAL_SPS:
+        nal->kind = NAL_KIND_SPS;
+        break;
+    case HEVC_NAL_PPS:
+        nal->kind = NAL_KIND_PPS;
+        break;
+    case HEVC_NAL_AUD:
+        nal->kind = NAL_KIND_AUD;
+        break;
+    case HEVC_NAL_SEI_PREFIX:
+    case HEVC_NAL_SEI_SUFFIX:
+        nal->kind = NAL_KIND_SEI;
+        break;
+    default:
+        nal->kind = NAL_KIND_OTHER;
+        break;
+    }
+
+    return true;
+}
+
+bool nal_parse(enum nal_codec codec, const uint8_t *data, size_t size,
+               struct nal_unit *nal)
+{
+    memset(nal, 0, sizeof(*nal));
+
+    if (!data || size < 1 || (data[0] & 0x80) != 0)
+        return false;
+
+    nal->data = data;
+    nal->size = size;
+
+    switch (codec) {
+    case NAL_CODEC_H264:
+        return parse_h264(data, nal);
+    case NAL_CODEC_HEVC:
+        return parse_hevc(data, size, nal);
+    default:
+        return false;
+    }
+}
+
+bool nal_next(enum nal_codec codec, const uint8_t **pos, const uint8_t *end,
+              struct nal_unit *nal)
+{
+    const uint8_t *start = find_start_code(*pos, end);
+
+    while (start < end) {
+        start += 3;
+
+        const uint8_t *next = find_start_code(start, end);
+        const uint8_t *nal_end = next;
+
+        // a four byte start code belongs to the next NAL unit
+        if (nal_end < end && nal_end > start && nal_end[-1] == 0)
+            nal_end--;
+
+        *pos = next;
+
+        if (nal_end > start &&
+            nal_parse(codec, start, nal_end - start, nal))
+            return true;
+
+        start = next;
+    }
+
+    *pos = end;
+    return false;
+}
+
+bool nal_parse_annexb(enum nal_codec codec, const uint8_t *data, size_t size,
+                      struct nal_unit *nal)
+{
+    // Only the header is looked at, so don't scan for the end of the unit
+    const uint8_t *end = data + size;
+    const uint8_t *start = find_start_code(data, end);
+
+    if (start + 3 >= end)
+        return false;
+
+    return nal_parse(codec, start + 3, end - start - 3, nal);
+}
+
+bool nal_keyframe(enum nal_codec codec, const uint8_t *data, size_t size)
+{
+    const uint8_t *pos = data;
+    const uint8_t *end = data + size;
+    struct nal_unit nal;
+
+    while (nal_next(codec, &pos, end, &nal)) {
+        if (nal.kind == NAL_KIND_IRAP)
+            return true;
+        if (nal.kind == NAL_KIND_SLICE)
+            return false;
+    }
+
+    return false;
+}
+
+bool nal_first_slice(enum nal_codec codec, const struct nal_unit *nal)
+{
+    // first_mb_in_slice is ue(v), so it is 0 exactly when its first bit is
+    // set. HEVC starts with first_slice_segment_in_pic_flag.
+    size_t header = codec == NAL_CODEC_HEVC ? 2 : 1;
+
+    if (!nal_is_vcl(nal) || nal->size <= header)
+        return false;
+
+    return (nal->data[header] & 0x80) != 0;
+}
+
+enum nal_codec nal_detect_codec(const uint8_t *data, size_t size)
+{
+    const uint8_t *end = data + size;
+    const uint8_t *start = find_start_code(data, end);
+
+    if (start + 5 > end)
+        return NAL_CODEC_UNKNOWN;
+
+    uint8_t b0 = start[3];
+    uint8_t b1 = start[4];
+
+    // HEVC VPS / SPS / PPS headers are 0x40 0x01, 0x42 0x01 and
+    // 0x44 0x01. As H.264 headers those would be reserved or data
+    // partitioning types which iOS never produces.
+    if ((b0 == 0x40 || b0 == 0x42 || b0 == 0x44) && b1 == 0x01)
+        return NAL_CODEC_HEVC;
+
+    int h264_type = b0 & 0x1f;
+    if ((b0 & 0x80) == 0 &&
+        (h264_type == H264_NAL_SPS || h264_type == H264_NAL_PPS))
+        return NAL_CODEC_H264;
+
+    return NAL_CODEC_UNKNOWN;
+}
+
+bool nal_parse_timestamp_sei(enum nal_codec codec, const struct nal_unit *nal,
+                             uint64_t *timestamp)
+{
+    uint8_t rbsp[MAX_SEI_SIZE];
+
+    if (nal->kind != NAL_KIND_SEI)
+        return false;
+
+    size_t header_size = codec == NAL_CODEC_HEVC ? 2 : 1;
+    if (nal->size <= header_size)
+        return false;
+
+    size_t size = nal_unescape(nal->data + header_size,
+                               nal->size - header_size, rbsp, sizeof(rbsp));
+    size_t pos = 0;
+
+    // An SEI NAL unit can hold several messages, each starting with
+    // ff-extended payload type and size
+    while (pos < size && rbsp[pos] != 0x80) {
+        uint32_t type = 0;
+        uint32_t payload_size = 0;
+
+        while (pos < size && rbsp[pos] == 0xff)
+            type += rbsp[pos++];
+        if (pos >= size)
+            return false;
+        type += rbsp[pos++];
+
+        while (pos < size && rbsp[pos] == 0xff)
+            payload_size += rbsp[pos++];
+        if (pos >= size)
+            return false;
+        payload_size += rbsp[pos++];
+
+        if (payload_size > size - pos)
+            return false;
+
+        if (type == SEI_USER_DATA_UNREGISTERED && payload_size >= 16 + 8 &&
+            memcmp(rbsp + pos, NAL_TIMESTAMP_SEI_UUID, 16) == 0) {
+            uint64_t value = 0;
+            for (int i = 0; i < 8; i++)
+                value = (value << 8) | rbsp[pos + 16 + i];
+
+            *timestamp = value;
+            return value != 0;
+        }
+
+        pos += payload_size;
+    }
+
+    return false;
+}
+
+const char *nal_codec_name(enum nal_codec codec)
+{
+    switch (codec) {
+    case NAL_CODEC_H264:
+        return "H.264";
+    case NAL_CODEC_HEVC:
+        return "HEVC";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,134 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum nal_codec {
+    NAL_CODEC_UNKNOWN = 0,
+    NAL_CODEC_H264,
+    NAL_CODEC_HEVC,
+};
+
+// Codec independent classification of a NAL unit
+enum nal_kind {
+    NAL_KIND_OTHER = 0,
+    NAL_KIND_VPS,
+    NAL_KIND_SPS,
+    NAL_KIND_PPS,
+    NAL_KIND_SEI,
+    NAL_KIND_AUD,
+    NAL_KIND_SLICE, // VCL NAL that is not a random access point
+    NAL_KIND_IRAP,  // IDR (H.264), IDR / CRA / BLA (HEVC)
+};
+
+struct nal_unit {
+    enum nal_kind kind;
+
+    // The codec specific nal_unit_type
+    int type;
+
+    // Whether later pictures may reference this one. Dropping a
+    // reference NAL means everything up to the next IRAP is undecodable.
+    // HEVC sub-layer non-reference pictures count as references until
+    // nal_apply_sub_layers() says otherwise.
+    bool reference;
+
+    // HEVC TemporalId and whether the type is one of the _N types, which
+    // higher temporal sub-layers can still reference. Zero for H.264.
+    int temporal_id;
+    bool sub_layer_non_reference;
+
+    // HEVC RASL pictures can't be decoded when decoding starts at the
+    // CRA they lead.
+    bool skippable_leading;
+
+    // Points at the NAL header, the start code is not included.
+    const uint8_t *data;
+    size_t size;
+};
+
+static inline bool nal_is_parameter_set(const struct nal_unit *nal)
+{
+    return nal->kind == NAL_KIND_VPS || nal->kind == NAL_KIND_SPS ||
+           nal->kind == NAL_KIND_PPS;
+}
+
+static inline bool nal_is_vcl(const struct nal_unit *nal)
+{
+    return nal->kind == NAL_KIND_SLICE || nal->kind == NAL_KIND_IRAP;
+}
+
+// An HEVC _N picture is only unused for reference when it is on the highest
+// temporal sub-layer, sps_max_sub_layers_minus1 of the active SPS.
+static inline void nal_apply_sub_layers(struct nal_unit *nal,
+                                        uint32_t max_sub_layers_minus1)
+{
+    if (nal->sub_layer_non_reference &&
+        (uint32_t)nal->temporal_id == max_sub_layers_minus1)
+        nal->reference = false;
+}
+
+// Classify the NAL unit starting at `data` (header first, no start code).
+extern bool nal_parse(enum nal_codec codec, const uint8_t *data, size_t size,
+                      struct nal_unit *nal);
+
+// Iterate over the NAL units of an Annex-B buffer. `pos` is advanced past
+// the returned unit, returns false once the buffer is exhausted.
+extern bool nal_next(enum nal_codec codec, const uint8_t **pos,
+                     const uint8_t *end, struct nal_unit *nal);
+
+// Classify the first NAL unit of an Annex-B buffer. The returned size runs
+// to the end of the buffer.
+extern bool nal_parse_annexb(enum nal_codec codec, const uint8_t *data,
+                             size_t size, struct nal_unit *nal);
+
+// Codec aware replacement for obs_avc_keyframe.
+extern bool nal_keyframe(enum nal_codec codec, const uint8_t *data,
+                         size_t size);
+
+// Whether a VCL NAL unit holds the first slice of its picture, which is
+// where one access unit ends and the next begins.
+extern bool nal_first_slice(enum nal_codec codec, const struct nal_unit *nal);
+
+// Work out the codec of an Annex-B buffer from its leading parameter set.
+// Returns NAL_CODEC_UNKNOWN if the buffer doesn't start with one.
+extern enum nal_codec nal_detect_codec(const uint8_t *data, size_t size);
+
+// The phone can tag a picture with its capture time in a preceding
+// user_data_unregistered SEI with this UUID. The payload is a big endian
+// uint64 of nanoseconds on the device clock.
+extern const uint8_t NAL_TIMESTAMP_SEI_UUID[16];
+
+// Find the capture time in an SEI NAL unit, if it carries one
+extern bool nal_parse_timestamp_sei(enum nal_codec codec,
+                                    const struct nal_unit *nal,
+                                    uint64_t *timestamp);
+
+extern const char *nal_codec_name(enum nal_codec codec);
+
+#ifdef __cplusplus
+}
+#endif
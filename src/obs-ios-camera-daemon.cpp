@@ -0,0 +1,155 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+// Keeps the connection to a phone and its decoder running outside of OBS.
+// Decoded frames go into a shared memory ring that any number of OBS
+// processes can map, so OBS restarting doesn't drop the phone, and a main
+// and a backup OBS share one decode.
+//
+//     obs-ios-camera-daemon HOST [PORT]
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <socket.h>
+#include <util/platform.h>
+
+#include "DeviceSession.hpp"
+#include "SharedFrameRing.hpp"
+#include "logging.h"
+
+static volatile sig_atomic_t stopping = 0;
+
+static void handle_signal(int signal)
+{
+	UNUSED_PARAMETER(signal);
+	stopping = 1;
+}
+
+// Stands in for an OBS source: always connected, never in standby, and
+// every frame goes into the ring.
+class RingSubscriber : public DeviceSession::Subscriber {
+public:
+	RingSubscriber(SharedFrameWriter *writer) : writer(writer) {}
+
+	// The ring is named after the device, it carries the main camera
+	uint32_t getStreamId() override { return 0; }
+	bool allowsLowLayer() override { return false; }
+
+	void sessionDidReceivePacket(
+		const portal::SimpleDataPacketProtocol::DataPacket &packet,
+		uint64_t timestamp) override
+	{
+		UNUSED_PARAMETER(packet);
+		UNUSED_PARAMETER(timestamp);
+	}
+
+	// Only video goes through the ring
+	void sessionDidDecodeAudio(const obs_source_audio *audio) override
+	{
+		UNUSED_PARAMETER(audio);
+	}
+
+	FrameSink *getFrameSink() override { return writer; }
+
+	// Clients decide how large they show the frames, send them whole
+	void getScaleTarget(uint32_t *width, uint32_t *height) override
+	{
+		*width = 0;
+		*height = 0;
+	}
+
+	bool wantsConnection() override { return true; }
+	bool wantsStandby() override { return false; }
+	DecodePriority getDecodePriority() override { return DecodePriority::Program; }
+
+private:
+	SharedFrameWriter *writer;
+};
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s HOST [PORT]\n", argv[0]);
+		return 2;
+	}
+
+	std::string host = argv[1];
+	int port = argc > 2 ? atoi(argv[2]) : 2019;
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	SharedFrameWriter writer;
+	if (!writer.create("obs-ios-camera " + host + ":" + std::to_string(port))) {
+		return 1;
+	}
+
+	std::string path = shared_frame_socket_path(host, port);
+	int listener = socket_create_unix(path.c_str());
+	if (listener < 0) {
+		portal_error("Could not listen on %s", path.c_str());
+		portal::log_stop();
+		return 1;
+	}
+
+	auto session = DeviceSession::forDevice(host, port);
+	RingSubscriber subscriber(&writer);
+	session->subscribe(&subscriber);
+
+	// The OBS processes reading the ring may run different canvases, the
+	// decoder can't skip frames for any of them
+	DeviceSessionSettings settings;
+	settings.decimateToCanvas = false;
+	session->configure(0, settings);
+	session->update();
+
+	portal_info("Serving %s:%d on %s", host.c_str(), port, path.c_str());
+
+	while (!stopping) {
+		if (socket_check_fd(listener, FDM_READ, 500) <= 0) {
+			continue;
+		}
+
+		int client = socket_accept(listener, 0);
+		if (client < 0) {
+			continue;
+		}
+
+		// The reader maps the ring and hangs up, frames never touch the socket
+		if (!shared_frame_send_fd(client, writer.getFd())) {
+			portal_warn("Could not hand the frame ring to a reader");
+		}
+		socket_close(client);
+	}
+
+	portal_info("Stopping");
+
+	session->unsubscribe(&subscriber);
+	session = nullptr;
+
+	socket_close(listener);
+	os_unlink(path.c_str());
+
+	portal::log_stop();
+	return 0;
+}
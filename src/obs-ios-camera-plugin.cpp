@@ -18,6 +18,9 @@
 
 #include <obs-module.h>
 
+#include "MetricsExporter.hpp"
+#include "logging.h"
+
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE("obs-ios-camera-plugin", "en-US")
 
@@ -25,9 +28,34 @@ OBS_MODULE_USE_DEFAULT_LOCALE("obs-ios-camera-plugin", "en-US")
 
 extern void RegisterIOSCameraSource();
 
+static MetricsExporter *metricsExporter = nullptr;
+
 bool obs_module_load(void)
 {
+    // Everything portal and the decode threads log goes through its logging
+    // thread, so the hot paths never wait on OBS's log file
+    portal::log_set_sink([](portal::LogLevel level, const char *message) {
+        blog((int)level, "[obs-ios-camera-plugin] %s", message);
+    });
+
     blog(LOG_INFO, "Loading iOS Camera Plugin (version %s)", IOS_CAMERA_PLUGIN_VERSION);
     RegisterIOSCameraSource();
+
+    auto exporterConfig = MetricsExporterConfig::load();
+    if (exporterConfig.mode != MetricsExportMode::Off) {
+        metricsExporter = new MetricsExporter(exporterConfig);
+        metricsExporter->start();
+    }
+
     return true;
 }
+
+void obs_module_unload(void)
+{
+    delete metricsExporter;
+    metricsExporter = nullptr;
+
+    // The logging thread runs code from this module, it has to be gone
+    // before the module is
+    portal::log_stop();
+}
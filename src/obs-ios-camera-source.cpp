@@ -18,77 +18,165 @@
 
 #include "obs-ios-camera-source.h"
 
+#include <util/platform.h>
+
+#include <algorithm>
+#include <cmath>
+
 #define TEXT_INPUT_NAME obs_module_text("OBSIOSCamera.Title")
 #define SETTING_DEVICE_HOST "setting_device_host"
 #define SETTING_DEVICE_PORT "setting_device_port"
+#define SETTING_DEVICE_STREAM "setting_device_stream"
 #define SETTING_PROP_LATENCY "latency"
 #define SETTING_PROP_LATENCY_NORMAL 0
 #define SETTING_PROP_LATENCY_LOW 1
 #define SETTING_PROP_HARDWARE_DECODER "setting_use_hw_decoder"
+#define SETTING_PROP_LATENCY_ADAPTIVE 2
+#define SETTING_PROP_JITTER_TARGET_LATENCY "setting_jitter_target_latency_ms"
+#define SETTING_PROP_JITTER_MIN_DEPTH "setting_jitter_min_depth"
+#define SETTING_PROP_JITTER_MAX_DEPTH "setting_jitter_max_depth"
+#define SETTING_PROP_DELAY "setting_delay_ms"
+#define SETTING_PROP_REPLAY_DURATION "setting_replay_duration_s"
+#define SETTING_PROP_REPLAY_PATH "setting_replay_path"
+#define SETTING_PROP_ISO_RECORD "setting_iso_record"
+#define SETTING_PROP_ISO_PATH "setting_iso_path"
+#define SETTING_PROP_TRACE "setting_trace"
+#define SETTING_PROP_CAPTURE_DAEMON "setting_capture_daemon"
+#define SETTING_PROP_DECIMATE "setting_decimate_to_canvas"
+#define SETTING_PROP_LOW_LAYER_IN_PREVIEW "setting_low_layer_in_preview"
+#define SETTING_PROP_DOWNSCALE "setting_downscale"
+#define SETTING_PROP_DOWNSCALE_OFF 0
+#define SETTING_PROP_DOWNSCALE_AUTO 1
+#define SETTING_PROP_STANDBY_ON_INACTIVE "setting_standby_on_inactive"
 #define SETTING_PROP_DISCONNECT_ON_INACTIVE "setting_disconnect_on_inactive"
 #define SETTING_PROP_FFMPEG_HARDWARE_DECODER "setting_use_ffmpeg_hw_decoder"
+#define SETTING_PROP_VIDEO_CODEC "setting_video_codec"
+#define SETTING_PROP_VIDEO_CODEC_AUTO 0
+#define SETTING_PROP_VIDEO_CODEC_H264 1
+#define SETTING_PROP_VIDEO_CODEC_HEVC 2
 
-IOSCameraInput::IOSCameraInput(obs_source_t *source_, obs_data_t *settings)
-	: source(source_), settings(settings)
+static void save_replay_hotkey(void *data, obs_hotkey_id id,
+			       obs_hotkey_t *hotkey, bool pressed)
 {
-	blog(LOG_INFO, "Creating instance of plugin!");
+	UNUSED_PARAMETER(id);
+	UNUSED_PARAMETER(hotkey);
 
-#ifdef __APPLE__
-	videoToolboxVideoDecoder.source = source_;
-	videoToolboxVideoDecoder.Init();
-#endif
+	if (pressed) {
+		reinterpret_cast<IOSCameraInput *>(data)->saveReplay();
+	}
+}
 
-	ffmpegVideoDecoder.source = source_;
-	ffmpegVideoDecoder.Init();
+static void save_replay_proc(void *data, calldata_t *cd)
+{
+	auto path = reinterpret_cast<IOSCameraInput *>(data)->saveReplay();
+	calldata_set_string(cd, "path", path.c_str());
+}
+
+static void save_trace_proc(void *data, calldata_t *cd)
+{
+	auto path = reinterpret_cast<IOSCameraInput *>(data)->saveTrace(0);
+	calldata_set_string(cd, "path", path.c_str());
+}
 
-	audioDecoder.source = source_;
-	audioDecoder.Init();
+IOSCameraInput::IOSCameraInput(obs_source_t *source_, obs_data_t *settings)
+	: source(source_), settings(settings),
+	  metrics(MetricsRegistry::shared().scope(
+		  std::string("source ") + obs_source_get_name(source_))),
+	  videoOutput(source_)
+{
+	blog(LOG_INFO, "Creating instance of plugin!");
 
-	videoDecoder = &ffmpegVideoDecoder;
+	videoOutput.setMetrics(metrics.get());
+
+	// Replays are saved from a hotkey, or by scripts and plugins through the
+	// save_replay procedure. `path` comes back empty if nothing was saved.
+	obs_hotkey_register_source(source_, "IOSCamera.SaveReplay",
+				   obs_module_text("OBSIOSCamera.SaveReplay"),
+				   save_replay_hotkey, this);
+	proc_handler_add(obs_source_get_proc_handler(source_),
+			 "void save_replay(out string path)", save_replay_proc,
+			 this);
+	proc_handler_add(obs_source_get_proc_handler(source_),
+			 "void save_trace(out string path)", save_trace_proc,
+			 this);
+
+	// Keep a trace of what led up to a hitch, and the second after it
+	videoOutput.hitches.onHitch = [this](uint64_t gapNs) {
+		blog(LOG_WARNING, "No frame for %llu ms, saving a trace",
+		     (unsigned long long)(gapNs / 1000000));
+		this->saveTrace(1000);
+	};
 
 	active = true;
 	loadSettings(settings);
 };
 
-void IOSCameraInput::setupConnectionController(std::string host, int port)
-{
-	std::cout << "Did Add device " << host << ":" << port << std::endl;
-
-	// Create the connection, and the connection manager, but don't start anything just yet
-	auto deviceConnection = std::make_shared<portal::DeviceConnection>(host, port);
-	auto deviceConnectionController = std::make_shared<DeviceApplicationConnectionController>(deviceConnection);
-
-	connectionController = deviceConnectionController;
-
-	// Setup the callbacks
-
-	deviceConnectionController->onProcessPacketCallback = [this](auto packet) {
-		try {
-			switch (packet.type) {
-			case 101: // Video Packet
-				this->videoDecoder->Input(packet.data, packet.type, packet.tag);
-				break;
-			case 102: // Audio Packet
-				this->audioDecoder.Input(packet.data, packet.type, packet.tag);
-			default:
-				break;
-			}
-		} catch (...) {
-			// This isn't great, but I haven't been able to figure out what is causing
-			// the exception that happens when
-			//   the phone is plugged in with the app open
-			//   OBS Studio is launched with the iOS Camera plugin ready
-			// This also doesn't happen _all_ the time. Which makes this 'fun'..
-			blog(LOG_INFO, "Exception caught...");
-		}
-	};
+void IOSCameraInput::sessionDidReceivePacket(
+	const portal::SimpleDataPacketProtocol::DataPacket &packet,
+	uint64_t timestamp)
+{
+	switch (packet.type) {
+	case 101: // Video Packet
+		this->replayBuffer.add(packet.data, timestamp);
+		this->isoRecorder.addVideo(packet.data, timestamp);
+		break;
+	case 102: // Audio Packet
+		this->isoRecorder.addAudio(packet.data, timestamp);
+	default:
+		break;
+	}
+}
+
+void IOSCameraInput::sessionDidDecodeAudio(const obs_source_audio *audio)
+{
+	obs_source_output_audio(source, audio);
+}
+
+bool IOSCameraInput::wantsConnection()
+{
+	return !disconnectOnInactive || active;
+}
 
-	resetDecoder();
+bool IOSCameraInput::wantsStandby()
+{
+	return !active && standbyOnInactive && !disconnectOnInactive;
 }
 
 IOSCameraInput ::~IOSCameraInput()
 {
+	// Nothing from the session may reach this source once it's gone
+	auto session = getSession();
+	if (session != nullptr) {
+		session->unsubscribe(this);
+	}
 
+	updateTracing(false);
+	metrics->snapshot().log();
+}
+
+void IOSCameraInput::tickStats(float seconds)
+{
+	auto session = getSession();
+	if (session == nullptr) {
+		stats.tick(seconds, metrics.get(), nullptr, nullptr);
+		return;
+	}
+
+	stats.tick(seconds, metrics.get(),
+		   session->getStreamMetrics(sessionStreamId),
+		   session->getMetrics());
+}
+
+StreamStatsSummary IOSCameraInput::getStats()
+{
+	auto session = getSession();
+	if (session == nullptr) {
+		return stats.summary(metrics.get(), nullptr, nullptr);
+	}
+
+	return stats.summary(metrics.get(),
+			     session->getStreamMetrics(sessionStreamId),
+			     session->getMetrics());
 }
 
 void IOSCameraInput::activate()
@@ -107,13 +195,125 @@ void IOSCameraInput::deactivate()
 	connectToDevice();
 }
 
+void IOSCameraInput::updateStandby()
+{
+	auto session = getSession();
+	if (session != nullptr) {
+		session->update();
+	}
+}
+
+void IOSCameraInput::configureSession(const DeviceSessionSettings &settings)
+{
+	sessionSettings = settings;
+
+	auto session = getSession();
+	if (session != nullptr) {
+		session->configure(sessionStreamId, settings);
+	}
+}
+
+// A new file in `directory`, or in the plugin's config directory under
+// `fallback` when no directory is set. The source name keeps files from
+// different phones apart.
+static std::string output_path(obs_source_t *source, std::string directory,
+			       const char *fallback, const char *extension,
+			       const char *prefix)
+{
+	if (directory.empty()) {
+		char *path = obs_module_config_path(fallback);
+		directory = path;
+		bfree(path);
+	}
+	os_mkdirs(directory.c_str());
+
+	std::string name = obs_source_get_name(source);
+	std::replace_if(name.begin(), name.end(), [](char c) {
+		return c == '/' || c == '\\' || c == ':';
+	}, '_');
+
+	std::string format = std::string(prefix) + " " + name + " %CCYY-%MM-%DD %hh-%mm-%ss";
+	char *filename = os_generate_formatted_filename(extension, true, format.c_str());
+	std::string path = directory + "/" + filename;
+	bfree(filename);
+
+	return path;
+}
+
+std::string IOSCameraInput::saveReplay()
+{
+	obs_data_t *settings = obs_source_get_settings(source);
+	std::string directory = obs_data_get_string(settings, SETTING_PROP_REPLAY_PATH);
+	obs_data_release(settings);
+
+	std::string path = output_path(source, directory, "replays", "mkv", "Replay");
+
+	if (!replayBuffer.save(path)) {
+		blog(LOG_INFO, "No replay to save");
+		return "";
+	}
+	return path;
+}
+
+void IOSCameraInput::updateIsoRecording(bool enabled, const std::string &directory)
+{
+	if (!enabled) {
+		isoRecorder.stop();
+		return;
+	}
+
+	if (isoRecorder.isRecording() && directory == isoDirectory) {
+		return;
+	}
+	isoDirectory = directory;
+
+	isoRecorder.start(output_path(source, directory, "recordings", "mp4", "ISO"));
+}
+
+void IOSCameraInput::updateTracing(bool enabled)
+{
+	if (enabled == tracing) {
+		return;
+	}
+	tracing = enabled;
+
+	if (enabled) {
+		Tracer::shared().enable();
+	} else {
+		Tracer::shared().disable();
+	}
+}
+
+// The trace holds every source's threads, it is only named after this one
+std::string IOSCameraInput::saveTrace(uint32_t delayMs)
+{
+	if (!Tracer::enabled()) {
+		blog(LOG_INFO, "Tracing is off, no trace to save");
+		return "";
+	}
+
+	std::string path = output_path(source, "", "traces", "json", "Trace");
+
+	if (delayMs > 0) {
+		Tracer::shared().dumpLater(path, delayMs);
+	} else if (!Tracer::shared().dump(path)) {
+		return "";
+	}
+	return path;
+}
+
 void IOSCameraInput::loadSettings(obs_data_t *settings)
 {
 	disconnectOnInactive = obs_data_get_bool(
 		settings, SETTING_PROP_DISCONNECT_ON_INACTIVE);
+#ifdef ENABLE_CAPTURE_DAEMON
+	useCaptureDaemon = obs_data_get_bool(settings, SETTING_PROP_CAPTURE_DAEMON);
+#endif
 
 	auto device_host = obs_data_get_string(settings, SETTING_DEVICE_HOST);
 	auto device_port = obs_data_get_int(settings, SETTING_DEVICE_PORT);
+	streamId = (uint32_t)obs_data_get_int(settings, SETTING_DEVICE_STREAM);
+	lowLayerInPreview = obs_data_get_bool(settings, SETTING_PROP_LOW_LAYER_IN_PREVIEW);
 
 	blog(LOG_INFO, "Loaded Settings");
 
@@ -132,16 +332,173 @@ void IOSCameraInput::reconnectToDevice()
 	connectToDevice();
 }
 
-void IOSCameraInput::resetDecoder()
+void IOSCameraInput::updateDecodePriority()
 {
-	// flush the decoders
-	ffmpegVideoDecoder.Flush();
-#ifdef __APPLE__
-	videoToolboxVideoDecoder.Flush();
-#endif
+	DecodePriority priority = DecodePriority::Hidden;
+	if (obs_source_active(source)) {
+		priority = DecodePriority::Program;
+	} else if (obs_source_showing(source)) {
+		priority = DecodePriority::Preview;
+	}
+
+	if (priority == decodePriority) {
+		return;
+	}
+	decodePriority = priority;
+
+	// The session decodes for the most visible of its sources
+	auto session = getSession();
+	if (session != nullptr) {
+		session->updatePriority();
+	}
+}
+
+void IOSCameraInput::updateLowLayer(bool enabled)
+{
+	if (lowLayerInPreview.exchange(enabled) == enabled) {
+		return;
+	}
+
+	auto session = getSession();
+	if (session != nullptr) {
+		session->updatePriority();
+	}
+}
+
+// Looks through every scene for the items showing a source, and works out
+// the largest size any of them shows it at
+struct DisplaySizeSearch {
+	obs_source_t *source;
+
+	// Of the group being looked through
+	vec2 scale;
+
+	bool found = false;
+
+	// Shown somewhere at a size that follows the source's, it can't shrink
+	bool fullSize = false;
+
+	float width = 0;
+	float height = 0;
+};
+
+static bool FindDisplaySize(obs_scene_t *scene, obs_sceneitem_t *item, void *param)
+{
+	UNUSED_PARAMETER(scene);
+	auto search = reinterpret_cast<DisplaySizeSearch *>(param);
+
+	if (obs_sceneitem_is_group(item)) {
+		vec2 outer = search->scale;
+		vec2 scale;
+		obs_sceneitem_get_scale(item, &scale);
+
+		// A group fitted into a box scales its items by its own extent
+		if (obs_sceneitem_get_bounds_type(item) != OBS_BOUNDS_NONE) {
+			search->fullSize = true;
+		} else {
+			search->scale.x *= std::fabs(scale.x);
+			search->scale.y *= std::fabs(scale.y);
+			obs_sceneitem_group_enum_items(item, FindDisplaySize, search);
+		}
+
+		search->scale = outer;
+		return !search->fullSize;
+	}
+
+	if (obs_sceneitem_get_source(item) != search->source) {
+		return true;
+	}
+	search->found = true;
+
+	// Without a bounding box the item is as large as the source, and the
+	// crop is in source pixels, a smaller picture would change the layout.
+	obs_sceneitem_crop crop;
+	obs_sceneitem_get_crop(item, &crop);
+	if (obs_sceneitem_get_bounds_type(item) == OBS_BOUNDS_NONE ||
+	    crop.left != 0 || crop.top != 0 || crop.right != 0 || crop.bottom != 0) {
+		search->fullSize = true;
+		return false;
+	}
+
+	vec2 bounds;
+	obs_sceneitem_get_bounds(item, &bounds);
+	search->width = std::max(search->width, std::fabs(bounds.x * search->scale.x));
+	search->height = std::max(search->height, std::fabs(bounds.y * search->scale.y));
+
+	return true;
+}
+
+static bool FindDisplaySizeInScene(void *param, obs_source_t *source)
+{
+	auto search = reinterpret_cast<DisplaySizeSearch *>(param);
+
+	obs_scene_t *scene = obs_scene_from_source(source);
+	if (scene == nullptr) {
+		return true;
+	}
+
+	search->scale.x = 1.0f;
+	search->scale.y = 1.0f;
+	obs_scene_enum_items(scene, FindDisplaySize, search);
+	return !search->fullSize;
+}
+
+void IOSCameraInput::updateDownscale(uint32_t mode)
+{
+	downscaleMode = mode;
+
+	if (mode == SETTING_PROP_DOWNSCALE_OFF) {
+		setScaleTarget(0, 0);
+	} else if (mode != SETTING_PROP_DOWNSCALE_AUTO) {
+		// Either way up, the shorter side stays at least `mode` pixels
+		setScaleTarget(mode, mode);
+	}
+}
+
+void IOSCameraInput::tickDownscale(float seconds)
+{
+	if (downscaleMode != SETTING_PROP_DOWNSCALE_AUTO) {
+		return;
+	}
+
+	// Scenes don't change often, no need to walk them every frame
+	downscaleElapsed += seconds;
+	if (downscaleElapsed < 1.0f) {
+		return;
+	}
+	downscaleElapsed = 0;
+
+	DisplaySizeSearch search;
+	search.source = source;
+	obs_enum_scenes(FindDisplaySizeInScene, &search);
+
+	if (!search.found || search.fullSize) {
+		setScaleTarget(0, 0);
+	} else {
+		setScaleTarget((uint32_t)std::ceil(search.width),
+			       (uint32_t)std::ceil(search.height));
+	}
+}
+
+void IOSCameraInput::setScaleTarget(uint32_t width, uint32_t height)
+{
+	bool changed = scaleWidth.exchange(width) != width;
+	changed |= scaleHeight.exchange(height) != height;
+	if (!changed) {
+		return;
+	}
+
+	if (width > 0 && height > 0) {
+		blog(LOG_INFO, "Shown at %ux%u, decoding no larger than needed", width, height);
+	} else {
+		blog(LOG_INFO, "Decoding at full size");
+	}
 
-	// Clear the video frame when a setting changes
-	obs_source_output_video(source, NULL);
+	// The session shrinks the picture as far as all of its sources allow
+	auto session = getSession();
+	if (session != nullptr) {
+		session->updateScale();
+	}
 }
 
 void IOSCameraInput::connectToDevice()
@@ -149,41 +506,74 @@ void IOSCameraInput::connectToDevice()
     auto host = this->host.value_or("");
     auto port = this->port.value_or(0);
 
-	// If there is no currently selected device, disconnect from all
-	// connection controllers
+	auto current = getSession();
+
+	// If there is no currently selected device, leave the session of the
+	// previous one
 	if (host.empty() || port <= 0) {
-	    if (connectionController != nullptr) {
-	        connectionController->disconnect();
-	        connectionController = nullptr;
+		if (current != nullptr) {
+			current->unsubscribe(this);
+			std::atomic_store(&session, std::shared_ptr<DeviceSession>());
 		}
 
+#ifdef ENABLE_CAPTURE_DAEMON
+		daemonClient.reset();
+#endif
+
 		// Clear the video frame when a setting changes
-		resetDecoder();
+		videoOutput.clear();
 		return;
 	}
 
-    blog(LOG_DEBUG, "Connecting to %s:%d", host.c_str(), port);
+#ifdef ENABLE_CAPTURE_DAEMON
+	// The daemon owns the connection to the phone, this source only shows
+	// what it decodes
+	if (useCaptureDaemon) {
+		if (current != nullptr) {
+			current->unsubscribe(this);
+			std::atomic_store(&session, std::shared_ptr<DeviceSession>());
+		}
 
-	if (connectionController != nullptr) {
-	    if (connectionController->getHost() != host || connectionController->getPort() != port) {
-	        // connection changed
-	        connectionController->disconnect();
-            setupConnectionController(host, port);
-	    }
-	} else {
-        setupConnectionController(host, port);
+		if (daemonClient == nullptr || daemonClient->getHost() != host ||
+		    daemonClient->getPort() != port) {
+			daemonClient.reset();
+			videoOutput.clear();
+			daemonClient = std::make_unique<CaptureDaemonClient>(host, port, &videoOutput);
+		}
+		return;
+	}
+
+	if (daemonClient != nullptr) {
+		daemonClient.reset();
+		videoOutput.clear();
 	}
+#endif
+
+    blog(LOG_DEBUG, "Connecting to %s:%d", host.c_str(), port);
+
+	if (current == nullptr || current->getHost() != host ||
+	    current->getPort() != port || sessionStreamId != streamId) {
+		// connection or camera changed
+		if (current != nullptr) {
+			current->unsubscribe(this);
+		}
+		videoOutput.clear();
 
-	auto shouldConnect = !disconnectOnInactive || active;
+		if (current == nullptr || current->getHost() != host || current->getPort() != port) {
+			current = DeviceSession::forDevice(host, port);
+			std::atomic_store(&session, current);
+		}
 
-	// Then connect to the selected device if the plugin is active, or inactive and connected on inactive.
-	if (shouldConnect) {
-	    if (connectionController != nullptr) {
-            blog(LOG_DEBUG, "Starting connection controller");
-            connectionController->start();
-//            connectionController->start(host, port);
-	    }
+		// A camera other sources already show keeps their decoder settings
+		sessionStreamId = streamId;
+		if (current->subscribe(this)) {
+			current->configure(sessionStreamId, sessionSettings);
+		}
 	}
+
+	// Then connect to the selected device if this source, or another one
+	// showing it, wants to be connected.
+	current->update();
 }
 
 #pragma mark - Settings Config
@@ -200,6 +590,126 @@ static bool reconnect_to_device(obs_properties_t *props, obs_property_t *p,
 	return false;
 }
 
+static bool save_replay(obs_properties_t *props, obs_property_t *p, void *data)
+{
+	UNUSED_PARAMETER(props);
+	UNUSED_PARAMETER(p);
+
+	auto cameraInput = reinterpret_cast<IOSCameraInput *>(data);
+	cameraInput->saveReplay();
+
+	return false;
+}
+
+static void update_stats(obs_properties_t *props, IOSCameraInput *cameraInput)
+{
+	auto stats = cameraInput->getStats();
+	auto session = cameraInput->getSession();
+	auto controller = session != nullptr ? session->getController() : nullptr;
+	char value[256];
+
+	auto set = [props](const char *name, const char *label,
+			   const char *value) {
+		std::string text = std::string(obs_module_text(label)) + ": " + value;
+		obs_property_set_description(obs_properties_get(props, name),
+					     text.c_str());
+	};
+
+	uint32_t width = cameraInput->videoOutput.getWidth();
+	uint32_t height = cameraInput->videoOutput.getHeight();
+	nal_codec codec = controller != nullptr
+				  ? controller->getCodec(cameraInput->getStreamId())
+				  : NAL_CODEC_UNKNOWN;
+	if (width != 0 && height != 0) {
+		snprintf(value, sizeof(value), "%ux%u %s", width, height,
+			 nal_codec_name(codec));
+	} else {
+		snprintf(value, sizeof(value), "-");
+	}
+	set("stats_resolution", "OBSIOSCamera.Stats.Resolution", value);
+
+	snprintf(value, sizeof(value), "%.1f Mbps", stats.bitsPerSecond / 1e6);
+	set("stats_bitrate", "OBSIOSCamera.Stats.Bitrate", value);
+
+	snprintf(value, sizeof(value), "%.1f in, %.1f out", stats.inputFps,
+		 stats.outputFps);
+	set("stats_fps", "OBSIOSCamera.Stats.FrameRate", value);
+
+	snprintf(value, sizeof(value), "%.1f ms p50, %.1f ms p99",
+		 stats.decodeP50 / 1e6, stats.decodeP99 / 1e6);
+	set("stats_decode", "OBSIOSCamera.Stats.DecodeTime", value);
+
+	snprintf(value, sizeof(value), "%llu (%llu max)",
+		 (unsigned long long)stats.queueDepth,
+		 (unsigned long long)stats.queueDepthMax);
+	set("stats_queue", "OBSIOSCamera.Stats.QueueDepth", value);
+
+	struct {
+		MetricCounter counter;
+		const char *label;
+	} drops[] = {
+		{MetricCounter::DropQueueOverload, "OBSIOSCamera.Stats.Dropped.QueueOverload"},
+		{MetricCounter::DropUndecodable, "OBSIOSCamera.Stats.Dropped.Undecodable"},
+		{MetricCounter::DropStandby, "OBSIOSCamera.Stats.Dropped.Standby"},
+		{MetricCounter::DropDecimated, "OBSIOSCamera.Stats.Dropped.Decimated"},
+		{MetricCounter::DropMailbox, "OBSIOSCamera.Stats.Dropped.Mailbox"},
+		{MetricCounter::DropDelayLine, "OBSIOSCamera.Stats.Dropped.DelayLine"},
+		{MetricCounter::DropJitterBuffer, "OBSIOSCamera.Stats.Dropped.JitterBuffer"},
+	};
+	std::string dropped;
+	for (auto &drop : drops) {
+		// The decoders count for the stream, the delay line for the
+		// device and the outputs for the source
+		uint64_t count = stats.source.counter(drop.counter) +
+				 stats.stream.counter(drop.counter) +
+				 stats.connection.counter(drop.counter);
+		if (count == 0) {
+			continue;
+		}
+		if (!dropped.empty()) {
+			dropped += ", ";
+		}
+		dropped += std::to_string(count) + " " + obs_module_text(drop.label);
+	}
+	set("stats_dropped", "OBSIOSCamera.Stats.Dropped",
+	    dropped.empty() ? "0" : dropped.c_str());
+
+	snprintf(value, sizeof(value), "%llu",
+		 (unsigned long long)stats.reconnects);
+	set("stats_reconnects", "OBSIOSCamera.Stats.Reconnects", value);
+
+	// From capture on the phone when it sends capture times, otherwise
+	// from arrival
+	if (stats.latencyP50 != 0) {
+		uint32_t delayMs = session != nullptr ? session->getDelayMs() : 0;
+		snprintf(value, sizeof(value), "%.0f ms",
+			 stats.latencyP50 / 1e6 + delayMs);
+	} else {
+		snprintf(value, sizeof(value), "-");
+	}
+	set("stats_latency", "OBSIOSCamera.Stats.Latency", value);
+}
+
+static bool save_trace(obs_properties_t *props, obs_property_t *p, void *data)
+{
+	UNUSED_PARAMETER(props);
+	UNUSED_PARAMETER(p);
+
+	auto cameraInput = reinterpret_cast<IOSCameraInput *>(data);
+	cameraInput->saveTrace(0);
+
+	return false;
+}
+
+static bool refresh_stats(obs_properties_t *props, obs_property_t *p,
+			  void *data)
+{
+	UNUSED_PARAMETER(p);
+
+	update_stats(props, reinterpret_cast<IOSCameraInput *>(data));
+	return true;
+}
+
 #pragma mark - Plugin Callbacks
 
 static const char *GetIOSCameraInputName(void *)
@@ -243,9 +753,17 @@ static void ActivateIOSCameraInput(void *data)
 	cameraInput->activate();
 }
 
+static void TickIOSCameraInput(void *data, float seconds)
+{
+	auto cameraInput = reinterpret_cast<IOSCameraInput *>(data);
+	cameraInput->updateDecodePriority();
+	cameraInput->videoOutput.tick(seconds);
+	cameraInput->tickStats(seconds);
+	cameraInput->tickDownscale(seconds);
+}
+
 static obs_properties_t *GetIOSCameraProperties(void *data)
 {
-	UNUSED_PARAMETER(data);
 	obs_properties_t *ppts = obs_properties_create();
 
     obs_properties_add_text(
@@ -258,6 +776,11 @@ static obs_properties_t *GetIOSCameraProperties(void *data)
             0, 65535,
             1);
 
+	obs_properties_add_int(
+		ppts, SETTING_DEVICE_STREAM,
+		obs_module_text("OBSIOSCamera.Settings.Device.Stream"),
+		0, portal::PortalMaxStreams - 1, 1);
+
 	obs_properties_add_button(ppts, "setting_button_connect_to_device",
 				  "Reconnect to Device", reconnect_to_device);
 
@@ -274,6 +797,61 @@ static obs_properties_t *GetIOSCameraProperties(void *data)
 		latency_modes,
 		obs_module_text("OBSIOSCamera.Settings.Latency.Low"),
 		SETTING_PROP_LATENCY_LOW);
+	obs_property_list_add_int(
+		latency_modes,
+		obs_module_text("OBSIOSCamera.Settings.Latency.Adaptive"),
+		SETTING_PROP_LATENCY_ADAPTIVE);
+
+	obs_properties_add_int_slider(
+		ppts, SETTING_PROP_JITTER_TARGET_LATENCY,
+		obs_module_text("OBSIOSCamera.Settings.JitterBuffer.TargetLatency"),
+		0, 1000, 10);
+	obs_properties_add_int(
+		ppts, SETTING_PROP_JITTER_MIN_DEPTH,
+		obs_module_text("OBSIOSCamera.Settings.JitterBuffer.MinDepth"),
+		0, 60, 1);
+	obs_properties_add_int(
+		ppts, SETTING_PROP_JITTER_MAX_DEPTH,
+		obs_module_text("OBSIOSCamera.Settings.JitterBuffer.MaxDepth"),
+		1, 60, 1);
+
+	obs_properties_add_int_slider(
+		ppts, SETTING_PROP_DELAY,
+		obs_module_text("OBSIOSCamera.Settings.Delay"),
+		0, 10000, 1);
+
+	obs_properties_add_int(
+		ppts, SETTING_PROP_REPLAY_DURATION,
+		obs_module_text("OBSIOSCamera.Settings.ReplayDuration"),
+		0, 300, 1);
+	obs_properties_add_path(
+		ppts, SETTING_PROP_REPLAY_PATH,
+		obs_module_text("OBSIOSCamera.Settings.ReplayPath"),
+		OBS_PATH_DIRECTORY, nullptr, nullptr);
+	obs_properties_add_button(ppts, "setting_button_save_replay",
+				  obs_module_text("OBSIOSCamera.SaveReplay"),
+				  save_replay);
+
+	obs_properties_add_bool(
+		ppts, SETTING_PROP_ISO_RECORD,
+		obs_module_text("OBSIOSCamera.Settings.IsoRecord"));
+	obs_properties_add_path(
+		ppts, SETTING_PROP_ISO_PATH,
+		obs_module_text("OBSIOSCamera.Settings.IsoPath"),
+		OBS_PATH_DIRECTORY, nullptr, nullptr);
+
+#ifdef ENABLE_CAPTURE_DAEMON
+	obs_properties_add_bool(
+		ppts, SETTING_PROP_CAPTURE_DAEMON,
+		obs_module_text("OBSIOSCamera.Settings.CaptureDaemon"));
+#endif
+
+	obs_properties_add_bool(
+		ppts, SETTING_PROP_TRACE,
+		obs_module_text("OBSIOSCamera.Settings.Trace"));
+	obs_properties_add_button(ppts, "setting_button_save_trace",
+				  obs_module_text("OBSIOSCamera.SaveTrace"),
+				  save_trace);
 
 #ifdef __APPLE__
 	obs_properties_add_bool(
@@ -281,6 +859,35 @@ static obs_properties_t *GetIOSCameraProperties(void *data)
 		obs_module_text("OBSIOSCamera.Settings.UseHardwareDecoder"));
 #endif
 
+	obs_properties_add_bool(
+		ppts, SETTING_PROP_DECIMATE,
+		obs_module_text("OBSIOSCamera.Settings.DecimateToCanvas"));
+
+	obs_properties_add_bool(
+		ppts, SETTING_PROP_LOW_LAYER_IN_PREVIEW,
+		obs_module_text("OBSIOSCamera.Settings.LowLayerInPreview"));
+
+	obs_property_t *downscale_modes = obs_properties_add_list(
+		ppts, SETTING_PROP_DOWNSCALE,
+		obs_module_text("OBSIOSCamera.Settings.Downscale"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+
+	obs_property_list_add_int(
+		downscale_modes,
+		obs_module_text("OBSIOSCamera.Settings.Downscale.Off"),
+		SETTING_PROP_DOWNSCALE_OFF);
+	obs_property_list_add_int(
+		downscale_modes,
+		obs_module_text("OBSIOSCamera.Settings.Downscale.Auto"),
+		SETTING_PROP_DOWNSCALE_AUTO);
+	obs_property_list_add_int(downscale_modes, "1080p", 1080);
+	obs_property_list_add_int(downscale_modes, "720p", 720);
+	obs_property_list_add_int(downscale_modes, "540p", 540);
+
+	obs_properties_add_bool(
+		ppts, SETTING_PROP_STANDBY_ON_INACTIVE,
+		obs_module_text("OBSIOSCamera.Settings.StandbyOnInactive"));
+
 	obs_properties_add_bool(
 		ppts, SETTING_PROP_DISCONNECT_ON_INACTIVE,
 		obs_module_text("OBSIOSCamera.Settings.DisconnectOnInactive"));
@@ -289,6 +896,47 @@ static obs_properties_t *GetIOSCameraProperties(void *data)
             ppts, SETTING_PROP_FFMPEG_HARDWARE_DECODER,
             obs_module_text("OBSIOSCamera.Settings.UseFFMpegHardwareDecoder"));
 
+	obs_property_t *video_codecs = obs_properties_add_list(
+		ppts, SETTING_PROP_VIDEO_CODEC,
+		obs_module_text("OBSIOSCamera.Settings.VideoCodec"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+
+	obs_property_list_add_int(
+		video_codecs,
+		obs_module_text("OBSIOSCamera.Settings.VideoCodec.Auto"),
+		SETTING_PROP_VIDEO_CODEC_AUTO);
+	obs_property_list_add_int(
+		video_codecs,
+		obs_module_text("OBSIOSCamera.Settings.VideoCodec.H264"),
+		SETTING_PROP_VIDEO_CODEC_H264);
+	obs_property_list_add_int(
+		video_codecs,
+		obs_module_text("OBSIOSCamera.Settings.VideoCodec.HEVC"),
+		SETTING_PROP_VIDEO_CODEC_HEVC);
+
+	// Read-only, filled in from the running stream
+	if (data != nullptr) {
+		obs_properties_t *stats = obs_properties_create();
+		const char *names[] = {
+			"stats_resolution", "stats_bitrate", "stats_fps",
+			"stats_decode",     "stats_queue",   "stats_dropped",
+			"stats_reconnects", "stats_latency",
+		};
+		for (auto name : names) {
+			obs_properties_add_text(stats, name, "", OBS_TEXT_INFO);
+		}
+		obs_properties_add_button(
+			stats, "setting_button_refresh_stats",
+			obs_module_text("OBSIOSCamera.Stats.Refresh"),
+			refresh_stats);
+
+		obs_properties_add_group(ppts, "stats",
+					 obs_module_text("OBSIOSCamera.Stats"),
+					 OBS_GROUP_NORMAL, stats);
+
+		update_stats(ppts, reinterpret_cast<IOSCameraInput *>(data));
+	}
+
 	return ppts;
 }
 
@@ -296,16 +944,36 @@ static void GetIOSCameraDefaults(obs_data_t *settings)
 {
 	obs_data_set_default_string(settings, SETTING_DEVICE_HOST, "");
 	obs_data_set_default_int(settings, SETTING_DEVICE_PORT, 2019);
+	obs_data_set_default_int(settings, SETTING_DEVICE_STREAM, 0);
 
 	obs_data_set_default_int(settings, SETTING_PROP_LATENCY,
-				 SETTING_PROP_LATENCY_LOW);
+				 SETTING_PROP_LATENCY_ADAPTIVE);
+	obs_data_set_default_int(settings, SETTING_PROP_JITTER_TARGET_LATENCY, 0);
+	obs_data_set_default_int(settings, SETTING_PROP_JITTER_MIN_DEPTH, 0);
+	obs_data_set_default_int(settings, SETTING_PROP_JITTER_MAX_DEPTH, 10);
 #ifdef __APPLE__
 	obs_data_set_default_bool(settings, SETTING_PROP_HARDWARE_DECODER,
 				  false);
 #endif
+	obs_data_set_default_int(settings, SETTING_PROP_DELAY, 0);
+	obs_data_set_default_int(settings, SETTING_PROP_REPLAY_DURATION, 0);
+	obs_data_set_default_string(settings, SETTING_PROP_REPLAY_PATH, "");
+	obs_data_set_default_bool(settings, SETTING_PROP_ISO_RECORD, false);
+	obs_data_set_default_string(settings, SETTING_PROP_ISO_PATH, "");
+	obs_data_set_default_bool(settings, SETTING_PROP_TRACE, false);
+#ifdef ENABLE_CAPTURE_DAEMON
+	obs_data_set_default_bool(settings, SETTING_PROP_CAPTURE_DAEMON, false);
+#endif
+	obs_data_set_default_bool(settings, SETTING_PROP_DECIMATE, true);
+	obs_data_set_default_bool(settings, SETTING_PROP_LOW_LAYER_IN_PREVIEW, false);
+	obs_data_set_default_int(settings, SETTING_PROP_DOWNSCALE,
+				 SETTING_PROP_DOWNSCALE_OFF);
+	obs_data_set_default_bool(settings, SETTING_PROP_STANDBY_ON_INACTIVE, true);
 	obs_data_set_default_bool(settings, SETTING_PROP_DISCONNECT_ON_INACTIVE,
 				  false);
     obs_data_set_default_bool(settings, SETTING_PROP_FFMPEG_HARDWARE_DECODER, false);
+	obs_data_set_default_int(settings, SETTING_PROP_VIDEO_CODEC,
+				 SETTING_PROP_VIDEO_CODEC_AUTO);
 }
 
 static void SaveIOSCameraInput(void *data, obs_data_t *settings)
@@ -327,29 +995,84 @@ static void UpdateIOSCameraInput(void *data, obs_data_t *settings)
 //	auto devicePort = obs_data_get_int(settings, SETTING_DEVICE_PORT);
 //	input->setDeviceHostPort(deviceHost, devicePort);
 
-	const bool is_unbuffered =
-		(obs_data_get_int(settings, SETTING_PROP_LATENCY) ==
-		 SETTING_PROP_LATENCY_LOW);
+	// In adaptive mode the jitter buffer does the buffering, OBS should
+	// show frames as soon as they are handed over.
+	const auto latency = obs_data_get_int(settings, SETTING_PROP_LATENCY);
+	const bool is_unbuffered = latency != SETTING_PROP_LATENCY_NORMAL;
 	obs_source_set_async_unbuffered(input->source, is_unbuffered);
 
-	bool useFFMpegHardwareDecoder =
+	JitterBufferSettings jitterSettings;
+	jitterSettings.targetLatencyMs = (uint32_t)obs_data_get_int(
+		settings, SETTING_PROP_JITTER_TARGET_LATENCY);
+	jitterSettings.minDepth = (uint32_t)obs_data_get_int(
+		settings, SETTING_PROP_JITTER_MIN_DEPTH);
+	jitterSettings.maxDepth = (uint32_t)obs_data_get_int(
+		settings, SETTING_PROP_JITTER_MAX_DEPTH);
+
+	VideoOutputMode outputMode = VideoOutputMode::Direct;
+	if (latency == SETTING_PROP_LATENCY_LOW) {
+		outputMode = VideoOutputMode::Latest;
+	} else if (latency == SETTING_PROP_LATENCY_ADAPTIVE) {
+		outputMode = VideoOutputMode::Buffered;
+	}
+	input->videoOutput.setMode(outputMode, jitterSettings);
+
+	input->replayBuffer.setDurationSeconds(
+		(uint32_t)obs_data_get_int(settings, SETTING_PROP_REPLAY_DURATION));
+	input->updateIsoRecording(
+		obs_data_get_bool(settings, SETTING_PROP_ISO_RECORD),
+		obs_data_get_string(settings, SETTING_PROP_ISO_PATH));
+	input->updateTracing(obs_data_get_bool(settings, SETTING_PROP_TRACE));
+
+	DeviceSessionSettings sessionSettings;
+	sessionSettings.delayMs =
+		(uint32_t)obs_data_get_int(settings, SETTING_PROP_DELAY);
+	sessionSettings.ffmpegHardwareDecoder =
         obs_data_get_bool(settings, SETTING_PROP_FFMPEG_HARDWARE_DECODER);
-
-	input->ffmpegVideoDecoder.setHW(useFFMpegHardwareDecoder);
-
+	sessionSettings.decimateToCanvas =
+		obs_data_get_bool(settings, SETTING_PROP_DECIMATE);
 #ifdef __APPLE__
-	bool useHardwareDecoder =
+	sessionSettings.videoToolboxDecoder =
 		obs_data_get_bool(settings, SETTING_PROP_HARDWARE_DECODER);
+#endif
 
-	if (useHardwareDecoder && !useFFMpegHardwareDecoder) {
-		input->videoDecoder = &input->videoToolboxVideoDecoder;
-	} else {
-		input->videoDecoder = &input->ffmpegVideoDecoder;
+	// The phone tells us which codec it is sending through the parameter
+	// sets, the setting only exists to force one.
+	switch (obs_data_get_int(settings, SETTING_PROP_VIDEO_CODEC)) {
+	case SETTING_PROP_VIDEO_CODEC_H264:
+		sessionSettings.codec = NAL_CODEC_H264;
+		break;
+	case SETTING_PROP_VIDEO_CODEC_HEVC:
+		sessionSettings.codec = NAL_CODEC_HEVC;
+		break;
 	}
-#endif
+
+	// Shared with every other source showing the same device
+	input->configureSession(sessionSettings);
 
 	input->disconnectOnInactive = obs_data_get_bool(
 		settings, SETTING_PROP_DISCONNECT_ON_INACTIVE);
+	input->standbyOnInactive = obs_data_get_bool(
+		settings, SETTING_PROP_STANDBY_ON_INACTIVE);
+	input->updateStandby();
+	input->updateLowLayer(
+		obs_data_get_bool(settings, SETTING_PROP_LOW_LAYER_IN_PREVIEW));
+	input->updateDownscale(
+		(uint32_t)obs_data_get_int(settings, SETTING_PROP_DOWNSCALE));
+
+	uint32_t streamId =
+		(uint32_t)obs_data_get_int(settings, SETTING_DEVICE_STREAM);
+	if (input->streamId.exchange(streamId) != streamId) {
+		input->connectToDevice();
+	}
+
+#ifdef ENABLE_CAPTURE_DAEMON
+	bool useCaptureDaemon =
+		obs_data_get_bool(settings, SETTING_PROP_CAPTURE_DAEMON);
+	if (input->useCaptureDaemon.exchange(useCaptureDaemon) != useCaptureDaemon) {
+		input->connectToDevice();
+	}
+#endif
 }
 
 void RegisterIOSCameraSource()
@@ -365,6 +1088,7 @@ void RegisterIOSCameraSource()
 
 	info.deactivate = DeactivateIOSCameraInput;
 	info.activate = ActivateIOSCameraInput;
+	info.video_tick = TickIOSCameraInput;
 
 	info.get_defaults = GetIOSCameraDefaults;
 	info.get_properties = GetIOSCameraProperties;
@@ -22,7 +22,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <obs-module.h>
 #include <optional>
 
-#include "DeviceApplicationConnectionController.hpp"
+#include "DeviceSession.hpp"
 
 #include <chrono>
 #include <obs-avc.h>
@@ -30,15 +30,18 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <thread>
 #include <condition_variable>
 
-#include "FFMpegVideoDecoder.h"
-#include "FFMpegAudioDecoder.h"
-#ifdef __APPLE__
-#include "VideoToolboxVideoDecoder.h"
+#include "ReplayBuffer.hpp"
+#include "IsoRecorder.hpp"
+#include "Metrics.hpp"
+#include "StreamStats.hpp"
+#ifdef ENABLE_CAPTURE_DAEMON
+#include "CaptureDaemonClient.hpp"
 #endif
 
 #define blog(level, msg, ...) blog(level, "[obs-ios-camera-plugin] " msg, ##__VA_ARGS__)
 
-class IOSCameraInput : public std::enable_shared_from_this<IOSCameraInput> {
+class IOSCameraInput : public DeviceSession::Subscriber,
+		       public std::enable_shared_from_this<IOSCameraInput> {
 public:
 
 	IOSCameraInput(obs_source_t *source_, obs_data_t *settings);
@@ -48,31 +51,96 @@ public:
 	void deactivate();
 	void loadSettings(obs_data_t *settings);
 	void reconnectToDevice();
-	void resetDecoder();
 	void connectToDevice();
+	void configureSession(const DeviceSessionSettings &settings);
+	void updateDecodePriority();
+	void updateLowLayer(bool enabled);
+	void updateDownscale(uint32_t mode);
+	void tickDownscale(float seconds);
+	void updateStandby();
+	std::string saveReplay();
+	void updateIsoRecording(bool enabled, const std::string &directory);
+	void tickStats(float seconds);
+	void updateTracing(bool enabled);
+	std::string saveTrace(uint32_t delayMs);
+	StreamStatsSummary getStats();
 
     void setDeviceHostPort(std::string host, int port);
 
-	std::shared_ptr<DeviceApplicationConnectionController> connectionController;
+	// The connection and decoders, shared with every other source showing
+	// the same device
+	std::shared_ptr<DeviceSession> getSession() { return std::atomic_load(&session); }
 
 	obs_source_t *source;
 	obs_data_t *settings;
 
 	std::atomic_bool active = false;
 	std::atomic_bool disconnectOnInactive = false;
+	std::atomic_bool standbyOnInactive = true;
+	std::atomic<DecodePriority> decodePriority = DecodePriority::Program;
 
-	VideoDecoder *videoDecoder;
-#ifdef __APPLE__
-	VideoToolboxDecoder videoToolboxVideoDecoder;
+	// Which of the phone's cameras to show, 0 is the main one
+	std::atomic<uint32_t> streamId = 0;
+
+	// Show the camera's low resolution layer while not in the program
+	std::atomic_bool lowLayerInPreview = false;
+
+	// Shrink the picture while decoding: 0 never, 1 to the size the
+	// scenes show it at, otherwise the shorter side in pixels
+	std::atomic<uint32_t> downscaleMode = 0;
+	std::atomic<uint32_t> scaleWidth = 0;
+	std::atomic<uint32_t> scaleHeight = 0;
+	float downscaleElapsed = 0;
+
+	// Latency histograms and counters for this source
+	std::shared_ptr<Metrics> metrics;
+	StreamStats stats;
+	bool tracing = false;
+
+	// This source's copy of the decoded frames
+	VideoOutput videoOutput;
+
+	// The last few seconds as received, for instant replays
+	ReplayBuffer replayBuffer;
+
+	// The stream as received, recorded to disk
+	IsoRecorder isoRecorder;
+	std::string isoDirectory;
+
+#ifdef ENABLE_CAPTURE_DAEMON
+	// Read the frames from a capture daemon instead of the phone
+	std::atomic_bool useCaptureDaemon = false;
+	std::unique_ptr<CaptureDaemonClient> daemonClient;
 #endif
-	FFMpegVideoDecoder ffmpegVideoDecoder;
-	FFMpegAudioDecoder audioDecoder;
+
+	// Device Session Subscriber
+	uint32_t getStreamId() override { return sessionStreamId; }
+	bool allowsLowLayer() override { return lowLayerInPreview; }
+	void sessionDidReceivePacket(
+		const portal::SimpleDataPacketProtocol::DataPacket &packet,
+		uint64_t timestamp) override;
+	void sessionDidDecodeAudio(const obs_source_audio *audio) override;
+	FrameSink *getFrameSink() override { return &videoOutput; }
+	void getScaleTarget(uint32_t *width, uint32_t *height) override
+	{
+		*width = scaleWidth;
+		*height = scaleHeight;
+	}
+	bool wantsConnection() override;
+	bool wantsStandby() override;
+	DecodePriority getDecodePriority() override { return decodePriority; }
 
 private:
     std::optional<std::string> host;
     std::optional<int> port;
 
-	void setupConnectionController(std::string host, int port);
+	std::shared_ptr<DeviceSession> session;
+	DeviceSessionSettings sessionSettings;
+
+	// The stream subscribed to, only changes while not subscribed
+	uint32_t sessionStreamId = 0;
+
+	void setScaleTarget(uint32_t width, uint32_t height);
 };
 
 #endif // OBSIOSCAMERASOURCE_H
@@ -0,0 +1,533 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "parameter-sets.h"
+#include "bitreader.h"
+
+#include <string.h>
+
+// Parameter sets are small, even with scaling lists and VUI
+#define MAX_SPS_SIZE 512
+
+// Enough for the fields at the start of a slice header
+#define MAX_SLICE_HEADER_SIZE 32
+
+#define HEVC_MAX_SUB_LAYERS 7
+#define HEVC_MAX_SHORT_TERM_REF_PIC_SETS 64
+
+static void skip_scaling_list(struct bitreader *br, int size)
+{
+    int last_scale = 8;
+    int next_scale = 8;
+
+    for (int i = 0; i < size; i++) {
+        if (next_scale != 0) {
+            int delta_scale = br_read_se(br);
+            next_scale = (last_scale + delta_scale + 256) % 256;
+        }
+        last_scale = next_scale == 0 ? last_scale : next_scale;
+    }
+}
+
+static void init_params(struct video_params *params)
+{
+    memset(params, 0, sizeof(*params));
+
+    params->chroma_format = 1;
+    params->bit_depth = 8;
+    params->colour_primaries = 2;
+    params->transfer_characteristics = 2;
+    params->matrix_coefficients = 2;
+}
+
+static void skip_aspect_ratio_info(struct bitreader *br)
+{
+    if (br_read_bit(br)) { // aspect_ratio_info_present_flag
+        // Extended_SAR carries an explicit sar_width / sar_height
+        if (br_read_bits(br, 8) == 255)
+            br_skip_bits(br, 32);
+    }
+}
+
+// video_signal_type, identical in the H.264 and HEVC VUI
+static void parse_video_signal_type(struct bitreader *br,
+                                    struct video_params *params)
+{
+    if (!br_read_bit(br)) // video_signal_type_present_flag
+        return;
+
+    br_skip_bits(br, 3); // video_format
+    params->full_range = br_read_bit(br);
+
+    if (br_read_bit(br)) { // colour_description_present_flag
+        params->colour_primaries = (uint8_t)br_read_bits(br, 8);
+        params->transfer_characteristics = (uint8_t)br_read_bits(br, 8);
+        params->matrix_coefficients = (uint8_t)br_read_bits(br, 8);
+    }
+}
+
+static void h264_parse_vui(struct bitreader *br, struct video_params *params)
+{
+    skip_aspect_ratio_info(br);
+
+    if (br_read_bit(br)) // overscan_info_present_flag
+        br_skip_bits(br, 1);
+
+    parse_video_signal_type(br, params);
+
+    if (br_read_bit(br)) { // chroma_loc_info_present_flag
+        br_read_ue(br);
+        br_read_ue(br);
+    }
+
+    if (br_read_bit(br)) { // timing_info_present_flag
+        uint32_t num_units_in_tick = br_read_bits(br, 32);
+        uint32_t time_scale = br_read_bits(br, 32);
+
+        // Two ticks per frame, one per field
+        if (num_units_in_tick != 0 && time_scale != 0) {
+            params->fps_num = time_scale;
+            params->fps_den = num_units_in_tick * 2;
+        }
+    }
+}
+
+bool h264_parse_sps(const uint8_t *data, size_t size, struct h264_sps *sps)
+{
+    uint8_t rbsp[MAX_SPS_SIZE];
+    struct bitreader br;
+    struct video_params *params = &sps->params;
+
+    memset(sps, 0, sizeof(*sps));
+    init_params(params);
+
+    if (size < 4)
+        return false;
+
+    // skip the NAL header
+    size_t rbsp_size = nal_unescape(data + 1, size - 1, rbsp, sizeof(rbsp));
+    br_init(&br, rbsp, rbsp_size);
+
+    params->profile = br_read_bits(&br, 8);
+    br_skip_bits(&br, 8); // constraint flags
+    params->level = br_read_bits(&br, 8);
+    sps->sps_id = br_read_ue(&br);
+
+    switch (params->profile) {
+    case 100: case 110: case 122: case 244: case 44:
+    case 83: case 86: case 118: case 128: case 138:
+    case 139: case 134: case 135: {
+        params->chroma_format = br_read_ue(&br);
+        if (params->chroma_format == 3)
+            sps->separate_colour_plane = br_read_bit(&br);
+
+        params->bit_depth = br_read_ue(&br) + 8;
+        br_read_ue(&br); // bit_depth_chroma_minus8
+        br_read_bit(&br); // qpprime_y_zero_transform_bypass_flag
+
+        if (br_read_bit(&br)) { // seq_scaling_matrix_present_flag
+            int lists = params->chroma_format != 3 ? 8 : 12;
+            for (int i = 0; i < lists; i++) {
+                if (br_read_bit(&br))
+                    skip_scaling_list(&br, i < 6 ? 16 : 64);
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    sps->log2_max_frame_num = br_read_ue(&br) + 4;
+
+    uint32_t pic_order_cnt_type = br_read_ue(&br);
+    if (pic_order_cnt_type == 0) {
+        br_read_ue(&br); // log2_max_pic_order_cnt_lsb_minus4
+    } else if (pic_order_cnt_type == 1) {
+        br_read_bit(&br); // delta_pic_order_always_zero_flag
+        br_read_se(&br);  // offset_for_non_ref_pic
+        br_read_se(&br);  // offset_for_top_to_bottom_field
+
+        uint32_t cycle = br_read_ue(&br);
+        for (uint32_t i = 0; i < cycle && !br.overrun; i++)
+            br_read_se(&br);
+    }
+
+    params->max_ref_frames = br_read_ue(&br);
+    sps->gaps_in_frame_num_allowed = br_read_bit(&br);
+
+    uint32_t width_in_mbs = br_read_ue(&br) + 1;
+    uint32_t height_in_map_units = br_read_ue(&br) + 1;
+    uint32_t frame_mbs_only = br_read_bit(&br);
+
+    if (!frame_mbs_only)
+        br_skip_bits(&br, 1); // mb_adaptive_frame_field_flag
+    br_skip_bits(&br, 1); // direct_8x8_inference_flag
+
+    params->width = width_in_mbs * 16;
+    params->height = height_in_map_units * 16 * (2 - frame_mbs_only);
+
+    if (br_read_bit(&br)) { // frame_cropping_flag
+        uint32_t left = br_read_ue(&br);
+        uint32_t right = br_read_ue(&br);
+        uint32_t top = br_read_ue(&br);
+        uint32_t bottom = br_read_ue(&br);
+
+        uint32_t crop_x = 1;
+        uint32_t crop_y = 2 - frame_mbs_only;
+
+        if (params->chroma_format != 0 && !sps->separate_colour_plane) {
+            crop_x = params->chroma_format == 3 ? 1 : 2;
+            crop_y *= params->chroma_format == 1 ? 2 : 1;
+        }
+
+        uint32_t crop_width = (left + right) * crop_x;
+        uint32_t crop_height = (top + bottom) * crop_y;
+
+        if (crop_width < params->width && crop_height < params->height) {
+            params->width -= crop_width;
+            params->height -= crop_height;
+        }
+    }
+
+    if (br_read_bit(&br)) // vui_parameters_present_flag
+        h264_parse_vui(&br, params);
+
+    return !br.overrun && sps->log2_max_frame_num <= 16;
+}
+
+static void hevc_parse_profile_tier_level(struct bitreader *br,
+                                         uint32_t max_sub_layers_minus1,
+                                         struct video_params *params)
+{
+    bool sub_layer_profile_present[HEVC_MAX_SUB_LAYERS];
+    bool sub_layer_level_present[HEVC_MAX_SUB_LAYERS];
+
+    br_skip_bits(br, 3); // general_profile_space, general_tier_flag
+    params->profile = br_read_bits(br, 5);
+
+    // compatibility flags, source / constraint flags
+    br_skip_bits(br, 32 + 4 + 43 + 1);
+    params->level = br_read_bits(br, 8);
+
+    for (uint32_t i = 0; i < max_sub_layers_minus1; i++) {
+        sub_layer_profile_present[i] = br_read_bit(br);
+        sub_layer_level_present[i] = br_read_bit(br);
+    }
+
+    if (max_sub_layers_minus1 > 0) {
+        for (uint32_t i = max_sub_layers_minus1; i < 8; i++)
+            br_skip_bits(br, 2); // reserved_zero_2bits
+    }
+
+    for (uint32_t i = 0; i < max_sub_layers_minus1; i++) {
+        if (sub_layer_profile_present[i])
+            br_skip_bits(br, 88);
+        if (sub_layer_level_present[i])
+            br_skip_bits(br, 8);
+    }
+}
+
+static void hevc_skip_scaling_list_data(struct bitreader *br)
+{
+    for (int size_id = 0; size_id < 4; size_id++) {
+        for (int matrix_id = 0; matrix_id < 6;
+             matrix_id += size_id == 3 ? 3 : 1) {
+            if (!br_read_bit(br)) { // scaling_list_pred_mode_flag
+                br_read_ue(br); // scaling_list_pred_matrix_id_delta
+                continue;
+            }
+
+            int coef_num = 1 << (4 + (size_id << 1));
+            if (coef_num > 64)
+                coef_num = 64;
+
+            if (size_id > 1)
+                br_read_se(br); // scaling_list_dc_coef_minus8
+
+            for (int i = 0; i < coef_num && !br->overrun; i++)
+                br_read_se(br); // scaling_list_delta_coef
+        }
+    }
+}
+
+// st_ref_pic_set() as it appears in the SPS. Returns NumDeltaPocs for the
+// set, which later sets predicted from it need.
+static uint32_t hevc_skip_st_ref_pic_set(struct bitreader *br, uint32_t idx,
+                                         const uint32_t *num_delta_pocs)
+{
+    if (idx != 0 && br_read_bit(br)) { // inter_ref_pic_set_prediction_flag
+        br_skip_bits(br, 1); // delta_rps_sign
+        br_read_ue(br);      // abs_delta_rps_minus1
+
+        uint32_t count = 0;
+        for (uint32_t j = 0; j <= num_delta_pocs[idx - 1] && !br->overrun;
+             j++) {
+            bool used_by_curr_pic = br_read_bit(br);
+            bool use_delta = used_by_curr_pic || br_read_bit(br);
+            if (use_delta)
+                count++;
+        }
+        return count;
+    }
+
+    uint32_t num_negative = br_read_ue(br);
+    uint32_t num_positive = br_read_ue(br);
+
+    if (num_negative > 16 || num_positive > 16) {
+        br->overrun = true;
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < num_negative + num_positive; i++) {
+        br_read_ue(br);     // delta_poc_sx_minus1
+        br_skip_bits(br, 1); // used_by_curr_pic_sx_flag
+    }
+
+    return num_negative + num_positive;
+}
+
+static void hevc_parse_vui(struct bitreader *br, struct video_params *params)
+{
+    skip_aspect_ratio_info(br);
+
+    if (br_read_bit(br)) // overscan_info_present_flag
+        br_skip_bits(br, 1);
+
+    parse_video_signal_type(br, params);
+
+    if (br_read_bit(br)) { // chroma_loc_info_present_flag
+        br_read_ue(br);
+        br_read_ue(br);
+    }
+
+    // neutral_chroma_indication_flag, field_seq_flag,
+    // frame_field_info_present_flag
+    br_skip_bits(br, 3);
+
+    if (br_read_bit(br)) { // default_display_window_flag
+        for (int i = 0; i < 4; i++)
+            br_read_ue(br);
+    }
+
+    if (br_read_bit(br)) { // vui_timing_info_present_flag
+        uint32_t num_units_in_tick = br_read_bits(br, 32);
+        uint32_t time_scale = br_read_bits(br, 32);
+
+        if (num_units_in_tick != 0 && time_scale != 0) {
+            params->fps_num = time_scale;
+            params->fps_den = num_units_in_tick;
+        }
+    }
+}
+
+bool hevc_parse_sps(const uint8_t *data, size_t size, struct hevc_sps *sps)
+{
+    uint8_t rbsp[MAX_SPS_SIZE];
+    uint32_t num_delta_pocs[HEVC_MAX_SHORT_TERM_REF_PIC_SETS];
+    struct bitreader br;
+    struct video_params *params = &sps->params;
+
+    memset(sps, 0, sizeof(*sps));
+    init_params(params);
+
+    if (size < 4)
+        return false;
+
+    // skip the two byte NAL header
+    size_t rbsp_size = nal_unescape(data + 2, size - 2, rbsp, sizeof(rbsp));
+    br_init(&br, rbsp, rbsp_size);
+
+    sps->vps_id = br_read_bits(&br, 4);
+    uint32_t max_sub_layers_minus1 = br_read_bits(&br, 3);
+    br_skip_bits(&br, 1); // sps_temporal_id_nesting_flag
+
+    if (max_sub_layers_minus1 >= HEVC_MAX_SUB_LAYERS)
+        return false;
+
+    params->max_sub_layers_minus1 = max_sub_layers_minus1;
+    hevc_parse_profile_tier_level(&br, max_sub_layers_minus1, params);
+
+    sps->sps_id = br_read_ue(&br);
+    params->chroma_format = br_read_ue(&br);
+
+    bool separate_colour_plane = false;
+    if (params->chroma_format == 3)
+        separate_colour_plane = br_read_bit(&br);
+
+    params->width = br_read_ue(&br);
+    params->height = br_read_ue(&br);
+
+    if (br_read_bit(&br)) { // conformance_window_flag
+        uint32_t left = br_read_ue(&br);
+        uint32_t right = br_read_ue(&br);
+        uint32_t top = br_read_ue(&br);
+        uint32_t bottom = br_read_ue(&br);
+
+        uint32_t sub_width = 1;
+        uint32_t sub_height = 1;
+
+        if (!separate_colour_plane) {
+            sub_width = params->chroma_format == 1 ||
+                                params->chroma_format == 2 ? 2 : 1;
+            sub_height = params->chroma_format == 1 ? 2 : 1;
+        }
+
+        uint32_t crop_width = (left + right) * sub_width;
+        uint32_t crop_height = (top + bottom) * sub_height;
+
+        if (crop_width < params->width && crop_height < params->height) {
+            params->width -= crop_width;
+            params->height -= crop_height;
+        }
+    }
+
+    params->bit_depth = br_read_ue(&br) + 8;
+    br_read_ue(&br); // bit_depth_chroma_minus8
+
+    uint32_t log2_max_poc_lsb = br_read_ue(&br) + 4;
+
+    bool sub_layer_ordering_info = br_read_bit(&br);
+    for (uint32_t i = sub_layer_ordering_info ? 0 : max_sub_layers_minus1;
+         i <= max_sub_layers_minus1; i++) {
+        // Only the highest sub layer matters for sizing the pool
+        params->max_ref_frames = br_read_ue(&br) + 1; // max_dec_pic_buffering_minus1
+        br_read_ue(&br); // max_num_reorder_pics
+        br_read_ue(&br); // max_latency_increase_plus1
+    }
+
+    br_read_ue(&br); // log2_min_luma_coding_block_size_minus3
+    br_read_ue(&br); // log2_diff_max_min_luma_coding_block_size
+    br_read_ue(&br); // log2_min_luma_transform_block_size_minus2
+    br_read_ue(&br); // log2_diff_max_min_luma_transform_block_size
+    br_read_ue(&br); // max_transform_hierarchy_depth_inter
+    br_read_ue(&br); // max_transform_hierarchy_depth_intra
+
+    if (br_read_bit(&br)) { // scaling_list_enabled_flag
+        if (br_read_bit(&br)) // sps_scaling_list_data_present_flag
+            hevc_skip_scaling_list_data(&br);
+    }
+
+    br_skip_bits(&br, 2); // amp_enabled_flag, sample_adaptive_offset_enabled_flag
+
+    if (br_read_bit(&br)) { // pcm_enabled_flag
+        br_skip_bits(&br, 8); // pcm sample bit depths
+        br_read_ue(&br);
+        br_read_ue(&br);
+        br_skip_bits(&br, 1); // pcm_loop_filter_disabled_flag
+    }
+
+    uint32_t num_short_term_ref_pic_sets = br_read_ue(&br);
+    if (num_short_term_ref_pic_sets > HEVC_MAX_SHORT_TERM_REF_PIC_SETS)
+        return false;
+
+    for (uint32_t i = 0; i < num_short_term_ref_pic_sets && !br.overrun; i++)
+        num_delta_pocs[i] = hevc_skip_st_ref_pic_set(&br, i, num_delta_pocs);
+
+    if (br_read_bit(&br)) { // long_term_ref_pics_present_flag
+        uint32_t num_long_term_ref_pics = br_read_ue(&br);
+        for (uint32_t i = 0; i < num_long_term_ref_pics && !br.overrun; i++)
+            br_skip_bits(&br, log2_max_poc_lsb + 1);
+    }
+
+    // sps_temporal_mvp_enabled_flag, strong_intra_smoothing_enabled_flag
+    br_skip_bits(&br, 2);
+
+    if (br_read_bit(&br)) // vui_parameters_present_flag
+        hevc_parse_vui(&br, params);
+
+    return !br.overrun && params->width != 0 && params->height != 0;
+}
+
+bool pps_parse_ids(enum nal_codec codec, const uint8_t *data, size_t size,
+                   uint32_t *pps_id, uint32_t *sps_id)
+{
+    uint8_t rbsp[MAX_SLICE_HEADER_SIZE];
+    struct bitreader br;
+
+    size_t header_size = codec == NAL_CODEC_HEVC ? 2 : 1;
+    if (size <= header_size)
+        return false;
+
+    size_t rbsp_size = nal_unescape(data + header_size, size - header_size,
+                                    rbsp, sizeof(rbsp));
+    br_init(&br, rbsp, rbsp_size);
+
+    *pps_id = br_read_ue(&br);
+    *sps_id = br_read_ue(&br);
+
+    return !br.overrun;
+}
+
+bool video_params_parse(enum nal_codec codec, const uint8_t *data,
+                        size_t size, struct video_params *params)
+{
+    if (codec == NAL_CODEC_HEVC) {
+        struct hevc_sps sps;
+        bool success = hevc_parse_sps(data, size, &sps);
+        *params = sps.params;
+        return success;
+    }
+
+    if (codec == NAL_CODEC_H264) {
+        struct h264_sps sps;
+        bool success = h264_parse_sps(data, size, &sps);
+        *params = sps.params;
+        return success;
+    }
+
+    init_params(params);
+    return false;
+}
+
+bool video_params_need_reinit(const struct video_params *a,
+                              const struct video_params *b)
+{
+    return a->width != b->width || a->height != b->height ||
+           a->profile != b->profile ||
+           a->chroma_format != b->chroma_format ||
+           a->bit_depth != b->bit_depth ||
+           a->max_ref_frames < b->max_ref_frames;
+}
+
+bool h264_parse_slice_header(const uint8_t *data, size_t size,
+                             const struct h264_sps *sps,
+                             struct h264_slice_header *header)
+{
+    uint8_t rbsp[MAX_SLICE_HEADER_SIZE];
+    struct bitreader br;
+
+    memset(header, 0, sizeof(*header));
+
+    if (size < 2)
+        return false;
+
+    size_t rbsp_size = nal_unescape(data + 1, size - 1, rbsp, sizeof(rbsp));
+    br_init(&br, rbsp, rbsp_size);
+
+    header->first_mb_in_slice = br_read_ue(&br);
+    header->slice_type = br_read_ue(&br);
+    header->pps_id = br_read_ue(&br);
+
+    if (sps->separate_colour_plane)
+        br_skip_bits(&br, 2); // colour_plane_id
+
+    header->frame_num = br_read_bits(&br, (int)sps->log2_max_frame_num);
+
+    return !br.overrun;
+}
@@ -0,0 +1,106 @@
+/*
+ obs-ios-camera-source
+ Copyright (C) 2020 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "nal-unit.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// What the decoder needs to know about a stream before the first picture
+struct video_params {
+    uint32_t width;  // after cropping
+    uint32_t height;
+
+    uint32_t profile; // profile_idc / general_profile_idc
+    uint32_t level;   // level_idc / general_level_idc
+    uint32_t chroma_format;
+    uint32_t bit_depth;
+
+    // Number of pictures the decoder keeps around for reference
+    uint32_t max_ref_frames;
+
+    // sps_max_sub_layers_minus1, always 0 for H.264
+    uint32_t max_sub_layers_minus1;
+
+    // VUI timing, both zero when the SPS doesn't signal it
+    uint32_t fps_num;
+    uint32_t fps_den;
+
+    // VUI colour description, 2 (unspecified) when not signalled
+    bool full_range;
+    uint8_t colour_primaries;
+    uint8_t transfer_characteristics;
+    uint8_t matrix_coefficients;
+};
+
+struct h264_sps {
+    uint32_t sps_id;
+    uint32_t log2_max_frame_num;
+    bool separate_colour_plane;
+    bool gaps_in_frame_num_allowed;
+
+    struct video_params params;
+};
+
+struct hevc_sps {
+    uint32_t vps_id;
+    uint32_t sps_id;
+
+    struct video_params params;
+};
+
+struct h264_slice_header {
+    uint32_t first_mb_in_slice;
+    uint32_t slice_type;
+    uint32_t pps_id;
+    uint32_t frame_num;
+};
+
+// All of these take the NAL unit starting at its header, without start code.
+extern bool h264_parse_sps(const uint8_t *data, size_t size,
+                           struct h264_sps *sps);
+
+extern bool hevc_parse_sps(const uint8_t *data, size_t size,
+                           struct hevc_sps *sps);
+
+// The ids linking a PPS to the SPS it was written for
+extern bool pps_parse_ids(enum nal_codec codec, const uint8_t *data,
+                          size_t size, uint32_t *pps_id, uint32_t *sps_id);
+
+extern bool video_params_parse(enum nal_codec codec, const uint8_t *data,
+                               size_t size, struct video_params *params);
+
+// Whether a decoder configured for `a` has to be recreated to decode `b`.
+// Timing, level or colour changes don't need that.
+extern bool video_params_need_reinit(const struct video_params *a,
+                                     const struct video_params *b);
+
+extern bool h264_parse_slice_header(const uint8_t *data, size_t size,
+                                    const struct h264_sps *sps,
+                                    struct h264_slice_header *header);
+
+#ifdef __cplusplus
+}
+#endif